@@ -0,0 +1,6 @@
+# Provisioning template for the pgo training run (fixed values, no -l)
+# path         record  encoding  value
+3F007FFF6F07   -       imsi      262019876543210
+3F007FFF6F46   -       spn       01:Benchmark
+3F007FFF6F40   1       adn       Own|+491700000000
+3F007F206F78   -       hex       0004
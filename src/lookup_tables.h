@@ -0,0 +1,590 @@
+// Generated by tools/mktables from data/*.csv. Do not edit; change the
+// CSV files and run 'make tables' instead.
+
+#ifndef LOOKUP_TABLES_H
+#define LOOKUP_TABLES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t key;        // digit count << 56 | value
+    const char *name;
+    const char *iso;     // ISO 3166 country code, "" when not applicable
+} lookup_entry_t;
+
+typedef struct {
+    const uint16_t *disp;
+    uint32_t num_buckets;
+    const lookup_entry_t *slots;
+    uint32_t num_slots;
+    int min_len;         // shortest and longest key in digits
+    int max_len;
+} lookup_table_t;
+
+// mcc.csv: 230 entries in 288 slots
+static const uint16_t mcc_disp[58] = {
+    6, 4, 16, 14, 0, 16, 38, 0, 2, 4, 3, 44, 0, 55, 0, 12,
+    6, 1, 0, 8, 4, 0, 0, 34, 1, 1, 7, 2, 13, 6, 16, 20,
+    22, 4, 4, 4, 3, 1, 18, 9, 20, 8, 76, 40, 13, 23, 7, 15,
+    3, 1, 3, 0, 0, 2, 2, 15, 24, 6
+};
+
+static const lookup_entry_t mcc_slots[288] = {
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x0300000000000260ULL, "Senegal", "SN"},   // 608
+    {0x0300000000000262ULL, "Mali", "ML"},   // 610
+    {0x0300000000000279ULL, "Seychelles", "SC"},   // 633
+    {0, NULL, NULL},
+    {0x030000000000016AULL, "Curacao", "CW"},   // 362
+    {0x030000000000025BULL, "Algeria", "DZ"},   // 603
+    {0x03000000000002C4ULL, "Honduras", "HN"},   // 708
+    {0x0300000000000285ULL, "Zambia", "ZM"},   // 645
+    {0x030000000000016EULL, "Dominica", "DM"},   // 366
+    {0x03000000000000E8ULL, "Austria", "AT"},   // 232
+    {0x03000000000000F4ULL, "Finland", "FI"},   // 244
+    {0, NULL, NULL},
+    {0x030000000000016BULL, "Aruba", "AW"},   // 363
+    {0x03000000000001A0ULL, "Jordan", "JO"},   // 416
+    {0x030000000000027BULL, "Rwanda", "RW"},   // 635
+    {0x03000000000001ADULL, "Nepal", "NP"},   // 429
+    {0x030000000000019DULL, "Sri Lanka", "LK"},   // 413
+    {0x030000000000021CULL, "Solomon Islands", "SB"},   // 540
+    {0x03000000000000CCULL, "Netherlands", "NL"},   // 204
+    {0x03000000000001A4ULL, "Saudi Arabia", "SA"},   // 420
+    {0x03000000000000D6ULL, "Spain", "ES"},   // 214
+    {0x0300000000000160ULL, "Grenada", "GD"},   // 352
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x030000000000025AULL, "Egypt", "EG"},   // 602
+    {0x0300000000000277ULL, "Angola", "AO"},   // 631
+    {0x030000000000021DULL, "Vanuatu", "VU"},   // 541
+    {0, NULL, NULL},
+    {0x03000000000000DAULL, "Bosnia and Herzegovina", "BA"},   // 218
+    {0x03000000000002EAULL, "Suriname", "SR"},   // 746
+    {0x0300000000000203ULL, "Philippines", "PH"},   // 515
+    {0, NULL, NULL},
+    {0x0300000000000267ULL, "Togo", "TG"},   // 615
+    {0x03000000000002C6ULL, "Nicaragua", "NI"},   // 710
+    {0x0300000000000162ULL, "Montserrat", "MS"},   // 354
+    {0x03000000000002C2ULL, "El Salvador", "SV"},   // 706
+    {0, NULL, NULL},
+    {0x0300000000000106ULL, "Germany", "DE"},   // 262
+    {0x03000000000000DEULL, "Italy", "IT"},   // 222
+    {0, NULL, NULL},
+    {0x030000000000026DULL, "Nigeria", "NG"},   // 621
+    {0x0300000000000104ULL, "Poland", "PL"},   // 260
+    {0, NULL, NULL},
+    {0x03000000000000D5ULL, "Andorra", "AD"},   // 213
+    {0, NULL, NULL},
+    {0x03000000000001FEULL, "Indonesia", "ID"},   // 510
+    {0, NULL, NULL},
+    {0x0300000000000268ULL, "Benin", "BJ"},   // 616
+    {0x03000000000001AAULL, "Bahrain", "BH"},   // 426
+    {0, NULL, NULL},
+    {0x03000000000001A8ULL, "United Arab Emirates", "AE"},   // 424
+    {0x03000000000000DBULL, "Croatia", "HR"},   // 219
+    {0x0300000000000273ULL, "Equatorial Guinea", "GQ"},   // 627
+    {0, NULL, NULL},
+    {0x030000000000027AULL, "Sudan", "SD"},   // 634
+    {0x03000000000000E1ULL, "Vatican City", "VA"},   // 225
+    {0x03000000000001B0ULL, "Iran", "IR"},   // 432
+    {0, NULL, NULL},
+    {0x03000000000002CCULL, "Peru", "PE"},   // 716
+    {0x0300000000000124ULL, "San Marino", "SM"},   // 292
+    {0x0300000000000288ULL, "Zimbabwe", "ZW"},   // 648
+    {0x030000000000025EULL, "Libya", "LY"},   // 606
+    {0x0300000000000220ULL, "American Samoa", "AS"},   // 544
+    {0x0300000000000191ULL, "Kazakhstan", "KZ"},   // 401
+    {0x0300000000000103ULL, "Moldova", "MD"},   // 259
+    {0x03000000000002E2ULL, "Guyana", "GY"},   // 738
+    {0, NULL, NULL},
+    {0x0300000000000272ULL, "Sao Tome and Principe", "ST"},   // 626
+    {0x0300000000000227ULL, "Marshall Islands", "MH"},   // 551
+    {0x03000000000000DCULL, "Serbia", "RS"},   // 220
+    {0x030000000000016CULL, "Bahamas", "BS"},   // 364
+    {0x0300000000000134ULL, "Saint Pierre and Miquelon", "PM"},   // 308
+    {0, NULL, NULL},
+    {0x03000000000000D8ULL, "Hungary", "HU"},   // 216
+    {0x0300000000000190ULL, "Azerbaijan", "AZ"},   // 400
+    {0x03000000000000D4ULL, "Monaco", "MC"},   // 212
+    {0x03000000000001A1ULL, "Syria", "SY"},   // 417
+    {0x0300000000000224ULL, "Cook Islands", "CK"},   // 548
+    {0x03000000000001CCULL, "China", "CN"},   // 460
+    {0, NULL, NULL},
+    {0x0300000000000210ULL, "Brunei", "BN"},   // 528
+    {0x03000000000002E0ULL, "Bolivia", "BO"},   // 736
+    {0x0300000000000208ULL, "Thailand", "TH"},   // 520
+    {0x0300000000000228ULL, "Palau", "PW"},   // 552
+    {0, NULL, NULL},
+    {0x030000000000019AULL, "Pakistan", "PK"},   // 410
+    {0x030000000000020DULL, "Singapore", "SG"},   // 525
+    {0x0300000000000110ULL, "Ireland", "IE"},   // 272
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x030000000000011EULL, "Turkey", "TR"},   // 286
+    {0x03000000000000CEULL, "Belgium", "BE"},   // 206
+    {0x030000000000027DULL, "Somalia", "SO"},   // 637
+    {0x030000000000021EULL, "Fiji", "FJ"},   // 542
+    {0x0300000000000221ULL, "Kiribati", "KI"},   // 545
+    {0, NULL, NULL},
+    {0x0300000000000170ULL, "Cuba", "CU"},   // 368
+    {0x03000000000001B4ULL, "Tajikistan", "TJ"},   // 436
+    {0, NULL, NULL},
+    {0x030000000000028EULL, "Comoros", "KM"},   // 654
+    {0x0300000000000166ULL, "Saint Lucia", "LC"},   // 358
+    {0x0300000000000261ULL, "Mauritania", "MR"},   // 609
+    {0x0300000000000278ULL, "Guinea-Bissau", "GW"},   // 632
+    {0x03000000000002EEULL, "Falkland Islands", "FK"},   // 750
+    {0x030000000000015AULL, "Cayman Islands", "KY"},   // 346
+    {0x03000000000002D4ULL, "Brazil", "BR"},   // 724
+    {0x0300000000000164ULL, "Saint Kitts and Nevis", "KN"},   // 356
+    {0x03000000000001C7ULL, "Macau", "MO"},   // 455
+    {0x0300000000000293ULL, "South Sudan", "SS"},   // 659
+    {0, NULL, NULL},
+    {0x030000000000027FULL, "Kenya", "KE"},   // 639
+    {0x03000000000002DEULL, "Venezuela", "VE"},   // 734
+    {0x0300000000000219ULL, "Papua New Guinea", "PG"},   // 537
+    {0, NULL, NULL},
+    {0x030000000000010AULL, "Gibraltar", "GI"},   // 266
+    {0x0300000000000174ULL, "Haiti", "HT"},   // 372
+    {0x0300000000000274ULL, "Gabon", "GA"},   // 628
+    {0x03000000000000FAULL, "Russia", "RU"},   // 250
+    {0, NULL, NULL},
+    {0x03000000000001A9ULL, "Israel", "IL"},   // 425
+    {0x03000000000001F6ULL, "Malaysia", "MY"},   // 502
+    {0x03000000000000E7ULL, "Slovakia", "SK"},   // 231
+    {0x03000000000001D6ULL, "Bangladesh", "BD"},   // 470
+    {0x03000000000001C9ULL, "Laos", "LA"},   // 457
+    {0x03000000000002E8ULL, "Paraguay", "PY"},   // 744
+    {0x03000000000001C2ULL, "South Korea", "KR"},   // 450
+    {0x03000000000002DCULL, "Colombia", "CO"},   // 732
+    {0, NULL, NULL},
+    {0x03000000000001B6ULL, "Turkmenistan", "TM"},   // 438
+    {0x03000000000001B2ULL, "Uzbekistan", "UZ"},   // 434
+    {0x03000000000001B5ULL, "Kyrgyzstan", "KG"},   // 437
+    {0x03000000000000CAULL, "Greece", "GR"},   // 202
+    {0x030000000000026EULL, "Chad", "TD"},   // 622
+    {0x0300000000000127ULL, "Liechtenstein", "LI"},   // 295
+    {0x03000000000002C8ULL, "Costa Rica", "CR"},   // 712
+    {0x0300000000000101ULL, "Belarus", "BY"},   // 257
+    {0x030000000000019EULL, "Myanmar", "MM"},   // 414
+    {0x03000000000001B8ULL, "Japan", "JP"},   // 440
+    {0x03000000000002D2ULL, "Argentina", "AR"},   // 722
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x0300000000000212ULL, "New Zealand", "NZ"},   // 530
+    {0x03000000000000F6ULL, "Lithuania", "LT"},   // 246
+    {0x0300000000000116ULL, "Malta", "MT"},   // 278
+    {0x0300000000000125ULL, "Slovenia", "SI"},   // 293
+    {0x0300000000000269ULL, "Mauritius", "MU"},   // 617
+    {0x030000000000013BULL, "United States", "US"},   // 315
+    {0x030000000000026CULL, "Ghana", "GH"},   // 620
+    {0x030000000000025CULL, "Morocco", "MA"},   // 604
+    {0x0300000000000129ULL, "Montenegro", "ME"},   // 297
+    {0x0300000000000271ULL, "Cape Verde", "CV"},   // 625
+    {0x03000000000001C4ULL, "Vietnam", "VN"},   // 452
+    {0x030000000000016DULL, "Anguilla", "AI"},   // 365
+    {0x0300000000000158ULL, "Antigua and Barbuda", "AG"},   // 344
+    {0x0300000000000286ULL, "Madagascar", "MG"},   // 646
+    {0x03000000000001F9ULL, "Australia", "AU"},   // 505
+    {0x0300000000000152ULL, "Jamaica", "JM"},   // 338
+    {0x03000000000001D8ULL, "Maldives", "MV"},   // 472
+    {0x030000000000027EULL, "Djibouti", "DJ"},   // 638
+    {0x0300000000000276ULL, "DR Congo", "CD"},   // 630
+    {0x0300000000000275ULL, "Congo", "CG"},   // 629
+    {0x0300000000000120ULL, "Faroe Islands", "FO"},   // 288
+    {0, NULL, NULL},
+    {0x030000000000015CULL, "British Virgin Islands", "VG"},   // 348
+    {0x030000000000026AULL, "Liberia", "LR"},   // 618
+    {0x03000000000002E4ULL, "Ecuador", "EC"},   // 740
+    {0x030000000000026FULL, "Central African Republic", "CF"},   // 623
+    {0x0300000000000172ULL, "Dominican Republic", "DO"},   // 370
+    {0x030000000000011AULL, "Georgia", "GE"},   // 282
+    {0x03000000000001A3ULL, "Kuwait", "KW"},   // 419
+    {0x03000000000002CAULL, "Panama", "PA"},   // 714
+    {0x0300000000000156ULL, "Barbados", "BB"},   // 342
+    {0x03000000000001B9ULL, "Japan", "JP"},   // 441
+    {0x03000000000001D2ULL, "Taiwan", "TW"},   // 466
+    {0x03000000000000F7ULL, "Latvia", "LV"},   // 247
+    {0x030000000000028BULL, "Lesotho", "LS"},   // 651
+    {0, NULL, NULL},
+    {0x0300000000000270ULL, "Cameroon", "CM"},   // 624
+    {0x0300000000000139ULL, "United States", "US"},   // 313
+    {0x030000000000028AULL, "Malawi", "MW"},   // 650
+    {0x0300000000000266ULL, "Niger", "NE"},   // 614
+    {0x0300000000000264ULL, "Cote d'Ivoire", "CI"},   // 612
+    {0x0300000000000114ULL, "Albania", "AL"},   // 276
+    {0x0300000000000118ULL, "Cyprus", "CY"},   // 280
+    {0, NULL, NULL},
+    {0x0300000000000263ULL, "Guinea", "GN"},   // 611
+    {0x030000000000014EULL, "Mexico", "MX"},   // 334
+    {0x03000000000001ACULL, "Mongolia", "MN"},   // 428
+    {0x030000000000010CULL, "Portugal", "PT"},   // 268
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x030000000000021BULL, "Tonga", "TO"},   // 539
+    {0x03000000000002C0ULL, "Guatemala", "GT"},   // 704
+    {0x03000000000000F2ULL, "Norway", "NO"},   // 242
+    {0x0300000000000154ULL, "French Antilles", "GP"},   // 340
+    {0x03000000000002BEULL, "Belize", "BZ"},   // 702
+    {0x0300000000000194ULL, "India", "IN"},   // 404
+    {0, NULL, NULL},
+    {0x03000000000002E6ULL, "French Guiana", "GF"},   // 742
+    {0x03000000000001ABULL, "Qatar", "QA"},   // 427
+    {0x0300000000000385ULL, "International", ""},   // 901
+    {0x03000000000000EEULL, "Denmark", "DK"},   // 238
+    {0, NULL, NULL},
+    {0x0300000000000282ULL, "Burundi", "BI"},   // 642
+    {0x030000000000011BULL, "Armenia", "AM"},   // 283
+    {0, NULL, NULL},
+    {0x0300000000000136ULL, "United States", "US"},   // 310
+    {0x0300000000000280ULL, "Tanzania", "TZ"},   // 640
+    {0x0300000000000265ULL, "Burkina Faso", "BF"},   // 613
+    {0, NULL, NULL},
+    {0x030000000000014AULL, "Puerto Rico", "PR"},   // 330
+    {0x03000000000000F8ULL, "Estonia", "EE"},   // 248
+    {0x03000000000001A2ULL, "Iraq", "IQ"},   // 418
+    {0x030000000000013CULL, "United States", "US"},   // 316
+    {0x0300000000000223ULL, "French Polynesia", "PF"},   // 547
+    {0x03000000000002DAULL, "Chile", "CL"},   // 730
+    {0, NULL, NULL},
+    {0x0300000000000289ULL, "Namibia", "NA"},   // 649
+    {0, NULL, NULL},
+    {0x030000000000025DULL, "Tunisia", "TN"},   // 605
+    {0, NULL, NULL},
+    {0x030000000000028CULL, "Botswana", "BW"},   // 652
+    {0x0300000000000176ULL, "Trinidad and Tobago", "TT"},   // 374
+    {0x0300000000000112ULL, "Iceland", "IS"},   // 274
+    {0x030000000000028FULL, "South Africa", "ZA"},   // 655
+    {0, NULL, NULL},
+    {0x03000000000000EBULL, "United Kingdom", "GB"},   // 235
+    {0x03000000000000E4ULL, "Switzerland", "CH"},   // 228
+    {0x030000000000015EULL, "Bermuda", "BM"},   // 350
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x03000000000001C8ULL, "Cambodia", "KH"},   // 456
+    {0x030000000000012EULL, "Canada", "CA"},   // 302
+    {0x0300000000000195ULL, "India", "IN"},   // 405
+    {0x0300000000000225ULL, "Samoa", "WS"},   // 549
+    {0x03000000000000D0ULL, "France", "FR"},   // 208
+    {0x03000000000000FFULL, "Ukraine", "UA"},   // 255
+    {0x03000000000001A5ULL, "Yemen", "YE"},   // 421
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x0300000000000192ULL, "Bhutan", "BT"},   // 402
+    {0x0300000000000287ULL, "Reunion", "RE"},   // 647
+    {0x0300000000000137ULL, "United States", "US"},   // 311
+    {0x0300000000000126ULL, "North Macedonia", "MK"},   // 294
+    {0x03000000000001D3ULL, "North Korea", "KP"},   // 467
+    {0x0300000000000122ULL, "Greenland", "GL"},   // 290
+    {0x030000000000013AULL, "United States", "US"},   // 314
+    {0x030000000000019CULL, "Afghanistan", "AF"},   // 412
+    {0x0300000000000202ULL, "Timor-Leste", "TL"},   // 514
+    {0, NULL, NULL},
+    {0x030000000000011CULL, "Bulgaria", "BG"},   // 284
+    {0x030000000000026BULL, "Sierra Leone", "SL"},   // 619
+    {0x0300000000000001ULL, "Test network", ""},   // 001
+    {0x0300000000000281ULL, "Uganda", "UG"},   // 641
+    {0, NULL, NULL},
+    {0x0300000000000283ULL, "Mozambique", "MZ"},   // 643
+    {0, NULL, NULL},
+    {0x0300000000000218ULL, "Nauru", "NR"},   // 536
+    {0x03000000000000DDULL, "Kosovo", "XK"},   // 221
+    {0, NULL, NULL},
+    {0x03000000000000E6ULL, "Czech Republic", "CZ"},   // 230
+    {0x0300000000000291ULL, "Eritrea", "ER"},   // 657
+    {0x030000000000019FULL, "Lebanon", "LB"},   // 415
+    {0x0300000000000178ULL, "Turks and Caicos Islands", "TC"},   // 376
+    {0x030000000000025FULL, "Gambia", "GM"},   // 607
+    {0x030000000000027CULL, "Ethiopia", "ET"},   // 636
+    {0x03000000000000E2ULL, "Romania", "RO"},   // 226
+    {0x03000000000000EAULL, "United Kingdom", "GB"},   // 234
+    {0, NULL, NULL},
+    {0x03000000000000F0ULL, "Sweden", "SE"},   // 240
+    {0x030000000000028DULL, "Eswatini", "SZ"},   // 653
+    {0x03000000000001CDULL, "China", "CN"},   // 461
+    {0x03000000000002ECULL, "Uruguay", "UY"},   // 748
+    {0, NULL, NULL},
+    {0x0300000000000222ULL, "New Caledonia", "NC"},   // 546
+    {0x0300000000000138ULL, "United States", "US"},   // 312
+    {0, NULL, NULL},
+    {0x030000000000010EULL, "Luxembourg", "LU"},   // 270
+    {0x03000000000001C6ULL, "Hong Kong", "HK"},   // 454
+    {0x0300000000000168ULL, "Saint Vincent and the Grenadines", "VC"},   // 360
+    {0x03000000000001A6ULL, "Oman", "OM"},   // 422
+    {0x0300000000000226ULL, "Micronesia", "FM"},   // 550
+};
+
+static const lookup_table_t mcc_table = {
+    mcc_disp, 58, mcc_slots, 288, 3, 3
+};
+
+// mnc.csv: 96 entries in 121 slots
+static const uint16_t mnc_disp[25] = {
+    0, 4, 0, 0, 39, 20, 2, 7, 6, 5, 10, 0, 49, 31, 26, 7,
+    47, 107, 0, 5, 12, 3, 8, 5, 4
+};
+
+static const lookup_entry_t mnc_slots[121] = {
+    {0x0500000000006659ULL, "Telekom Deutschland", ""},   // 26201
+    {0x05000000000068B6ULL, "MEO", ""},   // 26806
+    {0, NULL, NULL},
+    {0x0500000000005079ULL, "Proximus", ""},   // 20601
+    {0x050000000000B3BBULL, "China Telecom", ""},   // 46011
+    {0x050000000000539BULL, "Orange ES", ""},   // 21403
+    {0x0500000000006596ULL, "Play", ""},   // 26006
+    {0x0600000000049C8CULL, "Telus", ""},   // 302220
+    {0x05000000000068B3ULL, "NOS", ""},   // 26803
+    {0x050000000000ABF4ULL, "SoftBank", ""},   // 44020
+    {0x060000000004BC8AULL, "AT&T", ""},   // 310410
+    {0x0500000000005E8AULL, "Telia NO", ""},   // 24202
+    {0x050000000000B158ULL, "CSL", ""},   // 45400
+    {0, NULL, NULL},
+    {0x0500000000006593ULL, "Orange PL", ""},   // 26003
+    {0x0500000000005141ULL, "Orange", ""},   // 20801
+    {0x05000000000068B1ULL, "Vodafone PT", ""},   // 26801
+    {0x060000000004BBF4ULL, "T-Mobile US", ""},   // 310260
+    {0x0500000000005B7CULL, "Three UK", ""},   // 23420
+    {0x0500000000005399ULL, "Vodafone ES", ""},   // 21401
+    {0, NULL, NULL},
+    {0x0500000000006FBBULL, "Turk Telekom", ""},   // 28603
+    {0x0500000000005154ULL, "Bouygues Telecom", ""},   // 20820
+    {0x0500000000005B72ULL, "O2 UK", ""},   // 23410
+    {0x05000000000056EAULL, "Iliad", ""},   // 22250
+    {0x0500000000004FC0ULL, "Odido", ""},   // 20416
+    {0x050000000000CF09ULL, "One NZ", ""},   // 53001
+    {0x050000000000AC12ULL, "KDDI", ""},   // 44050
+    {0x050000000000B664ULL, "Chunghwa Telecom", ""},   // 46692
+    {0x050000000000514FULL, "Free Mobile", ""},   // 20815
+    {0x060000000004C0B8ULL, "Verizon", ""},   // 311480
+    {0x060000000004BB86ULL, "AT&T", ""},   // 310150
+    {0, NULL, NULL},
+    {0x0500000000006FB9ULL, "Turkcell", ""},   // 28601
+    {0, NULL, NULL},
+    {0x050000000000F2B2ULL, "MTN Nigeria", ""},   // 62130
+    {0x050000000000539CULL, "Yoigo", ""},   // 21404
+    {0, NULL, NULL},
+    {0x050000000000665FULL, "Telefonica Germany", ""},   // 26207
+    {0, NULL, NULL},
+    {0x050000000000FFE6ULL, "MTN South Africa", ""},   // 65510
+    {0x050000000000C546ULL, "Optus", ""},   // 50502
+    {0x05000000000061A9ULL, "MTS", ""},   // 25001
+    {0x0500000000005AA1ULL, "A1 Telekom Austria", ""},   // 23201
+    {0x0500000000000065ULL, "Test network", ""},   // 00101
+    {0x050000000000B3B1ULL, "China Unicom", ""},   // 46001
+    {0x0500000000004FB8ULL, "KPN", ""},   // 20408
+    {0x0500000000005E89ULL, "Telenor NO", ""},   // 24201
+    {0x0500000000011AD6ULL, "Vivo", ""},   // 72406
+    {0, NULL, NULL},
+    {0x050000000000C547ULL, "Vodafone AU", ""},   // 50503
+    {0x0500000000004FB4ULL, "Vodafone NL", ""},   // 20404
+    {0, NULL, NULL},
+    {0x05000000000056B9ULL, "TIM", ""},   // 22201
+    {0x0500000000005913ULL, "Salt", ""},   // 22803
+    {0x05000000000061AAULL, "MegaFon", ""},   // 25002
+    {0x0500000000005B89ULL, "EE", ""},   // 23433
+    {0x050000000000620BULL, "Beeline", ""},   // 25099
+    {0, NULL, NULL},
+    {0x0500000000009DDAULL, "Airtel", ""},   // 40410
+    {0x06000000000518C4ULL, "Telcel", ""},   // 334020
+    {0x0500000000006591ULL, "Plus", ""},   // 26001
+    {0x0500000000011ADAULL, "Vivo", ""},   // 72410
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x050000000000CD17ULL, "M1", ""},   // 52503
+    {0, NULL, NULL},
+    {0x0500000000011ADBULL, "Vivo", ""},   // 72411
+    {0, NULL, NULL},
+    {0x050000000000B3B0ULL, "China Mobile", ""},   // 46000
+    {0x050000000000CD19ULL, "StarHub", ""},   // 52505
+    {0x0500000000005CF9ULL, "TDC", ""},   // 23801
+    {0x050000000000CF0DULL, "Spark", ""},   // 53005
+    {0x0500000000005710ULL, "WindTre", ""},   // 22288
+    {0x0500000000011AD2ULL, "TIM Brasil", ""},   // 72402
+    {0x0500000000005FABULL, "Telia FI", ""},   // 24491
+    {0, NULL, NULL},
+    {0x050000000000508CULL, "Base", ""},   // 20620
+    {0x0500000000005DC1ULL, "Telia SE", ""},   // 24001
+    {0x0500000000011AD5ULL, "Claro Brasil", ""},   // 72405
+    {0x0500000000005B77ULL, "Vodafone UK", ""},   // 23415
+    {0x050000000000F99EULL, "Safaricom", ""},   // 63902
+    {0x0500000000005AA3ULL, "Magenta Telekom", ""},   // 23203
+    {0x050000000000514AULL, "SFR", ""},   // 20810
+    {0x050000000000FFDDULL, "Vodacom", ""},   // 65501
+    {0x050000000000CD15ULL, "Singtel", ""},   // 52501
+    {0x050000000000CB23ULL, "AIS", ""},   // 52003
+    {0x0500000000006592ULL, "T-Mobile PL", ""},   // 26002
+    {0, NULL, NULL},
+    {0x0500000000005F5CULL, "DNA", ""},   // 24412
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x050000000000C742ULL, "Telkomsel", ""},   // 51010
+    {0x0500000000005B86ULL, "EE", ""},   // 23430
+    {0x0600000000049E12ULL, "Bell", ""},   // 302610
+    {0x050000000000AFCDULL, "SK Telecom", ""},   // 45005
+    {0x050000000000AFD0ULL, "KT", ""},   // 45008
+    {0x0500000000005911ULL, "Swisscom", ""},   // 22801
+    {0x0500000000005F55ULL, "Elisa", ""},   // 24405
+    {0, NULL, NULL},
+    {0x050000000000ABEAULL, "NTT docomo", ""},   // 44010
+    {0x060000000004BB68ULL, "Sprint", ""},   // 310120
+    {0x0500000000005912ULL, "Sunrise", ""},   // 22802
+    {0x0500000000005CFAULL, "Telenor DK", ""},   // 23802
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x050000000000665AULL, "Vodafone DE", ""},   // 26202
+    {0x0600000000049E80ULL, "Rogers", ""},   // 302720
+    {0x05000000000056C2ULL, "Vodafone IT", ""},   // 22210
+    {0x0500000000005082ULL, "Orange Belgium", ""},   // 20610
+    {0, NULL, NULL},
+    {0x050000000000C545ULL, "Telstra", ""},   // 50501
+    {0x0500000000005DC7ULL, "Tele2 SE", ""},   // 24007
+    {0x050000000000539FULL, "Movistar", ""},   // 21407
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x0500000000006FBAULL, "Vodafone TR", ""},   // 28602
+    {0x0500000000005AAAULL, "Drei", ""},   // 23210
+    {0x050000000000665BULL, "Telefonica Germany", ""},   // 26203
+    {0, NULL, NULL},
+    {0x050000000000AFCEULL, "LG U+", ""},   // 45006
+};
+
+static const lookup_table_t mnc_table = {
+    mnc_disp, 25, mnc_slots, 121, 5, 6
+};
+
+// iccid-countries.csv: 73 entries in 92 slots
+static const uint16_t iccid_country_disp[19] = {
+    0, 1, 4, 2, 3, 1, 18, 0, 34, 18, 3, 3, 5, 44, 42, 14,
+    17, 3, 55
+};
+
+static const lookup_entry_t iccid_country_slots[92] = {
+    {0x0200000000000040ULL, "New Zealand", "NZ"},   // 64
+    {0x0200000000000041ULL, "Singapore", "SG"},   // 65
+    {0x0200000000000052ULL, "South Korea", "KR"},   // 82
+    {0x0200000000000039ULL, "Colombia", "CO"},   // 57
+    {0, NULL, NULL},
+    {0x0300000000000376ULL, "Taiwan", "TW"},   // 886
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x0200000000000042ULL, "Thailand", "TH"},   // 66
+    {0x0200000000000036ULL, "Argentina", "AR"},   // 54
+    {0, NULL, NULL},
+    {0x0300000000000164ULL, "Malta", "MT"},   // 356
+    {0x0300000000000161ULL, "Ireland", "IE"},   // 353
+    {0x03000000000003CEULL, "Qatar", "QA"},   // 974
+    {0, NULL, NULL},
+    {0x0200000000000034ULL, "Mexico", "MX"},   // 52
+    {0x0300000000000174ULL, "Estonia", "EE"},   // 372
+    {0x03000000000000FEULL, "Kenya", "KE"},   // 254
+    {0, NULL, NULL},
+    {0x03000000000000D8ULL, "Tunisia", "TN"},   // 216
+    {0x0200000000000021ULL, "France", "FR"},   // 33
+    {0x020000000000005EULL, "Sri Lanka", "LK"},   // 94
+    {0x020000000000003DULL, "Australia", "AU"},   // 61
+    {0, NULL, NULL},
+    {0x0200000000000028ULL, "Romania", "RO"},   // 40
+    {0x020000000000001BULL, "South Africa", "ZA"},   // 27
+    {0x03000000000003CCULL, "Israel", "IL"},   // 972
+    {0x0300000000000160ULL, "Luxembourg", "LU"},   // 352
+    {0x020000000000003EULL, "Indonesia", "ID"},   // 62
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x0200000000000054ULL, "Vietnam", "VN"},   // 84
+    {0x020000000000002FULL, "Norway", "NO"},   // 47
+    {0x0100000000000001ULL, "North America", "US"},   // 1
+    {0x020000000000001EULL, "Greece", "GR"},   // 30
+    {0x0200000000000033ULL, "Peru", "PE"},   // 51
+    {0x0200000000000001ULL, "North America", "US"},   // 01
+    {0, NULL, NULL},
+    {0x020000000000005BULL, "India", "IN"},   // 91
+    {0x0300000000000181ULL, "Croatia", "HR"},   // 385
+    {0, NULL, NULL},
+    {0x0200000000000029ULL, "Switzerland", "CH"},   // 41
+    {0x0300000000000162ULL, "Iceland", "IS"},   // 354
+    {0x03000000000003CBULL, "United Arab Emirates", "AE"},   // 971
+    {0x020000000000002CULL, "United Kingdom", "GB"},   // 44
+    {0x020000000000002BULL, "Austria", "AT"},   // 43
+    {0x030000000000017CULL, "Ukraine", "UA"},   // 380
+    {0x0300000000000173ULL, "Latvia", "LV"},   // 371
+    {0, NULL, NULL},
+    {0x0200000000000030ULL, "Poland", "PL"},   // 48
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x020000000000001FULL, "Netherlands", "NL"},   // 31
+    {0x0300000000000165ULL, "Cyprus", "CY"},   // 357
+    {0x0300000000000355ULL, "Macau", "MO"},   // 853
+    {0x0300000000000354ULL, "Hong Kong", "HK"},   // 852
+    {0x0300000000000166ULL, "Finland", "FI"},   // 358
+    {0x020000000000005AULL, "Turkey", "TR"},   // 90
+    {0x020000000000003FULL, "Philippines", "PH"},   // 63
+    {0x020000000000005CULL, "Pakistan", "PK"},   // 92
+    {0x020000000000003AULL, "Venezuela", "VE"},   // 58
+    {0x0200000000000051ULL, "Japan", "JP"},   // 81
+    {0x0200000000000038ULL, "Chile", "CL"},   // 56
+    {0x0300000000000172ULL, "Lithuania", "LT"},   // 370
+    {0x03000000000000EAULL, "Nigeria", "NG"},   // 234
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x03000000000001A5ULL, "Slovakia", "SK"},   // 421
+    {0, NULL, NULL},
+    {0x020000000000002EULL, "Sweden", "SE"},   // 46
+    {0x0200000000000031ULL, "Germany", "DE"},   // 49
+    {0x0200000000000022ULL, "Spain", "ES"},   // 34
+    {0x020000000000002DULL, "Denmark", "DK"},   // 45
+    {0x020000000000003CULL, "Malaysia", "MY"},   // 60
+    {0x03000000000000D4ULL, "Morocco", "MA"},   // 212
+    {0x0200000000000020ULL, "Belgium", "BE"},   // 32
+    {0x0200000000000037ULL, "Brazil", "BR"},   // 55
+    {0x030000000000015FULL, "Portugal", "PT"},   // 351
+    {0x0200000000000056ULL, "China", "CN"},   // 86
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x0100000000000007ULL, "Russia", "RU"},   // 7
+    {0x03000000000001A4ULL, "Czech Republic", "CZ"},   // 420
+    {0x0200000000000024ULL, "Hungary", "HU"},   // 36
+    {0x0200000000000027ULL, "Italy", "IT"},   // 39
+    {0x0300000000000182ULL, "Slovenia", "SI"},   // 386
+    {0x0300000000000167ULL, "Bulgaria", "BG"},   // 359
+    {0x0200000000000014ULL, "Egypt", "EG"},   // 20
+    {0x03000000000003C6ULL, "Saudi Arabia", "SA"},   // 966
+    {0x03000000000000D5ULL, "Algeria", "DZ"},   // 213
+    {0x030000000000017DULL, "Serbia", "RS"},   // 381
+    {0x0200000000000062ULL, "Iran", "IR"},   // 98
+};
+
+static const lookup_table_t iccid_country_table = {
+    iccid_country_disp, 19, iccid_country_slots, 92, 1, 3
+};
+
+// iccid-issuers.csv: 8 entries in 11 slots
+static const uint16_t iccid_issuer_disp[3] = {
+    1, 5, 1
+};
+
+static const lookup_entry_t iccid_issuer_slots[11] = {
+    {0x06000000000D9A58ULL, "Verizon Wireless", ""},   // 891480
+    {0, NULL, NULL},
+    {0x070000000087D200ULL, "Sprint", ""},   // 8901120
+    {0, NULL, NULL},
+    {0, NULL, NULL},
+    {0x070000000087D322ULL, "AT&T", ""},   // 8901410
+    {0x070000000087D28CULL, "T-Mobile US", ""},   // 8901260
+    {0x06000000000DB628ULL, "China Mobile", ""},   // 898600
+    {0x06000000000DB62BULL, "China Telecom", ""},   // 898603
+    {0x06000000000DB633ULL, "China Telecom", ""},   // 898611
+    {0x06000000000DB629ULL, "China Unicom", ""},   // 898601
+};
+
+static const lookup_table_t iccid_issuer_table = {
+    iccid_issuer_disp, 3, iccid_issuer_slots, 11, 6, 7
+};
+
+#endif
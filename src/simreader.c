@@ -3,46 +3,316 @@
  * Complete SIM/USIM analysis with multiple output modes
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 
 #if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
 #include <PCSC/winscard.h>
 #include "PCSC/pcsclite.h"
 #else
 #include <winscard.h>
 #endif
 
+#include "lookup_tables.h"
+
 #define BUFFER_SIZE 1024
-#define MAX_READERS 10
 #define VERSION "1.0.0"
 
+#define MAX_PATH_LEN 8
+#define MAX_FCP_LEN 258
+#define MAX_SNAPSHOT_FILES 128
+#define MAX_FIELDS 512
+#define MAX_VALUE_COLUMNS 16
+#define SNAPSHOT_MAGIC "simreader-snapshot"
+#define SNAPSHOT_VERSION 1
+
+// EF structures as coded in the FCP file descriptor byte (TS 102 221)
+#define EF_TRANSPARENT 0x01
+#define EF_LINEAR_FIXED 0x02
+#define EF_CYCLIC 0x06
+
+// 3GPP application codes following the RID in EF_DIR AIDs (TS 101 220)
+#define APP_USIM 0x1002
+#define APP_ISIM 0x1004
+#define ES10_MAX_RESPONSE 8192       // eUICC profile lists span several GET RESPONSEs
+
 typedef struct {
     int verbose;
     int json_output;
     int complete_analysis;
+    int read_apps;
     char *reader_name;
     int use_pin;
     int explore_files;
+    char *snapshot_file;
+    int all_readers;
+    char *values_file;
+    char *expect_file;
+    char *adm_key;
+    int dry_run;
+    char *virtual_file;
+    char *trace_file;
+    char *health_file;
+    char *metrics_file;
+    char *metrics_listen;
+    int watch;
+    int dashboard;
+    char *journal_file;
+    char *ring_path;
+    char *where_expr;
 } config_t;
 
+#define MAX_ECC_CODES 8
+
+// Network state from EF_AD, EF_LOCI, EF_PSLOCI, EF_EPSLOCI, EF_ACC and
+// EF_ECC. Identities are empty and statuses -1 when not available.
+typedef struct {
+    int ue_mode;             // EF_AD operation mode, -1 when not read
+    int mnc_length;          // 2 or 3, 0 when unknown
+    char mcc[4];
+    char mnc[4];
+    char tmsi[9];
+    char lai[24];            // MCC-MNC-LAC
+    int loci_status;
+    char ptmsi[9];
+    char rai[28];            // MCC-MNC-LAC-RAC
+    int psloci_status;
+    char guti[48];           // MCC-MNC-MMEGI-MMEC-M-TMSI
+    char tai[24];            // MCC-MNC-TAC
+    int epsloci_status;
+    int have_acc;
+    unsigned int access_classes;  // bit n set: access class n
+    int num_ecc;
+    struct {
+        char code[8];
+        char alpha[32];
+        int category;        // -1 for GSM EF_ECC, which has none
+    } ecc[MAX_ECC_CODES];
+} network_info_t;
+
+// Names looked up for the IMSI and ICCID; NULL when not in the tables
+typedef struct {
+    const char *country;         // from the MCC
+    const char *country_iso;
+    const char *operator_name;   // from the MCC and MNC
+    const char *issuer;          // from the ICCID issuer identification number
+    const char *issuer_country;
+    const char *issuer_country_iso;
+    int iccid_valid;             // Luhn check digit: 1 valid, 0 invalid, -1 no ICCID
+} enrichment_t;
+
+#define MAX_IMPU 4
+
+// IMS identities from the ISIM (TS 31.103): EF_IMPI, EF_DOMAIN and the
+// records of EF_IMPU
+typedef struct {
+    int present;             // ISIM found and selected
+    char impi[128];
+    char domain[128];
+    char impu[MAX_IMPU][128];
+    int num_impu;
+} ims_info_t;
+
+#define MAX_PROFILES 16
+
+typedef struct {
+    char iccid[21];
+    int enabled;
+    int profile_class;       // 0 test, 1 provisioning, 2 operational, -1 not given
+    char nickname[64];
+    char provider[64];
+    char name[64];
+} euicc_profile_t;
+
+// eUICC identity and installed profiles from the ISD-R (GSMA SGP.22 ES10c)
+typedef struct {
+    int present;             // ISD-R found and selected
+    char eid[33];
+    euicc_profile_t profiles[MAX_PROFILES];
+    int num_profiles;
+    int more_profiles;       // installed beyond MAX_PROFILES, not listed
+} euicc_info_t;
+
 typedef struct {
     char imsi[16];
-    char iccid[20];
+    char iccid[21];
     char msisdn[16];
     char spn[64];
     int valid;
+    const char *expect_status;
+    network_info_t net;
+    enrichment_t info;
+    ims_info_t ims;
+    euicc_info_t euicc;
+    int local_contacts;      // -a: used EF_ADN records of the USIM phonebook, -1 without one
+    int local_total;
 } sim_data_t;
 
+// One elementary file as captured from a card: raw FCP and complete contents
+typedef struct {
+    BYTE path[MAX_PATH_LEN];
+    int path_len;
+    BYTE fcp[MAX_FCP_LEN];
+    int fcp_len;
+    int structure;
+    int record_len;
+    int num_records;
+    BYTE *data;
+    int data_len;
+    uint64_t hash;
+} snap_file_t;
+
+typedef struct {
+    BYTE atr[MAX_ATR_SIZE];
+    int atr_len;
+    snap_file_t files[MAX_SNAPSHOT_FILES];
+    int num_files;
+} snapshot_t;
+
+typedef struct {
+    char name[32];
+    char value[160];
+} sim_field_t;
+
+typedef struct {
+    sim_field_t fields[MAX_FIELDS];
+    int count;
+} field_list_t;
+
 static SCARDCONTEXT hContext;
 static SCARDHANDLE hCard;
 static DWORD dwActiveProtocol;
+static int logical_channel;   // channel for exchange_apdu commands (0-3)
+
+// Command class of the card in use: 0x00 (UICC, ETSI TS 102 221) or 0xA0
+// (GSM 11.11), -1 until detected. Classic 2G SIMs
+// reject CLA 00, so their commands are translated to the GSM set.
+#define CLASS_CACHE_SIZE 16
+
+static int card_class = -1;
+static BYTE gsm_df[MAX_PATH_LEN];    // current DF of a GSM class card, 0 bytes when unknown
+static int gsm_df_len;
+
+// Class already detected for an ATR, so later cards of a batch need no probe
+static struct {
+    BYTE atr[MAX_ATR_SIZE];
+    int atr_len;
+    int cla;
+} class_cache[CLASS_CACHE_SIZE];
+static int class_cache_count;
+static int class_cache_next;
+static int class_checked;            // cache consulted for the card in use
+static BYTE class_atr[MAX_ATR_SIZE];
+static int class_atr_len;
+
+// When set, APDUs go to an emulated card (--virtual) instead of PC/SC
+static int (*emulated_transmit)(const BYTE *apdu, DWORD apdu_len, BYTE *resp, DWORD *resp_len);
+static BYTE emulated_atr[MAX_ATR_SIZE];
+static int emulated_atr_len;
+
+// APDU trace (--trace): every command and response with its time in
+// microseconds since the trace was opened
+static FILE *trace_out;
+static double trace_start_us;
+
+// Health of the reader in use in multi-reader mode: sessions, transport
+// errors, retries and command latencies, kept across runs with --health
+#define HEALTH_BUCKETS 24            // log2 latency buckets from 1 us
+#define TRANSMIT_RETRIES 2
+
+typedef struct {
+    char name[256];
+    unsigned long sessions;
+    unsigned long degraded;          // sessions with errors, retries or a failure
+    unsigned long commands;
+    unsigned long errors;            // commands that failed after the retries
+    unsigned long retries;
+    uint32_t window;                 // last 32 sessions, latest in bit 0; 1 = degraded
+    int quarantined;                 // HEALTH_* reason, 0 when in service
+    unsigned long latency[HEALTH_BUCKETS];
+    int session_errors;              // of the session in progress
+    int session_retries;
+} reader_health_t;
+
+static reader_health_t *current_health;
+
+// Counters published by --metrics and --metrics-listen
+#define METRICS_BUCKETS 18           // session time, log2 buckets from 1 ms
+
+typedef struct {
+    unsigned long apdus[256];        // by INS
+    unsigned long status_words[256]; // by SW1
+    unsigned long transport_errors;
+    unsigned long cards_ok;
+    unsigned long cards_failed;
+    unsigned long session_ms[METRICS_BUCKETS];
+    double session_seconds;
+    int queue_depth;                 // cards waiting for their session
+    char iccid[21];                  // card of the current session, for --dashboard
+} metrics_t;
+
+static metrics_t metrics;
+
+// Handlers report the ICCID they decoded, which --dashboard shows
+static void session_iccid(const char *iccid) {
+    snprintf(metrics.iccid, sizeof(metrics.iccid), "%s", iccid);
+}
 
 // Utility functions
+static double monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void health_record(reader_health_t *h, double us, int ok) {
+    int bucket = 0;
+    while (bucket < HEALTH_BUCKETS - 1 && us >= (double)(2u << bucket)) bucket++;
+    h->commands++;
+    h->latency[bucket]++;
+    if (!ok) h->session_errors++;
+}
+
+static void metrics_apdu(const BYTE *apdu, DWORD apdu_len, const BYTE *resp, DWORD resp_len, int ok) {
+    if (!ok) {
+        metrics.transport_errors++;
+        return;
+    }
+    if (apdu_len >= 2) metrics.apdus[apdu[1]]++;
+    if (resp_len >= 2) metrics.status_words[resp[resp_len - 2]]++;
+}
+
+static void trace_apdu(char direction, const BYTE *data, DWORD len) {
+    fprintf(trace_out, "%.0f %c ", monotonic_us() - trace_start_us, direction);
+    for (DWORD i = 0; i < len; i++) fprintf(trace_out, "%02X", data[i]);
+    fputc('\n', trace_out);
+}
+
 static void print_hex(const char *label, const BYTE *data, DWORD length) {
     printf("%s: ", label);
     for (DWORD i = 0; i < length; i++) {
@@ -65,36 +335,38 @@ static int bytes_to_bcd(const BYTE *data, int length, char *output) {
     return 0;
 }
 
+// EF_IMSI: length byte, then swapped BCD digits behind the parity/type
+// nibble of the first byte (TS 31.102 4.2.2)
 static int decode_imsi(const BYTE *data, int length, char *output) {
-    if (length < 2) return -1;
+    if (length < 2 || data[0] < 1 || data[0] > 8 || data[0] >= length) return -1;
     
     int pos = 0;
-    int start = 0;
     
-    // Skip length byte if present
-    if (data[0] <= length - 1 && data[0] < 0x80) {
-        start = 1;
-    }
-    
-    for (int i = start; i < length && pos < 15; i++) {
-        BYTE b = data[i];
-        output[pos++] = (b & 0x0F) + '0';
-        if (pos < 15) {
-            output[pos++] = ((b >> 4) & 0x0F) + '0';
+    for (int i = 1; i <= data[0] && pos < 15; i++) {
+        BYTE lo = data[i] & 0x0F;
+        BYTE hi = (data[i] >> 4) & 0x0F;
+        if (i > 1) {
+            if (lo > 9) break;
+            output[pos++] = lo + '0';
         }
+        if (hi > 9 || pos >= 15) break;
+        output[pos++] = hi + '0';
     }
     output[pos] = '\0';
-    return 0;
+    return pos ? 0 : -1;
 }
 
 static int decode_iccid(const BYTE *data, int length, char *output) {
     if (length < 1) return -1;
     
+    // Up to 20 digits, the last one possibly an F filler
     int pos = 0;
-    for (int i = 0; i < length && pos < 19; i++) {
+    for (int i = 0; i < length && pos < 20; i++) {
         BYTE b = data[i];
+        if ((b & 0x0F) == 0x0F) break;
         output[pos++] = (b & 0x0F) + '0';
-        if (pos < 19) {
+        if (((b >> 4) & 0x0F) == 0x0F) break;
+        if (pos < 20) {
             output[pos++] = ((b >> 4) & 0x0F) + '0';
         }
     }
@@ -112,38 +384,55 @@ static int establish_context(void) {
     return 0;
 }
 
-static int find_reader(const char *preferred_name, char *reader_name, DWORD *reader_len) {
-    char mszReaders[MAX_READERS * 64];
-    DWORD dwReaders = sizeof(mszReaders);
-    
-    LONG rv = SCardListReaders(hContext, NULL, mszReaders, &dwReaders);
+// All connected readers as a multi-string (each name NUL terminated, an
+// empty name at the end), sized by asking first; NULL when listing fails.
+// A station can have any number of readers with names of any length.
+static char *list_readers(int *count) {
+    char *readers = NULL;
+    DWORD len = 0;
+    LONG rv;
+
+    // Readers plugged in between the two calls make the buffer too small
+    do {
+        free(readers);
+        readers = NULL;
+        rv = SCardListReaders(hContext, NULL, NULL, &len);
+        if (rv != SCARD_S_SUCCESS) break;
+        if (!(readers = malloc(len + 1))) return NULL;
+        rv = SCardListReaders(hContext, NULL, readers, &len);
+    } while (rv == SCARD_E_INSUFFICIENT_BUFFER);
     if (rv != SCARD_S_SUCCESS) {
         fprintf(stderr, "SCardListReaders failed: %s\n", pcsc_stringify_error(rv));
-        return -1;
+        free(readers);
+        return NULL;
     }
-    
-    char *p = mszReaders;
-    while (*p && (p - mszReaders) < (int)dwReaders) {
-        if (strstr(p, "ACR38") || strstr(p, "ACS")) {
-            if (!preferred_name || strstr(p, preferred_name)) {
-                strncpy(reader_name, p, *reader_len - 1);
-                reader_name[*reader_len - 1] = '\0';
-                *reader_len = strlen(reader_name) + 1;
-                return 0;
-            }
+    readers[len] = '\0';        // in case the library left out the final NUL
+    if (len) readers[len - 1] = '\0';
+    *count = 0;
+    for (char *p = readers; *p; p += strlen(p) + 1) (*count)++;
+    return readers;
+}
+
+static int find_reader(const char *preferred_name, char *reader_name, DWORD *reader_len) {
+    int count;
+    char *readers = list_readers(&count);
+    char *found = NULL;
+
+    if (!readers) return -1;
+    for (char *p = readers; *p && !found; p += strlen(p) + 1) {
+        if (preferred_name ? strstr(p, preferred_name) != NULL
+                           : (strstr(p, "ACR38") || strstr(p, "ACS"))) {
+            found = p;
         }
-        p += strlen(p) + 1;
     }
-    
-    p = mszReaders;
-    if (*p) {
-        strncpy(reader_name, p, *reader_len - 1);
+    if (!found && !preferred_name && readers[0]) found = readers;
+    if (found) {
+        strncpy(reader_name, found, *reader_len - 1);
         reader_name[*reader_len - 1] = '\0';
         *reader_len = strlen(reader_name) + 1;
-        return 0;
     }
-    
-    return -1;
+    free(readers);
+    return found ? 0 : -1;
 }
 
 static int connect_to_card(const char *reader_name) {
@@ -154,28 +443,340 @@ static int connect_to_card(const char *reader_name) {
         fprintf(stderr, "SCardConnect failed: %s\n", pcsc_stringify_error(rv));
         return -1;
     }
+    card_class = -1;
+    class_checked = 0;
+    gsm_df_len = 0;
+    return 0;
+}
+
+static void disconnect_card(void) {
+    if (hCard) {
+        SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+        hCard = 0;
+    }
+}
+
+static int get_atr(BYTE *atr, int *atr_len) {
+    DWORD len = MAX_ATR_SIZE;
+    DWORD state, protocol;
+    char name[256];
+    DWORD name_len = sizeof(name);
+
+    if (emulated_transmit) {
+        memcpy(atr, emulated_atr, emulated_atr_len);
+        *atr_len = emulated_atr_len;
+        return 0;
+    }
+    if (SCardStatus(hCard, name, &name_len, &state, &protocol, atr, &len) != SCARD_S_SUCCESS) {
+        return -1;
+    }
+    *atr_len = len;
     return 0;
 }
 
-static int transmit_apdu(const BYTE *send_apdu, DWORD send_len, 
-                        BYTE *recv_apdu, DWORD *recv_len) {
+// Send one APDU to the card exactly as given
+static int card_transmit(const BYTE *send_apdu, DWORD send_len,
+                         BYTE *recv_apdu, DWORD *recv_len) {
     SCARD_IO_REQUEST pioSendPci;
     DWORD dwRecvLength = *recv_len;
     
+    if (trace_out) trace_apdu('>', send_apdu, send_len);
+    if (emulated_transmit) {
+        int rv = emulated_transmit(send_apdu, send_len, recv_apdu, recv_len);
+        metrics_apdu(send_apdu, send_len, recv_apdu, *recv_len, rv == 0);
+        if (trace_out && rv == 0) trace_apdu('<', recv_apdu, *recv_len);
+        return rv;
+    }
+    
     if (dwActiveProtocol == SCARD_PROTOCOL_T0) {
         pioSendPci = *SCARD_PCI_T0;
     } else {
         pioSendPci = *SCARD_PCI_T1;
     }
     
-    LONG rv = SCardTransmit(hCard, &pioSendPci, send_apdu, send_len,
+    // Communication errors (worn contacts, loose cables) are retried, except
+    // for AUTHENTICATE/RUN GSM ALGORITHM and INCREASE, which the card may
+    // have executed before the response was lost
+    int retry = send_len < 2 || (send_apdu[1] != 0x88 && send_apdu[1] != 0x32);
+    double start = monotonic_us();
+    LONG rv;
+    for (int attempt = 0;; attempt++) {
+        dwRecvLength = *recv_len;
+        rv = SCardTransmit(hCard, &pioSendPci, send_apdu, send_len,
                            NULL, recv_apdu, &dwRecvLength);
+        if (rv == SCARD_S_SUCCESS || !retry || attempt == TRANSMIT_RETRIES ||
+            (rv != SCARD_F_COMM_ERROR && rv != SCARD_E_NOT_TRANSACTED)) {
+            break;
+        }
+        if (current_health) current_health->session_retries++;
+    }
+    if (current_health) health_record(current_health, monotonic_us() - start, rv == SCARD_S_SUCCESS);
+    metrics_apdu(send_apdu, send_len, recv_apdu, dwRecvLength, rv == SCARD_S_SUCCESS);
     if (rv != SCARD_S_SUCCESS) {
         fprintf(stderr, "SCardTransmit failed: %s\n", pcsc_stringify_error(rv));
         return -1;
     }
     
     *recv_len = dwRecvLength;
+    if (trace_out) trace_apdu('<', recv_apdu, *recv_len);
+    return 0;
+}
+
+// GSM class commands
+
+// GSM 11.11 status words with a UICC equivalent, so callers only check one set
+static WORD gsm_status(WORD sw) {
+    static const struct {
+        WORD gsm;
+        WORD uicc;
+    } map[] = {
+        {0x9240, 0x6581},   // memory problem
+        {0x9400, 0x6986},   // no EF selected
+        {0x9402, 0x6A83},   // out of range, record not found
+        {0x9404, 0x6A82},   // file not found
+        {0x9408, 0x6981},   // file inconsistent with command
+        {0x9802, 0x6982},   // no CHV initialised
+        {0x9804, 0x6982},   // access condition not fulfilled
+        {0x9808, 0x6985},   // contradiction with CHV status
+        {0x9810, 0x6985},   // contradiction with invalidation status
+        {0x9840, 0x6983},   // CHV blocked
+    };
+
+    if ((sw & 0xFF00) == 0x9200) return 0x9000;   // update succeeded after retries
+    if ((sw & 0xFF00) == 0x6700 && (sw & 0xFF)) return 0x6C00 | (sw & 0xFF);   // right P3 given
+    for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+        if (map[i].gsm == sw) return map[i].uicc;
+    }
+    return sw;
+}
+
+// Build the FCP template (tag 62) for a GSM SELECT response: descriptor,
+// file ID, life cycle status and, for EFs, file size
+static int gsm_fcp(const BYTE *r, int len, BYTE *fcp) {
+    int n = 2;
+
+    if (len < 13) return 0;
+    fcp[n++] = 0x82;
+    if (r[6] != 0x04) {
+        fcp[n++] = 2;
+        fcp[n++] = 0x78;   // DF
+        fcp[n++] = 0x21;
+    } else if (len >= 15 && (r[13] == 0x01 || r[13] == 0x03)) {
+        int record_len = r[14];
+        int records = record_len ? ((r[2] << 8) | r[3]) / record_len : 0;
+        fcp[n++] = 5;
+        fcp[n++] = r[13] == 0x01 ? 0x42 : 0x46;   // linear fixed or cyclic
+        fcp[n++] = 0x21;
+        fcp[n++] = 0x00;
+        fcp[n++] = record_len;
+        fcp[n++] = records;
+    } else {
+        fcp[n++] = 2;
+        fcp[n++] = 0x41;   // transparent
+        fcp[n++] = 0x21;
+    }
+    fcp[n++] = 0x83;
+    fcp[n++] = 2;
+    fcp[n++] = r[4];
+    fcp[n++] = r[5];
+    fcp[n++] = 0x8A;
+    fcp[n++] = 1;
+    fcp[n++] = r[6] != 0x04 || (r[11] & 0x01) ? 0x05 : 0x04;   // activated or invalidated
+    if (r[6] == 0x04) {
+        fcp[n++] = 0x80;
+        fcp[n++] = 2;
+        fcp[n++] = r[2];
+        fcp[n++] = r[3];
+    }
+    fcp[0] = 0x62;
+    fcp[1] = n - 2;
+    return n;
+}
+
+// card_transmit returning the status word
+static int card_exchange(const BYTE *apdu, DWORD apdu_len, BYTE *resp, DWORD *resp_len, WORD *sw) {
+    if (card_transmit(apdu, apdu_len, resp, resp_len) < 0 || *resp_len < 2) return -1;
+    *sw = (resp[*resp_len - 2] << 8) | resp[*resp_len - 1];
+    return 0;
+}
+
+// SELECT a UICC command asked for: by file ID, or by path from the MF as a
+// walk of GSM SELECTs. The walk starts at the current DF when the path
+// passes through it. GSM file IDs tell DFs (3F, 7F, 5F) from EFs.
+static int gsm_select(const BYTE *apdu, DWORD apdu_len, BYTE *recv_apdu, DWORD *recv_len) {
+    BYTE path[MAX_PATH_LEN];
+    int path_len = 0;
+    int start = 0;
+    BYTE resp[BUFFER_SIZE];
+    DWORD resp_len;
+    WORD sw = 0x9000;
+    int lc = apdu_len > 5 ? apdu[4] : 0;
+
+    if (lc < 2 || (lc & 1) || 5 + lc > (int)apdu_len || lc + 2 > MAX_PATH_LEN) {
+        sw = 0x6700;
+        goto done;
+    }
+    if (apdu[2] == 0x08) {
+        if (apdu[5] != 0x3F || apdu[6] != 0x00) {
+            path[path_len++] = 0x3F;   // the path is from the MF, which some callers include
+            path[path_len++] = 0x00;
+        }
+    } else if (apdu[2] > 0x02 || lc != 2) {
+        sw = 0x6A86;   // no AID or parent selection in GSM 11.11
+        goto done;
+    }
+    memcpy(path + path_len, apdu + 5, lc);
+    path_len += lc;
+    for (int i = 0; i < path_len; i += 2) {
+        if (path[i] == 0x7F && path[i + 1] == 0xFF) {
+            sw = 0x6A82;   // no ADF on a GSM SIM
+            goto done;
+        }
+    }
+    if (apdu[2] == 0x08 && gsm_df_len && gsm_df_len < path_len &&
+        memcmp(gsm_df, path, gsm_df_len) == 0) {
+        start = gsm_df_len;
+    }
+
+    for (int i = start; i < path_len; i += 2) {
+        BYTE select[] = {0xA0, 0xA4, 0x00, 0x00, 0x02, path[i], path[i + 1]};
+
+        resp_len = sizeof(resp);
+        if (card_exchange(select, sizeof(select), resp, &resp_len, &sw) < 0) {
+            gsm_df_len = 0;
+            return -1;
+        }
+        if ((sw & 0xFF00) != 0x9F00) goto done;
+        if (path[i] == 0x3F) {
+            gsm_df_len = 2;
+            memcpy(gsm_df, path + i, 2);
+        } else if (path[i] == 0x7F || path[i] == 0x5F) {
+            if (apdu[2] == 0x08) {
+                gsm_df_len = i + 2;
+                memcpy(gsm_df, path, gsm_df_len);
+            } else if (path[i] == 0x7F) {
+                gsm_df[0] = 0x3F;
+                gsm_df[1] = 0x00;
+                memcpy(gsm_df + 2, path + i, 2);
+                gsm_df_len = 4;
+            } else if (gsm_df_len == 4) {
+                memcpy(gsm_df + gsm_df_len, path + i, 2);
+                gsm_df_len += 2;
+            } else {
+                gsm_df_len = 0;
+            }
+        }
+    }
+
+    // P2 0C asks for no data; otherwise the GSM response becomes an FCP
+    *recv_len = 0;
+    if ((apdu[3] & 0x0C) != 0x0C) {
+        BYTE get_response[] = {0xA0, 0xC0, 0x00, 0x00, (BYTE)(sw & 0xFF)};
+
+        resp_len = sizeof(resp);
+        if (card_exchange(get_response, sizeof(get_response), resp, &resp_len, &sw) < 0) return -1;
+        if (sw != 0x9000) goto done;
+        *recv_len = gsm_fcp(resp, resp_len - 2, recv_apdu);
+    }
+    sw = 0x9000;
+
+done:
+    sw = gsm_status(sw);
+    recv_apdu[*recv_len] = sw >> 8;
+    recv_apdu[*recv_len + 1] = sw & 0xFF;
+    *recv_len += 2;
+    return 0;
+}
+
+// Send a UICC class command to a GSM class card: SELECT is rebuilt, the
+// commands GSM 11.11 shares are sent with CLA A0 and the status word
+// translated back, and the rest are refused without reaching the card
+static int gsm_transmit(const BYTE *send_apdu, DWORD send_len, BYTE *recv_apdu, DWORD *recv_len) {
+    static const BYTE shared[] = {0xB0, 0xB2, 0xD6, 0xDC, 0x20, 0x24, 0x26, 0x28, 0x2C, 0x32,
+                                  0x04, 0x44, 0xC0, 0xF2, 0x10, 0x12, 0x14, 0xC2, 0xFA};
+    BYTE apdu[BUFFER_SIZE];
+    WORD sw = 0x6D00;
+
+    if (send_len < 4 || send_len > sizeof(apdu)) return -1;
+    if (send_apdu[1] == 0xA4) {
+        *recv_len = 0;
+        return gsm_select(send_apdu, send_len, recv_apdu, recv_len);
+    }
+    if (memchr(shared, send_apdu[1], sizeof(shared)) &&
+        !(send_apdu[1] == 0xB0 && (send_apdu[2] & 0x80)) &&   // no SFI addressing
+        !(send_apdu[1] == 0xB2 && (send_apdu[3] & 0xF8))) {
+        memcpy(apdu, send_apdu, send_len);
+        apdu[0] = 0xA0;
+        if (apdu[1] >= 0x20 && apdu[1] <= 0x2C && apdu[3] == 0x81) {
+            apdu[3] = 0x02;   // PIN2 is CHV2
+        }
+        if (card_transmit(apdu, send_len, recv_apdu, recv_len) < 0) return -1;
+        if (*recv_len < 2) return 0;
+        sw = (recv_apdu[*recv_len - 2] << 8) | recv_apdu[*recv_len - 1];
+        if ((sw & 0xFF00) == 0x9F00) sw = 0x6100 | (sw & 0xFF);
+        *recv_len -= 2;
+    } else {
+        *recv_len = 0;
+    }
+    sw = gsm_status(sw);
+    recv_apdu[*recv_len] = sw >> 8;
+    recv_apdu[*recv_len + 1] = sw & 0xFF;
+    *recv_len += 2;
+    return 0;
+}
+
+// Look the card's ATR up in the class cache; the class stays unknown
+// (-1) for a new ATR until its first SELECT answers
+static void card_class_lookup(void) {
+    int atr_len;
+
+    class_checked = 1;
+    if (emulated_transmit) {
+        card_class = 0x00;
+        return;
+    }
+    if (get_atr(class_atr, &atr_len) < 0) atr_len = 0;
+    class_atr_len = atr_len;
+    for (int i = 0; i < class_cache_count && atr_len; i++) {
+        if (class_cache[i].atr_len == atr_len && memcmp(class_cache[i].atr, class_atr, atr_len) == 0) {
+            card_class = class_cache[i].cla;
+            return;
+        }
+    }
+}
+
+static void card_class_learn(int cla) {
+    card_class = cla;
+    if (class_atr_len) {
+        int slot = class_cache_next++ % CLASS_CACHE_SIZE;
+        if (class_cache_count < CLASS_CACHE_SIZE) class_cache_count++;
+        memcpy(class_cache[slot].atr, class_atr, class_atr_len);
+        class_cache[slot].atr_len = class_atr_len;
+        class_cache[slot].cla = cla;
+    }
+}
+
+// Send one APDU in the card's command class. A card with a new ATR is
+// taken to be a UICC until its first SELECT: GSM-only SIMs reject CLA 00
+// with 6E00 or 6D00, and that SELECT is sent again in the GSM class.
+static int transmit_apdu(const BYTE *send_apdu, DWORD send_len,
+                         BYTE *recv_apdu, DWORD *recv_len) {
+    int uicc = send_len >= 2 && (send_apdu[0] & 0xF0) == 0x00;
+
+    if (!class_checked) card_class_lookup();
+    if (card_class == 0xA0 && uicc) {
+        return gsm_transmit(send_apdu, send_len, recv_apdu, recv_len);
+    }
+    DWORD max_len = *recv_len;
+    if (card_transmit(send_apdu, send_len, recv_apdu, recv_len) < 0) return -1;
+    if (card_class < 0 && uicc && send_apdu[1] == 0xA4 && *recv_len >= 2) {
+        WORD sw = (recv_apdu[*recv_len - 2] << 8) | recv_apdu[*recv_len - 1];
+        card_class_learn(sw == 0x6E00 || sw == 0x6D00 ? 0xA0 : 0x00);
+        if (card_class == 0xA0) {
+            *recv_len = max_len;
+            return gsm_transmit(send_apdu, send_len, recv_apdu, recv_len);
+        }
+    }
     return 0;
 }
 
@@ -292,379 +893,10231 @@ static int read_binary(BYTE *data, int max_len, int *actual_len, int verbose) {
     return -1;
 }
 
-// Explore common SIM/USIM files
-static void explore_sim_files(int verbose) {
-    printf("\n=== Exploring SIM/USIM File Structure ===\n");
-    
-    // Common files to check
-    struct {
-        BYTE id[2];
-        const char *name;
-        const char *description;
-    } files_to_check[] = {
-        {{0x2F, 0xE2}, "EF_ICCID", "SIM Card Serial Number"},
-        {{0x2F, 0x05}, "EF_PL", "Preferred Languages"},
-        {{0x2F, 0x06}, "EF_ICCID", "ICCID (alternative location)"},
-        {{0x3F, 0x00}, "MF", "Master File"},
-        {{0x7F, 0x20}, "DF_GSM", "GSM Directory"},
-        {{0x7F, 0x10}, "DF_TELECOM", "Telecom Directory"},
-        {{0x6F, 0x07}, "EF_IMSI", "International Mobile Subscriber Identity"},
-        {{0x6F, 0x46}, "EF_SPN", "Service Provider Name"},
-        {{0x6F, 0x3A}, "EF_ADN", "Abbreviated Dialing Numbers (Contacts)"},
-        {{0x6F, 0x3B}, "EF_FDN", "Fixed Dialing Numbers"},
-        {{0x6F, 0x3C}, "EF_SMS", "SMS Messages"},
-        {{0x6F, 0x49}, "EF_SDN", "Service Dialing Numbers"},
-        {{0x6F, 0x44}, "EF_LDN", "Last Dialed Numbers"},
-        {{0x6F, 0x40}, "EF_MSISDN", "Subscriber Phone Number"},
-        {{0x6F, 0x45}, "EF_EXT1", "Extension 1"},
-        {{0x6F, 0x47}, "EF_SMSR", "SMS Status Reports"},
-        {{0x6F, 0x74}, "EF_PLMNwAcT", "PLMN Selector"},
-        {{0x6F, 0x78}, "EF_ACC", "Access Control Class"},
-        {{0x6F, 0x7B}, "EF_FPLMN", "Forbidden PLMNs"},
-        {{0x6F, 0x7E}, "EF_LOCI", "Location Information"},
-        {{0x6F, 0xAD}, "EF_AD", "Administrative Data"},
-        {{0x6F, 0xAE}, "EF_PHASE", "Phase Identification"},
-        {{0x6F, 0xB1}, "EF_VGCS", "Voice Group Call Service"},
-        {{0x6F, 0xB2}, "EF_VGCSS", "VGCS Status"},
-        {{0x6F, 0xB3}, "EF_VBS", "Voice Broadcast Service"},
-        {{0x6F, 0xB4}, "EF_VBSS", "VBS Status"},
-        {{0x6F, 0xB5}, "EF_eMLPP", "enhanced Multi Level Precedence"},
-        {{0x6F, 0xB6}, "EF_AAeM", "Automatic Answer for eMLPP"},
-        {{0x6F, 0xB7}, "EF_ECC", "Emergency Call Codes"},
-        {{0x6F, 0x20}, "EF_CK", "Ciphering Key"},
-        {{0x6F, 0x21}, "EF_IMSI", "IMSI (alternative location)"},
-        {{0x6F, 0x22}, "EF_Kc", "Ciphering Key (GPRS)"},
-        {{0x6F, 0x23}, "EF_PUNCT", "Punctuation"},
-        {{0x6F, 0x24}, "EF_SME", "Short Message Entity"},
-        {{0x6F, 0x25}, "EF_SMSP", "Short Message Service Parameters"},
-        {{0x6F, 0x26}, "EF_SMSS", "SMS Status"},
-        {{0x6F, 0x30}, "EF_LP", "Language Preference"},
-        {{0x6F, 0x31}, "EF_PLMNsel", "PLMN Selector"},
-        {{0x6F, 0x32}, "EF_FPLMNsel", "Forbidden PLMN Selector"},
-        {{0x6F, 0x33}, "EF_PLMNwAcT", "PLMN with Access Technology"},
-        {{0x6F, 0x35}, "EF_OPLMNwAcT", "Operator PLMN with Access Technology"},
-        {{0x6F, 0x36}, "EF_HPLMNwAcT", "HPLMN with Access Technology"},
-        {{0x6F, 0x37}, "EF_CPBCCH", "CPBCCH Information"},
-        {{0x6F, 0x38}, "EF_INVSCAN", "Inquiry Scan"},
-        {{0x6F, 0x39}, "EF_PNN", "PLMN Network Name"},
-        {{0x6F, 0x3E}, "EF_OPL", "Operator PLMN List"},
-        {{0x6F, 0x41}, "EF_EXT2", "Extension 2"},
-        {{0x6F, 0x42}, "EF_EXT3", "Extension 3"},
-        {{0x6F, 0x43}, "EF_EXT4", "Extension 4"},
-        {{0x6F, 0x48}, "EF_SUME", "Setup Menu Elements"},
-        {{0x6F, 0x4A}, "EF_EXT5", "Extension 5"},
-        {{0x6F, 0x4B}, "EF_EXT6", "Extension 6"},
-        {{0x6F, 0x4C}, "EF_MMI", "Man Machine Interface"},
-        {{0x6F, 0x4D}, "EF_MMSN", "MMS Notification"},
-        {{0x6F, 0x4E}, "EF_MMSICP", "MMS ICP"},
-        {{0x6F, 0x4F}, "EF_MMSUP", "MMS User Preferences"},
-        {{0x6F, 0x50}, "EF_MMSUCP", "MMS User Connectivity Preferences"},
-    };
-    
-    int num_files = sizeof(files_to_check) / sizeof(files_to_check[0]);
-    int found_files = 0;
-    
-    for (int i = 0; i < num_files; i++) {
-        if (select_file_traditional(files_to_check[i].id, files_to_check[i].name, verbose) == 0) {
-            found_files++;
-            printf("✓ %s (%s) - %s\n", files_to_check[i].name, 
-                   files_to_check[i].description, 
-                   files_to_check[i].id[0] < 0x7F ? "Transparent File" : "Dedicated File");
-            printf("\n");
+// Generic file access (FCP-aware)
+
+// Send an APDU and collect the complete response data, following 61xx
+// (GET RESPONSE) and 6Cxx (wrong Le) status words. The final status word is
+// returned in *sw and is not part of the data.
+static int exchange_apdu(const BYTE *apdu, DWORD apdu_len, BYTE *data, int max_len,
+                         int *data_len, WORD *sw) {
+    BYTE cmd[BUFFER_SIZE];
+    BYTE resp[BUFFER_SIZE];
+    DWORD resp_len = sizeof(resp);
+
+    *data_len = 0;
+    if (apdu_len > sizeof(cmd)) return -1;
+    memcpy(cmd, apdu, apdu_len);
+    cmd[0] = (cmd[0] & 0xFC) | logical_channel;
+
+    if (transmit_apdu(cmd, apdu_len, resp, &resp_len) < 0 || resp_len < 2) {
+        return -1;
+    }
+    *sw = (resp[resp_len-2] << 8) | resp[resp_len-1];
+
+    // Short APDUs carry Le only as their last byte after the header (case
+    // 2) or after the command data (case 4); case 1 and 3 have none
+    int has_le = apdu_len == 5 || (apdu_len > 5 && apdu_len == 6u + apdu[4]);
+    if ((*sw & 0xFF00) == 0x6C00 && has_le) {
+        // Reissue with the length the card asked for
+        cmd[apdu_len - 1] = *sw & 0xFF;
+        resp_len = sizeof(resp);
+        if (transmit_apdu(cmd, apdu_len, resp, &resp_len) < 0 || resp_len < 2) {
+            return -1;
         }
+        *sw = (resp[resp_len-2] << 8) | resp[resp_len-1];
     }
-    
-    printf("Found %d accessible files out of %d checked\n", found_files, num_files);
+
+    int len = resp_len - 2;
+    if (len > max_len) len = max_len;
+    memcpy(data, resp, len);
+    *data_len = len;
+
+    // 61xx (9Fxx for GSM class commands): response data waiting
+    while ((*sw & 0xFF00) == 0x6100 || (*sw & 0xFF00) == 0x9F00) {
+        BYTE get_response[] = {cmd[0], 0xC0, 0x00, 0x00, (BYTE)(*sw & 0xFF)};
+        resp_len = sizeof(resp);
+        if (transmit_apdu(get_response, sizeof(get_response), resp, &resp_len) < 0 ||
+            resp_len < 2) {
+            return -1;
+        }
+        *sw = (resp[resp_len-2] << 8) | resp[resp_len-1];
+        len = resp_len - 2;
+        if (*data_len + len > max_len) len = max_len - *data_len;
+        memcpy(data + *data_len, resp, len);
+        *data_len += len;
+    }
+
+    return 0;
 }
 
-// Universal data extraction functions (try both methods)
-static int get_iccid(sim_data_t *sim_data, int verbose) {
-    BYTE iccid[] = {0x2F, 0xE2};
-    BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
-    BYTE data[20];
+// Select a file by its absolute path (starting with 3F00). When fcp is not
+// NULL the FCP template is requested and returned.
+static int select_path(const BYTE *path, int path_len, BYTE *fcp, int *fcp_len, int verbose) {
+    BYTE apdu[5 + MAX_PATH_LEN + 1];
+    int apdu_len = 0;
+    BYTE resp[BUFFER_SIZE];
+    int resp_len;
+    WORD sw;
+
+    if (path_len < 2 || path_len > MAX_PATH_LEN) return -1;
+
+    apdu[apdu_len++] = 0x00;
+    apdu[apdu_len++] = 0xA4;
+    if (path_len == 2) {
+        apdu[apdu_len++] = 0x00;  // P1: Select by file ID (MF)
+    } else {
+        apdu[apdu_len++] = 0x08;  // P1: Select by path from MF
+        path += 2;
+        path_len -= 2;
+    }
+    apdu[apdu_len++] = fcp ? 0x04 : 0x0C;  // P2: FCP template or no data
+    apdu[apdu_len++] = path_len;
+    memcpy(&apdu[apdu_len], path, path_len);
+    apdu_len += path_len;
+    if (fcp && dwActiveProtocol != SCARD_PROTOCOL_T0) {
+        apdu[apdu_len++] = 0x00;  // Le (T=0 uses GET RESPONSE instead)
+    }
+
+    if (exchange_apdu(apdu, apdu_len, resp, sizeof(resp), &resp_len, &sw) < 0) {
+        return -1;
+    }
+    if (sw != 0x9000) {
+        if (verbose) {
+            print_hex("Select failed for path", path, path_len);
+            printf("  SW=%04X\n", sw);
+        }
+        return -1;
+    }
+
+    if (fcp) {
+        if (resp_len > MAX_FCP_LEN) resp_len = MAX_FCP_LEN;
+        memcpy(fcp, resp, resp_len);
+        *fcp_len = resp_len;
+    }
+    return 0;
+}
+
+// Find a BER-TLV tag inside the FCP template (tag 62)
+static const BYTE *fcp_find_tag(const BYTE *fcp, int fcp_len, BYTE tag, int *len) {
+    if (fcp_len < 2 || fcp[0] != 0x62) return NULL;
+
+    int end = 2 + fcp[1];
+    if (end > fcp_len) end = fcp_len;
+
+    for (int i = 2; i + 1 < end; ) {
+        BYTE t = fcp[i];
+        int l = fcp[i + 1];
+        if (i + 2 + l > end) break;
+        if (t == tag) {
+            *len = l;
+            return &fcp[i + 2];
+        }
+        i += 2 + l;
+    }
+    return NULL;
+}
+
+// Fill in structure, record size and record count from the FCP
+static void parse_fcp(snap_file_t *file) {
+    const BYTE *v;
     int len;
-    
-    // Try traditional selection first
-    if (select_file_traditional(iccid, "EF_ICCID", verbose) == 0) {
-        if (read_binary(data, 20, &len, verbose) == 0) {
-            print_hex_verbose("ICCID raw", data, len, verbose);
-            if (decode_iccid(data, len, sim_data->iccid) == 0) {
-                return 0;
+
+    file->structure = 0;
+    file->record_len = 0;
+    file->num_records = 0;
+
+    v = fcp_find_tag(file->fcp, file->fcp_len, 0x82, &len);
+    if (v && len >= 1) {
+        file->structure = v[0] & 0x07;
+        if (len >= 5) {
+            file->record_len = (v[2] << 8) | v[3];
+            file->num_records = v[4];
+        }
+    }
+}
+
+static int fcp_file_size(const snap_file_t *file) {
+    int len;
+    const BYTE *v = fcp_find_tag(file->fcp, file->fcp_len, 0x80, &len);
+
+    if (v && len >= 2) return (v[0] << 8) | v[1];
+    if (file->record_len) return file->record_len * file->num_records;
+    return 0;
+}
+
+// Read size bytes of a transparent EF: the current one, or the file with
+// short file identifier sfi in the current DF (which also selects it)
+static int read_binary_all(int sfi, BYTE *data, int size) {
+    BYTE resp[BUFFER_SIZE];
+    int resp_len;
+    WORD sw;
+    int offset = 0;
+
+    while (offset < size) {
+        int chunk = size - offset > 256 ? 256 : size - offset;
+        BYTE apdu[] = {0x00, 0xB0, (BYTE)((offset >> 8) & 0x7F), (BYTE)(offset & 0xFF),
+                       (BYTE)(chunk & 0xFF)};
+        if (sfi && offset == 0) {
+            apdu[2] = 0x80 | sfi;  // P1: SFI addressing, P2 is the offset
+        }
+
+        if (exchange_apdu(apdu, sizeof(apdu), resp, sizeof(resp), &resp_len, &sw) < 0 ||
+            sw != 0x9000 || resp_len == 0) {
+            break;
+        }
+        if (resp_len > size - offset) resp_len = size - offset;
+        memcpy(data + offset, resp, resp_len);
+        offset += resp_len;
+    }
+
+    return offset;
+}
+
+// Records are at most 256 bytes (Le 00) in a short READ RECORD
+static int read_record(int sfi, int record, BYTE *data, int record_len) {
+    BYTE apdu[] = {0x00, 0xB2, (BYTE)record, (BYTE)((sfi << 3) | 0x04), (BYTE)record_len};
+    BYTE resp[BUFFER_SIZE];
+    int resp_len;
+    WORD sw;
+
+    if (record_len < 1 || record_len > 256) return -1;
+    if (exchange_apdu(apdu, sizeof(apdu), resp, sizeof(resp), &resp_len, &sw) < 0 ||
+        sw != 0x9000) {
+        return -1;
+    }
+    if (resp_len > record_len) resp_len = record_len;
+    memcpy(data, resp, resp_len);
+    return resp_len;
+}
+
+static int update_binary(int offset, const BYTE *data, int len) {
+    BYTE apdu[5 + 255];
+    BYTE resp[BUFFER_SIZE];
+    int resp_len;
+    WORD sw;
+
+    while (len > 0) {
+        int chunk = len > 255 ? 255 : len;
+        apdu[0] = 0x00;
+        apdu[1] = 0xD6;
+        apdu[2] = (offset >> 8) & 0x7F;
+        apdu[3] = offset & 0xFF;
+        apdu[4] = chunk;
+        memcpy(&apdu[5], data, chunk);
+        if (exchange_apdu(apdu, 5 + chunk, resp, sizeof(resp), &resp_len, &sw) < 0 ||
+            sw != 0x9000) {
+            return -1;
+        }
+        offset += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int update_record(int record, const BYTE *data, int record_len) {
+    BYTE apdu[5 + 255];
+    BYTE resp[BUFFER_SIZE];
+    int resp_len;
+    WORD sw;
+
+    if (record_len > 255) return -1;
+    apdu[0] = 0x00;
+    apdu[1] = 0xDC;
+    apdu[2] = record;
+    apdu[3] = 0x04;  // P2: absolute record number
+    apdu[4] = record_len;
+    memcpy(&apdu[5], data, record_len);
+    if (exchange_apdu(apdu, 5 + record_len, resp, sizeof(resp), &resp_len, &sw) < 0 ||
+        sw != 0x9000) {
+        return -1;
+    }
+    return 0;
+}
+
+// Present an ADM key (key reference 0A) to unlock administrative updates
+static int verify_adm(const BYTE *key, int verbose) {
+    BYTE apdu[5 + 8] = {0x00, 0x20, 0x00, 0x0A, 0x08};
+    BYTE resp[BUFFER_SIZE];
+    int resp_len;
+    WORD sw;
+
+    memcpy(&apdu[5], key, 8);
+    if (exchange_apdu(apdu, sizeof(apdu), resp, sizeof(resp), &resp_len, &sw) < 0) {
+        return -1;
+    }
+    if (sw != 0x9000) {
+        if (verbose || (sw & 0xFFF0) == 0x63C0) {
+            fprintf(stderr, "ADM verification failed (SW=%04X)\n", sw);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Snapshot capture and storage
+
+// Files captured in a snapshot, as absolute paths from the MF. Paths through
+// 7FFF refer to the USIM application selected from EF_DIR.
+static const struct {
+    BYTE path[MAX_PATH_LEN];
+    int path_len;
+    const char *name;
+} snapshot_catalog[] = {
+    {{0x3F, 0x00, 0x2F, 0xE2}, 4, "EF_ICCID"},
+    {{0x3F, 0x00, 0x2F, 0x00}, 4, "EF_DIR"},
+    {{0x3F, 0x00, 0x2F, 0x05}, 4, "EF_PL"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x3A}, 6, "EF_ADN"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x3B}, 6, "EF_FDN"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x3C}, 6, "EF_SMS"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x40}, 6, "EF_MSISDN"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x42}, 6, "EF_SMSP"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x43}, 6, "EF_SMSS"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x44}, 6, "EF_LND"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x47}, 6, "EF_SMSR"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x49}, 6, "EF_SDN"},
+    {{0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x4A}, 6, "EF_EXT1"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x07}, 6, "EF_IMSI"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x38}, 6, "EF_SST"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x46}, 6, "EF_SPN"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x78}, 6, "EF_ACC"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x7B}, 6, "EF_FPLMN"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x7E}, 6, "EF_LOCI"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0xAD}, 6, "EF_AD"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0xAE}, 6, "EF_PHASE"},
+    {{0x3F, 0x00, 0x7F, 0x20, 0x6F, 0xB7}, 6, "EF_ECC"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x07}, 6, "EF_IMSI"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x38}, 6, "EF_UST"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x56}, 6, "EF_EST"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x46}, 6, "EF_SPN"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x40}, 6, "EF_MSISDN"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x78}, 6, "EF_ACC"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x7B}, 6, "EF_FPLMN"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x7E}, 6, "EF_LOCI"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x73}, 6, "EF_PSLOCI"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0xE3}, 6, "EF_EPSLOCI"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0xAD}, 6, "EF_AD"},
+    {{0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0xB7}, 6, "EF_ECC"},
+};
+
+static const char *catalog_name(const BYTE *path, int path_len) {
+    int num = sizeof(snapshot_catalog) / sizeof(snapshot_catalog[0]);
+
+    for (int i = 0; i < num; i++) {
+        if (snapshot_catalog[i].path_len == path_len &&
+            memcmp(snapshot_catalog[i].path, path, path_len) == 0) {
+            return snapshot_catalog[i].name;
+        }
+    }
+    return NULL;
+}
+
+static int path_in_adf(const BYTE *path, int path_len) {
+    return path_len >= 4 && path[2] == 0x7F && path[3] == 0xFF;
+}
+
+static uint64_t fnv1a64(const BYTE *data, int len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Decoded by hand: this parses every byte of a snapshot archive
+static int hex_to_bytes(const char *hex, BYTE *out, int max_len) {
+    int len = 0;
+
+    while (hex[0] && hex[1]) {
+        int hi = hex_nibble(hex[0]);
+        int lo = hex_nibble(hex[1]);
+        if (len >= max_len || hi < 0 || lo < 0) return -1;
+        out[len++] = (BYTE)(hi << 4 | lo);
+        hex += 2;
+    }
+    return hex[0] ? -1 : len;
+}
+
+static void fprint_hex(FILE *out, const BYTE *data, int len) {
+    static const char digits[] = "0123456789ABCDEF";
+    char buf[512];
+
+    if (len == 0) {
+        fputc('-', out);
+        return;
+    }
+    // Formatted in blocks: snapshots of generated cards run to gigabytes
+    for (int i = 0; i < len; i += sizeof(buf) / 2) {
+        int n = len - i < (int)sizeof(buf) / 2 ? len - i : (int)sizeof(buf) / 2;
+        for (int k = 0; k < n; k++) {
+            buf[2 * k] = digits[data[i + k] >> 4];
+            buf[2 * k + 1] = digits[data[i + k] & 0x0F];
+        }
+        fwrite(buf, 1, 2 * n, out);
+    }
+}
+
+static void snapshot_free(snapshot_t *snap) {
+    for (int i = 0; i < snap->num_files; i++) {
+        free(snap->files[i].data);
+    }
+    snap->num_files = 0;
+}
+
+static snap_file_t *snapshot_find(const snapshot_t *snap, const BYTE *path, int path_len) {
+    for (int i = 0; i < snap->num_files; i++) {
+        if (snap->files[i].path_len == path_len &&
+            memcmp(snap->files[i].path, path, path_len) == 0) {
+            return (snap_file_t *)&snap->files[i];
+        }
+    }
+    return NULL;
+}
+
+// The EF 6Fxx in DF 7Fxx (7FFF: the USIM)
+static snap_file_t *snapshot_find_ef(const snapshot_t *snap, BYTE df, BYTE fid_lo) {
+    BYTE path[] = {0x3F, 0x00, 0x7F, df, 0x6F, fid_lo};
+    return snapshot_find(snap, path, sizeof(path));
+}
+
+// Find the USIM AID in an EF_DIR record (application template 61 L 4F L AID)
+static int dir_record_aid(const BYTE *data, int len, WORD app, BYTE *aid) {
+    static const BYTE rid[] = {0xA0, 0x00, 0x00, 0x00, 0x87};
+
+    if (len < 4 || data[0] != 0x61 || data[2] != 0x4F) return -1;
+    int aid_len = data[3];
+    if (aid_len < (int)sizeof(rid) + 2 || aid_len > 16 || 4 + aid_len > len ||
+        memcmp(&data[4], rid, sizeof(rid)) != 0 ||
+        ((data[4 + sizeof(rid)] << 8) | data[5 + sizeof(rid)]) != app) {
+        return -1;
+    }
+    memcpy(aid, &data[4], aid_len);
+    return aid_len;
+}
+
+static int dir_record_usim_aid(const BYTE *data, int len, BYTE *aid) {
+    return dir_record_aid(data, len, APP_USIM, aid);
+}
+
+static int select_aid(const BYTE *aid, int aid_len, int verbose) {
+    BYTE apdu[5 + 16];
+    BYTE resp[BUFFER_SIZE];
+    int resp_len;
+    WORD sw;
+
+    if (aid_len > 16) return -1;
+    apdu[0] = 0x00;
+    apdu[1] = 0xA4;
+    apdu[2] = 0x04;  // P1: Select by DF name (AID)
+    apdu[3] = 0x0C;
+    apdu[4] = aid_len;
+    memcpy(&apdu[5], aid, aid_len);
+    if (exchange_apdu(apdu, 5 + aid_len, resp, sizeof(resp), &resp_len, &sw) < 0 ||
+        sw != 0x9000) {
+        return -1;
+    }
+    if (verbose) print_hex("Selected application", aid, aid_len);
+    return 0;
+}
+
+// Select the application listed in EF_DIR with the given 3GPP application
+// code (APP_USIM, APP_ISIM) on the current channel, so 7FFF paths resolve
+static int select_app(WORD app, int verbose) {
+    BYTE dir_path[] = {0x3F, 0x00, 0x2F, 0x00};
+    BYTE fcp[MAX_FCP_LEN];
+    int fcp_len;
+    snap_file_t dir = {0};
+
+    if (select_path(dir_path, sizeof(dir_path), fcp, &fcp_len, verbose) < 0) return -1;
+    memcpy(dir.fcp, fcp, fcp_len);
+    dir.fcp_len = fcp_len;
+    parse_fcp(&dir);
+
+    for (int rec = 1; rec <= dir.num_records; rec++) {
+        BYTE data[BUFFER_SIZE];
+        BYTE aid[16];
+        int len = read_record(0, rec, data, dir.record_len);
+        int aid_len = dir_record_aid(data, len, app, aid);
+
+        if (aid_len > 0 && select_aid(aid, aid_len, verbose) == 0) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int select_usim(int verbose) {
+    return select_app(APP_USIM, verbose);
+}
+
+// Open a logical channel with MANAGE CHANNEL; returns its number (1-3)
+static int open_channel(int verbose) {
+    BYTE apdu[] = {0x00, 0x70, 0x00, 0x00, 0x01};
+    BYTE resp[8];
+    int resp_len;
+    WORD sw;
+
+    if (exchange_apdu(apdu, sizeof(apdu), resp, sizeof(resp), &resp_len, &sw) < 0 ||
+        sw != 0x9000 || resp_len < 1 || resp[0] < 1 || resp[0] > 3) {
+        if (verbose) printf("MANAGE CHANNEL open failed\n");
+        return -1;
+    }
+    if (verbose) printf("Opened logical channel %d\n", resp[0]);
+    return resp[0];
+}
+
+static void close_channel(int channel) {
+    BYTE apdu[] = {0x00, 0x70, 0x80, (BYTE)channel};
+    BYTE resp[8];
+    int resp_len;
+    WORD sw;
+
+    exchange_apdu(apdu, sizeof(apdu), resp, sizeof(resp), &resp_len, &sw);
+}
+
+// Select a file by path and read its FCP and complete contents; the caller
+// frees file->data
+static int read_ef(snap_file_t *file, const BYTE *path, int path_len, int verbose) {
+    memset(file, 0, sizeof(*file));
+    memcpy(file->path, path, path_len);
+    file->path_len = path_len;
+
+    if (select_path(path, path_len, file->fcp, &file->fcp_len, verbose) < 0) {
+        return -1;
+    }
+    parse_fcp(file);
+
+    // Record files are read record by record, whatever size tag 80 gives
+    int records = file->structure == EF_LINEAR_FIXED || file->structure == EF_CYCLIC;
+    int size = records ? file->num_records * file->record_len : fcp_file_size(file);
+    file->data = malloc(size > 0 ? size : 1);
+    if (!file->data) return -1;
+
+    if (file->structure == EF_TRANSPARENT) {
+        file->data_len = read_binary_all(0, file->data, size);
+    } else if (file->structure == EF_LINEAR_FIXED || file->structure == EF_CYCLIC) {
+        for (int rec = 1; rec <= file->num_records; rec++) {
+            BYTE *dst = file->data + (rec - 1) * file->record_len;
+            if (read_record(0, rec, dst, file->record_len) != file->record_len) break;
+            file->data_len += file->record_len;
+        }
+    }
+    file->hash = fnv1a64(file->data, file->data_len);
+    return 0;
+}
+
+// Read one file (FCP and full contents) into the snapshot
+static int snapshot_read_file(snapshot_t *snap, const BYTE *path, int path_len, int verbose) {
+    if (snap->num_files >= MAX_SNAPSHOT_FILES) return -1;
+
+    snap_file_t *file = &snap->files[snap->num_files];
+    if (read_ef(file, path, path_len, verbose) < 0) {
+        free(file->data);
+        file->data = NULL;
+        return -1;
+    }
+    snap->num_files++;
+
+    if (verbose) {
+        printf("Captured %s (%d bytes)\n", catalog_name(path, path_len) ?
+               catalog_name(path, path_len) : "file", file->data_len);
+    }
+    return 0;
+}
+
+// Capture the catalog files from the card. With a plan, only the files
+// present in the plan snapshot are read.
+static int snapshot_capture(snapshot_t *snap, const snapshot_t *plan, int verbose) {
+    int num = sizeof(snapshot_catalog) / sizeof(snapshot_catalog[0]);
+    int have_usim = -1;
+
+    snap->num_files = 0;
+    if (get_atr(snap->atr, &snap->atr_len) < 0) {
+        snap->atr_len = 0;
+    }
+
+    int total = plan ? plan->num_files : num;
+    for (int i = 0; i < total; i++) {
+        const BYTE *path = plan ? plan->files[i].path : snapshot_catalog[i].path;
+        int path_len = plan ? plan->files[i].path_len : snapshot_catalog[i].path_len;
+
+        if (path_in_adf(path, path_len)) {
+            if (have_usim < 0) have_usim = select_usim(verbose) == 0;
+            if (!have_usim) continue;
+        }
+        snapshot_read_file(snap, path, path_len, verbose);
+    }
+
+    return snap->num_files > 0 ? 0 : -1;
+}
+
+static int snapshot_save(FILE *out, const snapshot_t *snap) {
+    fprintf(out, "%s %d\n", SNAPSHOT_MAGIC, SNAPSHOT_VERSION);
+    fprintf(out, "atr ");
+    fprint_hex(out, snap->atr, snap->atr_len);
+    fputc('\n', out);
+
+    for (int i = 0; i < snap->num_files; i++) {
+        const snap_file_t *file = &snap->files[i];
+        fprintf(out, "file ");
+        fprint_hex(out, file->path, file->path_len);
+        fprintf(out, " %016" PRIx64 " ", file->hash);
+        fprint_hex(out, file->fcp, file->fcp_len);
+        fputc(' ', out);
+        fprint_hex(out, file->data, file->data_len);
+        fputc('\n', out);
+    }
+
+    fprintf(out, "end\n");
+    return ferror(out) ? -1 : 0;
+}
+
+// Load the next snapshot from a stream. Returns 1 when a snapshot was read,
+// 0 at end of input and -1 on malformed input.
+static int snapshot_load(FILE *in, snapshot_t *snap) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    int started = 0;
+    int result = -1;
+
+    snap->num_files = 0;
+    snap->atr_len = 0;
+
+    while ((n = getline(&line, &cap, in)) >= 0) {
+        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+
+        if (!started) {
+            int version;
+            if (sscanf(line, SNAPSHOT_MAGIC " %d", &version) != 1 ||
+                version != SNAPSHOT_VERSION) {
+                break;
+            }
+            started = 1;
+            continue;
+        }
+
+        if (strcmp(line, "end") == 0) {
+            result = 1;
+            break;
+        }
+
+        char *save = NULL;
+        char *key = strtok_r(line, " ", &save);
+        if (strcmp(key, "atr") == 0) {
+            char *hex = strtok_r(NULL, " ", &save);
+            int len = hex && strcmp(hex, "-") ? hex_to_bytes(hex, snap->atr, MAX_ATR_SIZE) : 0;
+            if (len < 0) break;
+            snap->atr_len = len;
+        } else if (strcmp(key, "file") == 0) {
+            char *path = strtok_r(NULL, " ", &save);
+            char *hash = strtok_r(NULL, " ", &save);
+            char *fcp = strtok_r(NULL, " ", &save);
+            char *data = strtok_r(NULL, " ", &save);
+            if (!path || !hash || !fcp || !data || snap->num_files >= MAX_SNAPSHOT_FILES) break;
+
+            snap_file_t *file = &snap->files[snap->num_files];
+            memset(file, 0, sizeof(*file));
+            file->path_len = hex_to_bytes(path, file->path, MAX_PATH_LEN);
+            file->fcp_len = strcmp(fcp, "-") ? hex_to_bytes(fcp, file->fcp, MAX_FCP_LEN) : 0;
+            file->hash = strtoull(hash, NULL, 16);
+            file->data = malloc(strlen(data) / 2 + 1);
+            if (!file->data) break;
+            file->data_len = strcmp(data, "-") ? hex_to_bytes(data, file->data, strlen(data) / 2) : 0;
+            if (file->path_len < 2 || file->fcp_len < 0 || file->data_len < 0) {
+                free(file->data);
+                break;
+            }
+            parse_fcp(file);
+            snap->num_files++;
+        }
+        // Unknown keys are skipped so newer writers stay readable
+    }
+
+    if (!started && n < 0) result = 0;
+    free(line);
+    if (result < 0) snapshot_free(snap);
+    return result;
+}
+
+static int snapshot_load_file(const char *filename, snapshot_t *snap) {
+    FILE *in = fopen(filename, "r");
+    if (!in) {
+        fprintf(stderr, "Cannot open snapshot %s\n", filename);
+        return -1;
+    }
+
+    int rv = snapshot_load(in, snap);
+    fclose(in);
+    if (rv <= 0) {
+        fprintf(stderr, "Invalid snapshot %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Milenage (TS 35.206)
+
+static const BYTE aes_sbox[256] = {
+    0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+    0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+    0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+    0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+    0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+    0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+    0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+    0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+    0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+    0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+    0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+    0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+    0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+    0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+    0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16,
+};
+
+// Expanded AES-128 encryption key: 11 round keys
+typedef struct {
+    BYTE rk[176];
+} aes128_key_t;
+
+static void aes128_expand(const BYTE *key, aes128_key_t *ks) {
+    BYTE rcon = 0x01;
+
+    memcpy(ks->rk, key, 16);
+    for (int i = 16; i < 176; i += 4) {
+        BYTE t[4];
+        memcpy(t, &ks->rk[i - 4], 4);
+        if (i % 16 == 0) {
+            BYTE first = t[0];
+            t[0] = aes_sbox[t[1]] ^ rcon;
+            t[1] = aes_sbox[t[2]];
+            t[2] = aes_sbox[t[3]];
+            t[3] = aes_sbox[first];
+            rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x1B : 0);
+        }
+        for (int j = 0; j < 4; j++) ks->rk[i + j] = ks->rk[i - 16 + j] ^ t[j];
+    }
+}
+
+static BYTE aes_xtime(BYTE x) {
+    return (x << 1) ^ ((x & 0x80) ? 0x1B : 0);
+}
+
+static void aes128_encrypt(const aes128_key_t *ks, const BYTE *in, BYTE *out) {
+    BYTE s[16];
+
+    for (int i = 0; i < 16; i++) s[i] = in[i] ^ ks->rk[i];
+    for (int round = 1; round <= 10; round++) {
+        BYTE t[16];
+        // SubBytes and ShiftRows (the state is column-major)
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) t[4 * c + r] = aes_sbox[s[4 * ((c + r) % 4) + r]];
+        }
+        if (round < 10) {
+            for (int c = 0; c < 4; c++) {
+                BYTE *col = &t[4 * c];
+                BYTE all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                BYTE first = col[0];
+                col[0] ^= all ^ aes_xtime(col[0] ^ col[1]);
+                col[1] ^= all ^ aes_xtime(col[1] ^ col[2]);
+                col[2] ^= all ^ aes_xtime(col[2] ^ col[3]);
+                col[3] ^= all ^ aes_xtime(col[3] ^ first);
+            }
+        }
+        for (int i = 0; i < 16; i++) s[i] = t[i] ^ ks->rk[16 * round + i];
+    }
+    memcpy(out, s, 16);
+}
+
+// Batched AES-128 encryption: block i of in is encrypted under keys[i].
+// With AES-NI, AES_LANES independent blocks are interleaved so that the
+// AESENC pipeline stays full; otherwise blocks go through aes128_encrypt
+// one at a time.
+#define AES_LANES 8
+
+typedef void (*aes128_batch_fn)(const aes128_key_t *const *keys, const BYTE *in, BYTE *out, int n);
+
+static void aes128_encrypt_batch_portable(const aes128_key_t *const *keys, const BYTE *in,
+                                          BYTE *out, int n) {
+    for (int i = 0; i < n; i++) aes128_encrypt(keys[i], in + 16 * i, out + 16 * i);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <wmmintrin.h>
+#define HAVE_AES_NI 1
+
+__attribute__((target("aes,sse2")))
+static void aes128_encrypt_batch_ni(const aes128_key_t *const *keys, const BYTE *in, BYTE *out,
+                                    int n) {
+    int i = 0;
+
+    for (; i + AES_LANES <= n; i += AES_LANES) {
+        __m128i s[AES_LANES];
+        for (int l = 0; l < AES_LANES; l++) {
+            s[l] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + 16 * (i + l))),
+                                 _mm_loadu_si128((const __m128i *)keys[i + l]->rk));
+        }
+        for (int round = 1; round < 10; round++) {
+            for (int l = 0; l < AES_LANES; l++) {
+                s[l] = _mm_aesenc_si128(s[l], _mm_loadu_si128((const __m128i *)(keys[i + l]->rk + 16 * round)));
             }
         }
+        for (int l = 0; l < AES_LANES; l++) {
+            s[l] = _mm_aesenclast_si128(s[l], _mm_loadu_si128((const __m128i *)(keys[i + l]->rk + 160)));
+            _mm_storeu_si128((__m128i *)(out + 16 * (i + l)), s[l]);
+        }
+    }
+    for (; i < n; i++) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + 16 * i)),
+                                  _mm_loadu_si128((const __m128i *)keys[i]->rk));
+        for (int round = 1; round < 10; round++) {
+            b = _mm_aesenc_si128(b, _mm_loadu_si128((const __m128i *)(keys[i]->rk + 16 * round)));
+        }
+        b = _mm_aesenclast_si128(b, _mm_loadu_si128((const __m128i *)(keys[i]->rk + 160)));
+        _mm_storeu_si128((__m128i *)(out + 16 * i), b);
+    }
+}
+#endif
+
+// The batch kernel for this CPU; SIMREADER_NO_AESNI in the environment
+// forces the portable one
+static aes128_batch_fn aes128_batch_kernel(const char **name) {
+#ifdef HAVE_AES_NI
+    if (!getenv("SIMREADER_NO_AESNI") && __builtin_cpu_supports("aes")) {
+        if (name) *name = "aes-ni";
+        return aes128_encrypt_batch_ni;
+    }
+#endif
+    if (name) *name = "portable";
+    return aes128_encrypt_batch_portable;
+}
+
+typedef struct {
+    aes128_key_t k;
+    BYTE opc[16];
+} milenage_t;
+
+static void milenage_init(milenage_t *m, const BYTE *k, const BYTE *opc) {
+    aes128_expand(k, &m->k);
+    memcpy(m->opc, opc, 16);
+}
+
+// OUTn = E_K(rot(x XOR OPc, r) XOR cn) XOR OPc, with r in bytes and the
+// constant cn in the last byte. milenage_in builds the block to encrypt.
+static void milenage_in(const milenage_t *m, const BYTE *x, int r, BYTE c, BYTE *in) {
+    for (int i = 0; i < 16; i++) in[i] = x[(i + r) % 16] ^ m->opc[(i + r) % 16];
+    in[15] ^= c;
+}
+
+static void milenage_out(const milenage_t *m, const BYTE *x, int r, BYTE c, BYTE *out) {
+    BYTE in[16];
+
+    milenage_in(m, x, r, c, in);
+    aes128_encrypt(&m->k, in, out);
+    for (int i = 0; i < 16; i++) out[i] ^= m->opc[i];
+}
+
+// f1 and f1*: network and resynchronisation authentication codes
+static void milenage_f1(const milenage_t *m, const BYTE *rand, const BYTE *sqn, const BYTE *amf,
+                        BYTE *mac_a, BYTE *mac_s) {
+    BYTE temp[16];
+    BYTE in1[16];
+    BYTE x[16];
+    BYTE out[16];
+
+    for (int i = 0; i < 16; i++) x[i] = rand[i] ^ m->opc[i];
+    aes128_encrypt(&m->k, x, temp);
+    memcpy(in1, sqn, 6);
+    memcpy(in1 + 6, amf, 2);
+    memcpy(in1 + 8, in1, 8);
+    // TEMP XOR rot(IN1 XOR OPc, r1): TEMP is rotated the other way first
+    for (int i = 0; i < 16; i++) x[i] = in1[i] ^ temp[(i + 8) % 16];
+    milenage_out(m, x, 8, 0x00, out);
+    if (mac_a) memcpy(mac_a, out, 8);
+    if (mac_s) memcpy(mac_s, out + 8, 8);
+}
+
+// f2 to f5*: RES, CK, IK, AK and the resynchronisation AK
+static void milenage_f2345(const milenage_t *m, const BYTE *rand, BYTE *res, BYTE *ck, BYTE *ik,
+                           BYTE *ak, BYTE *ak_s) {
+    BYTE temp[16];
+    BYTE x[16];
+    BYTE out[16];
+
+    for (int i = 0; i < 16; i++) x[i] = rand[i] ^ m->opc[i];
+    aes128_encrypt(&m->k, x, temp);
+    milenage_out(m, temp, 0, 0x01, out);
+    if (res) memcpy(res, out + 8, 8);
+    if (ak) memcpy(ak, out, 6);
+    if (ck) {
+        milenage_out(m, temp, 4, 0x02, out);
+        memcpy(ck, out, 16);
+    }
+    if (ik) {
+        milenage_out(m, temp, 8, 0x04, out);
+        memcpy(ik, out, 16);
+    }
+    if (ak_s) {
+        milenage_out(m, temp, 12, 0x08, out);
+        memcpy(ak_s, out, 6);
+    }
+}
+
+// RES, CK and IK for many (key, RAND) pairs at once: the TEMP blocks of a
+// chunk are encrypted in one batch, then the f2, f3 and f4 blocks in another
+#define MILENAGE_CHUNK 256
+
+typedef struct {
+    const milenage_t *m;
+    BYTE rand[16];
+    BYTE res[8];
+    BYTE ck[16];
+    BYTE ik[16];
+} milenage_job_t;
+
+static void milenage_f234_batch(aes128_batch_fn kernel, milenage_job_t *jobs, int n) {
+    static const struct {
+        int r;
+        BYTE c;
+    } outputs[3] = {{0, 0x01}, {4, 0x02}, {8, 0x04}};
+    const aes128_key_t *keys[3 * MILENAGE_CHUNK];
+    BYTE in[3 * MILENAGE_CHUNK][16];
+    BYTE out[3 * MILENAGE_CHUNK][16];
+
+    for (int base = 0; base < n; base += MILENAGE_CHUNK) {
+        int count = n - base < MILENAGE_CHUNK ? n - base : MILENAGE_CHUNK;
+        milenage_job_t *chunk = jobs + base;
+
+        for (int j = 0; j < count; j++) {
+            keys[j] = &chunk[j].m->k;
+            for (int i = 0; i < 16; i++) in[j][i] = chunk[j].rand[i] ^ chunk[j].m->opc[i];
+        }
+        kernel(keys, in[0], out[0], count);
+        for (int j = 0; j < count; j++) {
+            for (int o = 0; o < 3; o++) {
+                keys[3 * j + o] = &chunk[j].m->k;
+                milenage_in(chunk[j].m, out[j], outputs[o].r, outputs[o].c, in[3 * j + o]);
+            }
+        }
+        kernel(keys, in[0], out[0], 3 * count);
+        for (int j = 0; j < count; j++) {
+            const BYTE *opc = chunk[j].m->opc;
+            for (int i = 0; i < 16; i++) {
+                if (i >= 8) chunk[j].res[i - 8] = out[3 * j][i] ^ opc[i];
+                chunk[j].ck[i] = out[3 * j + 1][i] ^ opc[i];
+                chunk[j].ik[i] = out[3 * j + 2][i] ^ opc[i];
+            }
+        }
+    }
+}
+
+// GSM SRES and Kc derived from the UMTS values (conversion functions c2
+// and c3, TS 33.102 6.8.1.2)
+static void umts_to_gsm(const BYTE *res, const BYTE *ck, const BYTE *ik, BYTE *sres, BYTE *kc) {
+    for (int i = 0; i < 4; i++) sres[i] = res[i] ^ res[i + 4];
+    for (int i = 0; i < 8; i++) kc[i] = ck[i] ^ ck[i + 8] ^ ik[i] ^ ik[i + 8];
+}
+
+// Virtual card
+
+// A card emulated from a snapshot, for testing without hardware. It
+// answers SELECT (by path, file ID or the USIM AID), READ and UPDATE
+// BINARY/RECORD (also by SFI), VERIFY, MANAGE CHANNEL for one logical
+// channel, and AUTHENTICATE / RUN GSM ALGORITHM with Milenage when its K
+// and OPc are known. Updates change only the copy in memory.
+typedef struct {
+    snapshot_t *snap;
+    BYTE df[MAX_PATH_LEN];   // current DF as an absolute path
+    int df_len;
+    snap_file_t *ef;         // current EF, NULL when a DF was selected last
+    int channel_open;        // logical channel 1, with its own selection
+    BYTE channel_df[MAX_PATH_LEN];
+    int channel_df_len;
+    snap_file_t *channel_ef;
+    int have_keys;
+    milenage_t milenage;
+    BYTE sqn[6];             // highest sequence number accepted
+} virtual_card_t;
+
+static virtual_card_t virtual_card;
+
+static int virtual_reply(BYTE *resp, DWORD *resp_len, const BYTE *data, int len, WORD sw) {
+    if (len > 0) memcpy(resp, data, len);
+    resp[len] = sw >> 8;
+    resp[len + 1] = sw & 0xFF;
+    *resp_len = len + 2;
+    return 0;
+}
+
+// Whether the snapshot holds any file below path (which is then a DF)
+static int virtual_is_df(const BYTE *path, int path_len) {
+    for (int i = 0; i < virtual_card.snap->num_files; i++) {
+        const snap_file_t *f = &virtual_card.snap->files[i];
+        if (f->path_len > path_len && memcmp(f->path, path, path_len) == 0) return 1;
+    }
+    return 0;
+}
+
+static int virtual_file_sfi(const snap_file_t *file) {
+    int len;
+    const BYTE *sfi = fcp_find_tag(file->fcp, file->fcp_len, 0x88, &len);
+    return sfi && len == 1 ? sfi[0] >> 3 : -1;
+}
+
+// Make path (absolute) current. Returns 0, or -1 when it does not exist.
+static int virtual_select_path(const BYTE *path, int path_len) {
+    snap_file_t *file = snapshot_find(virtual_card.snap, path, path_len);
+
+    if (file) {
+        virtual_card.ef = file;
+        memcpy(virtual_card.df, path, path_len - 2);
+        virtual_card.df_len = path_len - 2;
+        return 0;
+    }
+    if (path_len == 2 || virtual_is_df(path, path_len)) {
+        virtual_card.ef = NULL;
+        memcpy(virtual_card.df, path, path_len);
+        virtual_card.df_len = path_len;
+        return 0;
+    }
+    return -1;
+}
+
+static int virtual_select(const BYTE *apdu, int lc, BYTE *resp, DWORD *resp_len) {
+    static const BYTE usim_rid[] = {0xA0, 0x00, 0x00, 0x00, 0x87, 0x10, 0x02};
+    BYTE path[MAX_PATH_LEN] = {0x3F, 0x00};
+    int path_len = 2;
+    const BYTE *data = apdu + 5;
+    BYTE p1 = apdu[2];
+    int found = -1;
+
+    if (p1 == 0x04) {
+        // Only the USIM application is emulated; it is reached as 7FFF
+        if (lc >= (int)sizeof(usim_rid) && memcmp(data, usim_rid, sizeof(usim_rid)) == 0) {
+            path[path_len++] = 0x7F;
+            path[path_len++] = 0xFF;
+            found = virtual_select_path(path, path_len);
+        }
+    } else if (p1 == 0x08 && lc >= 2 && lc % 2 == 0) {
+        // Paths start below the MF, but select_file_by_path includes it
+        if (data[0] == 0x3F && data[1] == 0x00) {
+            data += 2;
+            lc -= 2;
+        }
+        if (2 + lc <= MAX_PATH_LEN) {
+            memcpy(path + 2, data, lc);
+            found = virtual_select_path(path, 2 + lc);
+        }
+    } else if (p1 == 0x00 && lc == 2) {
+        if (data[0] == 0x3F && data[1] == 0x00) {
+            found = virtual_select_path(path, 2);
+        } else if (data[0] == 0x7F && data[1] == 0xFF) {
+            path[2] = 0x7F;
+            path[3] = 0xFF;
+            found = virtual_select_path(path, 4);
+        } else {
+            // A child of the current DF, or a sibling of it
+            memcpy(path, virtual_card.df, virtual_card.df_len);
+            memcpy(path + virtual_card.df_len, data, 2);
+            found = virtual_card.df_len + 2 <= MAX_PATH_LEN ?
+                    virtual_select_path(path, virtual_card.df_len + 2) : -1;
+            if (found < 0 && virtual_card.df_len > 2) {
+                memcpy(path + virtual_card.df_len - 2, data, 2);
+                found = virtual_select_path(path, virtual_card.df_len);
+            }
+        }
+    }
+    if (found < 0) return virtual_reply(resp, resp_len, NULL, 0, 0x6A82);
+    if ((apdu[3] & 0x0C) == 0x0C || !virtual_card.ef) {
+        return virtual_reply(resp, resp_len, NULL, 0, 0x9000);
+    }
+    return virtual_reply(resp, resp_len, virtual_card.ef->fcp, virtual_card.ef->fcp_len, 0x9000);
+}
+
+// The file addressed by an SFI in the current DF (which becomes current),
+// or the current EF for SFI 0
+static snap_file_t *virtual_sfi_file(int sfi) {
+    if (!sfi) return virtual_card.ef;
+    for (int i = 0; i < virtual_card.snap->num_files; i++) {
+        snap_file_t *f = &virtual_card.snap->files[i];
+        if (f->path_len == virtual_card.df_len + 2 &&
+            memcmp(f->path, virtual_card.df, virtual_card.df_len) == 0 &&
+            virtual_file_sfi(f) == sfi) {
+            virtual_card.ef = f;
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// AUTHENTICATE in 3G context: check MAC-A and the sequence number, then
+// answer with RES, CK, IK and Kc, or with AUTS on a sequence number that is
+// not fresh
+static int virtual_authenticate_3g(const BYTE *data, int lc, BYTE *resp, DWORD *resp_len) {
+    const milenage_t *m = &virtual_card.milenage;
+    const BYTE *rand = data + 1;
+    const BYTE *autn = data + 18;
+    BYTE res[8], ck[16], ik[16], ak[6], ak_s[6], sqn[6], mac[8], sres[4];
+    BYTE out[64];
+    int len = 0;
+
+    if (lc < 34 || data[0] != 16 || data[17] != 16) return virtual_reply(resp, resp_len, NULL, 0, 0x6700);
+    milenage_f2345(m, rand, res, ck, ik, ak, ak_s);
+    for (int i = 0; i < 6; i++) sqn[i] = autn[i] ^ ak[i];
+    milenage_f1(m, rand, sqn, autn + 6, mac, NULL);
+    if (memcmp(mac, autn + 8, 8) != 0) return virtual_reply(resp, resp_len, NULL, 0, 0x9862);
+
+    if (memcmp(sqn, virtual_card.sqn, 6) <= 0) {
+        static const BYTE amf_resync[2] = {0x00, 0x00};
+        BYTE mac_s[8];
+        milenage_f1(m, rand, virtual_card.sqn, amf_resync, NULL, mac_s);
+        out[len++] = 0xDC;
+        out[len++] = 14;
+        for (int i = 0; i < 6; i++) out[len++] = virtual_card.sqn[i] ^ ak_s[i];
+        memcpy(out + len, mac_s, 8);
+        len += 8;
+        return virtual_reply(resp, resp_len, out, len, 0x9000);
+    }
+
+    memcpy(virtual_card.sqn, sqn, 6);
+    out[len++] = 0xDB;
+    out[len++] = 8;
+    memcpy(out + len, res, 8);
+    len += 8;
+    out[len++] = 16;
+    memcpy(out + len, ck, 16);
+    len += 16;
+    out[len++] = 16;
+    memcpy(out + len, ik, 16);
+    len += 16;
+    out[len++] = 8;
+    umts_to_gsm(res, ck, ik, sres, out + len);
+    len += 8;
+    return virtual_reply(resp, resp_len, out, len, 0x9000);
+}
+
+// AUTHENTICATE in GSM context (USIM) and RUN GSM ALGORITHM (CLA A0)
+static int virtual_authenticate_gsm(const BYTE *rand, int gsm_class, BYTE *resp, DWORD *resp_len) {
+    BYTE res[8], ck[16], ik[16], sres[4], kc[8];
+    BYTE out[16];
+
+    milenage_f2345(&virtual_card.milenage, rand, res, ck, ik, NULL, NULL);
+    umts_to_gsm(res, ck, ik, sres, kc);
+    if (gsm_class) {
+        // SRES and Kc without length bytes
+        memcpy(out, sres, 4);
+        memcpy(out + 4, kc, 8);
+        return virtual_reply(resp, resp_len, out, 12, 0x9000);
+    }
+    out[0] = 4;
+    memcpy(out + 1, sres, 4);
+    out[5] = 8;
+    memcpy(out + 6, kc, 8);
+    return virtual_reply(resp, resp_len, out, 14, 0x9000);
+}
+
+// Exchange the basic channel's selection with that of logical channel 1
+static void virtual_swap_channel(void) {
+    BYTE df[MAX_PATH_LEN];
+    int df_len = virtual_card.df_len;
+    snap_file_t *ef = virtual_card.ef;
+
+    memcpy(df, virtual_card.df, sizeof(df));
+    memcpy(virtual_card.df, virtual_card.channel_df, sizeof(df));
+    virtual_card.df_len = virtual_card.channel_df_len;
+    virtual_card.ef = virtual_card.channel_ef;
+    memcpy(virtual_card.channel_df, df, sizeof(df));
+    virtual_card.channel_df_len = df_len;
+    virtual_card.channel_ef = ef;
+}
+
+// MANAGE CHANNEL: open channel 1 (with the MF selected) or close it
+static int virtual_manage_channel(const BYTE *apdu, BYTE *resp, DWORD *resp_len) {
+    static const BYTE channel = 0x01;
+
+    if (apdu[2] == 0x00 && apdu[3] == 0x00) {
+        if (virtual_card.channel_open) return virtual_reply(resp, resp_len, NULL, 0, 0x6A81);
+        virtual_card.channel_open = 1;
+        virtual_card.channel_df[0] = 0x3F;
+        virtual_card.channel_df[1] = 0x00;
+        virtual_card.channel_df_len = 2;
+        virtual_card.channel_ef = NULL;
+        return virtual_reply(resp, resp_len, &channel, 1, 0x9000);
+    }
+    if (apdu[2] == 0x80 && apdu[3] == channel && virtual_card.channel_open) {
+        virtual_card.channel_open = 0;
+        return virtual_reply(resp, resp_len, NULL, 0, 0x9000);
+    }
+    return virtual_reply(resp, resp_len, NULL, 0, 0x6A86);
+}
+
+static int virtual_transmit(const BYTE *apdu, DWORD apdu_len, BYTE *resp, DWORD *resp_len) {
+    BYTE ins = apdu_len >= 4 ? apdu[1] : 0;
+    int lc = apdu_len > 5 ? apdu[4] : 0;
+    int le = apdu_len == 5 ? (apdu[4] ? apdu[4] : 256) : 256;
+    int channel = apdu_len >= 4 && (apdu[0] & 0xF0) != 0xA0 ? apdu[0] & 0x03 : 0;
+    snap_file_t *file;
+
+    if (apdu_len < 4 || (apdu_len > 5 && (DWORD)(5 + lc) > apdu_len)) {
+        return virtual_reply(resp, resp_len, NULL, 0, 0x6700);
+    }
+    if (ins == 0x70 && !channel) return virtual_manage_channel(apdu, resp, resp_len);
+
+    // Commands on the logical channel run against its own selection
+    if (channel) {
+        BYTE command[5 + 255 + 1];
+        int rv;
+
+        if (channel != 1 || !virtual_card.channel_open || apdu_len > sizeof(command)) {
+            return virtual_reply(resp, resp_len, NULL, 0, 0x6881);
+        }
+        memcpy(command, apdu, apdu_len);
+        command[0] &= ~0x03;
+        virtual_swap_channel();
+        rv = virtual_transmit(command, apdu_len, resp, resp_len);
+        virtual_swap_channel();
+        return rv;
+    }
+
+    switch (ins) {
+        case 0xA4:
+            return virtual_select(apdu, lc, resp, resp_len);
+        case 0xB0:
+        case 0xD6: {
+            int offset = (apdu[2] & 0x80) ? apdu[3] : ((apdu[2] & 0x7F) << 8) | apdu[3];
+            file = virtual_sfi_file((apdu[2] & 0x80) ? apdu[2] & 0x1F : 0);
+            if (!file || file->structure != EF_TRANSPARENT) {
+                return virtual_reply(resp, resp_len, NULL, 0, file ? 0x6981 : 0x6A82);
+            }
+            if (offset >= file->data_len) return virtual_reply(resp, resp_len, NULL, 0, 0x6B00);
+            if (ins == 0xD6) {
+                int n = offset + lc > file->data_len ? file->data_len - offset : lc;
+                memcpy(file->data + offset, apdu + 5, n);
+                return virtual_reply(resp, resp_len, NULL, 0, 0x9000);
+            }
+            if (offset + le > file->data_len) le = file->data_len - offset;
+            return virtual_reply(resp, resp_len, file->data + offset, le, 0x9000);
+        }
+        case 0xB2:
+        case 0xDC: {
+            int record = apdu[2];
+            file = virtual_sfi_file(apdu[3] >> 3);
+            if (!file || file->structure == EF_TRANSPARENT || !file->record_len) {
+                return virtual_reply(resp, resp_len, NULL, 0, file ? 0x6981 : 0x6A82);
+            }
+            if ((apdu[3] & 0x07) != 0x04 || record < 1 ||
+                record * file->record_len > file->data_len) {
+                return virtual_reply(resp, resp_len, NULL, 0, 0x6A83);
+            }
+            BYTE *r = file->data + (record - 1) * file->record_len;
+            if (ins == 0xDC) {
+                memcpy(r, apdu + 5, lc < file->record_len ? lc : file->record_len);
+                return virtual_reply(resp, resp_len, NULL, 0, 0x9000);
+            }
+            return virtual_reply(resp, resp_len, r, file->record_len, 0x9000);
+        }
+        case 0x20:
+            return virtual_reply(resp, resp_len, NULL, 0, 0x9000);
+        case 0x88:
+            if (!virtual_card.have_keys) return virtual_reply(resp, resp_len, NULL, 0, 0x6985);
+            if ((apdu[0] & 0xF0) == 0xA0) {
+                if (lc != 16) return virtual_reply(resp, resp_len, NULL, 0, 0x6700);
+                return virtual_authenticate_gsm(apdu + 5, 1, resp, resp_len);
+            }
+            if (apdu[3] == 0x81) return virtual_authenticate_3g(apdu + 5, lc, resp, resp_len);
+            if (apdu[3] == 0x80 && lc >= 17 && apdu[5] == 16) {
+                return virtual_authenticate_gsm(apdu + 6, 0, resp, resp_len);
+            }
+            return virtual_reply(resp, resp_len, NULL, 0, 0x6A86);
+    }
+    return virtual_reply(resp, resp_len, NULL, 0, 0x6D00);
+}
+
+// Operator and issuer lookup
+
+// The tables in lookup_tables.h are generated from data/*.csv by
+// tools/mktables. Keys are digit strings; the hash functions must match
+// the generator.
+static uint64_t digits_key(const char *digits, int len) {
+    uint64_t value = 0;
+    for (int i = 0; i < len; i++) value = value * 10 + (digits[i] - '0');
+    return ((uint64_t)len << 56) | value;
+}
+
+static uint64_t lookup_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static const lookup_entry_t *lookup_digits(const lookup_table_t *table, const char *digits, int len) {
+    uint64_t key = digits_key(digits, len);
+    uint32_t disp = table->disp[lookup_mix(key) % table->num_buckets];
+    const lookup_entry_t *e =
+        &table->slots[lookup_mix(key + (uint64_t)(disp + 1) * 0x9E3779B97F4A7C15ULL) % table->num_slots];
+    return e->name && e->key == key ? e : NULL;
+}
+
+// Entry for the longest prefix of digits found in the table
+static const lookup_entry_t *lookup_prefix(const lookup_table_t *table, const char *digits) {
+    int len = strlen(digits);
+    for (int n = len < table->max_len ? len : table->max_len; n >= table->min_len; n--) {
+        const lookup_entry_t *e = lookup_digits(table, digits, n);
+        if (e) return e;
+    }
+    return NULL;
+}
+
+static int all_digits(const char *s) {
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9') return 0;
+    }
+    return 1;
+}
+
+static int luhn_valid(const char *digits) {
+    int len = strlen(digits);
+    int sum = 0;
+
+    for (int i = 0; i < len; i++) {
+        int d = digits[len - 1 - i] - '0';
+        if (i & 1) d = d * 2 > 9 ? d * 2 - 9 : d * 2;
+        sum += d;
+    }
+    return len > 1 && sum % 10 == 0;
+}
+
+// Operator of an IMSI. With an unknown MNC length (0) a three digit MNC is
+// tried before a two digit one.
+static const lookup_entry_t *lookup_operator(const char *imsi, int mnc_length) {
+    if (strlen(imsi) < 6 || !all_digits(imsi)) return NULL;
+    if (mnc_length) return lookup_digits(&mnc_table, imsi, 3 + mnc_length);
+    const lookup_entry_t *e = lookup_digits(&mnc_table, imsi, 6);
+    return e ? e : lookup_digits(&mnc_table, imsi, 5);
+}
+
+static const lookup_entry_t *lookup_country(const char *imsi) {
+    if (strlen(imsi) < 3 || !all_digits(imsi)) return NULL;
+    return lookup_digits(&mcc_table, imsi, 3);
+}
+
+// The ICCID country code follows the 89 (telecommunications) industry
+// identifier; the issuer is found by the longest listed prefix
+static const lookup_entry_t *lookup_issuer_country(const char *iccid) {
+    if (strncmp(iccid, "89", 2) != 0 || !all_digits(iccid)) return NULL;
+    return lookup_prefix(&iccid_country_table, iccid + 2);
+}
+
+static const lookup_entry_t *lookup_issuer(const char *iccid) {
+    if (!all_digits(iccid)) return NULL;
+    return lookup_prefix(&iccid_issuer_table, iccid);
+}
+
+static void enrich(const char *imsi, int mnc_length, const char *iccid, enrichment_t *info) {
+    const lookup_entry_t *e;
+
+    memset(info, 0, sizeof(*info));
+    if ((e = lookup_country(imsi)) != NULL) {
+        info->country = e->name;
+        info->country_iso = e->iso;
+    }
+    if ((e = lookup_operator(imsi, mnc_length)) != NULL) info->operator_name = e->name;
+    if ((e = lookup_issuer_country(iccid)) != NULL) {
+        info->issuer_country = e->name;
+        info->issuer_country_iso = e->iso;
+    }
+    if ((e = lookup_issuer(iccid)) != NULL) info->issuer = e->name;
+    info->iccid_valid = iccid[0] ? luhn_valid(iccid) && all_digits(iccid) : -1;
+}
+
+// Field decoders
+
+static void field_add(field_list_t *list, const char *name, const char *fmt, ...) {
+    if (list->count >= MAX_FIELDS) return;
+
+    sim_field_t *field = &list->fields[list->count++];
+    va_list ap;
+    snprintf(field->name, sizeof(field->name), "%s", name);
+    va_start(ap, fmt);
+    vsnprintf(field->value, sizeof(field->value), fmt, ap);
+    va_end(ap);
+}
+
+static void hex_string(const BYTE *data, int len, char *out, int out_size) {
+    static const char digits[] = "0123456789ABCDEF";
+    int pos = 0;
+
+    for (int i = 0; i < len && pos + 3 <= out_size; i++) {
+        out[pos++] = digits[data[i] >> 4];
+        out[pos++] = digits[data[i] & 0x0F];
+    }
+    out[pos] = '\0';
+}
+
+// Decode swapped-nibble BCD digits as used for dialling numbers; stops at
+// the first F filler nibble
+static void decode_bcd_number(const BYTE *data, int length, char *output, int max_len) {
+    static const char digits[] = "0123456789*#pwe?";
+    int pos = 0;
+
+    for (int i = 0; i < length && pos < max_len - 1; i++) {
+        BYTE lo = data[i] & 0x0F;
+        BYTE hi = (data[i] >> 4) & 0x0F;
+        if (lo == 0x0F) break;
+        output[pos++] = digits[lo];
+        if (hi == 0x0F || pos >= max_len - 1) break;
+        output[pos++] = digits[hi];
+    }
+    output[pos] = '\0';
+}
+
+// PLMN (MCC/MNC) as coded in TS 24.008 routing area/location area identities
+static int decode_plmn(const BYTE *data, char *output) {
+    if (data[0] == 0xFF && data[1] == 0xFF && data[2] == 0xFF) return -1;
+
+    BYTE mnc3 = (data[1] >> 4) & 0x0F;
+    if (mnc3 == 0x0F) {
+        sprintf(output, "%d%d%d-%d%d", data[0] & 0x0F, (data[0] >> 4) & 0x0F,
+                data[1] & 0x0F, data[2] & 0x0F, (data[2] >> 4) & 0x0F);
+    } else {
+        sprintf(output, "%d%d%d-%d%d%d", data[0] & 0x0F, (data[0] >> 4) & 0x0F,
+                data[1] & 0x0F, data[2] & 0x0F, (data[2] >> 4) & 0x0F, mnc3);
+    }
+    return 0;
+}
+
+static int is_empty(const BYTE *data, int len) {
+    for (int i = 0; i < len; i++) {
+        if (data[i] != 0xFF) return 0;
+    }
+    return 1;
+}
+
+// GSM 03.38 default alphabet (unpacked, as used in alpha identifiers)
+static const unsigned short gsm7_default[128] = {
+    0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+    0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+    0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+    0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+    0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0,
+};
+
+// Extension table, reached through the escape character 1B
+static const struct {
+    BYTE code;
+    unsigned short cp;
+} gsm7_extension[] = {
+    {0x0A, 0x000C}, {0x14, 0x005E}, {0x28, 0x007B}, {0x29, 0x007D}, {0x2F, 0x005C},
+    {0x3C, 0x005B}, {0x3D, 0x007E}, {0x3E, 0x005D}, {0x40, 0x007C}, {0x65, 0x20AC},
+};
+
+static unsigned int gsm7_extension_char(BYTE code) {
+    for (size_t i = 0; i < sizeof(gsm7_extension) / sizeof(gsm7_extension[0]); i++) {
+        if (gsm7_extension[i].code == code) return gsm7_extension[i].cp;
+    }
+    return 0x0020;
+}
+
+// Append a code point as UTF-8; returns the new length (unchanged if full)
+static int utf8_put(char *output, int pos, int max_len, unsigned int cp) {
+    char buf[4];
+    int n;
+
+    if (cp < 0x80) {
+        buf[0] = cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        buf[0] = 0xC0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3F);
+        n = 2;
+    } else if (cp < 0x10000) {
+        buf[0] = 0xE0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3F);
+        buf[2] = 0x80 | (cp & 0x3F);
+        n = 3;
+    } else {
+        buf[0] = 0xF0 | (cp >> 18);
+        buf[1] = 0x80 | ((cp >> 12) & 0x3F);
+        buf[2] = 0x80 | ((cp >> 6) & 0x3F);
+        buf[3] = 0x80 | (cp & 0x3F);
+        n = 4;
+    }
+    if (pos + n >= max_len) return pos;
+    memcpy(output + pos, buf, n);
+    return pos + n;
+}
+
+// Next code point of a UTF-8 string (BMP only; invalid bytes become '?')
+static unsigned int utf8_next(const char **text) {
+    const BYTE *s = (const BYTE *)*text;
+    unsigned int cp = '?';
+    int n = 1;
+
+    if (s[0] < 0x80) {
+        cp = s[0];
+    } else if ((s[0] & 0xE0) == 0xC0 && (s[1] & 0xC0) == 0x80) {
+        cp = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+        n = 2;
+    } else if ((s[0] & 0xF0) == 0xE0 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80) {
+        cp = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        n = 3;
+    }
+    *text += n;
+    return cp;
+}
+
+// Alpha identifier (TS 102 221 annex A): GSM default alphabet, or UCS2 in
+// one of the 80/81/82 codings. The output is UTF-8.
+static void decode_alpha(const BYTE *data, int len, char *output, int max_len) {
+    int pos = 0;
+
+    if (len >= 1 && data[0] == 0x80) {
+        for (int i = 1; i + 1 < len; i += 2) {
+            unsigned int cp = (data[i] << 8) | data[i + 1];
+            if (cp == 0xFFFF) break;
+            pos = utf8_put(output, pos, max_len, cp);
+        }
+    } else if (len >= 3 && (data[0] == 0x81 || data[0] == 0x82)) {
+        // Count, base pointer (81: bits 15..8 of a 0hhh hhhh h000 0000
+        // base, 82: two bytes), then characters relative to the base
+        int start = data[0] == 0x81 ? 3 : 4;
+        unsigned int base = data[0] == 0x81 ? data[2] << 7 :
+                            len >= 4 ? (data[2] << 8) | data[3] : 0;
+        for (int i = start; i < len && i < start + data[1]; i++) {
+            unsigned int cp = data[i] & 0x80 ? base + (data[i] & 0x7F) : gsm7_default[data[i]];
+            pos = utf8_put(output, pos, max_len, cp);
+        }
+    } else {
+        for (int i = 0; i < len && data[i] != 0xFF; i++) {
+            unsigned int cp;
+            if (data[i] == 0x1B && i + 1 < len && data[i + 1] != 0xFF) {
+                cp = gsm7_extension_char(data[++i]);
+            } else {
+                cp = gsm7_default[data[i] & 0x7F];
+            }
+            pos = utf8_put(output, pos, max_len, cp);
+        }
+    }
+    output[pos] = '\0';
+}
+
+// Encode UTF-8 text as an alpha identifier of len bytes (FF padded): GSM
+// default alphabet when every character has a code, UCS2 (80) otherwise.
+// Text that does not fit is truncated.
+static void encode_alpha(const char *text, BYTE *out, int len) {
+    const char *p = text;
+    int pos = 0;
+
+    memset(out, 0xFF, len);
+    while (*p) {
+        unsigned int cp = utf8_next(&p);
+        int code = -1;
+
+        for (int c = 0; c < 128 && code < 0; c++) {
+            if (gsm7_default[c] == cp && c != 0x1B) code = c;
+        }
+        if (code < 0) {
+            for (size_t e = 0; e < sizeof(gsm7_extension) / sizeof(gsm7_extension[0]); e++) {
+                if (gsm7_extension[e].cp == cp) code = 0x100 | gsm7_extension[e].code;
+            }
+        }
+        if (code < 0) break;
+        if (code & 0x100) {
+            if (pos + 2 > len) return;
+            out[pos++] = 0x1B;
+        }
+        if (pos + 1 > len) return;
+        out[pos++] = code & 0xFF;
+    }
+    if (!*p) return;
+
+    memset(out, 0xFF, len);
+    if (len < 1) return;
+    out[0] = 0x80;
+    pos = 1;
+    for (p = text; *p && pos + 2 <= len; pos += 2) {
+        unsigned int cp = utf8_next(&p);
+        out[pos] = cp >> 8;
+        out[pos + 1] = cp & 0xFF;
+    }
+}
+
+static void decode_fields_iccid(const snap_file_t *file, field_list_t *out) {
+    char iccid[21];
+    enrichment_t info;
+
+    if (decode_iccid(file->data, file->data_len, iccid) < 0 || !iccid[0]) return;
+    enrich("", 0, iccid, &info);
+    field_add(out, "iccid", "%s", iccid);
+    field_add(out, "check_digit", "%s", info.iccid_valid ? "valid" : "invalid");
+    if (info.issuer_country) field_add(out, "issuer_country", "%s", info.issuer_country);
+    if (info.issuer) field_add(out, "issuer", "%s", info.issuer);
+}
+
+static void decode_fields_imsi(const snap_file_t *file, field_list_t *out) {
+    char imsi[16];
+    enrichment_t info;
+
+    if (decode_imsi(file->data, file->data_len, imsi) == 0) {
+        enrich(imsi, 0, "", &info);
+        field_add(out, "imsi", "%s", imsi);
+        field_add(out, "mcc", "%.3s", imsi);
+        if (info.country) field_add(out, "country", "%s", info.country);
+        if (info.operator_name) field_add(out, "operator", "%s", info.operator_name);
+    }
+}
+
+static void decode_fields_spn(const snap_file_t *file, field_list_t *out) {
+    char name[64];
+    if (file->data_len < 1) return;
+    decode_alpha(file->data + 1, file->data_len - 1, name, sizeof(name));
+    field_add(out, "display_condition", "%02X", file->data[0]);
+    field_add(out, "name", "%s", name);
+}
+
+// ADN-style record: alpha identifier followed by 14 bytes of number data
+static void decode_dialling_record(const BYTE *r, int rlen, char *alpha, int alpha_size,
+                                   char *number, int number_size) {
+    decode_alpha(r, rlen - 14, alpha, alpha_size);
+    int num_len = r[rlen - 14];
+    number[0] = '\0';
+    if (num_len >= 2 && num_len <= 11) {
+        int plus = r[rlen - 13] == 0x91;
+        if (plus) number[0] = '+';
+        decode_bcd_number(&r[rlen - 12], num_len - 1, number + plus, number_size - plus);
+    }
+}
+
+static void decode_fields_dialling(const snap_file_t *file, field_list_t *out) {
+    int rlen = file->record_len;
+    if (rlen < 14) return;
+
+    for (int rec = 0; rec < file->num_records && (rec + 1) * rlen <= file->data_len; rec++) {
+        const BYTE *r = file->data + rec * rlen;
+        char name[24];
+        char alpha[64];
+        char number[48];
+
+        if (is_empty(r, rlen)) continue;
+        decode_dialling_record(r, rlen, alpha, sizeof(alpha), number, sizeof(number));
+        snprintf(name, sizeof(name), "record %d", rec + 1);
+        field_add(out, name, "%s%s%s", alpha, alpha[0] ? " " : "", number);
+    }
+}
+
+// EF_MSISDN: the first number is reported as the subscriber's MSISDN, any
+// further records like ADN records
+static void decode_fields_msisdn(const snap_file_t *file, field_list_t *out) {
+    int rlen = file->record_len;
+    int found = 0;
+    if (rlen < 14) return;
+
+    for (int rec = 0; rec < file->num_records && (rec + 1) * rlen <= file->data_len; rec++) {
+        const BYTE *r = file->data + rec * rlen;
+        char name[24];
+        char alpha[64];
+        char number[48];
+
+        if (is_empty(r, rlen)) continue;
+        decode_dialling_record(r, rlen, alpha, sizeof(alpha), number, sizeof(number));
+        if (!found && number[0]) {
+            field_add(out, "msisdn", "%s", number);
+            field_add(out, "alpha", "%s", alpha);
+            found = 1;
+            continue;
+        }
+        snprintf(name, sizeof(name), "record %d", rec + 1);
+        field_add(out, name, "%s%s%s", alpha, alpha[0] ? " " : "", number);
+    }
+}
+
+static void decode_fields_languages(const snap_file_t *file, field_list_t *out) {
+    char langs[160];
+    int pos = 0;
+
+    for (int i = 0; i + 1 < file->data_len && pos + 4 < (int)sizeof(langs); i += 2) {
+        if (file->data[i] == 0xFF) continue;
+        pos += sprintf(langs + pos, "%s%c%c", pos ? "," : "",
+                       file->data[i], file->data[i + 1]);
+    }
+    langs[pos] = '\0';
+    field_add(out, "languages", "%s", langs);
+}
+
+static void decode_fields_plmn_list(const snap_file_t *file, field_list_t *out) {
+    for (int i = 0; i + 2 < file->data_len; i += 3) {
+        char name[24];
+        char plmn[16];
+        if (decode_plmn(&file->data[i], plmn) < 0) continue;
+        snprintf(name, sizeof(name), "plmn %d", i / 3 + 1);
+        field_add(out, name, "%s", plmn);
+    }
+}
+
+// Service tables: one bit per service in EF_UST, two bits in the GSM EF_SST
+static void decode_fields_services(const snap_file_t *file, field_list_t *out) {
+    int bits = path_in_adf(file->path, file->path_len) ? 1 : 2;
+    char list[160];
+    int pos = 0;
+
+    for (int i = 0; i < file->data_len * 8 / bits; i++) {
+        int bit = i * bits;
+        if (!(file->data[bit / 8] & (1 << (bit % 8)))) continue;
+        if (pos + 5 >= (int)sizeof(list)) break;
+        pos += sprintf(list + pos, "%s%d", pos ? " " : "", i + 1);
+    }
+    list[pos] = '\0';
+    field_add(out, "services", "%s", list);
+}
+
+static void decode_fields_dir(const snap_file_t *file, field_list_t *out) {
+    int rlen = file->record_len;
+    if (rlen < 4) return;
+
+    for (int rec = 0; rec < file->num_records && (rec + 1) * rlen <= file->data_len; rec++) {
+        const BYTE *r = file->data + rec * rlen;
+        char name[24];
+        char aid[40];
+        char label[40] = "";
+
+        if (r[0] != 0x61 || r[2] != 0x4F || r[3] > 16 || 4 + r[3] > rlen) continue;
+        hex_string(&r[4], r[3], aid, sizeof(aid));
+        int i = 4 + r[3];
+        if (i + 2 <= rlen && r[i] == 0x50) {
+            decode_alpha(&r[i + 2], r[i + 1] <= rlen - i - 2 ? r[i + 1] : rlen - i - 2,
+                         label, sizeof(label));
+        }
+        snprintf(name, sizeof(name), "app %d", rec + 1);
+        field_add(out, name, "%s%s%s", aid, label[0] ? " " : "", label);
+    }
+}
+
+// Fallback: transparent files in 16-byte rows, records as hex
+static void decode_fields_raw(const snap_file_t *file, field_list_t *out) {
+    char name[24];
+    char hex[384];
+
+    if (file->structure == EF_TRANSPARENT || file->record_len == 0) {
+        for (int off = 0; off < file->data_len; off += 16) {
+            int len = file->data_len - off > 16 ? 16 : file->data_len - off;
+            hex_string(file->data + off, len, hex, sizeof(hex));
+            snprintf(name, sizeof(name), "data[%04X]", off);
+            field_add(out, name, "%s", hex);
+        }
+        return;
+    }
+
+    for (int rec = 0; rec < file->num_records &&
+         (rec + 1) * file->record_len <= file->data_len; rec++) {
+        hex_string(file->data + rec * file->record_len, file->record_len, hex, sizeof(hex));
+        snprintf(name, sizeof(name), "record %d", rec + 1);
+        field_add(out, name, "%s", hex);
+    }
+}
+
+// Network state (TS 31.102 4.2.17, 4.2.23, 4.2.91, 4.2.15, 4.2.21, 4.2.18)
+
+static const char *loci_status_names[] = {
+    "updated", "not updated", "plmn not allowed", "location area not allowed"
+};
+static const char *psloci_status_names[] = {
+    "updated", "not updated", "plmn not allowed", "routing area not allowed"
+};
+static const char *epsloci_status_names[] = {"updated", "not updated", "roaming not allowed"};
+static const char *ecc_category_names[] = {
+    "police", "ambulance", "fire brigade", "marine guard", "mountain rescue",
+    "manual ecall", "automatic ecall"
+};
+
+static void network_info_init(network_info_t *net) {
+    memset(net, 0, sizeof(*net));
+    net->ue_mode = -1;
+    net->loci_status = -1;
+    net->psloci_status = -1;
+    net->epsloci_status = -1;
+}
+
+// Temporary identities; all FF means none is allocated
+static void decode_tmsi(const BYTE *data, char *output) {
+    output[0] = '\0';
+    if (!is_empty(data, 4)) hex_string(data, 4, output, 9);
+}
+
+// EF_LOCI: TMSI, LAI (PLMN and LAC), TMSI time, location update status
+static void decode_loci(const snap_file_t *file, network_info_t *net) {
+    const BYTE *d = file->data;
+    char plmn[16];
+
+    if (file->data_len < 11) return;
+    decode_tmsi(d, net->tmsi);
+    if (decode_plmn(d + 4, plmn) == 0) {
+        snprintf(net->lai, sizeof(net->lai), "%s-%02X%02X", plmn, d[7], d[8]);
+    }
+    net->loci_status = d[10] & 0x07;
+}
+
+// EF_PSLOCI: P-TMSI, P-TMSI signature, RAI (LAI and RAC), routing area
+// update status
+static void decode_psloci(const snap_file_t *file, network_info_t *net) {
+    const BYTE *d = file->data;
+    char plmn[16];
+
+    if (file->data_len < 14) return;
+    decode_tmsi(d, net->ptmsi);
+    if (decode_plmn(d + 7, plmn) == 0) {
+        snprintf(net->rai, sizeof(net->rai), "%s-%02X%02X-%02X", plmn, d[10], d[11], d[12]);
+    }
+    net->psloci_status = d[13] & 0x07;
+}
+
+// EF_EPSLOCI: GUTI as a mobile identity (length 0B, type F6, PLMN, MME group
+// ID, MME code, M-TMSI), last visited TAI and EPS update status
+static void decode_epsloci(const snap_file_t *file, network_info_t *net) {
+    const BYTE *d = file->data;
+    char plmn[16];
+
+    if (file->data_len < 18) return;
+    if (d[0] == 0x0B && (d[1] & 0x07) == 0x06 && decode_plmn(d + 2, plmn) == 0) {
+        snprintf(net->guti, sizeof(net->guti), "%s-%02X%02X-%02X-%02X%02X%02X%02X",
+                 plmn, d[5], d[6], d[7], d[8], d[9], d[10], d[11]);
+    }
+    if (decode_plmn(d + 12, plmn) == 0) {
+        snprintf(net->tai, sizeof(net->tai), "%s-%02X%02X", plmn, d[15], d[16]);
+    }
+    net->epsloci_status = d[17] & 0x07;
+}
+
+// EF_ACC: 16 bits, access class 15 in the top bit
+static void decode_acc(const snap_file_t *file, network_info_t *net) {
+    if (file->data_len < 2) return;
+    net->access_classes = (file->data[0] << 8) | file->data[1];
+    net->have_acc = 1;
+}
+
+// EF_ECC: 3-byte BCD codes; the USIM file has one record per code with an
+// alpha identifier and the emergency service category
+static void decode_ecc(const snap_file_t *file, network_info_t *net) {
+    int usim = file->structure != EF_TRANSPARENT;
+    int size = usim ? file->record_len : 3;
+    int count = usim ? file->num_records : file->data_len / 3;
+
+    net->num_ecc = 0;
+    if (size < (usim ? 4 : 3)) return;
+    for (int i = 0; i < count && (i + 1) * size <= file->data_len; i++) {
+        const BYTE *r = file->data + i * size;
+        if (is_empty(r, 3) || net->num_ecc == MAX_ECC_CODES) continue;
+
+        decode_bcd_number(r, 3, net->ecc[net->num_ecc].code, sizeof(net->ecc[0].code));
+        net->ecc[net->num_ecc].alpha[0] = '\0';
+        net->ecc[net->num_ecc].category = -1;
+        if (usim) {
+            decode_alpha(r + 3, size - 4, net->ecc[net->num_ecc].alpha, sizeof(net->ecc[0].alpha));
+            net->ecc[net->num_ecc].category = r[size - 1];
+        }
+        net->num_ecc++;
+    }
+}
+
+// EF_AD: UE operation mode and the length of the MNC in the IMSI
+static void decode_ad(const snap_file_t *file, network_info_t *net) {
+    if (file->data_len < 1) return;
+    net->ue_mode = file->data[0];
+    if (file->data_len >= 4 && ((file->data[3] & 0x0F) == 2 || (file->data[3] & 0x0F) == 3)) {
+        net->mnc_length = file->data[3] & 0x0F;
+    }
+}
+
+// Split the IMSI into MCC and MNC using the MNC length from EF_AD
+static void split_imsi(const char *imsi, network_info_t *net) {
+    net->mcc[0] = net->mnc[0] = '\0';
+    if (strlen(imsi) < 6) return;
+    snprintf(net->mcc, sizeof(net->mcc), "%.3s", imsi);
+    if (net->mnc_length) snprintf(net->mnc, sizeof(net->mnc), "%.*s", net->mnc_length, imsi + 3);
+}
+
+static void format_access_classes(unsigned int classes, char *output, int max_len) {
+    int pos = 0;
+
+    output[0] = '\0';
+    for (int c = 0; c < 16 && pos < max_len - 4; c++) {
+        if (classes & (1u << c)) pos += sprintf(output + pos, "%s%d", pos ? "," : "", c);
+    }
+}
+
+static void format_ecc_categories(int category, char *output, int max_len) {
+    int pos = 0;
+
+    output[0] = '\0';
+    for (int b = 0; b < 7 && category > 0; b++) {
+        if (!(category & (1 << b))) continue;
+        pos += snprintf(output + pos, max_len - pos, "%s%s", pos ? "," : "", ecc_category_names[b]);
+        if (pos >= max_len) break;
+    }
+}
+
+static void decode_fields_network(const snap_file_t *file, field_list_t *out) {
+    network_info_t net;
+    int fid = (file->path[file->path_len - 2] << 8) | file->path[file->path_len - 1];
+
+    network_info_init(&net);
+    switch (fid) {
+        case 0x6F7E:
+            decode_loci(file, &net);
+            field_add(out, "tmsi", "%s", net.tmsi);
+            field_add(out, "lai", "%s", net.lai);
+            if (net.loci_status >= 0) {
+                field_add(out, "update_status", "%s",
+                          net.loci_status < 4 ? loci_status_names[net.loci_status] : "reserved");
+            }
+            break;
+        case 0x6F73:
+        case 0x6F53:
+            decode_psloci(file, &net);
+            field_add(out, "ptmsi", "%s", net.ptmsi);
+            field_add(out, "rai", "%s", net.rai);
+            if (net.psloci_status >= 0) {
+                field_add(out, "update_status", "%s", net.psloci_status < 4 ?
+                          psloci_status_names[net.psloci_status] : "reserved");
+            }
+            break;
+        case 0x6FE3:
+            decode_epsloci(file, &net);
+            field_add(out, "guti", "%s", net.guti);
+            field_add(out, "tai", "%s", net.tai);
+            if (net.epsloci_status >= 0) {
+                field_add(out, "update_status", "%s", net.epsloci_status < 3 ?
+                          epsloci_status_names[net.epsloci_status] : "reserved");
+            }
+            break;
+        case 0x6F78: {
+            char classes[64];
+            decode_acc(file, &net);
+            format_access_classes(net.access_classes, classes, sizeof(classes));
+            if (net.have_acc) field_add(out, "access_classes", "%s", classes);
+            break;
+        }
+        case 0x6FB7:
+            decode_ecc(file, &net);
+            for (int i = 0; i < net.num_ecc; i++) {
+                char name[24];
+                char categories[96];
+                snprintf(name, sizeof(name), "ecc %d", i + 1);
+                format_ecc_categories(net.ecc[i].category, categories, sizeof(categories));
+                field_add(out, name, "%s%s%s%s %s", net.ecc[i].code, categories[0] ? " (" : "",
+                          categories, categories[0] ? ")" : "", net.ecc[i].alpha);
+            }
+            break;
+        case 0x6FAD:
+            decode_ad(file, &net);
+            field_add(out, "ue_mode", "%02X", net.ue_mode);
+            if (net.mnc_length) field_add(out, "mnc_length", "%d", net.mnc_length);
+            break;
+    }
+}
+
+// Decoders are keyed by the file ID, i.e. the last element of the path
+static const struct {
+    WORD fid;
+    void (*decode)(const snap_file_t *file, field_list_t *out);
+} field_decoders[] = {
+    {0x2FE2, decode_fields_iccid},
+    {0x2F00, decode_fields_dir},
+    {0x2F05, decode_fields_languages},
+    {0x6F07, decode_fields_imsi},
+    {0x6F46, decode_fields_spn},
+    {0x6F3A, decode_fields_dialling},
+    {0x6F3B, decode_fields_dialling},
+    {0x6F40, decode_fields_msisdn},
+    {0x6F44, decode_fields_dialling},
+    {0x6F49, decode_fields_dialling},
+    {0x6F38, decode_fields_services},
+    {0x6F7B, decode_fields_plmn_list},
+    {0x6F7E, decode_fields_network},
+    {0x6F73, decode_fields_network},
+    {0x6F53, decode_fields_network},
+    {0x6FE3, decode_fields_network},
+    {0x6F78, decode_fields_network},
+    {0x6FB7, decode_fields_network},
+    {0x6FAD, decode_fields_network},
+};
+
+static void decode_file_fields(const snap_file_t *file, field_list_t *out) {
+    int num = sizeof(field_decoders) / sizeof(field_decoders[0]);
+    WORD fid = (file->path[file->path_len - 2] << 8) | file->path[file->path_len - 1];
+
+    for (int i = 0; i < num; i++) {
+        if (field_decoders[i].fid == fid) {
+            field_decoders[i].decode(file, out);
+            return;
+        }
+    }
+    decode_fields_raw(file, out);
+}
+
+static void decode_fcp_fields(const snap_file_t *file, field_list_t *out) {
+    static const char *structures[] = {"none", "transparent", "linear fixed", "?", "?", "?",
+                                       "cyclic", "?"};
+    char hex[MAX_FCP_LEN * 2 + 1];
+    const BYTE *v;
+    int len;
+
+    field_add(out, "fcp.structure", "%s", structures[file->structure & 0x07]);
+    field_add(out, "fcp.size", "%d", fcp_file_size(file));
+    if (file->record_len) {
+        field_add(out, "fcp.record_length", "%d", file->record_len);
+        field_add(out, "fcp.records", "%d", file->num_records);
+    }
+    if ((v = fcp_find_tag(file->fcp, file->fcp_len, 0x88, &len)) && len >= 1) {
+        field_add(out, "fcp.sfi", "%02X", v[0] >> 3);
+    }
+    if ((v = fcp_find_tag(file->fcp, file->fcp_len, 0x8A, &len)) && len >= 1) {
+        field_add(out, "fcp.lcs", "%02X", v[0]);
+    }
+    static const BYTE security_tags[] = {0x8B, 0x8C, 0xAB};
+    for (int i = 0; i < 3; i++) {
+        if ((v = fcp_find_tag(file->fcp, file->fcp_len, security_tags[i], &len))) {
+            hex_string(v, len, hex, sizeof(hex));
+            field_add(out, "fcp.security", "%02X:%s", security_tags[i], hex);
+        }
+    }
+}
+
+// Snapshot diff
+
+static void print_path(const BYTE *path, int path_len) {
+    const char *name = catalog_name(path, path_len);
+    printf("%s ", name ? name : "EF");
+    for (int i = 0; i < path_len; i++) {
+        printf("%02X", path[i]);
+    }
+}
+
+static const char *field_lookup(const field_list_t *list, const char *name) {
+    for (int i = 0; i < list->count; i++) {
+        if (strcmp(list->fields[i].name, name) == 0) return list->fields[i].value;
+    }
+    return NULL;
+}
+
+static void print_field_diff(const field_list_t *a, const field_list_t *b) {
+    for (int i = 0; i < a->count; i++) {
+        const char *other = field_lookup(b, a->fields[i].name);
+        if (!other) {
+            printf("    %s: %s -> (absent)\n", a->fields[i].name, a->fields[i].value);
+        } else if (strcmp(other, a->fields[i].value) != 0) {
+            printf("    %s: %s -> %s\n", a->fields[i].name, a->fields[i].value, other);
+        }
+    }
+    for (int i = 0; i < b->count; i++) {
+        if (!field_lookup(a, b->fields[i].name)) {
+            printf("    %s: (absent) -> %s\n", b->fields[i].name, b->fields[i].value);
+        }
+    }
+}
+
+// Compare two snapshots file by file. Files whose stored hash and FCP match
+// are skipped without decoding. Returns the number of differing files.
+static int snapshot_diff(const snapshot_t *a, const snapshot_t *b) {
+    field_list_t *fa = malloc(sizeof(field_list_t));
+    field_list_t *fb = malloc(sizeof(field_list_t));
+    int differences = 0;
+
+    if (!fa || !fb) {
+        free(fa);
+        free(fb);
+        return -1;
+    }
+
+    for (int i = 0; i < a->num_files; i++) {
+        const snap_file_t *x = &a->files[i];
+        const snap_file_t *y = snapshot_find(b, x->path, x->path_len);
+
+        if (!y) {
+            printf("- ");
+            print_path(x->path, x->path_len);
+            printf("\n");
+            differences++;
+            continue;
+        }
+
+        int same_fcp = x->fcp_len == y->fcp_len && memcmp(x->fcp, y->fcp, x->fcp_len) == 0;
+        int same_data = x->hash == y->hash && x->data_len == y->data_len;
+        if (same_fcp && same_data) continue;
+
+        printf("~ ");
+        print_path(x->path, x->path_len);
+        printf("\n");
+        differences++;
+
+        if (!same_fcp) {
+            fa->count = fb->count = 0;
+            decode_fcp_fields(x, fa);
+            decode_fcp_fields(y, fb);
+            print_field_diff(fa, fb);
+        }
+        if (!same_data) {
+            fa->count = fb->count = 0;
+            decode_file_fields(x, fa);
+            decode_file_fields(y, fb);
+            print_field_diff(fa, fb);
+        }
+    }
+
+    for (int i = 0; i < b->num_files; i++) {
+        const snap_file_t *y = &b->files[i];
+        if (!snapshot_find(a, y->path, y->path_len)) {
+            printf("+ ");
+            print_path(y->path, y->path_len);
+            printf("\n");
+            differences++;
+        }
+    }
+
+    free(fa);
+    free(fb);
+    return differences;
+}
+
+// Per-card expected values
+
+// A CSV file whose header row names decoded fields (iccid, imsi, msisdn,
+// ...). Rows are kept sorted by ICCID for lookup.
+typedef struct {
+    char *key;
+    char *cells[MAX_VALUE_COLUMNS];
+} value_row_t;
+
+typedef struct {
+    char *text;
+    char *columns[MAX_VALUE_COLUMNS];
+    int num_columns;
+    value_row_t *rows;
+    int num_rows;
+} value_table_t;
+
+static char *trim(char *str) {
+    while (*str == ' ' || *str == '\t') str++;
+    char *end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) *--end = '\0';
+    return str;
+}
+
+static int split_csv(char *line, char **cells, int max) {
+    int count = 0;
+    char *save = NULL;
+
+    for (char *tok = strtok_r(line, ",", &save); tok && count < max;
+         tok = strtok_r(NULL, ",", &save)) {
+        cells[count++] = trim(tok);
+    }
+    return count;
+}
+
+static int compare_value_rows(const void *a, const void *b) {
+    return strcmp(((const value_row_t *)a)->key, ((const value_row_t *)b)->key);
+}
+
+static void value_table_free(value_table_t *table) {
+    free(table->text);
+    free(table->rows);
+    memset(table, 0, sizeof(*table));
+}
+
+static int value_table_load(const char *filename, value_table_t *table) {
+    FILE *in = fopen(filename, "r");
+    long size;
+    int iccid_column = -1;
+    int capacity = 0;
+
+    memset(table, 0, sizeof(*table));
+    if (!in) {
+        fprintf(stderr, "Cannot open values list %s\n", filename);
+        return -1;
+    }
+    if (fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < 0 || fseek(in, 0, SEEK_SET) != 0 ||
+        !(table->text = malloc(size + 1)) || fread(table->text, 1, size, in) != (size_t)size) {
+        fprintf(stderr, "Cannot read values list %s\n", filename);
+        fclose(in);
+        value_table_free(table);
+        return -1;
+    }
+    fclose(in);
+    table->text[size] = '\0';
+
+    char *save = NULL;
+    for (char *line = strtok_r(table->text, "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save)) {
+        line = trim(line);
+        if (!line[0] || line[0] == '#') continue;
+
+        if (!table->num_columns) {
+            table->num_columns = split_csv(line, table->columns, MAX_VALUE_COLUMNS);
+            for (int i = 0; i < table->num_columns; i++) {
+                for (char *c = table->columns[i]; *c; c++) {
+                    if (*c >= 'A' && *c <= 'Z') *c += 'a' - 'A';
+                }
+                if (strcmp(table->columns[i], "iccid") == 0) iccid_column = i;
+            }
+            if (iccid_column < 0) {
+                fprintf(stderr, "Values list %s has no iccid column\n", filename);
+                value_table_free(table);
+                return -1;
+            }
+            continue;
+        }
+
+        if (table->num_rows == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            value_row_t *rows = realloc(table->rows, capacity * sizeof(value_row_t));
+            if (!rows) {
+                value_table_free(table);
+                return -1;
+            }
+            table->rows = rows;
+        }
+
+        value_row_t *row = &table->rows[table->num_rows];
+        memset(row, 0, sizeof(*row));
+        if (split_csv(line, row->cells, MAX_VALUE_COLUMNS) <= iccid_column) continue;
+        row->key = row->cells[iccid_column];
+        table->num_rows++;
+    }
+
+    qsort(table->rows, table->num_rows, sizeof(value_row_t), compare_value_rows);
+    return 0;
+}
+
+static const value_row_t *value_table_find(const value_table_t *table, const char *iccid) {
+    value_row_t key = {0};
+    key.key = (char *)iccid;
+    return bsearch(&key, table->rows, table->num_rows, sizeof(value_row_t), compare_value_rows);
+}
+
+static const char *value_row_get(const value_table_t *table, const value_row_t *row,
+                                 const char *column) {
+    for (int i = 0; i < table->num_columns; i++) {
+        if (strcmp(table->columns[i], column) == 0) {
+            return row->cells[i] && row->cells[i][0] ? row->cells[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+// Golden-profile verification
+
+// Decoded fields that differ from card to card. They are compared against
+// the values list when it has them and ignored otherwise.
+static const char *per_card_fields[] = {"iccid", "imsi", "msisdn"};
+
+typedef struct {
+    const snap_file_t *golden;
+    int sfi;
+    int group;
+    int per_card;
+} verify_step_t;
+
+// Step groups, executed in this order: MF files (SFI reads right after
+// selecting the MF), files under DF_TELECOM/DF_GSM (selected by path) and
+// USIM files (SFI reads after a single SELECT by AID)
+enum { GROUP_MF, GROUP_DF, GROUP_ADF };
+
+typedef struct {
+    const snapshot_t *golden;
+    const value_table_t *values;
+    verify_step_t steps[MAX_SNAPSHOT_FILES];
+    int num_steps;
+    BYTE usim_aid[16];
+    int usim_aid_len;
+    int passed;
+    int failed;
+} verify_ctx_t;
+
+static int is_per_card_field(const verify_ctx_t *ctx, const char *name) {
+    for (size_t i = 0; i < sizeof(per_card_fields) / sizeof(per_card_fields[0]); i++) {
+        if (strcmp(per_card_fields[i], name) == 0) return 1;
+    }
+    if (ctx->values) {
+        for (int i = 0; i < ctx->values->num_columns; i++) {
+            if (strcmp(ctx->values->columns[i], name) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+// Build the read plan once from the golden snapshot
+static int plan_verification(verify_ctx_t *ctx) {
+    field_list_t *fields = malloc(sizeof(field_list_t));
+
+    if (!fields) return -1;
+    ctx->num_steps = 0;
+
+    for (int group = GROUP_MF; group <= GROUP_ADF; group++) {
+        for (int i = 0; i < ctx->golden->num_files; i++) {
+            const snap_file_t *file = &ctx->golden->files[i];
+            int file_group = file->path_len == 4 ? GROUP_MF :
+                             path_in_adf(file->path, file->path_len) ? GROUP_ADF : GROUP_DF;
+            const BYTE *v;
+            int len;
+
+            if (file_group != group || file->path_len < 4) continue;
+
+            verify_step_t *step = &ctx->steps[ctx->num_steps++];
+            memset(step, 0, sizeof(*step));
+            step->golden = file;
+            step->group = group;
+            if (group != GROUP_DF && (v = fcp_find_tag(file->fcp, file->fcp_len, 0x88, &len)) &&
+                len == 1) {
+                step->sfi = v[0] >> 3;
+            }
+
+            fields->count = 0;
+            decode_file_fields(file, fields);
+            for (int f = 0; f < fields->count && !step->per_card; f++) {
+                step->per_card = is_per_card_field(ctx, fields->fields[f].name);
+            }
+
+            // The ICCID goes first: it selects the row of the values list
+            if (file->path[2] == 0x2F && file->path[3] == 0xE2 && ctx->num_steps > 1) {
+                verify_step_t first = *step;
+                memmove(&ctx->steps[1], &ctx->steps[0],
+                        (ctx->num_steps - 1) * sizeof(verify_step_t));
+                ctx->steps[0] = first;
+            }
+        }
+    }
+
+    for (int i = 0; i < ctx->golden->num_files && !ctx->usim_aid_len; i++) {
+        const snap_file_t *file = &ctx->golden->files[i];
+        if (file->path_len != 4 || file->path[2] != 0x2F || file->path[3] != 0x00) continue;
+        for (int rec = 0; rec < file->num_records &&
+             (rec + 1) * file->record_len <= file->data_len; rec++) {
+            int aid_len = dir_record_usim_aid(file->data + rec * file->record_len,
+                                              file->record_len, ctx->usim_aid);
+            if (aid_len > 0) {
+                ctx->usim_aid_len = aid_len;
+                break;
+            }
+        }
+    }
+
+    free(fields);
+    return 0;
+}
+
+// Read the golden extent of one file from the card
+static int verify_read(const verify_step_t *step, BYTE *data, int verbose) {
+    const snap_file_t *golden = step->golden;
+    int sfi = step->sfi;
+
+    if (!sfi && select_path(golden->path, golden->path_len, NULL, NULL, verbose) < 0) {
+        return -1;
+    }
+
+    if (golden->structure == EF_TRANSPARENT) {
+        return read_binary_all(sfi, data, golden->data_len) == golden->data_len ? 0 : -1;
+    }
+    for (int rec = 1; rec <= golden->num_records &&
+         rec * golden->record_len <= golden->data_len; rec++) {
+        BYTE *dst = data + (rec - 1) * golden->record_len;
+        if (read_record(sfi, rec, dst, golden->record_len) != golden->record_len) return -1;
+    }
+    return 0;
+}
+
+// Compare decoded fields; per-card fields are checked against the row of
+// the values list and skipped when it has no value for them
+static int verify_fields(const verify_ctx_t *ctx, const value_row_t *row,
+                         const snap_file_t *golden, const snap_file_t *card) {
+    field_list_t *expected = malloc(sizeof(field_list_t));
+    field_list_t *actual = malloc(sizeof(field_list_t));
+    int match = 1;
+
+    if (!expected || !actual) {
+        free(expected);
+        free(actual);
+        return 0;
+    }
+    expected->count = actual->count = 0;
+    decode_file_fields(golden, expected);
+    decode_file_fields(card, actual);
+
+    for (int i = 0; i < expected->count && match; i++) {
+        const char *name = expected->fields[i].name;
+        const char *want = expected->fields[i].value;
+        const char *have = field_lookup(actual, name);
+
+        if (is_per_card_field(ctx, name)) {
+            want = row ? value_row_get(ctx->values, row, name) : NULL;
+            if (!want) continue;
+        }
+        match = have && strcmp(have, want) == 0;
+    }
+    for (int i = 0; i < actual->count && match; i++) {
+        match = is_per_card_field(ctx, actual->fields[i].name) ||
+                field_lookup(expected, actual->fields[i].name) != NULL;
+    }
+
+    free(expected);
+    free(actual);
+    return match;
+}
+
+static int verify_card(const config_t *config, const char *reader, void *arg) {
+    verify_ctx_t *ctx = arg;
+    BYTE mf[] = {0x3F, 0x00};
+    BYTE *data = NULL;
+    const value_row_t *row = NULL;
+    char iccid[21] = "";
+    char mismatches[MAX_SNAPSHOT_FILES][MAX_PATH_LEN * 2 + 1];
+    int num_mismatches = 0;
+    int usim_selected = 0;
+
+    // Start from a known current DF so the SFI reads resolve under the MF
+    if (select_path(mf, sizeof(mf), NULL, NULL, config->verbose) < 0) {
+        fprintf(stderr, "%s: cannot select MF\n", reader);
+        return -1;
+    }
+
+    for (int i = 0; i < ctx->num_steps; i++) {
+        const verify_step_t *step = &ctx->steps[i];
+        const snap_file_t *golden = step->golden;
+        snap_file_t card = *golden;
+        int ok;
+
+        if (step->group == GROUP_ADF && !usim_selected) {
+            usim_selected = ctx->usim_aid_len ?
+                select_aid(ctx->usim_aid, ctx->usim_aid_len, config->verbose) == 0 :
+                select_usim(config->verbose) == 0;
+            usim_selected = usim_selected ? 1 : -1;
+        }
+
+        free(data);
+        data = malloc(golden->data_len ? golden->data_len : 1);
+        ok = data && (step->group != GROUP_ADF || usim_selected > 0) &&
+             verify_read(step, data, config->verbose) == 0;
+
+        if (ok) {
+            card.data = data;
+            card.hash = fnv1a64(data, golden->data_len);
+            if (golden->path[2] == 0x2F && golden->path[3] == 0xE2) {
+                decode_iccid(data, golden->data_len, iccid);
+                session_iccid(iccid);
+                if (ctx->values) row = value_table_find(ctx->values, iccid);
+            }
+            ok = step->per_card ? verify_fields(ctx, row, golden, &card) :
+                 card.hash == golden->hash && memcmp(data, golden->data, golden->data_len) == 0;
+        }
+
+        if (!ok) {
+            char *out = mismatches[num_mismatches++];
+            for (int j = 0; j < golden->path_len; j++) {
+                sprintf(out + j * 2, "%02X", golden->path[j]);
+            }
+        }
+    }
+    free(data);
+
+    int pass = num_mismatches == 0 && (!ctx->values || row != NULL);
+    if (pass) ctx->passed++; else ctx->failed++;
+
+    if (config->json_output) {
+        printf("{\"reader\": \"%s\", \"iccid\": \"%s\", \"result\": \"%s\"",
+               reader, iccid, pass ? "pass" : "fail");
+        if (ctx->values && !row) printf(", \"error\": \"not in values list\"");
+        printf(", \"mismatches\": [");
+        for (int i = 0; i < num_mismatches; i++) {
+            printf("%s\"%s\"", i ? ", " : "", mismatches[i]);
+        }
+        printf("]}\n");
+    } else {
+        printf("%s %s %s", pass ? "PASS" : "FAIL", iccid[0] ? iccid : "-", reader);
+        if (ctx->values && !row) printf(" not-in-values-list");
+        for (int i = 0; i < num_mismatches; i++) {
+            printf(" %s", mismatches[i]);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+    return pass ? 0 : 1;
+}
+
+// Expected-inventory reconciliation
+
+// The expected ICCIDs live in an open-addressing hash table (linear
+// probing, load factor <= 0.5) of packed BCD keys. It is built once from the
+// text list and stored next to it as FILE.idx, which later runs map
+// read-only without parsing. The index records the size, inode and
+// nanosecond mtime of the list it was built from; when it cannot be written
+// (a read-only directory) the table is kept in memory for the run.
+#define EXPECT_MAGIC "SRICCID2"
+
+typedef struct {
+    uint64_t hi;  // digits 1-16, one per nibble, most significant first
+    uint64_t lo;  // digits 17-20, F-padded; an all-zero slot is empty
+} iccid_key_t;
+
+typedef struct {
+    char magic[8];
+    uint64_t num_slots;
+    uint64_t num_keys;
+    uint64_t source_size;
+    uint64_t source_dev;
+    uint64_t source_inode;
+    int64_t source_mtime;
+    int64_t source_mtime_ns;
+} expect_header_t;
+
+typedef struct {
+    void *map;
+    size_t map_len;
+    iccid_key_t *table;          // in-memory table when there is no index
+    const iccid_key_t *slots;
+    uint64_t num_slots;
+    uint64_t num_keys;
+    uint8_t *seen;
+    uint64_t num_seen;
+} expect_set_t;
+
+enum { EXPECT_UNEXPECTED, EXPECT_EXPECTED, EXPECT_DUPLICATE };
+
+static const char *expect_status_names[] = {"unexpected", "expected", "duplicate"};
+
+static int iccid_key(const char *digits, int len, iccid_key_t *key) {
+    if (len < 1 || len > 20) return -1;
+
+    key->hi = 0;
+    key->lo = 0;
+    for (int i = 0; i < 20; i++) {
+        uint64_t nibble = 0x0F;
+        if (i < len) {
+            if (digits[i] < '0' || digits[i] > '9') return -1;
+            nibble = digits[i] - '0';
+        }
+        if (i < 16) key->hi = (key->hi << 4) | nibble;
+        else key->lo = (key->lo << 4) | nibble;
+    }
+    return 0;
+}
+
+static uint64_t iccid_hash(const iccid_key_t *key) {
+    uint64_t h = key->hi ^ (key->lo * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Slot of key, or the empty slot where it would go. The probe is bounded so
+// that a damaged index without empty slots cannot loop forever; the slot
+// returned then holds another key.
+static uint64_t expect_slot(const iccid_key_t *slots, uint64_t num_slots, const iccid_key_t *key) {
+    uint64_t mask = num_slots - 1;
+    uint64_t i = iccid_hash(key) & mask;
+
+    for (uint64_t n = 1; n < num_slots && (slots[i].hi || slots[i].lo) &&
+         (slots[i].hi != key->hi || slots[i].lo != key->lo); n++) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void iccid_key_string(const iccid_key_t *key, char *out) {
+    int pos = 0;
+    for (int i = 15; i >= 0; i--) {
+        int nibble = (key->hi >> (i * 4)) & 0x0F;
+        if (nibble == 0x0F) break;
+        out[pos++] = '0' + nibble;
+    }
+    for (int i = 3; i >= 0 && pos >= 16; i--) {
+        int nibble = (key->lo >> (i * 4)) & 0x0F;
+        if (nibble == 0x0F) break;
+        out[pos++] = '0' + nibble;
+    }
+    out[pos] = '\0';
+}
+
+static void expect_header_init(expect_header_t *header, const struct stat *st) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, EXPECT_MAGIC, sizeof(header->magic));
+    header->source_size = st->st_size;
+    header->source_dev = st->st_dev;
+    header->source_inode = st->st_ino;
+    header->source_mtime = st->st_mtim.tv_sec;
+    header->source_mtime_ns = st->st_mtim.tv_nsec;
+}
+
+// Build the table from the text list (one ICCID per line, optionally the
+// first column of a CSV). Fills in the slot and key counts of header.
+static iccid_key_t *expect_build(const char *filename, const struct stat *st, expect_header_t *header) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    const char *text = st->st_size ? mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (text == MAP_FAILED) return NULL;
+
+    uint64_t lines = 0;
+    for (off_t i = 0; i < st->st_size; i++) {
+        if (text[i] == '\n') lines++;
+    }
+    uint64_t num_slots = 16;
+    while (num_slots < (lines + 1) * 2) num_slots <<= 1;
+
+    iccid_key_t *slots = calloc(num_slots, sizeof(iccid_key_t));
+    uint64_t num_keys = 0;
+
+    for (off_t i = 0; slots && i < st->st_size; ) {
+        off_t start = i;
+        while (i < st->st_size && text[i] >= '0' && text[i] <= '9') i++;
+
+        iccid_key_t key;
+        if (iccid_key(text + start, i - start, &key) == 0) {
+            uint64_t slot = expect_slot(slots, num_slots, &key);
+            if (!slots[slot].hi && !slots[slot].lo) {
+                slots[slot] = key;
+                num_keys++;
+            }
+        }
+        while (i < st->st_size && text[i] != '\n') i++;
+        i++;
+    }
+
+    if (st->st_size) munmap((void *)text, st->st_size);
+    expect_header_init(header, st);
+    header->num_slots = num_slots;
+    header->num_keys = num_keys;
+    return slots;
+}
+
+// Write the index through a temporary file of its own, so concurrent runs
+// building the same index do not clobber each other
+static int expect_write(const char *index_name, const expect_header_t *header, const iccid_key_t *slots) {
+    char tmp_name[4200];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", index_name);
+    int fd = mkstemp(tmp_name);
+    if (fd < 0) return -1;
+
+    FILE *out = fdopen(fd, "wb");
+    if (!out) {
+        close(fd);
+        unlink(tmp_name);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    if (fwrite(header, sizeof(*header), 1, out) != 1 ||
+        fwrite(slots, sizeof(iccid_key_t), header->num_slots, out) != header->num_slots) {
+        fclose(out);
+        unlink(tmp_name);
+        return -1;
+    }
+    if (fclose(out) != 0 || rename(tmp_name, index_name) != 0) {
+        unlink(tmp_name);
+        return -1;
+    }
+    return 0;
+}
+
+static int expect_map(const char *index_name, const struct stat *source, expect_set_t *set) {
+    expect_header_t current;
+    struct stat st;
+    int fd = open(index_name, O_RDONLY);
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(expect_header_t)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    // The slot count must be a power of two that fills the rest of the
+    // file exactly and leaves empty slots for the probes
+    const expect_header_t *header = map;
+    uint64_t room = (st.st_size - sizeof(expect_header_t)) / sizeof(iccid_key_t);
+    expect_header_init(&current, source);
+    if (memcmp(header->magic, current.magic, sizeof(header->magic)) != 0 ||
+        header->source_size != current.source_size ||
+        header->source_dev != current.source_dev ||
+        header->source_inode != current.source_inode ||
+        header->source_mtime != current.source_mtime ||
+        header->source_mtime_ns != current.source_mtime_ns ||
+        header->num_slots == 0 || (header->num_slots & (header->num_slots - 1)) != 0 ||
+        header->num_slots != room ||
+        sizeof(expect_header_t) + room * sizeof(iccid_key_t) != (uint64_t)st.st_size ||
+        header->num_keys >= header->num_slots) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    set->map = map;
+    set->map_len = st.st_size;
+    set->slots = (const iccid_key_t *)((const char *)map + sizeof(expect_header_t));
+    set->num_slots = header->num_slots;
+    set->num_keys = header->num_keys;
+    return 0;
+}
+
+static int expect_load(const char *filename, expect_set_t *set) {
+    char index_name[4096];
+    struct stat st;
+
+    memset(set, 0, sizeof(*set));
+    if (stat(filename, &st) < 0) {
+        fprintf(stderr, "Cannot open expected list %s\n", filename);
+        return -1;
+    }
+    snprintf(index_name, sizeof(index_name), "%s.idx", filename);
+
+    if (expect_map(index_name, &st, set) < 0) {
+        expect_header_t header;
+        iccid_key_t *table = expect_build(filename, &st, &header);
+        if (!table) {
+            fprintf(stderr, "Cannot read expected list %s\n", filename);
+            return -1;
+        }
+        if (expect_write(index_name, &header, table) == 0 && expect_map(index_name, &st, set) == 0) {
+            free(table);
+        } else {
+            fprintf(stderr, "Cannot write index %s; using an in-memory table\n", index_name);
+            set->table = table;
+            set->slots = table;
+            set->num_slots = header.num_slots;
+            set->num_keys = header.num_keys;
+        }
+    }
+
+    set->seen = calloc(set->num_slots / 8 + 1, 1);
+    if (!set->seen) {
+        if (set->map) munmap(set->map, set->map_len);
+        free(set->table);
+        return -1;
+    }
+    return 0;
+}
+
+static void expect_free(expect_set_t *set) {
+    if (set->map) munmap(set->map, set->map_len);
+    free(set->table);
+    free(set->seen);
+    memset(set, 0, sizeof(*set));
+}
+
+static int expect_check(expect_set_t *set, const char *iccid) {
+    iccid_key_t key;
+
+    if (iccid_key(iccid, strlen(iccid), &key) < 0) return EXPECT_UNEXPECTED;
+
+    uint64_t slot = expect_slot(set->slots, set->num_slots, &key);
+    if (set->slots[slot].hi != key.hi || set->slots[slot].lo != key.lo) return EXPECT_UNEXPECTED;
+    if (set->seen[slot / 8] & (1 << (slot % 8))) return EXPECT_DUPLICATE;
+
+    set->seen[slot / 8] |= 1 << (slot % 8);
+    set->num_seen++;
+    return EXPECT_EXPECTED;
+}
+
+// Print the expected ICCIDs that were never scanned
+static void expect_print_remainder(const expect_set_t *set, int json) {
+    char iccid[21];
+    int first = 1;
+
+    if (json) {
+        printf("{\n  \"unscanned_count\": %" PRIu64 ",\n  \"unscanned\": [",
+               set->num_keys - set->num_seen);
+    } else {
+        printf("=== Unscanned expected ICCIDs (%" PRIu64 " of %" PRIu64 ") ===\n",
+               set->num_keys - set->num_seen, set->num_keys);
+    }
+
+    for (uint64_t i = 0; i < set->num_slots; i++) {
+        if ((!set->slots[i].hi && !set->slots[i].lo) || (set->seen[i / 8] & (1 << (i % 8)))) {
+            continue;
+        }
+        iccid_key_string(&set->slots[i], iccid);
+        if (json) {
+            printf("%s\"%s\"", first ? "" : ", ", iccid);
+        } else {
+            printf("%s\n", iccid);
+        }
+        first = 0;
+    }
+
+    if (json) printf("]\n}\n");
+}
+
+// Profile provisioning
+
+// A template line is "PATH RECORD ENCODING VALUE": RECORD is a record
+// number or - for transparent files, and VALUE may reference per-card
+// variables as ${column} from the values list (plus ${iccid}). Encodings:
+//   hex     raw bytes, written from offset 0
+//   ascii   text, padded with FF to the file size
+//   imsi    EF_IMSI coding
+//   iccid   swapped BCD digits
+//   spn     [CC:]name, display condition byte CC (hex, default 00)
+//   adn     [alpha|]number as a dialling number record (EF_MSISDN, EF_ADN)
+#define MAX_TEMPLATE_ENTRIES 64
+#define MAX_WRITE_RANGES 32
+// Separate runs of changed bytes closer than this are written as one
+// UPDATE BINARY; the gap costs less than another command header
+#define WRITE_MERGE_GAP 6
+
+typedef struct {
+    BYTE path[MAX_PATH_LEN];
+    int path_len;
+    int record;
+    char encoding[8];
+    char value[256];
+} template_entry_t;
+
+typedef struct {
+    template_entry_t entries[MAX_TEMPLATE_ENTRIES];
+    int num_entries;
+} profile_template_t;
+
+typedef struct {
+    const profile_template_t *profile;
+    const value_table_t *values;
+    BYTE adm[8];
+    int have_adm;
+    int dry_run;
+    int provisioned;
+    int unchanged;
+    int failed;
+} provision_ctx_t;
+
+static int template_load(const char *filename, profile_template_t *profile) {
+    FILE *in = fopen(filename, "r");
+    char line[512];
+    int line_no = 0;
+
+    profile->num_entries = 0;
+    if (!in) {
+        fprintf(stderr, "Cannot open template %s\n", filename);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        char path[32];
+        char record[16];
+        char *p = trim(line);
+        int consumed;
+
+        line_no++;
+        p[strcspn(p, "\n")] = '\0';
+        if (!p[0] || p[0] == '#') continue;
+
+        template_entry_t *entry = &profile->entries[profile->num_entries];
+        memset(entry, 0, sizeof(*entry));
+        if (profile->num_entries >= MAX_TEMPLATE_ENTRIES ||
+            sscanf(p, "%31s %15s %7s %n", path, record, entry->encoding, &consumed) != 3 ||
+            (entry->path_len = hex_to_bytes(path, entry->path, MAX_PATH_LEN)) < 4) {
+            fprintf(stderr, "%s:%d: invalid template line\n", filename, line_no);
+            fclose(in);
+            return -1;
+        }
+        entry->record = strcmp(record, "-") == 0 ? 0 : atoi(record);
+        snprintf(entry->value, sizeof(entry->value), "%s", trim(p + consumed));
+        profile->num_entries++;
+    }
+
+    fclose(in);
+    return 0;
+}
+
+// Substitute ${name} references; fails when a variable has no value
+static int expand_variables(const char *value, const value_table_t *values,
+                            const value_row_t *row, const char *iccid,
+                            char *out, int out_size) {
+    int pos = 0;
+
+    while (*value) {
+        const char *replacement = NULL;
+        int skip = 1;
+
+        if (value[0] == '$' && value[1] == '{') {
+            const char *end = strchr(value, '}');
+            char name[32];
+            if (!end || end - value - 2 >= (int)sizeof(name)) return -1;
+            memcpy(name, value + 2, end - value - 2);
+            name[end - value - 2] = '\0';
+            for (char *c = name; *c; c++) {
+                if (*c >= 'A' && *c <= 'Z') *c += 'a' - 'A';
+            }
+            replacement = strcmp(name, "iccid") == 0 ? iccid :
+                          row ? value_row_get(values, row, name) : NULL;
+            if (!replacement) {
+                fprintf(stderr, "No value for ${%s}\n", name);
+                return -1;
+            }
+            skip = end - value + 1;
+        }
+
+        int len = replacement ? (int)strlen(replacement) : 1;
+        if (pos + len >= out_size) return -1;
+        memcpy(out + pos, replacement ? replacement : value, len);
+        pos += len;
+        value += skip;
+    }
+    out[pos] = '\0';
+    return 0;
+}
+
+static int encode_bcd_swapped(const char *digits, BYTE *out, int max_len) {
+    static const char codes[] = "0123456789*#pwe";
+    int count = 0;
+
+    for (const char *d = digits; *d; d++) {
+        const char *c = strchr(codes, *d);
+        if (!c) continue;
+        if (count / 2 >= max_len) return -1;
+        BYTE nibble = c - codes;
+        if (count % 2 == 0) out[count / 2] = 0xF0 | nibble;
+        else out[count / 2] = (out[count / 2] & 0x0F) | (nibble << 4);
+        count++;
+    }
+    return (count + 1) / 2;
+}
+
+// Encode value into out (size bytes, prefilled with FF); returns the number
+// of significant bytes
+static int encode_template_value(const char *encoding, const char *value, BYTE *out, int size) {
+    memset(out, 0xFF, size);
+
+    if (strcmp(encoding, "hex") == 0) {
+        return hex_to_bytes(value, out, size);
+    }
+    if (strcmp(encoding, "ascii") == 0) {
+        int len = strlen(value);
+        if (len > size) return -1;
+        memcpy(out, value, len);
+        return size;
+    }
+    if (strcmp(encoding, "iccid") == 0) {
+        return encode_bcd_swapped(value, out, size) < 0 ? -1 : size;
+    }
+    if (strcmp(encoding, "imsi") == 0) {
+        int digits = strlen(value);
+        char nibbles[20];
+        if (digits < 6 || digits > 15 || size < 9) return -1;
+        // Identity type 1 (IMSI) with the odd/even indication, then digits
+        nibbles[0] = digits % 2 ? '9' : '1';
+        memcpy(nibbles + 1, value, digits + 1);
+        out[0] = (digits + 2) / 2;
+        return encode_bcd_swapped(nibbles, out + 1, 8) < 0 ? -1 : 9;
+    }
+    if (strcmp(encoding, "spn") == 0) {
+        unsigned int condition = 0;
+        const char *colon = strchr(value, ':');
+        if (colon && colon - value == 2 && sscanf(value, "%2x", &condition) == 1) {
+            value = colon + 1;
+        }
+        out[0] = condition;
+        encode_alpha(value, out + 1, size - 1);
+        return size;
+    }
+    if (strcmp(encoding, "adn") == 0) {
+        const char *bar = strchr(value, '|');
+        const char *number = bar ? bar + 1 : value;
+        int alpha_len = bar ? bar - value : 0;
+        char alpha[128];
+        if (size < 14 || alpha_len >= (int)sizeof(alpha)) return -1;
+        memcpy(alpha, value, alpha_len);
+        alpha[alpha_len] = '\0';
+        encode_alpha(alpha, out, size - 14);
+        BYTE *num = out + size - 14;
+        int plus = number[0] == '+';
+        int len = encode_bcd_swapped(number + plus, num + 2, 10);
+        if (len < 0) return -1;
+        num[0] = len + 1;
+        num[1] = plus ? 0x91 : 0x81;
+        return size;
+    }
+
+    fprintf(stderr, "Unknown encoding %s\n", encoding);
+    return -1;
+}
+
+typedef struct {
+    int offset;
+    int len;
+} write_range_t;
+
+// Runs of bytes that differ between current and wanted, with close runs
+// merged. Returns the number of ranges, or -1 if there are too many.
+static int diff_ranges(const BYTE *current, const BYTE *wanted, int len, write_range_t *ranges) {
+    int count = 0;
+
+    for (int i = 0; i < len; i++) {
+        if (current[i] == wanted[i]) continue;
+        if (count && i - (ranges[count-1].offset + ranges[count-1].len) < WRITE_MERGE_GAP) {
+            ranges[count-1].len = i + 1 - ranges[count-1].offset;
+        } else {
+            if (count == MAX_WRITE_RANGES) return -1;
+            ranges[count].offset = i;
+            ranges[count].len = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+static void print_plan_path(const template_entry_t *entry) {
+    for (int i = 0; i < entry->path_len; i++) {
+        printf("%02X", entry->path[i]);
+    }
+    if (entry->record) printf("#%d", entry->record);
+}
+
+// Apply one template entry: read the target, write only what differs and
+// read back the written ranges. Returns the number of writes, -1 on error.
+static int provision_entry(const provision_ctx_t *ctx, const template_entry_t *entry,
+                           const char *value, int verbose) {
+    snap_file_t file = {0};
+    BYTE current[BUFFER_SIZE];
+    BYTE wanted[BUFFER_SIZE];
+    BYTE check[BUFFER_SIZE];
+    write_range_t ranges[MAX_WRITE_RANGES];
+    int num_ranges;
+    int len;
+
+    if (select_path(entry->path, entry->path_len, file.fcp, &file.fcp_len, verbose) < 0) {
+        return -1;
+    }
+    parse_fcp(&file);
+
+    if (entry->record) {
+        if (file.structure == EF_TRANSPARENT || entry->record > file.num_records ||
+            file.record_len > (int)sizeof(wanted)) {
+            return -1;
+        }
+        len = file.record_len;
+        if (encode_template_value(entry->encoding, value, wanted, len) < 0 ||
+            read_record(0, entry->record, current, len) != len) {
+            return -1;
+        }
+        if (memcmp(current, wanted, len) == 0) return 0;
+
+        if (ctx->dry_run) {
+            printf("  would update ");
+            print_plan_path(entry);
+            printf("\n");
+            return 1;
+        }
+        if (update_record(entry->record, wanted, len) < 0 ||
+            read_record(0, entry->record, check, len) != len || memcmp(check, wanted, len) != 0) {
+            return -1;
+        }
+        return 1;
+    }
+
+    int size = fcp_file_size(&file);
+    if (file.structure != EF_TRANSPARENT || size > (int)sizeof(wanted)) return -1;
+    len = encode_template_value(entry->encoding, value, wanted, size);
+    if (len < 0 || read_binary_all(0, current, len) != len) return -1;
+
+    num_ranges = diff_ranges(current, wanted, len, ranges);
+    if (num_ranges < 0) {
+        ranges[0].offset = 0;
+        ranges[0].len = len;
+        num_ranges = 1;
+    }
+
+    for (int i = 0; i < num_ranges; i++) {
+        const write_range_t *r = &ranges[i];
+        if (ctx->dry_run) {
+            printf("  would update ");
+            print_plan_path(entry);
+            printf(" [%d..%d]\n", r->offset, r->offset + r->len - 1);
+            continue;
+        }
+        if (update_binary(r->offset, wanted + r->offset, r->len) < 0) return -1;
+    }
+
+    // Read back only the written ranges
+    for (int i = 0; i < num_ranges && !ctx->dry_run; i++) {
+        const write_range_t *r = &ranges[i];
+        for (int done = 0; done < r->len; ) {
+            int chunk = r->len - done > 256 ? 256 : r->len - done;
+            int offset = r->offset + done;
+            BYTE apdu[] = {0x00, 0xB0, (BYTE)((offset >> 8) & 0x7F), (BYTE)(offset & 0xFF),
+                           (BYTE)(chunk & 0xFF)};
+            int resp_len;
+            WORD sw;
+            if (exchange_apdu(apdu, sizeof(apdu), check, sizeof(check), &resp_len, &sw) < 0 ||
+                sw != 0x9000 || resp_len != chunk || memcmp(check, wanted + offset, chunk) != 0) {
+                return -1;
+            }
+            done += chunk;
+        }
+    }
+    return num_ranges;
+}
+
+static int provision_card(const config_t *config, const char *reader, void *arg) {
+    provision_ctx_t *ctx = arg;
+    BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+    BYTE data[10];
+    char iccid[21] = "";
+    const value_row_t *row = NULL;
+    int writes = 0;
+    int have_usim = -1;
+    int failed = 0;
+
+    if (select_path(iccid_path, sizeof(iccid_path), NULL, NULL, config->verbose) == 0 &&
+        read_binary_all(0, data, sizeof(data)) == (int)sizeof(data)) {
+        decode_iccid(data, sizeof(data), iccid);
+        session_iccid(iccid);
+    }
+    if (ctx->values && !(row = value_table_find(ctx->values, iccid))) {
+        printf("FAILED %s %s not-in-values-list\n", iccid[0] ? iccid : "-", reader);
+        ctx->failed++;
+        return 1;
+    }
+    if (ctx->have_adm && !ctx->dry_run && verify_adm(ctx->adm, config->verbose) < 0) {
+        printf("FAILED %s %s adm\n", iccid, reader);
+        ctx->failed++;
+        return 1;
+    }
+
+    if (ctx->dry_run) printf("Plan for %s (%s):\n", iccid, reader);
+
+    for (int i = 0; i < ctx->profile->num_entries; i++) {
+        const template_entry_t *entry = &ctx->profile->entries[i];
+        char value[256];
+        int rv = -1;
+
+        if (path_in_adf(entry->path, entry->path_len) && have_usim < 0) {
+            have_usim = select_usim(config->verbose) == 0;
+        }
+        if ((!path_in_adf(entry->path, entry->path_len) || have_usim) &&
+            expand_variables(entry->value, ctx->values, row, iccid, value, sizeof(value)) == 0) {
+            rv = provision_entry(ctx, entry, value, config->verbose);
+        }
+
+        if (rv < 0) {
+            if (!failed) printf("FAILED %s %s", iccid, reader);
+            printf(" ");
+            print_plan_path(entry);
+            failed = 1;
+        } else {
+            writes += rv;
+        }
+    }
+
+    if (failed) {
+        printf("\n");
+        ctx->failed++;
+        return 1;
+    }
+    if (ctx->dry_run) {
+        printf("  %d update(s)\n", writes);
+    } else if (writes) {
+        printf("PROVISIONED %s %s %d update(s)\n", iccid, reader, writes);
+        ctx->provisioned++;
+    } else {
+        printf("UNCHANGED %s %s\n", iccid, reader);
+        ctx->unchanged++;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// Dump import
+
+// Dumps written by other SIM tools are converted into snapshots. The format
+// is recognised from the contents:
+//   pySim-shell  export scripts: "select PATH", then "update_binary HEX" or
+//                "update_record N HEX"
+//   pySim-read   the text printed by pySim-read.py: decoded ICCID, IMSI,
+//                SPN and MSISDN, and SMSP, ACC, EF_AD and the service tables
+//                in hex
+//   JSON         an object of file paths and hex strings (transparent files)
+//                or arrays of hex strings (records); nested objects are
+//                directories
+//   hex dump     "PATH: HEX" lines, "PATH#N: HEX" for record N, and an
+//                optional "atr: HEX" line
+// Paths are hex file IDs (3f00/7f20/6f07) or pySim names (MF/DF.GSM/EF.IMSI).
+// Dumps carry no FCP, so one is built from the structure and size of the
+// imported contents.
+
+static const struct {
+    const char *name;
+    WORD fid;
+} import_dir_names[] = {
+    {"MF", 0x3F00},
+    {"DF.TELECOM", 0x7F10},
+    {"DF.GSM", 0x7F20},
+    {"ADF.USIM", 0x7FFF},
+    {"DF.PHONEBOOK", 0x5F3A},
+};
+
+static int is_hex_string(const char *s) {
+    if (!*s) return 0;
+    for (; *s; s++) {
+        if (!((*s >= '0' && *s <= '9') || (*s >= 'a' && *s <= 'f') || (*s >= 'A' && *s <= 'F'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// File ID of an EF named like pySim does (EF.IMSI), looked up in the
+// snapshot catalog; an entry below the given directory is preferred
+static int import_ef_fid(const char *name, const BYTE *dir, int dir_len) {
+    int num = sizeof(snapshot_catalog) / sizeof(snapshot_catalog[0]);
+    int fid = -1;
+
+    for (int i = 0; i < num; i++) {
+        const BYTE *p = snapshot_catalog[i].path;
+        int len = snapshot_catalog[i].path_len;
+        if (strcasecmp(snapshot_catalog[i].name + 3, name + 3) != 0) continue;
+        if (len == dir_len + 2 && memcmp(p, dir, dir_len) == 0) return (p[len - 2] << 8) | p[len - 1];
+        if (fid < 0) fid = (p[len - 2] << 8) | p[len - 1];
+    }
+    return fid;
+}
+
+// Directories have IDs 3Fxx, 5Fxx and 7Fxx
+static int is_df_id(const BYTE *fid) {
+    return fid[0] == 0x3F || fid[0] == 0x5F || fid[0] == 0x7F;
+}
+
+// Resolve a path relative to the file base (as pySim does: ".." is the
+// parent, and a name below an EF is one of its siblings). Paths starting
+// with the MF or an ADF are absolute, and the MF is prepended when neither
+// gives one. Returns the length of the path in bytes, or -1.
+static int import_resolve(const char *text, const BYTE *base, int base_len, BYTE *path) {
+    char buf[128];
+    char *save = NULL;
+    int len = 0;
+
+    if (strlen(text) >= sizeof(buf)) return -1;
+    strcpy(buf, text);
+    if (base_len > 0) {
+        memmove(path, base, base_len);
+        len = base_len;
+    }
+
+    for (char *tok = strtok_r(buf, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
+        int fids[MAX_PATH_LEN / 2];
+        int count = 0;
+
+        if (strcmp(tok, "..") == 0) {
+            if (len > 2) len -= 2;
+            continue;
+        }
+        if (len >= 2 && !is_df_id(path + len - 2)) len -= 2;
+        if (strlen(tok) % 4 == 0 && is_hex_string(tok)) {
+            for (; *tok && count < MAX_PATH_LEN / 2; tok += 4) {
+                unsigned int fid;
+                sscanf(tok, "%4x", &fid);
+                fids[count++] = fid;
+            }
+            if (*tok) return -1;
+        } else {
+            int num = sizeof(import_dir_names) / sizeof(import_dir_names[0]);
+            for (int i = 0; i < num && !count; i++) {
+                if (strcasecmp(tok, import_dir_names[i].name) == 0) fids[count++] = import_dir_names[i].fid;
+            }
+            if (!count && (strncasecmp(tok, "EF.", 3) == 0 || strncasecmp(tok, "EF_", 3) == 0)) {
+                int fid = import_ef_fid(tok, path, len);
+                if (fid >= 0) fids[count++] = fid;
+            }
+            if (!count) return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            if (fids[i] == 0x3F00) len = 0;
+            if (fids[i] == 0x7FFF) {
+                path[0] = 0x3F;
+                path[1] = 0x00;
+                len = 2;
+            }
+            if (len + 2 > MAX_PATH_LEN) return -1;
+            path[len++] = fids[i] >> 8;
+            path[len++] = fids[i] & 0xFF;
+        }
+    }
+
+    if (len < 2) return -1;
+    if (path[0] != 0x3F || path[1] != 0x00) {
+        if (len + 2 > MAX_PATH_LEN) return -1;
+        memmove(path + 2, path, len);
+        path[0] = 0x3F;
+        path[1] = 0x00;
+        len += 2;
+    }
+    return len;
+}
+
+static snap_file_t *import_file(snapshot_t *snap, const BYTE *path, int path_len) {
+    snap_file_t *file = snapshot_find(snap, path, path_len);
+
+    if (file) return file;
+    if (snap->num_files >= MAX_SNAPSHOT_FILES) return NULL;
+    file = &snap->files[snap->num_files++];
+    memset(file, 0, sizeof(*file));
+    memcpy(file->path, path, path_len);
+    file->path_len = path_len;
+    return file;
+}
+
+static int import_binary(snapshot_t *snap, const BYTE *path, int path_len, const BYTE *data, int len) {
+    snap_file_t *file = import_file(snap, path, path_len);
+
+    if (!file || file->structure || len < 1) return -1;
+    if (!(file->data = malloc(len))) return -1;
+    memcpy(file->data, data, len);
+    file->data_len = len;
+    file->structure = EF_TRANSPARENT;
+    return 0;
+}
+
+// Store record number record; all records of a file must have the same
+// length, and missing ones are left empty (FF)
+static int import_record(snapshot_t *snap, const BYTE *path, int path_len, int record,
+                         const BYTE *data, int len) {
+    snap_file_t *file = import_file(snap, path, path_len);
+
+    if (!file || record < 1 || record > 255 || len < 1) return -1;
+    if (!file->structure) {
+        file->structure = EF_LINEAR_FIXED;
+        file->record_len = len;
+    }
+    if (file->structure != EF_LINEAR_FIXED || len != file->record_len) return -1;
+    if (record > file->num_records) {
+        BYTE *grown = realloc(file->data, record * len);
+        if (!grown) return -1;
+        memset(grown + file->num_records * len, 0xFF, (record - file->num_records) * len);
+        file->data = grown;
+        file->num_records = record;
+        file->data_len = record * len;
+    }
+    memcpy(file->data + (record - 1) * len, data, len);
+    return 0;
+}
+
+// Build the FCP (file descriptor, file ID, size) and hash of every file
+static void import_finish(snapshot_t *snap) {
+    for (int i = 0; i < snap->num_files; i++) {
+        snap_file_t *file = &snap->files[i];
+        BYTE *f = file->fcp;
+        int n = 2;
+
+        f[n++] = 0x82;
+        if (file->structure == EF_LINEAR_FIXED) {
+            f[n++] = 5;
+            f[n++] = 0x42;
+            f[n++] = 0x21;
+            f[n++] = file->record_len >> 8;
+            f[n++] = file->record_len & 0xFF;
+            f[n++] = file->num_records;
+        } else {
+            f[n++] = 2;
+            f[n++] = 0x41;
+            f[n++] = 0x21;
+        }
+        f[n++] = 0x83;
+        f[n++] = 2;
+        f[n++] = file->path[file->path_len - 2];
+        f[n++] = file->path[file->path_len - 1];
+        f[n++] = 0x80;
+        f[n++] = 2;
+        f[n++] = file->data_len >> 8;
+        f[n++] = file->data_len & 0xFF;
+        f[0] = 0x62;
+        f[1] = n - 2;
+        file->fcp_len = n;
+        parse_fcp(file);
+        file->hash = fnv1a64(file->data, file->data_len);
+    }
+}
+
+// Remove white space from a hex string in place; returns it
+static char *hex_compact(char *s) {
+    char *out = s;
+    for (char *in = s; *in; in++) {
+        if (*in != ' ' && *in != '\t' && *in != '\r' && *in != '\n') *out++ = *in;
+    }
+    *out = '\0';
+    return s;
+}
+
+// pySim-shell export script. Relative selects start from the previously
+// selected file.
+static int import_pysim_shell(snapshot_t *snap, char *text, const char *source) {
+    BYTE path[MAX_PATH_LEN];
+    BYTE selected[MAX_PATH_LEN];
+    int path_len = 0;
+    int selected_len = 0;
+    int line_no = 0;
+    char *save = NULL;
+
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *cmd;
+        char *arg;
+        char *rest = NULL;
+
+        line_no++;
+        line = trim(line);
+        if (!*line || *line == '#') continue;
+        cmd = strtok_r(line, " \t", &rest);
+        arg = strtok_r(NULL, " \t", &rest);
+
+        if (strcmp(cmd, "select") == 0 && arg) {
+            path_len = import_resolve(arg, selected, selected_len, path);
+            if (path_len < 0) {
+                fprintf(stderr, "%s:%d: unknown file %s\n", source, line_no, arg);
+                continue;
+            }
+            memcpy(selected, path, path_len);
+            selected_len = path_len;
+        } else if (strcmp(cmd, "update_binary") == 0 && arg) {
+            BYTE data[BUFFER_SIZE];
+            int len = hex_to_bytes(hex_compact(arg), data, sizeof(data));
+            if (path_len > 0 && (len < 0 || import_binary(snap, path, path_len, data, len) < 0)) {
+                fprintf(stderr, "%s:%d: invalid update_binary\n", source, line_no);
+                return -1;
+            }
+        } else if (strcmp(cmd, "update_record") == 0 && arg) {
+            BYTE data[256];
+            char *hex = strtok_r(NULL, " \t", &rest);
+            int len = hex ? hex_to_bytes(hex_compact(hex), data, sizeof(data)) : -1;
+            if (path_len > 0 &&
+                (len < 0 || import_record(snap, path, path_len, atoi(arg), data, len) < 0)) {
+                fprintf(stderr, "%s:%d: invalid update_record\n", source, line_no);
+                return -1;
+            }
+        }
+        // Other commands (verify_adm, update_binary_decoded, ...) carry no raw contents
+    }
+    return 0;
+}
+
+// pySim-read output. Only unindented "Label: value" lines are used; the
+// indented lines below them are decodings of the same data.
+static int import_pysim_read(snapshot_t *snap, char *text) {
+    static const BYTE df_gsm[] = {0x3F, 0x00, 0x7F, 0x20};
+    static const BYTE adf_usim[] = {0x3F, 0x00, 0x7F, 0xFF};
+    static const BYTE df_telecom[] = {0x3F, 0x00, 0x7F, 0x10};
+    // Hex fields copied as they are; in_adf also puts a copy into the USIM
+    static const struct {
+        const char *label;
+        WORD fid;
+        int dir;                 // 0 DF_GSM, 1 ADF_USIM, 2 DF_TELECOM
+        int in_adf;
+        int record;
+    } hex_fields[] = {
+        {"ACC", 0x6F78, 0, 1, 0},
+        {"Administrative data", 0x6FAD, 0, 1, 0},
+        {"SIM Service Table", 0x6F38, 0, 0, 0},
+        {"USIM Service Table", 0x6F38, 1, 0, 0},
+        {"SMSP", 0x6F42, 2, 0, 1},
+    };
+    int usim = strstr(text, "\nUSIM Service Table:") != NULL;
+    char spn[64] = "";
+    int have_spn = 0;
+    int condition = 0;
+    char *save = NULL;
+
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *colon = strchr(line, ':');
+        BYTE path[MAX_PATH_LEN];
+        BYTE data[BUFFER_SIZE];
+        int len;
+
+        if (line[0] == ' ' || line[0] == '\t' || !colon) continue;
+        *colon = '\0';
+        char *label = trim(line);
+        char *value = trim(colon + 1);
+
+        if (strcmp(label, "ATR") == 0) {
+            len = hex_to_bytes(hex_compact(value), snap->atr, MAX_ATR_SIZE);
+            snap->atr_len = len > 0 ? len : 0;
+        } else if (strcmp(label, "ICCID") == 0 && all_digits(value)) {
+            static const BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+            encode_template_value("iccid", value, data, 10);
+            import_binary(snap, iccid_path, sizeof(iccid_path), data, 10);
+        } else if (strcmp(label, "IMSI") == 0 && all_digits(value) &&
+                   encode_template_value("imsi", value, data, 9) == 9) {
+            for (int copy = 0; copy <= usim; copy++) {
+                memcpy(path, copy ? adf_usim : df_gsm, 4);
+                path[4] = 0x6F;
+                path[5] = 0x07;
+                import_binary(snap, path, 6, data, 9);
+            }
+        } else if (strcmp(label, "SPN") == 0) {
+            snprintf(spn, sizeof(spn), "%s", value);
+            have_spn = 1;
+        } else if (strcmp(label, "Show in HPLMN") == 0) {
+            if (strcmp(value, "True") == 0) condition |= 0x01;
+        } else if (strcmp(label, "Hide in OPLMN") == 0) {
+            if (strcmp(value, "True") == 0) condition |= 0x02;
+        } else if (strncmp(label, "MSISDN", 6) == 0 && (value[0] == '+' || all_digits(value)) && value[0]) {
+            memcpy(path, df_telecom, 4);
+            path[4] = 0x6F;
+            path[5] = 0x40;
+            if (encode_template_value("adn", value, data, 14) == 14) import_record(snap, path, 6, 1, data, 14);
+        } else {
+            int num = sizeof(hex_fields) / sizeof(hex_fields[0]);
+            for (int i = 0; i < num; i++) {
+                if (strcmp(label, hex_fields[i].label) != 0) continue;
+                if (!is_hex_string(hex_compact(value)) ||
+                    (len = hex_to_bytes(value, data, sizeof(data))) <= 0) {
+                    break;
+                }
+                for (int copy = 0; copy <= (hex_fields[i].in_adf && usim); copy++) {
+                    int dir = copy ? 1 : hex_fields[i].dir;
+                    memcpy(path, dir == 0 ? df_gsm : dir == 1 ? adf_usim : df_telecom, 4);
+                    path[4] = hex_fields[i].fid >> 8;
+                    path[5] = hex_fields[i].fid & 0xFF;
+                    if (hex_fields[i].record) import_record(snap, path, 6, 1, data, len);
+                    else import_binary(snap, path, 6, data, len);
+                }
+                break;
+            }
+        }
+    }
+
+    if (have_spn) {
+        BYTE data[17];
+        char value[80];
+        snprintf(value, sizeof(value), "%02X:%s", condition, spn);
+        encode_template_value("spn", value, data, sizeof(data));
+        for (int copy = 0; copy <= usim; copy++) {
+            BYTE path[6];
+            memcpy(path, copy ? adf_usim : df_gsm, 4);
+            path[4] = 0x6F;
+            path[5] = 0x46;
+            import_binary(snap, path, 6, data, sizeof(data));
+        }
+    }
+    return snap->num_files ? 0 : -1;
+}
+
+static void json_skip_space(const char **p) {
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') (*p)++;
+}
+
+// A JSON string into out (at least as long as the input); only the simple
+// escapes are decoded
+static int json_string(const char **p, char *out) {
+    int n = 0;
+
+    if (**p != '"') return -1;
+    for ((*p)++; **p && **p != '"'; (*p)++) {
+        if (**p == '\\' && (*p)[1]) (*p)++;
+        out[n++] = **p;
+    }
+    if (**p != '"') return -1;
+    (*p)++;
+    out[n] = '\0';
+    return n;
+}
+
+// Skip a value that is not imported (number, literal or nested container)
+static int json_skip(const char **p, char *scratch) {
+    int depth = 0;
+
+    do {
+        json_skip_space(p);
+        if (**p == '"') {
+            if (json_string(p, scratch) < 0) return -1;
+        } else if (**p == '{' || **p == '[') {
+            depth++;
+            (*p)++;
+        } else if (**p == '}' || **p == ']') {
+            depth--;
+            (*p)++;
+        } else if (**p == ',' || **p == ':') {
+            (*p)++;
+        } else if (**p) {
+            while (**p && !strchr(",:]} \t\r\n", **p)) (*p)++;
+        } else {
+            return -1;
+        }
+    } while (depth > 0);
+    return 0;
+}
+
+static int import_json_object(snapshot_t *snap, const char **p, const BYTE *dir, int dir_len,
+                              char *key, char *scratch, const char *source) {
+    json_skip_space(p);
+    if (*(*p)++ != '{') return -1;
+    json_skip_space(p);
+    if (**p == '}') {
+        (*p)++;
+        return 0;
+    }
+
+    for (;;) {
+        BYTE path[MAX_PATH_LEN];
+        int path_len;
+
+        json_skip_space(p);
+        if (json_string(p, key) < 0) return -1;
+        json_skip_space(p);
+        if (*(*p)++ != ':') return -1;
+        json_skip_space(p);
+
+        if (strcasecmp(key, "atr") == 0 && **p == '"') {
+            if (json_string(p, scratch) < 0) return -1;
+            int len = hex_to_bytes(hex_compact(scratch), snap->atr, MAX_ATR_SIZE);
+            snap->atr_len = len > 0 ? len : 0;
+        } else if ((path_len = import_resolve(key, dir, dir_len, path)) < 0) {
+            fprintf(stderr, "%s: unknown file %s\n", source, key);
+            if (json_skip(p, scratch) < 0) return -1;
+        } else if (**p == '{') {
+            if (import_json_object(snap, p, path, path_len, key, scratch, source) < 0) return -1;
+        } else if (**p == '"') {
+            int len = json_string(p, scratch);
+            BYTE *data = (BYTE *)scratch;
+            if (len < 0) return -1;
+            len = hex_to_bytes(hex_compact(scratch), data, len / 2 + 1);
+            if (len > 0 && import_binary(snap, path, path_len, data, len) < 0) return -1;
+        } else if (**p == '[') {
+            int record = 0;
+            (*p)++;
+            json_skip_space(p);
+            while (**p != ']') {
+                record++;
+                if (**p == '"') {
+                    int len = json_string(p, scratch);
+                    BYTE *data = (BYTE *)scratch;
+                    if (len < 0) return -1;
+                    len = hex_to_bytes(hex_compact(scratch), data, len / 2 + 1);
+                    if (len > 0 && import_record(snap, path, path_len, record, data, len) < 0) {
+                        return -1;
+                    }
+                } else if (json_skip(p, scratch) < 0) {
+                    return -1;
+                }
+                json_skip_space(p);
+                if (**p == ',') (*p)++;
+                else if (**p != ']') return -1;
+                json_skip_space(p);
+            }
+            (*p)++;
+        } else if (json_skip(p, scratch) < 0) {
+            return -1;
+        }
+
+        json_skip_space(p);
+        if (**p == ',') {
+            (*p)++;
+            continue;
+        }
+        if (*(*p)++ != '}') return -1;
+        return 0;
+    }
+}
+
+static int import_json(snapshot_t *snap, const char *text, const char *source) {
+    size_t size = strlen(text) + 1;
+    char *key = malloc(size);
+    char *scratch = malloc(size);
+    const char *p = text;
+    int rv = -1;
+
+    if (key && scratch) rv = import_json_object(snap, &p, NULL, 0, key, scratch, source);
+    if (rv < 0) fprintf(stderr, "%s: invalid JSON near offset %ld\n", source, (long)(p - text));
+    free(key);
+    free(scratch);
+    return rv;
+}
+
+// "PATH: HEX" dump, with "PATH#N" for records
+static int import_hex_dump(snapshot_t *snap, char *text, const char *source) {
+    int line_no = 0;
+    char *save = NULL;
+
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        BYTE path[MAX_PATH_LEN];
+        BYTE data[BUFFER_SIZE];
+        int path_len;
+        int record = 0;
+        int len;
+
+        line_no++;
+        line = trim(line);
+        if (!*line || *line == '#') continue;
+        char *split = strchr(line, ':');
+        if (!split) split = strpbrk(line, " \t");
+        if (!split) goto malformed;
+        *split = '\0';
+        char *name = trim(line);
+        char *hex = hex_compact(split + 1);
+
+        if (strcasecmp(name, "atr") == 0) {
+            len = hex_to_bytes(hex, snap->atr, MAX_ATR_SIZE);
+            if (len < 0) goto malformed;
+            snap->atr_len = len;
+            continue;
+        }
+        char *hash = strchr(name, '#');
+        if (hash) {
+            *hash = '\0';
+            record = atoi(hash + 1);
+            if (record < 1) goto malformed;
+        }
+        if ((path_len = import_resolve(name, NULL, 0, path)) < 0 ||
+            (len = hex_to_bytes(hex, data, sizeof(data))) <= 0) {
+            goto malformed;
+        }
+        if ((record ? import_record(snap, path, path_len, record, data, len)
+                    : import_binary(snap, path, path_len, data, len)) < 0) {
+            goto malformed;
+        }
+        continue;
+
+malformed:
+        fprintf(stderr, "%s:%d: expected PATH[#RECORD]: HEX\n", source, line_no);
+        return -1;
+    }
+    return 0;
+}
+
+static const char *import_detect(const char *text) {
+    const char *p = text;
+
+    json_skip_space(&p);
+    if (*p == '{') return "json";
+    for (const char *line = text; line; line = strchr(line, '\n')) {
+        if (*line == '\n') line++;
+        if (strncmp(line, "select ", 7) == 0 || strncmp(line, "update_binary ", 14) == 0 ||
+            strncmp(line, "update_record ", 14) == 0) {
+            return "pysim-shell";
+        }
+        if (strncmp(line, "ICCID: ", 7) == 0 || strncmp(line, "IMSI: ", 6) == 0) return "pysim-read";
+    }
+    return "hex";
+}
+
+// Convert one dump ("-" for stdin) into snap; *format receives the format
+// that was recognised
+static int import_dump(const char *filename, snapshot_t *snap, const char **format) {
+    FILE *in = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    char *text = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    int rv;
+
+    memset(snap, 0, sizeof(*snap));
+    if (!in) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+    for (;;) {
+        if (size + 4096 + 1 > capacity) {
+            capacity = capacity ? 2 * capacity : 65536;
+            char *grown = realloc(text, capacity);
+            if (!grown) {
+                free(text);
+                if (in != stdin) fclose(in);
+                return -1;
+            }
+            text = grown;
+        }
+        size_t n = fread(text + size, 1, 4096, in);
+        size += n;
+        if (n < 4096) break;
+    }
+    if (in != stdin) fclose(in);
+    text[size] = '\0';
+
+    *format = import_detect(text);
+    if (strcmp(*format, "json") == 0) rv = import_json(snap, text, filename);
+    else if (strcmp(*format, "pysim-shell") == 0) rv = import_pysim_shell(snap, text, filename);
+    else if (strcmp(*format, "pysim-read") == 0) rv = import_pysim_read(snap, text);
+    else rv = import_hex_dump(snap, text, filename);
+    free(text);
+
+    if (rv == 0 && !snap->num_files) {
+        fprintf(stderr, "%s: no files found\n", filename);
+        rv = -1;
+    }
+    if (rv < 0) {
+        snapshot_free(snap);
+        return -1;
+    }
+    import_finish(snap);
+    return 0;
+}
+
+// Synthetic cards
+
+// generate derives any number of distinct, internally consistent cards from
+// a template snapshot for scale tests. Card n (counting from 0) gets the
+// template ICCID and IMSI with n added to their serial parts: the ICCID
+// with a new Luhn check digit, the IMSI keeping its MCC and the MNC length
+// of EF_AD. The MSISDN is renumbered the same way, EF_ADN and EF_SMS are
+// filled to the requested share of their records with random contacts and
+// SMS-DELIVER messages, EF_UST and EF_SST list the services whose files
+// exist, and EF_SMSS reports whether the SMS store is full. The contents of
+// card n depend only on the template and n.
+
+#define GENERATE_ICCID_SERIAL 10     // ICCID digits before the check digit that count cards
+#define GENERATE_MSISDN_SERIAL 8
+
+typedef struct {
+    snapshot_t *snap;            // the template, rewritten for each card
+    char iccid[24];
+    char imsi[16];
+    int mnc_length;
+    char msisdn[24];
+    char msisdn_alpha[64];
+    char number_prefix[24];      // of contact numbers: the MSISDN's, or 0
+    BYTE smsc[12];               // length, type of address and BCD digits
+    uint64_t seed;
+    int fill_phonebook;          // percentage of records in use
+    int fill_sms;
+} generate_ctx_t;
+
+static const char *generate_first_names[] = {
+    "Anna", "Ben", "Carla", "David", "Elena", "Felix", "Greta", "Hugo", "Ines", "Jonas",
+    "Katrin", "Lukas", "Maria", "Noah", "Olga", "Paul", "Rosa", "Simon", "Tara", "Viktor",
+};
+
+static const char *generate_last_names[] = {
+    "Meyer", "Schmidt", "Novak", "Rossi", "Garcia", "Dubois", "Jansen", "Kowalski", "Silva",
+    "Nielsen", "Horvat", "Berg", "Costa", "Weber", "Lindqvist", "Moreau",
+};
+
+static const char *generate_words[] = {
+    "ok", "see", "you", "at", "the", "station", "tomorrow", "running", "late", "call", "me",
+    "when", "home", "thanks", "for", "dinner", "meeting", "moved", "to", "three", "your",
+    "code", "is", "balance", "credit", "added", "bring", "keys", "please", "weekend",
+};
+
+#define GENERATE_COUNT(table) ((int)(sizeof(table) / sizeof(table[0])))
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static int generate_random(uint64_t *state, int n) {
+    return (int)(splitmix64(state) % (uint64_t)n);
+}
+
+// Add n to the decimal number formed by the last count digits of digits,
+// wrapping around within those digits
+static void add_to_serial(char *digits, int count, uint64_t n) {
+    int len = strlen(digits);
+
+    for (int i = len - 1; i >= 0 && i >= len - count && n; i--) {
+        uint64_t d = (digits[i] - '0') + n % 10;
+        n = n / 10 + d / 10;
+        digits[i] = '0' + d % 10;
+    }
+}
+
+// The template identities that cards are derived from
+static int generate_prepare(generate_ctx_t *ctx) {
+    snapshot_t *snap = ctx->snap;
+    BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+    snap_file_t *file = snapshot_find(snap, iccid_path, sizeof(iccid_path));
+
+    if (!file || decode_iccid(file->data, file->data_len, ctx->iccid) < 0 ||
+        strlen(ctx->iccid) < GENERATE_ICCID_SERIAL + 2) {
+        fprintf(stderr, "Template has no ICCID\n");
+        return -1;
+    }
+    if (!(file = snapshot_find_ef(snap, 0xFF, 0x07)) && !(file = snapshot_find_ef(snap, 0x20, 0x07))) {
+        fprintf(stderr, "Template has no IMSI\n");
+        return -1;
+    }
+    if (decode_imsi(file->data, file->data_len, ctx->imsi) < 0 || strlen(ctx->imsi) < 6) {
+        fprintf(stderr, "Template IMSI is invalid\n");
+        return -1;
+    }
+
+    // MNC length from EF_AD, or from the operator tables when EF_AD has none
+    ctx->mnc_length = 0;
+    if (((file = snapshot_find_ef(snap, 0xFF, 0xAD)) || (file = snapshot_find_ef(snap, 0x20, 0xAD))) &&
+        file->data_len >= 4 && ((file->data[3] & 0x0F) == 2 || (file->data[3] & 0x0F) == 3)) {
+        ctx->mnc_length = file->data[3] & 0x0F;
+    }
+    if (!ctx->mnc_length) ctx->mnc_length = lookup_operator(ctx->imsi, 3) ? 3 : 2;
+
+    ctx->msisdn[0] = ctx->msisdn_alpha[0] = '\0';
+    if (((file = snapshot_find_ef(snap, 0xFF, 0x40)) || (file = snapshot_find_ef(snap, 0x10, 0x40))) &&
+        file->record_len >= 14 && file->data_len >= file->record_len) {
+        decode_dialling_record(file->data, file->record_len, ctx->msisdn_alpha,
+                               sizeof(ctx->msisdn_alpha), ctx->msisdn, sizeof(ctx->msisdn));
+    }
+    int digits = strlen(ctx->msisdn) - (ctx->msisdn[0] == '+');
+    if (ctx->msisdn[0] == '+' && digits > GENERATE_MSISDN_SERIAL) {
+        snprintf(ctx->number_prefix, sizeof(ctx->number_prefix), "%.*s",
+                 (int)strlen(ctx->msisdn) - GENERATE_MSISDN_SERIAL, ctx->msisdn);
+    } else {
+        strcpy(ctx->number_prefix, "0");
+    }
+    if (digits <= GENERATE_MSISDN_SERIAL) ctx->msisdn[0] = '\0';
+
+    // SMSC of the first EF_SMSP record (present when indicator bit 2 is clear)
+    memset(ctx->smsc, 0xFF, sizeof(ctx->smsc));
+    ctx->smsc[0] = 0;
+    if (((file = snapshot_find_ef(snap, 0xFF, 0x42)) || (file = snapshot_find_ef(snap, 0x10, 0x42))) &&
+        file->record_len >= 28 && file->data_len >= file->record_len) {
+        const BYTE *p = file->data + file->record_len - 28;
+        if (!(p[0] & 0x02) && p[13] >= 2 && p[13] <= 11) memcpy(ctx->smsc, p + 13, p[13] + 1);
+    }
+
+    ctx->seed = fnv1a64((const BYTE *)ctx->iccid, strlen(ctx->iccid)) ^
+                fnv1a64((const BYTE *)ctx->imsi, strlen(ctx->imsi));
+    return 0;
+}
+
+// A dialling number: the prefix followed by random digits
+static void generate_number(const generate_ctx_t *ctx, uint64_t *rng, char *out) {
+    int len = strlen(ctx->number_prefix);
+    int count = ctx->number_prefix[0] == '+' ? GENERATE_MSISDN_SERIAL : 10;
+
+    memcpy(out, ctx->number_prefix, len);
+    for (int i = 0; i < count; i++) out[len++] = '0' + generate_random(rng, 10);
+    out[len] = '\0';
+}
+
+static void generate_identities(generate_ctx_t *ctx, uint64_t n) {
+    snapshot_t *snap = ctx->snap;
+    BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+    char digits[24];
+    snap_file_t *file;
+
+    // ICCID: serial before the check digit, then a new Luhn check digit
+    int len = strlen(ctx->iccid);
+    strcpy(digits, ctx->iccid);
+    digits[len - 1] = '\0';
+    add_to_serial(digits, GENERATE_ICCID_SERIAL, n);
+    for (char check = '0'; check <= '9'; check++) {
+        digits[len - 1] = check;
+        digits[len] = '\0';
+        if (luhn_valid(digits)) break;
+    }
+    if ((file = snapshot_find(snap, iccid_path, sizeof(iccid_path))) != NULL) {
+        encode_template_value("iccid", digits, file->data, file->data_len);
+    }
+
+    // IMSI: MSIN after the MCC and MNC, in both the USIM and DF_GSM
+    strcpy(digits, ctx->imsi);
+    add_to_serial(digits, strlen(digits) - 3 - ctx->mnc_length, n);
+    for (BYTE df = 0x20; df; df = df == 0x20 ? 0xFF : 0) {
+        if ((file = snapshot_find_ef(snap, df, 0x07)) != NULL && file->data_len >= 9) {
+            encode_template_value("imsi", digits, file->data, file->data_len);
+        }
+        if ((file = snapshot_find_ef(snap, df, 0xAD)) != NULL && file->data_len >= 4) {
+            file->data[3] = (file->data[3] & 0xF0) | ctx->mnc_length;
+        }
+    }
+
+    if (ctx->msisdn[0]) {
+        char value[96];
+        strcpy(digits, ctx->msisdn);
+        add_to_serial(digits, GENERATE_MSISDN_SERIAL, n);
+        snprintf(value, sizeof(value), "%s|%s", ctx->msisdn_alpha, digits);
+        for (BYTE df = 0x10; df; df = df == 0x10 ? 0xFF : 0) {
+            if ((file = snapshot_find_ef(snap, df, 0x40)) != NULL && file->record_len >= 14 &&
+                file->data_len >= file->record_len) {
+                encode_template_value("adn", value, file->data, file->record_len);
+            }
+        }
+    }
+}
+
+// Whether record r of count is in use when need of the remaining records
+// must be (selection sampling: exactly the requested number is chosen)
+static int generate_take(uint64_t *rng, int r, int count, int *need) {
+    if (*need <= 0 || generate_random(rng, count - r) >= *need) return 0;
+    (*need)--;
+    return 1;
+}
+
+static void generate_phonebook(const generate_ctx_t *ctx, snap_file_t *file, uint64_t *rng) {
+    int rlen = file->record_len;
+    int count = file->data_len / (rlen ? rlen : 1);
+    int need = (count * ctx->fill_phonebook + 50) / 100;
+
+    if (file->structure != EF_LINEAR_FIXED || rlen < 14) return;
+    for (int r = 0; r < count; r++) {
+        BYTE *rec = file->data + r * rlen;
+        char value[96];
+        char number[24];
+
+        if (!generate_take(rng, r, count, &need)) {
+            memset(rec, 0xFF, rlen);
+            continue;
+        }
+        generate_number(ctx, rng, number);
+        snprintf(value, sizeof(value), "%s %s|%s",
+                 generate_first_names[generate_random(rng, GENERATE_COUNT(generate_first_names))],
+                 generate_last_names[generate_random(rng, GENERATE_COUNT(generate_last_names))],
+                 number);
+        encode_template_value("adn", value, rec, rlen);
+    }
+}
+
+// Pack GSM default alphabet codes into septets; returns the octet count
+static int gsm7_pack(const BYTE *codes, int count, BYTE *out) {
+    int octets = (count * 7 + 7) / 8;
+
+    memset(out, 0, octets);
+    for (int i = 0; i < count; i++) {
+        int bit = i * 7;
+        out[bit / 8] |= codes[i] << (bit % 8);
+        if (bit % 8 > 1) out[bit / 8 + 1] |= codes[i] >> (8 - bit % 8);
+    }
+    return octets;
+}
+
+// An SMS-DELIVER record: status (read or unread), SMSC address, then the
+// TPDU with a 7-bit text of random words
+static void generate_sms_record(const generate_ctx_t *ctx, uint64_t *rng, BYTE *rec, int rlen) {
+    char text[161];
+    char number[24];
+    int len = 0;
+    int pos = 0;
+
+    memset(rec, 0xFF, rlen);
+    rec[pos++] = generate_random(rng, 2) ? 0x01 : 0x03;
+    if (ctx->smsc[0]) {
+        memcpy(rec + pos, ctx->smsc, ctx->smsc[0] + 1);
+        pos += ctx->smsc[0] + 1;
+    } else {
+        rec[pos++] = 0;
+    }
+
+    rec[pos++] = 0x04;           // SMS-DELIVER, no more messages to send
+    generate_number(ctx, rng, number);
+    int plus = number[0] == '+';
+    rec[pos++] = strlen(number) - plus;
+    rec[pos++] = plus ? 0x91 : 0x81;
+    pos += encode_bcd_swapped(number + plus, rec + pos, 10);
+    rec[pos++] = 0x00;           // PID
+    rec[pos++] = 0x00;           // DCS: GSM 7-bit default alphabet
+
+    // Time stamp in 2024/2025 as swapped BCD, time zone +00
+    int stamp[6] = {24 + generate_random(rng, 2), 1 + generate_random(rng, 12),
+                    1 + generate_random(rng, 28), generate_random(rng, 24),
+                    generate_random(rng, 60), generate_random(rng, 60)};
+    for (int i = 0; i < 6; i++) rec[pos++] = (stamp[i] % 10) << 4 | stamp[i] / 10;
+    rec[pos++] = 0x00;
+
+    // As many words as fit in the record (and 160 characters)
+    int room = (rlen - pos - 1) * 8 / 7;
+    int words = 3 + generate_random(rng, 20);
+    text[0] = '\0';
+    for (int w = 0; w < words; w++) {
+        const char *word = generate_words[generate_random(rng, GENERATE_COUNT(generate_words))];
+        int next = len + (len ? 1 : 0) + strlen(word);
+        if (next > room || next > 160) break;
+        len += snprintf(text + len, sizeof(text) - len, "%s%s", len ? " " : "", word);
+    }
+    // Lower case letters and the space have their ASCII codes in the GSM
+    // default alphabet
+    rec[pos++] = len;
+    gsm7_pack((const BYTE *)text, len, rec + pos);
+}
+
+// Fill EF_SMS; returns 1 when every record is in use
+static int generate_sms(const generate_ctx_t *ctx, snap_file_t *file, uint64_t *rng) {
+    int rlen = file->record_len;
+    int count = file->data_len / (rlen ? rlen : 1);
+    int need = (count * ctx->fill_sms + 50) / 100;
+    int full = count && need == count;
+
+    // Room for the status, a full SMSC address and the TPDU header
+    if (file->structure != EF_LINEAR_FIXED || rlen < 40) return 0;
+    for (int r = 0; r < count; r++) {
+        BYTE *rec = file->data + r * rlen;
+        if (generate_take(rng, r, count, &need)) {
+            generate_sms_record(ctx, rng, rec, rlen);
+        } else {
+            memset(rec, 0xFF, rlen);
+            rec[0] = 0x00;
+        }
+    }
+    return full;
+}
+
+// EF_UST services (one bit each) and DF_GSM EF_SST services (allocated and
+// activated bits) for files this generator knows; 0 where the table has no
+// service for the file
+static const struct {
+    int ust;
+    int sst;
+    BYTE fid;                    // 6Fxx
+} generate_services[] = {
+    {0, 2, 0x3A},                // ADN
+    {2, 3, 0x3B},                // FDN
+    {10, 4, 0x3C},               // SMS
+    {21, 9, 0x40},               // MSISDN
+    {0, 10, 0x4A},               // EXT1
+    {12, 12, 0x42},              // SMSP
+    {19, 17, 0x46},              // SPN
+    {4, 18, 0x49},               // SDN
+    {11, 0, 0x47},               // SMSR
+    {85, 0, 0xE3},               // EPSLOCI
+};
+
+// Set the services whose files exist in the USIM (EF_UST) or in DF_TELECOM
+// and DF_GSM (EF_SST), and clear those whose files do not
+static void generate_service_tables(snapshot_t *snap) {
+    snap_file_t *ust = snapshot_find_ef(snap, 0xFF, 0x38);
+    snap_file_t *sst = snapshot_find_ef(snap, 0x20, 0x38);
+
+    for (int i = 0; i < GENERATE_COUNT(generate_services); i++) {
+        BYTE fid = generate_services[i].fid;
+        int n = generate_services[i].ust - 1;
+        if (ust && n >= 0 && n / 8 < ust->data_len) {
+            BYTE bit = 1 << (n % 8);
+            if (snapshot_find_ef(snap, 0xFF, fid)) ust->data[n / 8] |= bit;
+            else ust->data[n / 8] &= ~bit;
+        }
+        n = generate_services[i].sst - 1;
+        if (sst && n >= 0 && n / 4 < sst->data_len) {
+            BYTE bits = 3 << (2 * (n % 4));
+            if (snapshot_find_ef(snap, 0x10, fid) || snapshot_find_ef(snap, 0x20, fid)) sst->data[n / 4] |= bits;
+            else sst->data[n / 4] &= ~bits;
+        }
+    }
+}
+
+// Rewrite the template as card n
+static void generate_card(generate_ctx_t *ctx, uint64_t n) {
+    snapshot_t *snap = ctx->snap;
+    uint64_t rng = ctx->seed ^ (n * 0xD1B54A32D192ED03ULL);
+    int sms_full = 0;
+    snap_file_t *file;
+
+    generate_identities(ctx, n);
+    for (BYTE df = 0x10; df; df = df == 0x10 ? 0xFF : 0) {
+        if ((file = snapshot_find_ef(snap, df, 0x3A)) != NULL) generate_phonebook(ctx, file, &rng);
+        if ((file = snapshot_find_ef(snap, df, 0x3C)) != NULL) sms_full |= generate_sms(ctx, file, &rng);
+    }
+    for (BYTE df = 0x10; df; df = df == 0x10 ? 0xFF : 0) {
+        // The status reports referred to the template's messages
+        if ((file = snapshot_find_ef(snap, df, 0x47)) != NULL && file->record_len > 0) {
+            memset(file->data, 0xFF, file->data_len);
+            for (int r = 0; r < file->data_len; r += file->record_len) file->data[r] = 0x00;
+        }
+        if ((file = snapshot_find_ef(snap, df, 0x43)) != NULL && file->data_len >= 2) {
+            file->data[0] = generate_random(&rng, 256);
+            file->data[1] = sms_full ? 0xFE : 0xFF;
+        }
+    }
+    generate_service_tables(snap);
+
+    for (int i = 0; i < snap->num_files; i++) {
+        snap->files[i].hash = fnv1a64(snap->files[i].data, snap->files[i].data_len);
+    }
+}
+
+// Phonebook
+
+// The global phonebook is EF_ADN (with EF_EXT1) under DF_TELECOM. The USIM
+// local phonebook is described by EF_PBR in DF_PHONEBOOK: each PBR record
+// lists the files of one segment, linked to EF_ADN record by record (type
+// 1, template A8), through the EF_IAP index (type 2, A9) or by record
+// pointers such as the extension byte (type 3, AA).
+//
+// Each file of a segment is read in one pass: EF_ADN, EF_IAP and type 1
+// files completely, type 2 and type 3 files only for the records that are
+// referenced. Contacts are then resolved from memory.
+#define PB_MAX_FILES 12
+#define PB_MAX_SEGMENTS 4
+#define PB_MAX_LINKED 3
+
+#define PBR_ADN 0xC0
+#define PBR_IAP 0xC1
+#define PBR_EXT1 0xC2
+#define PBR_SNE 0xC3
+#define PBR_ANR 0xC4
+#define PBR_EMAIL 0xCA
+
+typedef struct {
+    BYTE tag;
+    int type;
+    BYTE fid[2];
+    int sfi;
+    int iap_index;    // position of a type 2 file's entry in EF_IAP records
+    int record_len;
+    int num_records;
+    BYTE *data;       // records as read; unread records are FF
+    BYTE *wanted;     // records as they should be after an import
+    char *loaded;
+} pb_file_t;
+
+typedef struct {
+    BYTE df[MAX_PATH_LEN];
+    int df_len;
+    pb_file_t files[PB_MAX_FILES];
+    int num_files;
+    int adn;
+    int iap;
+    int ext;
+} pb_segment_t;
+
+typedef struct {
+    int record;       // EF_ADN record, counted across segments
+    int local;
+    char name[96];
+    char number[48];
+    char anr[PB_MAX_LINKED][48];
+    char email[PB_MAX_LINKED][128];
+    char nickname[96];
+} contact_t;
+
+typedef struct {
+    int local;
+    pb_segment_t segments[PB_MAX_SEGMENTS];
+    int num_segments;
+    contact_t *contacts;  // one per EF_ADN record, empty ones included
+    int num_contacts;
+} phonebook_t;
+
+static void phonebook_free(phonebook_t *pb) {
+    for (int s = 0; s < pb->num_segments; s++) {
+        for (int f = 0; f < pb->segments[s].num_files; f++) {
+            pb_file_t *file = &pb->segments[s].files[f];
+            free(file->data);
+            free(file->wanted);
+            free(file->loaded);
+        }
+    }
+    free(pb->contacts);
+    memset(pb, 0, sizeof(*pb));
+}
+
+// The contact field stored in a linked file: the n-th ANR file of a segment
+// holds anr[n], and so on. NULL for files that are not resolved.
+static char *contact_linked_field(contact_t *c, const pb_segment_t *seg, int index, int *size) {
+    int nth = 0;
+
+    for (int i = 0; i < index; i++) {
+        if (seg->files[i].tag == seg->files[index].tag) nth++;
+    }
+    switch (seg->files[index].tag) {
+        case PBR_ANR:
+            if (nth >= PB_MAX_LINKED) break;
+            *size = sizeof(c->anr[0]);
+            return c->anr[nth];
+        case PBR_EMAIL:
+            if (nth >= PB_MAX_LINKED) break;
+            *size = sizeof(c->email[0]);
+            return c->email[nth];
+        case PBR_SNE:
+            if (nth) break;
+            *size = sizeof(c->nickname);
+            return c->nickname;
+    }
+    return NULL;
+}
+
+static int pb_file_used(const pb_segment_t *seg, int index) {
+    contact_t probe;
+    int size;
+    BYTE tag = seg->files[index].tag;
+    return tag == PBR_ADN || tag == PBR_IAP || tag == PBR_EXT1 ||
+           contact_linked_field(&probe, seg, index, &size) != NULL;
+}
+
+static pb_file_t *pb_add_file(pb_segment_t *seg, BYTE tag, int type, const BYTE *fid, int sfi) {
+    if (seg->num_files >= PB_MAX_FILES) return NULL;
+
+    pb_file_t *file = &seg->files[seg->num_files];
+    memset(file, 0, sizeof(*file));
+    file->tag = tag;
+    file->type = type;
+    file->fid[0] = fid[0];
+    file->fid[1] = fid[1];
+    file->sfi = sfi;
+    file->iap_index = -1;
+    if (tag == PBR_ADN && seg->adn < 0) seg->adn = seg->num_files;
+    if (tag == PBR_IAP && seg->iap < 0) seg->iap = seg->num_files;
+    if (tag == PBR_EXT1 && seg->ext < 0) seg->ext = seg->num_files;
+    return &seg->files[seg->num_files++];
+}
+
+// One EF_PBR record: constructed templates A8/A9/AA of file tags C0..CB,
+// each with the file ID and optionally the SFI
+static int pb_parse_pbr(const BYTE *r, int len, pb_segment_t *seg) {
+    int iap_index = 0;
+
+    for (int i = 0; i + 2 <= len && r[i] != 0xFF; ) {
+        BYTE template = r[i];
+        int tlen = r[i + 1];
+        int end = i + 2 + tlen;
+        if (end > len) return -1;
+
+        for (int j = i + 2; j + 2 <= end; j += 2 + r[j + 1]) {
+            const BYTE *v = &r[j + 2];
+            int vlen = r[j + 1];
+            if (j + 2 + vlen > end) return -1;
+            int type = template == 0xA8 ? 1 : template == 0xA9 ? 2 : 3;
+            if (vlen >= 2) {
+                pb_file_t *file = pb_add_file(seg, r[j], type, v, vlen >= 3 ? v[2] : 0);
+                if (file && type == 2) file->iap_index = iap_index;
+            }
+            if (type == 2) iap_index++;
+        }
+        i = end;
+    }
+    return seg->adn >= 0 ? 0 : -1;
+}
+
+static int pb_select(const pb_segment_t *seg, const pb_file_t *file, snap_file_t *info, int verbose) {
+    BYTE path[MAX_PATH_LEN];
+
+    if (seg->df_len + 2 > MAX_PATH_LEN) return -1;
+    memcpy(path, seg->df, seg->df_len);
+    path[seg->df_len] = file->fid[0];
+    path[seg->df_len + 1] = file->fid[1];
+    memset(info, 0, sizeof(*info));
+    if (select_path(path, seg->df_len + 2, info->fcp, &info->fcp_len, verbose) < 0) {
+        return -1;
+    }
+    parse_fcp(info);
+    return 0;
+}
+
+// Select a file and read the records flagged in want (all when NULL)
+static int pb_read_file(const pb_segment_t *seg, pb_file_t *file, const char *want, int verbose) {
+    snap_file_t info;
+
+    if (pb_select(seg, file, &info, verbose) < 0 || info.structure == EF_TRANSPARENT ||
+        info.record_len <= 0 || info.num_records <= 0) {
+        return -1;
+    }
+    if (!file->data) {
+        file->record_len = info.record_len;
+        file->num_records = info.num_records;
+        file->data = malloc(file->num_records * file->record_len);
+        file->loaded = calloc(file->num_records, 1);
+        if (!file->data || !file->loaded) return -1;
+        memset(file->data, 0xFF, file->num_records * file->record_len);
+    }
+
+    for (int rec = 0; rec < file->num_records; rec++) {
+        if (file->loaded[rec] || (want && !want[rec])) continue;
+        BYTE *r = file->data + rec * file->record_len;
+        if (read_record(0, rec + 1, r, file->record_len) != file->record_len) return -1;
+        file->loaded[rec] = 1;
+    }
+    return 0;
+}
+
+static int pb_any(const char *want) {
+    for (int i = 0; i < 255; i++) {
+        if (want[i]) return 1;
+    }
+    return 0;
+}
+
+// Read the EXT1 records referenced from EF_ADN/EF_ANR and their chains
+static int pb_read_ext(pb_segment_t *seg, int verbose) {
+    pb_file_t *ext = &seg->files[seg->ext];
+
+    for (int pass = 0; pass < 4; pass++) {
+        char want[256] = {0};
+        for (int f = 0; f < seg->num_files; f++) {
+            const pb_file_t *file = &seg->files[f];
+            if (!file->data || (file->tag != PBR_ADN && file->tag != PBR_ANR && f != seg->ext)) {
+                continue;
+            }
+            int at = f == seg->ext ? 12 : file->tag == PBR_ADN ? file->record_len - 1 : 14;
+            if (at >= file->record_len) continue;
+            for (int rec = 0; rec < file->num_records; rec++) {
+                int target = file->data[rec * file->record_len + at];
+                if (file->loaded[rec] && target >= 1 && target <= 255 &&
+                    (!ext->loaded || (target <= ext->num_records && !ext->loaded[target - 1]))) {
+                    want[target - 1] = 1;
+                }
+            }
+        }
+        if (!pb_any(want)) break;
+        if (pb_read_file(seg, ext, want, verbose) < 0) return -1;
+    }
+    return 0;
+}
+
+static int pb_read_segment(pb_segment_t *seg, int verbose) {
+    pb_file_t *adn = &seg->files[seg->adn];
+
+    // EF_ADN, EF_IAP and type 1 files completely
+    for (int f = 0; f < seg->num_files; f++) {
+        pb_file_t *file = &seg->files[f];
+        if (file->type != 1 || !pb_file_used(seg, f)) continue;
+        if (pb_read_file(seg, file, NULL, verbose) < 0) {
+            if (f == seg->adn) return -1;
+            file->type = 0;  // unreadable linked file: ignored
+        }
+    }
+
+    // Type 2 files: only the records EF_IAP points at
+    for (int f = 0; f < seg->num_files; f++) {
+        pb_file_t *file = &seg->files[f];
+        char want[256] = {0};
+        if (file->type != 2 || !pb_file_used(seg, f)) continue;
+        if (seg->iap >= 0 && seg->files[seg->iap].data) {
+            const pb_file_t *iap = &seg->files[seg->iap];
+            for (int rec = 0; rec < iap->num_records && rec < adn->num_records; rec++) {
+                int target = iap->data[rec * iap->record_len + file->iap_index];
+                if (file->iap_index < iap->record_len && target >= 1 && target <= 255) {
+                    want[target - 1] = 1;
+                }
+            }
+        }
+        if (pb_any(want) && pb_read_file(seg, file, want, verbose) < 0) file->type = 0;
+    }
+
+    if (seg->ext >= 0 && pb_read_ext(seg, verbose) < 0) seg->ext = -1;
+    return 0;
+}
+
+// Dialling number (length, TON/NPI, 10 BCD bytes) continued in EXT1 records
+static void pb_decode_number(const pb_segment_t *seg, const BYTE *num, BYTE ext_record,
+                             char *number, int size) {
+    const pb_file_t *ext = seg->ext >= 0 ? &seg->files[seg->ext] : NULL;
+    int len = num[0];
+
+    number[0] = '\0';
+    if (len < 2 || len > 11) return;
+    int plus = (num[1] & 0x70) == 0x10;
+    if (plus) number[0] = '+';
+    decode_bcd_number(num + 2, len - 1, number + plus, size - plus);
+
+    for (int hops = 0; ext && hops < 4; hops++) {
+        if (ext_record < 1 || ext_record > ext->num_records || ext->record_len < 13 ||
+            !ext->loaded[ext_record - 1]) {
+            break;
+        }
+        const BYTE *r = ext->data + (ext_record - 1) * ext->record_len;
+        if (r[0] != 0x02) break;
+        int n = strlen(number);
+        decode_bcd_number(r + 2, r[1] > 10 ? 10 : r[1], number + n, size - n);
+        ext_record = r[12];
+    }
+}
+
+// Value of a linked record: numbers for EF_ANR, alpha text otherwise. Type
+// 2 records end with the ADN SFI and record number.
+static void pb_decode_linked(const pb_segment_t *seg, const pb_file_t *file, const BYTE *r,
+                             char *value, int size) {
+    int len = file->record_len - (file->type == 2 ? 2 : 0);
+
+    if (file->tag == PBR_ANR) {
+        value[0] = '\0';
+        if (len >= 15) pb_decode_number(seg, r + 1, r[14], value, size);
+    } else {
+        decode_alpha(r, len, value, size);
+    }
+}
+
+static void pb_decode_contact(const pb_segment_t *seg, int rec, contact_t *c) {
+    const pb_file_t *adn = &seg->files[seg->adn];
+    const BYTE *r = adn->data + rec * adn->record_len;
+    int rlen = adn->record_len;
+
+    if (rlen < 14) return;
+    decode_alpha(r, rlen - 14, c->name, sizeof(c->name));
+    pb_decode_number(seg, r + rlen - 14, r[rlen - 1], c->number, sizeof(c->number));
+    if (!c->name[0] && !c->number[0]) return;
+
+    for (int f = 0; f < seg->num_files; f++) {
+        const pb_file_t *file = &seg->files[f];
+        int size;
+        char *value = contact_linked_field(c, seg, f, &size);
+        int target = -1;
+
+        if (!value || !file->data) continue;
+        if (file->type == 1) {
+            target = rec;
+        } else if (file->type == 2 && seg->iap >= 0 && seg->files[seg->iap].data) {
+            const pb_file_t *iap = &seg->files[seg->iap];
+            if (rec < iap->num_records && file->iap_index < iap->record_len) {
+                target = iap->data[rec * iap->record_len + file->iap_index] - 1;
+            }
+        }
+        if (target >= 0 && target < file->num_records && file->loaded[target]) {
+            pb_decode_linked(seg, file, file->data + target * file->record_len, value, size);
+        }
+    }
+}
+
+static int phonebook_resolve(phonebook_t *pb) {
+    int total = 0;
+
+    for (int s = 0; s < pb->num_segments; s++) {
+        total += pb->segments[s].files[pb->segments[s].adn].num_records;
+    }
+    pb->contacts = calloc(total ? total : 1, sizeof(contact_t));
+    if (!pb->contacts) return -1;
+
+    for (int s = 0; s < pb->num_segments; s++) {
+        const pb_segment_t *seg = &pb->segments[s];
+        for (int rec = 0; rec < seg->files[seg->adn].num_records; rec++) {
+            contact_t *c = &pb->contacts[pb->num_contacts];
+            c->record = ++pb->num_contacts;
+            c->local = pb->local;
+            pb_decode_contact(seg, rec, c);
+        }
+    }
+    return 0;
+}
+
+static int contact_is_empty(const contact_t *c) {
+    return !c->name[0] && !c->number[0];
+}
+
+// The segments of the USIM local phonebook, from EF_PBR; no file is read
+static int pb_read_pbr(phonebook_t *pb, int verbose) {
+    static const BYTE phonebook[] = {0x3F, 0x00, 0x7F, 0xFF, 0x5F, 0x3A};
+    pb_segment_t pbr_seg = {.adn = -1, .iap = -1, .ext = -1};
+    BYTE pbr_fid[] = {0x4F, 0x30};
+    pb_file_t *pbr;
+
+    if (select_usim(verbose) < 0) return -1;
+    memcpy(pbr_seg.df, phonebook, sizeof(phonebook));
+    pbr_seg.df_len = sizeof(phonebook);
+    pbr = pb_add_file(&pbr_seg, 0, 1, pbr_fid, 0);
+    if (pb_read_file(&pbr_seg, pbr, NULL, verbose) < 0) {
+        free(pbr->data);
+        free(pbr->loaded);
+        return -1;
+    }
+    for (int rec = 0; rec < pbr->num_records && pb->num_segments < PB_MAX_SEGMENTS; rec++) {
+        pb_segment_t *seg = &pb->segments[pb->num_segments];
+        const BYTE *r = pbr->data + rec * pbr->record_len;
+        if (is_empty(r, pbr->record_len)) continue;
+        memset(seg, 0, sizeof(*seg));
+        seg->adn = seg->iap = seg->ext = -1;
+        memcpy(seg->df, phonebook, sizeof(phonebook));
+        seg->df_len = sizeof(phonebook);
+        if (pb_parse_pbr(r, pbr->record_len, seg) == 0) pb->num_segments++;
+    }
+    free(pbr->data);
+    free(pbr->loaded);
+    return 0;
+}
+
+// Read the USIM local phonebook (local set) or the DF_TELECOM one
+static int phonebook_read(phonebook_t *pb, int local, int verbose) {
+    static const BYTE telecom[] = {0x3F, 0x00, 0x7F, 0x10};
+
+    memset(pb, 0, sizeof(*pb));
+    pb->local = local;
+
+    if (local) {
+        if (pb_read_pbr(pb, verbose) < 0) return -1;
+    } else {
+        static const BYTE adn_fid[] = {0x6F, 0x3A};
+        static const BYTE ext_fid[] = {0x6F, 0x4A};
+        pb_segment_t *seg = &pb->segments[0];
+        seg->adn = seg->iap = seg->ext = -1;
+        memcpy(seg->df, telecom, sizeof(telecom));
+        seg->df_len = sizeof(telecom);
+        pb_add_file(seg, PBR_ADN, 1, adn_fid, 0);
+        pb_add_file(seg, PBR_EXT1, 3, ext_fid, 0);
+        pb->num_segments = 1;
+    }
+
+    for (int s = 0; s < pb->num_segments; s++) {
+        if (pb_read_segment(&pb->segments[s], verbose) < 0) {
+            phonebook_free(pb);
+            return -1;
+        }
+    }
+    if (phonebook_resolve(pb) < 0) {
+        phonebook_free(pb);
+        return -1;
+    }
+    return 0;
+}
+
+// Used and total records of the EF_ADN files EF_PBR lists, for -a: only
+// those files are read, not the linked ones. -1 without a local phonebook.
+static int phonebook_count_local(int *total, int verbose) {
+    phonebook_t pb;
+    int used = 0;
+
+    memset(&pb, 0, sizeof(pb));
+    pb.local = 1;
+    *total = 0;
+    if (pb_read_pbr(&pb, verbose) < 0 || pb.num_segments == 0) {
+        phonebook_free(&pb);
+        return -1;
+    }
+    for (int s = 0; s < pb.num_segments; s++) {
+        pb_segment_t *seg = &pb.segments[s];
+        pb_file_t *adn = &seg->files[seg->adn];
+        if (pb_read_file(seg, adn, NULL, verbose) < 0) continue;
+        *total += adn->num_records;
+        for (int rec = 0; rec < adn->num_records; rec++) {
+            if (!is_empty(adn->data + rec * adn->record_len, adn->record_len)) used++;
+        }
+    }
+    phonebook_free(&pb);
+    return used;
+}
+
+// JSON string with the characters that need escaping escaped
+static void fprint_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if (*s == '\n') fprintf(out, "\\n");
+        else if ((BYTE)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void print_json_string(const char *s) {
+    fprint_json_string(stdout, s);
+}
+
+static void print_vcard_value(const char *s) {
+    for (; *s; s++) {
+        if (*s == ',' || *s == ';' || *s == '\\') printf("\\%c", *s);
+        else if (*s == '\n') printf("\\n");
+        else putchar(*s);
+    }
+}
+
+static void phonebook_print_vcard(const phonebook_t *pb) {
+    for (int i = 0; i < pb->num_contacts; i++) {
+        const contact_t *c = &pb->contacts[i];
+        const char *name = c->name[0] ? c->name : c->number;
+        if (contact_is_empty(c)) continue;
+
+        printf("BEGIN:VCARD\r\nVERSION:3.0\r\nFN:");
+        print_vcard_value(name);
+        printf("\r\nN:");
+        print_vcard_value(name);
+        printf(";;;;\r\n");
+        if (c->number[0]) printf("TEL;TYPE=CELL:%s\r\n", c->number);
+        for (int k = 0; k < PB_MAX_LINKED; k++) {
+            if (c->anr[k][0]) printf("TEL;TYPE=VOICE:%s\r\n", c->anr[k]);
+        }
+        for (int k = 0; k < PB_MAX_LINKED; k++) {
+            if (!c->email[k][0]) continue;
+            printf("EMAIL;TYPE=INTERNET:");
+            print_vcard_value(c->email[k]);
+            printf("\r\n");
+        }
+        if (c->nickname[0]) {
+            printf("NICKNAME:");
+            print_vcard_value(c->nickname);
+            printf("\r\n");
+        }
+        printf("X-SIM-RECORD:%s/%d\r\nEND:VCARD\r\n", c->local ? "local" : "global", c->record);
+    }
+}
+
+static void phonebook_print_ndjson(const phonebook_t *pb) {
+    for (int i = 0; i < pb->num_contacts; i++) {
+        const contact_t *c = &pb->contacts[i];
+        if (contact_is_empty(c)) continue;
+
+        printf("{\"phonebook\": \"%s\", \"record\": %d, \"name\": ",
+               c->local ? "local" : "global", c->record);
+        print_json_string(c->name);
+        printf(", \"number\": ");
+        print_json_string(c->number);
+        printf(", \"anr\": [");
+        for (int k = 0, n = 0; k < PB_MAX_LINKED; k++) {
+            if (!c->anr[k][0]) continue;
+            printf("%s", n++ ? ", " : "");
+            print_json_string(c->anr[k]);
+        }
+        printf("], \"email\": [");
+        for (int k = 0, n = 0; k < PB_MAX_LINKED; k++) {
+            if (!c->email[k][0]) continue;
+            printf("%s", n++ ? ", " : "");
+            print_json_string(c->email[k]);
+        }
+        printf("], \"nickname\": ");
+        print_json_string(c->nickname);
+        printf("}\n");
+    }
+}
+
+// Keep the characters a dialling number can hold
+static void clean_number(const char *in, char *out, int size) {
+    int pos = 0;
+    for (; *in && pos < size - 1; in++) {
+        if ((*in == '+' && pos == 0) || strchr("0123456789*#", *in)) out[pos++] = *in;
+    }
+    out[pos] = '\0';
+}
+
+static void unescape_vcard_value(char *s) {
+    char *out = s;
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) {
+            s++;
+            *out++ = (*s == 'n' || *s == 'N') ? '\n' : *s;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+// Load the contacts of a vCard file (FN/N, TEL, EMAIL, NICKNAME and the
+// X-SIM-RECORD written by the export)
+static int vcard_load(const char *filename, contact_t **contacts, int *count) {
+    FILE *in = fopen(filename, "r");
+    char line[1024];
+    char next[1024];
+    int have_next = 0;
+    int capacity = 64;
+    contact_t *c = NULL;
+
+    *count = 0;
+    *contacts = malloc(capacity * sizeof(contact_t));
+    if (!in || !*contacts) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        if (in) fclose(in);
+        free(*contacts);
+        *contacts = NULL;
+        return -1;
+    }
+
+    while (have_next || fgets(next, sizeof(next), in)) {
+        // Unfold continuation lines (starting with a space or tab)
+        snprintf(line, sizeof(line), "%s", next);
+        line[strcspn(line, "\r\n")] = '\0';
+        have_next = 0;
+        while (fgets(next, sizeof(next), in)) {
+            if (next[0] != ' ' && next[0] != '\t') {
+                have_next = 1;
+                break;
+            }
+            next[strcspn(next, "\r\n")] = '\0';
+            strncat(line, next + 1, sizeof(line) - strlen(line) - 1);
+        }
+
+        char *value = strchr(line, ':');
+        if (!value) continue;
+        *value++ = '\0';
+        char *params = strchr(line, ';');
+        if (params) *params = '\0';
+        char *group = strchr(line, '.');
+        char *name = group ? group + 1 : line;
+        for (char *p = name; *p; p++) {
+            if (*p >= 'a' && *p <= 'z') *p -= 'a' - 'A';
+        }
+
+        if (strcmp(name, "BEGIN") == 0) {
+            if (*count == capacity) {
+                contact_t *grown = realloc(*contacts, 2 * capacity * sizeof(contact_t));
+                if (!grown) break;
+                *contacts = grown;
+                capacity *= 2;
+            }
+            c = &(*contacts)[*count];
+            memset(c, 0, sizeof(*c));
+            continue;
+        }
+        if (!c) continue;
+        if (strcmp(name, "END") == 0) {
+            if (!contact_is_empty(c)) (*count)++;
+            c = NULL;
+            continue;
+        }
+
+        if (strcmp(name, "X-SIM-RECORD") == 0) {
+            c->local = strncmp(value, "local/", 6) == 0;
+            c->record = atoi(strchr(value, '/') ? strchr(value, '/') + 1 : value);
+            continue;
+        }
+        unescape_vcard_value(value);
+        if (strcmp(name, "FN") == 0) {
+            snprintf(c->name, sizeof(c->name), "%s", value);
+        } else if (strcmp(name, "N") == 0 && !c->name[0]) {
+            // Family;Given;... -> "Given Family"
+            char *given = strchr(value, ';');
+            if (given) {
+                *given++ = '\0';
+                given[strcspn(given, ";")] = '\0';
+            }
+            snprintf(c->name, sizeof(c->name), "%s%s%s", given ? given : "",
+                     given && *given && *value ? " " : "", value);
+        } else if (strcmp(name, "TEL") == 0) {
+            if (!c->number[0]) {
+                clean_number(value, c->number, sizeof(c->number));
+            } else {
+                for (int k = 0; k < PB_MAX_LINKED; k++) {
+                    if (c->anr[k][0]) continue;
+                    clean_number(value, c->anr[k], sizeof(c->anr[k]));
+                    break;
+                }
+            }
+        } else if (strcmp(name, "EMAIL") == 0) {
+            for (int k = 0; k < PB_MAX_LINKED; k++) {
+                if (c->email[k][0]) continue;
+                snprintf(c->email[k], sizeof(c->email[k]), "%s", value);
+                break;
+            }
+        } else if (strcmp(name, "NICKNAME") == 0) {
+            snprintf(c->nickname, sizeof(c->nickname), "%s", value);
+        }
+    }
+
+    fclose(in);
+    return 0;
+}
+
+static int contact_equal(const contact_t *a, const contact_t *b) {
+    if (strcmp(a->name, b->name) || strcmp(a->number, b->number) ||
+        strcmp(a->nickname, b->nickname)) {
+        return 0;
+    }
+    for (int k = 0; k < PB_MAX_LINKED; k++) {
+        if (strcmp(a->anr[k], b->anr[k]) || strcmp(a->email[k], b->email[k])) return 0;
+    }
+    return 1;
+}
+
+static int pb_ensure_sized(pb_segment_t *seg, pb_file_t *file, int verbose) {
+    char none[256] = {0};
+    return file->data ? 0 : pb_read_file(seg, file, none, verbose);
+}
+
+// The contact as segment seg would store it: text cut to the record sizes,
+// numbers to 20 digits (40 with EXT1) and fields without a file dropped
+static void pb_normalize(const pb_segment_t *seg, const contact_t *in, contact_t *out) {
+    const pb_file_t *adn = &seg->files[seg->adn];
+    BYTE buf[256];
+    int plus = in->number[0] == '+';
+    int max_digits = seg->ext >= 0 ? 40 : 20;
+
+    memset(out, 0, sizeof(*out));
+    out->record = in->record;
+    out->local = in->local;
+    encode_alpha(in->name, buf, adn->record_len - 14);
+    decode_alpha(buf, adn->record_len - 14, out->name, sizeof(out->name));
+    snprintf(out->number, sizeof(out->number), "%.*s", plus + max_digits, in->number);
+    if (!out->number[plus]) out->number[0] = '\0';
+
+    for (int f = 0; f < seg->num_files; f++) {
+        const pb_file_t *file = &seg->files[f];
+        int size;
+        char *dst = contact_linked_field(out, seg, f, &size);
+        const char *src = contact_linked_field((contact_t *)in, seg, f, &size);
+        if (!dst || (file->type != 1 && file->type != 2) || file->record_len < 3) continue;
+
+        if (file->tag == PBR_ANR) {
+            int anr_plus = src[0] == '+';
+            snprintf(dst, size, "%.*s", anr_plus + 20, src);
+            if (!dst[anr_plus]) dst[0] = '\0';
+        } else {
+            int len = file->record_len - (file->type == 2 ? 2 : 0);
+            encode_alpha(src, buf, len);
+            decode_alpha(buf, len, dst, size);
+        }
+    }
+}
+
+static BYTE *pb_wanted(pb_file_t *file) {
+    if (!file->wanted && file->data) {
+        file->wanted = malloc(file->num_records * file->record_len);
+        if (file->wanted) memcpy(file->wanted, file->data, file->num_records * file->record_len);
+    }
+    return file->wanted;
+}
+
+// Clear an EXT1 chain that is being replaced
+static void pb_release_ext(pb_segment_t *seg, int record) {
+    if (seg->ext < 0) return;
+    pb_file_t *ext = &seg->files[seg->ext];
+    BYTE *wanted = pb_wanted(ext);
+
+    for (int hops = 0; wanted && hops < 4; hops++) {
+        if (record < 1 || record > ext->num_records || !ext->loaded[record - 1] ||
+            ext->record_len < 13) {
+            break;
+        }
+        BYTE *x = wanted + (record - 1) * ext->record_len;
+        record = x[12];
+        memset(x, 0xFF, ext->record_len);
+    }
+}
+
+// A record of a type 2 file (or EXT1) that nothing points at
+static int pb_alloc_record(pb_segment_t *seg, int index) {
+    pb_file_t *file = &seg->files[index];
+    char used[256] = {0};
+
+    for (int f = 0; f < seg->num_files; f++) {
+        pb_file_t *from = &seg->files[f];
+        BYTE *w = pb_wanted(from);
+        if (!w) continue;
+        for (int rec = 0; rec < from->num_records; rec++) {
+            const BYTE *r = w + rec * from->record_len;
+            int target = 0;
+            if (file->type == 2 && f == seg->iap && file->iap_index < from->record_len) {
+                target = r[file->iap_index];
+            } else if (index == seg->ext && from->loaded[rec]) {
+                if (from->tag == PBR_ADN) target = r[from->record_len - 1];
+                else if (from->tag == PBR_ANR && from->record_len >= 15) target = r[14];
+                else if (f == seg->ext && r[0] != 0xFF) target = r[12];
+            }
+            if (target >= 1 && target <= 255) used[target - 1] = 1;
+        }
+    }
+    for (int rec = 0; rec < file->num_records; rec++) {
+        if (!used[rec]) return rec;
+    }
+    return -1;
+}
+
+// Length, TON/NPI and up to 20 BCD digits at num; the rest of a longer
+// number goes to an EXT1 record whose number is stored in *ext_byte
+static int pb_encode_number(pb_segment_t *seg, const char *number, BYTE *num, BYTE *ext_byte,
+                            int verbose) {
+    int plus = number[0] == '+';
+    const char *digits = number + plus;
+    char head[21];
+
+    if (!*digits) return 0;
+    snprintf(head, sizeof(head), "%.20s", digits);
+    num[0] = encode_bcd_swapped(head, num + 2, 10) + 1;
+    num[1] = plus ? 0x91 : 0x81;
+    if (strlen(digits) <= 20) return 0;
+
+    if (seg->ext < 0 || pb_ensure_sized(seg, &seg->files[seg->ext], verbose) < 0) return -1;
+    pb_file_t *ext = &seg->files[seg->ext];
+    int rec = pb_alloc_record(seg, seg->ext);
+    if (rec < 0 || ext->record_len < 13 || !pb_wanted(ext)) return -1;
+    BYTE *x = ext->wanted + rec * ext->record_len;
+    memset(x, 0xFF, ext->record_len);
+    x[0] = 0x02;  // additional data
+    x[1] = encode_bcd_swapped(digits + 20, x + 2, 10);
+    *ext_byte = rec + 1;
+    return 0;
+}
+
+static int pb_encode_linked(pb_segment_t *seg, const pb_file_t *file, BYTE *r, const char *value,
+                            int verbose) {
+    int len = file->record_len - (file->type == 2 ? 2 : 0);
+
+    if (file->tag == PBR_ANR) {
+        if (len < 15) return -1;
+        r[0] = 0x00;
+        return pb_encode_number(seg, value, r + 1, &r[14], verbose);
+    }
+    encode_alpha(value, r, len);
+    return 0;
+}
+
+// Rewrite EF_ADN record rec of a segment and its linked records from old
+// to c. Records whose value stays the same are left alone.
+static int pb_encode_slot(pb_segment_t *seg, int rec, const contact_t *old, const contact_t *c,
+                          int verbose) {
+    pb_file_t *adn = &seg->files[seg->adn];
+    int rlen = adn->record_len;
+    BYTE *r = pb_wanted(adn);
+
+    if (!r) return -1;
+    r += rec * rlen;
+    if (strcmp(old->name, c->name) || strcmp(old->number, c->number)) {
+        pb_release_ext(seg, r[rlen - 1]);
+        memset(r, 0xFF, rlen);
+        encode_alpha(c->name, r, rlen - 14);
+        if (pb_encode_number(seg, c->number, r + rlen - 14, &r[rlen - 1], verbose) < 0) {
+            return -1;
+        }
+    }
+
+    for (int f = 0; f < seg->num_files; f++) {
+        pb_file_t *file = &seg->files[f];
+        int size;
+        const char *value = contact_linked_field((contact_t *)c, seg, f, &size);
+        const char *old_value = contact_linked_field((contact_t *)old, seg, f, &size);
+        BYTE *lr;
+
+        if (!value || (file->type != 1 && file->type != 2) || strcmp(value, old_value) == 0) {
+            continue;
+        }
+        if (pb_ensure_sized(seg, file, verbose) < 0 || !pb_wanted(file)) continue;
+
+        if (file->type == 1) {
+            if (rec >= file->num_records) continue;
+            lr = file->wanted + rec * file->record_len;
+            if (file->tag == PBR_ANR && file->record_len >= 15) pb_release_ext(seg, lr[14]);
+            memset(lr, 0xFF, file->record_len);
+            if (value[0] && pb_encode_linked(seg, file, lr, value, verbose) < 0) return -1;
+            continue;
+        }
+
+        // Type 2: reuse the linked record if there is one, else allocate
+        pb_file_t *iap = seg->iap >= 0 ? &seg->files[seg->iap] : NULL;
+        if (!iap || !pb_wanted(iap) || rec >= iap->num_records ||
+            file->iap_index >= iap->record_len) {
+            continue;
+        }
+        BYTE *link = iap->wanted + rec * iap->record_len + file->iap_index;
+        int target = *link >= 1 && *link <= file->num_records ? *link - 1 : -1;
+        if (target >= 0) {
+            lr = file->wanted + target * file->record_len;
+            if (file->tag == PBR_ANR && file->record_len >= 15 && file->loaded[target]) {
+                pb_release_ext(seg, lr[14]);
+            }
+            memset(lr, 0xFF, file->record_len);
+        }
+        *link = 0xFF;
+        if (!value[0]) continue;
+        if (target < 0 && (target = pb_alloc_record(seg, f)) < 0) {
+            fprintf(stderr, "No free record for contact %s\n", c->name);
+            return -1;
+        }
+        lr = file->wanted + target * file->record_len;
+        if (pb_encode_linked(seg, file, lr, value, verbose) < 0) return -1;
+        lr[file->record_len - 2] = adn->sfi ? adn->sfi : 0xFF;
+        lr[file->record_len - 1] = rec + 1;
+        *link = target + 1;
+    }
+    return 0;
+}
+
+static pb_segment_t *pb_slot_segment(phonebook_t *pb, int slot, int *rec) {
+    for (int s = 0; s < pb->num_segments; s++) {
+        int n = pb->segments[s].files[pb->segments[s].adn].num_records;
+        if (slot < n) {
+            *rec = slot;
+            return &pb->segments[s];
+        }
+        slot -= n;
+    }
+    return NULL;
+}
+
+// Make the phonebook hold exactly the given contacts. Contacts keep the
+// record named by X-SIM-RECORD or one where they are already stored; new
+// ones take free records. Empty contacts are skipped. Only records that change are written. Returns
+// the number of records written, or -1 on error.
+static int phonebook_import(phonebook_t *pb, const contact_t *contacts, int count,
+                            int dry_run, int *changed, int verbose) {
+    int *slot_of = malloc(pb->num_contacts * sizeof(int) + 1);
+    char *placed = calloc(count + 1, 1);
+    int writes = 0;
+    int rv = -1;
+
+    *changed = 0;
+    if (!slot_of || !placed) goto out;
+    for (int k = 0; k < pb->num_contacts; k++) slot_of[k] = -1;
+
+    for (int i = 0; i < count; i++) placed[i] = contact_is_empty(&contacts[i]);
+    for (int i = 0; i < count; i++) {
+        int k = contacts[i].record - 1;
+        if (!placed[i] && contacts[i].local == pb->local && k >= 0 && k < pb->num_contacts &&
+            slot_of[k] < 0) {
+            slot_of[k] = i;
+            placed[i] = 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < pb->num_contacts && !placed[i]; k++) {
+            contact_t stored;
+            int rec = 0;
+            if (placed[i] || slot_of[k] >= 0 || contact_is_empty(&pb->contacts[k])) continue;
+            pb_normalize(pb_slot_segment(pb, k, &rec), &contacts[i], &stored);
+            if (contact_equal(&stored, &pb->contacts[k])) {
+                slot_of[k] = i;
+                placed[i] = 1;
+            }
+        }
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0, k = 0; i < count; i++) {
+            if (placed[i]) continue;
+            while (k < pb->num_contacts &&
+                   (slot_of[k] >= 0 || (pass == 0 && !contact_is_empty(&pb->contacts[k])))) {
+                k++;
+            }
+            if (k == pb->num_contacts) break;
+            slot_of[k] = i;
+            placed[i] = 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (!placed[i]) {
+            fprintf(stderr, "Phonebook full: %d contacts, %d records\n", count, pb->num_contacts);
+            goto out;
+        }
+    }
+
+    for (int k = 0; k < pb->num_contacts; k++) {
+        contact_t wanted = {0};
+        int rec = 0;
+        pb_segment_t *seg = pb_slot_segment(pb, k, &rec);
+        if (slot_of[k] >= 0) pb_normalize(seg, &contacts[slot_of[k]], &wanted);
+        if (contact_equal(&wanted, &pb->contacts[k])) continue;
+        if (pb_encode_slot(seg, rec, &pb->contacts[k], &wanted, verbose) < 0) goto out;
+        (*changed)++;
+    }
+
+    // Write the records whose wanted contents differ, one SELECT per file
+    for (int s = 0; s < pb->num_segments; s++) {
+        pb_segment_t *seg = &pb->segments[s];
+        for (int f = 0; f < seg->num_files; f++) {
+            pb_file_t *file = &seg->files[f];
+            snap_file_t info;
+            int selected = 0;
+            if (!file->wanted) continue;
+
+            for (int rec = 0; rec < file->num_records; rec++) {
+                const BYTE *w = file->wanted + rec * file->record_len;
+                if (memcmp(w, file->data + rec * file->record_len, file->record_len) == 0) {
+                    continue;
+                }
+                writes++;
+                if (dry_run) {
+                    printf("  would update ");
+                    for (int i = 0; i < seg->df_len; i++) printf("%02X", seg->df[i]);
+                    printf("%02X%02X#%d\n", file->fid[0], file->fid[1], rec + 1);
+                    continue;
+                }
+                if (!selected && pb_select(seg, file, &info, verbose) < 0) goto out;
+                selected = 1;
+                if (update_record(rec + 1, w, file->record_len) < 0) {
+                    fprintf(stderr, "UPDATE RECORD %02X%02X#%d failed\n",
+                            file->fid[0], file->fid[1], rec + 1);
+                    goto out;
+                }
+            }
+        }
+    }
+    rv = writes;
+
+out:
+    free(slot_of);
+    free(placed);
+    return rv;
+}
+
+typedef struct {
+    const contact_t *contacts;  // import when not NULL
+    int num_contacts;
+    BYTE adm[8];
+    int have_adm;
+    int dry_run;
+} phonebook_ctx_t;
+
+static int phonebook_card(const config_t *config, const char *reader, void *arg) {
+    phonebook_ctx_t *ctx = arg;
+    phonebook_t pb;
+    int found = 0;
+
+    if (!ctx->contacts) {
+        for (int local = 1; local >= 0; local--) {
+            if (phonebook_read(&pb, local, config->verbose) < 0) continue;
+            if (config->json_output) phonebook_print_ndjson(&pb);
+            else phonebook_print_vcard(&pb);
+            phonebook_free(&pb);
+            found = 1;
+        }
+        if (!found) fprintf(stderr, "%s: no phonebook found\n", reader);
+        return found ? 0 : 1;
+    }
+
+    // Contacts exported from the global phonebook go back to it; all
+    // others go to the USIM phonebook, or the global one without it
+    phonebook_t books[2];
+    int have[2];
+    int changed = 0;
+    int writes = 0;
+    int rv = 0;
+
+    have[1] = phonebook_read(&books[1], 1, config->verbose) == 0;
+    have[0] = phonebook_read(&books[0], 0, config->verbose) == 0;
+    if (!have[0] && !have[1]) {
+        fprintf(stderr, "%s: no phonebook found\n", reader);
+        return 1;
+    }
+    if (ctx->have_adm && !ctx->dry_run && verify_adm(ctx->adm, config->verbose) < 0) {
+        rv = 1;
+    }
+
+    for (int local = 1; local >= 0 && rv == 0; local--) {
+        contact_t *subset;
+        int count = 0;
+        int book_changed;
+        int book_writes;
+
+        if (!have[local]) continue;
+        subset = malloc((ctx->num_contacts + 1) * sizeof(contact_t));
+        if (!subset) {
+            rv = 1;
+            break;
+        }
+        for (int i = 0; i < ctx->num_contacts; i++) {
+            const contact_t *c = &ctx->contacts[i];
+            int target = have[1] && (!have[0] || c->local || !c->record);
+            if (target != local) continue;
+            subset[count] = *c;
+            subset[count++].local = local;
+        }
+        book_writes = phonebook_import(&books[local], subset, count, ctx->dry_run,
+                                       &book_changed, config->verbose);
+        free(subset);
+        if (book_writes < 0) {
+            rv = 1;
+            break;
+        }
+        changed += book_changed;
+        writes += book_writes;
+    }
+
+    if (rv == 0) {
+        printf("%s: %d contact(s) %s, %d record(s) %s\n", reader, changed,
+               ctx->dry_run ? "to change" : "changed", writes,
+               ctx->dry_run ? "to write" : "written");
+    }
+    for (int local = 0; local < 2; local++) {
+        if (have[local]) phonebook_free(&books[local]);
+    }
+    return rv;
+}
+
+// SMS store
+
+// EF_SMS records hold a status byte followed by the SMSC address and the
+// TPDU (TS 31.102 4.2.25, TS 23.040 9.2). Messages are decoded and printed
+// one record at a time.
+#define SMS_MAX_TEXT 1024
+
+typedef struct {
+    const BYTE *data;
+    int len;
+    int pos;
+    int error;
+} tpdu_reader_t;
+
+static const BYTE *tp_take(tpdu_reader_t *r, int n) {
+    if (r->error || n < 0 || r->pos + n > r->len) {
+        r->error = 1;
+        return NULL;
+    }
+    r->pos += n;
+    return r->data + r->pos - n;
+}
+
+static int tp_byte(tpdu_reader_t *r) {
+    const BYTE *b = tp_take(r, 1);
+    return b ? *b : 0;
+}
+
+// Unpack GSM 7-bit septets (starting skip septets in) to UTF-8
+static void gsm7_unpack(const BYTE *data, int data_len, int skip, int septets,
+                        char *output, int max_len) {
+    int pos = 0;
+    int escape = 0;
+
+    for (int i = skip; i < septets; i++) {
+        int bit = i * 7;
+        if (bit / 8 >= data_len) break;
+        int value = data[bit / 8] >> (bit % 8);
+        if (bit % 8 > 1 && bit / 8 + 1 < data_len) value |= data[bit / 8 + 1] << (8 - bit % 8);
+        value &= 0x7F;
+
+        if (escape) {
+            pos = utf8_put(output, pos, max_len, gsm7_extension_char(value));
+            escape = 0;
+        } else if (value == 0x1B) {
+            escape = 1;
+        } else {
+            pos = utf8_put(output, pos, max_len, gsm7_default[value]);
+        }
+    }
+    output[pos] = '\0';
+}
+
+// TP address: digit count, type of address, then BCD digits or packed
+// alphanumeric text
+static void sms_decode_address(tpdu_reader_t *r, char *output, int max_len) {
+    int digits = tp_byte(r);
+    int toa = tp_byte(r);
+    const BYTE *value = tp_take(r, (digits + 1) / 2);
+
+    output[0] = '\0';
+    if (!value || digits > 40) return;
+    if (((toa >> 4) & 0x07) == 0x05) {
+        gsm7_unpack(value, (digits + 1) / 2, 0, digits * 4 / 7, output, max_len);
+        return;
+    }
+    int plus = ((toa >> 4) & 0x07) == 0x01;
+    if (plus) output[0] = '+';
+    decode_bcd_number(value, (digits + 1) / 2, output + plus, max_len - plus);
+}
+
+// Service centre time stamp: swapped BCD YYMMDDhhmmss and the time zone in
+// quarter hours (bit 3 of the last octet is the sign)
+static void sms_decode_timestamp(const BYTE *ts, char *output) {
+    int digits[6];
+
+    for (int i = 0; i < 6; i++) {
+        digits[i] = (ts[i] & 0x0F) * 10 + (ts[i] >> 4);
+    }
+    int quarters = (ts[6] & 0x07) * 10 + (ts[6] >> 4);
+    sprintf(output, "20%02d-%02d-%02dT%02d:%02d:%02d%c%02d:%02d",
+            digits[0] % 100, digits[1] % 100, digits[2] % 100, digits[3] % 100,
+            digits[4] % 100, digits[5] % 100, ts[6] & 0x08 ? '-' : '+',
+            quarters / 4, (quarters % 4) * 15);
+}
+
+// Relative validity period (TS 23.040 9.2.3.12.1) in minutes
+static int sms_validity_minutes(int vp) {
+    if (vp <= 143) return (vp + 1) * 5;
+    if (vp <= 167) return 12 * 60 + (vp - 143) * 30;
+    if (vp <= 196) return (vp - 166) * 24 * 60;
+    return (vp - 192) * 7 * 24 * 60;
+}
+
+enum { SMS_GSM7, SMS_8BIT, SMS_UCS2 };
+static const char *sms_alphabet_names[] = {"gsm7", "8bit", "ucs2"};
+
+// Alphabet of a data coding scheme (TS 23.038 4); compressed text and
+// reserved codings are reported as 8-bit data
+static int sms_alphabet(int dcs) {
+    switch (dcs & 0xF0) {
+        case 0x00: case 0x10: case 0x20: case 0x30:
+        case 0x40: case 0x50: case 0x60: case 0x70:
+            if (dcs & 0x20) return SMS_8BIT;
+            return ((dcs >> 2) & 0x03) == 0x01 ? SMS_8BIT :
+                   ((dcs >> 2) & 0x03) == 0x02 ? SMS_UCS2 : SMS_GSM7;
+        case 0xC0: case 0xD0:
+            return SMS_GSM7;
+        case 0xE0:
+            return SMS_UCS2;
+        case 0xF0:
+            return dcs & 0x04 ? SMS_8BIT : SMS_GSM7;
+    }
+    return SMS_8BIT;
+}
+
+typedef struct {
+    int record;
+    BYTE status;
+    char smsc[24];
+    int mti;
+    char address[48];
+    char timestamp[32];
+    int mr;
+    int validity;
+    int pid;
+    int dcs;
+    int alphabet;
+    int concat_ref;
+    int concat_total;
+    int concat_seq;
+    char text[SMS_MAX_TEXT];
+} sms_message_t;
+
+// User data: optional header (concatenation IEs 00 and 08 are decoded),
+// then text in the message alphabet, or hex for 8-bit data
+static void sms_decode_user_data(tpdu_reader_t *r, int udhi, sms_message_t *msg) {
+    int udl = tp_byte(r);
+    int octets = msg->alphabet == SMS_GSM7 ? (udl * 7 + 7) / 8 : udl;
+    const BYTE *ud;
+    int header = 0;
+
+    if (octets > r->len - r->pos) octets = r->len - r->pos;
+    ud = tp_take(r, octets);
+    if (!ud) return;
+
+    if (udhi && octets > 0) {
+        header = ud[0] + 1;
+        for (int i = 1; i + 2 <= header && i + 2 + ud[i + 1] <= header; i += 2 + ud[i + 1]) {
+            const BYTE *ie = &ud[i + 2];
+            if (ud[i] == 0x00 && ud[i + 1] == 3) {
+                msg->concat_ref = ie[0];
+                msg->concat_total = ie[1];
+                msg->concat_seq = ie[2];
+            } else if (ud[i] == 0x08 && ud[i + 1] == 4) {
+                msg->concat_ref = (ie[0] << 8) | ie[1];
+                msg->concat_total = ie[2];
+                msg->concat_seq = ie[3];
+            }
+        }
+        if (header > octets) header = octets;
+    }
+
+    if (msg->alphabet == SMS_GSM7) {
+        gsm7_unpack(ud, octets, (header * 8 + 6) / 7, udl, msg->text, sizeof(msg->text));
+    } else if (msg->alphabet == SMS_UCS2) {
+        int pos = 0;
+        for (int i = header; i + 1 < octets; i += 2) {
+            unsigned int cp = (ud[i] << 8) | ud[i + 1];
+            if (cp >= 0xD800 && cp < 0xDC00 && i + 3 < octets) {
+                unsigned int low = (ud[i + 2] << 8) | ud[i + 3];
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+            pos = utf8_put(msg->text, pos, sizeof(msg->text), cp);
+        }
+        msg->text[pos] = '\0';
+    } else {
+        hex_string(ud + header, octets - header, msg->text, sizeof(msg->text));
+    }
+}
+
+// Decode one EF_SMS record; returns -1 for free or malformed records
+static int sms_parse(const BYTE *rec, int len, int record, sms_message_t *msg) {
+    tpdu_reader_t r = {rec, len, 0, 0};
+
+    memset(msg, 0, sizeof(*msg));
+    msg->record = record;
+    msg->mr = -1;
+    msg->validity = -1;
+    msg->status = tp_byte(&r);
+    if (!(msg->status & 0x01)) return -1;
+
+    // SMSC address: length in octets including the type of address
+    int sc_len = tp_byte(&r);
+    if (sc_len > 0 && sc_len <= 11) {
+        const BYTE *sc = tp_take(&r, sc_len);
+        if (sc) {
+            int plus = ((sc[0] >> 4) & 0x07) == 0x01;
+            if (plus) msg->smsc[0] = '+';
+            decode_bcd_number(sc + 1, sc_len - 1, msg->smsc + plus, sizeof(msg->smsc) - plus);
+        }
+    } else if (sc_len == 0xFF) {
+        return -1;
+    }
+
+    int fo = tp_byte(&r);
+    msg->mti = fo & 0x03;
+    if (msg->mti == 0x00) {
+        sms_decode_address(&r, msg->address, sizeof(msg->address));
+        msg->pid = tp_byte(&r);
+        msg->dcs = tp_byte(&r);
+        const BYTE *ts = tp_take(&r, 7);
+        if (ts) sms_decode_timestamp(ts, msg->timestamp);
+    } else if (msg->mti == 0x01) {
+        msg->mr = tp_byte(&r);
+        sms_decode_address(&r, msg->address, sizeof(msg->address));
+        msg->pid = tp_byte(&r);
+        msg->dcs = tp_byte(&r);
+        int vpf = (fo >> 3) & 0x03;
+        if (vpf == 0x02) {
+            msg->validity = sms_validity_minutes(tp_byte(&r));
+        } else if (vpf == 0x03) {
+            const BYTE *vp = tp_take(&r, 7);
+            if (vp) sms_decode_timestamp(vp, msg->timestamp);
+        } else if (vpf == 0x01) {
+            tp_take(&r, 7);  // enhanced format: not decoded
+        }
+    } else {
+        return -1;
+    }
+    msg->alphabet = sms_alphabet(msg->dcs);
+    sms_decode_user_data(&r, fo & 0x40, msg);
+    return r.error ? -1 : 0;
+}
+
+static void sms_print(const sms_message_t *msg) {
+    static const char *status_names[] = {"", "read", "", "unread", "", "sent", "", "unsent"};
+    int deliver = msg->mti == 0x00;
+
+    printf("{\"file\": \"sms\", \"record\": %d, \"status\": \"%s\", \"type\": \"%s\"",
+           msg->record, status_names[msg->status & 0x07], deliver ? "deliver" : "submit");
+    if (msg->smsc[0]) printf(", \"smsc\": \"%s\"", msg->smsc);
+    printf(", \"%s\": ", deliver ? "from" : "to");
+    print_json_string(msg->address);
+    if (msg->mr >= 0) printf(", \"mr\": %d", msg->mr);
+    if (msg->timestamp[0]) {
+        printf(", \"%s\": \"%s\"", deliver ? "timestamp" : "valid_until", msg->timestamp);
+    }
+    if (msg->validity >= 0) printf(", \"validity_minutes\": %d", msg->validity);
+    printf(", \"pid\": %d, \"dcs\": %d, \"encoding\": \"%s\"", msg->pid, msg->dcs,
+           sms_alphabet_names[msg->alphabet]);
+    if (msg->concat_total) {
+        printf(", \"concat\": {\"ref\": %d, \"total\": %d, \"seq\": %d}",
+               msg->concat_ref, msg->concat_total, msg->concat_seq);
+    }
+    printf(", \"%s\": ", msg->alphabet == SMS_8BIT ? "data" : "text");
+    print_json_string(msg->text);
+    printf("}\n");
+}
+
+// Record numbers of the current file whose first byte equals value, by
+// enhanced SEARCH RECORD; -1 when the card does not support it
+static int search_records(BYTE value, char *found, int max) {
+    BYTE apdu[] = {0x00, 0xA2, 0x01, 0x06, 0x03, 0x04, 0x00, value, 0x00};
+    BYTE resp[BUFFER_SIZE];
+    int resp_len;
+    WORD sw;
+    int apdu_len = dwActiveProtocol == SCARD_PROTOCOL_T0 ? 8 : 9;
+
+    if (exchange_apdu(apdu, apdu_len, resp, sizeof(resp), &resp_len, &sw) < 0) return -1;
+    if (sw == 0x6282 || sw == 0x6A83) return 0;
+    if (sw != 0x9000) return -1;
+    for (int i = 0; i < resp_len; i++) {
+        if (resp[i] >= 1 && resp[i] <= max) found[resp[i] - 1] = 1;
+    }
+    return 0;
+}
+
+// Select an SMS file in the USIM, or under DF_TELECOM without it
+static int sms_select(BYTE fid_hi, BYTE fid_lo, snap_file_t *info, int have_usim, int verbose) {
+    BYTE usim_path[] = {0x3F, 0x00, 0x7F, 0xFF, fid_hi, fid_lo};
+    BYTE telecom_path[] = {0x3F, 0x00, 0x7F, 0x10, fid_hi, fid_lo};
+
+    memset(info, 0, sizeof(*info));
+    if ((!have_usim ||
+         select_path(usim_path, sizeof(usim_path), info->fcp, &info->fcp_len, verbose) < 0) &&
+        select_path(telecom_path, sizeof(telecom_path), info->fcp, &info->fcp_len, verbose) < 0) {
+        return -1;
+    }
+    parse_fcp(info);
+    return 0;
+}
+
+// Statuses of used EF_SMS records (bit 1 set): received read/unread,
+// sent (with the status report states) and unsent
+static const BYTE sms_used_status[] = {0x01, 0x03, 0x05, 0x07, 0x0D, 0x15, 0x1D};
+
+static int sms_export_messages(int have_usim, int verbose) {
+    snap_file_t info;
+    BYTE rec[256];
+    char used[256];
+    int count = 0;
+
+    if (sms_select(0x6F, 0x3C, &info, have_usim, verbose) < 0 ||
+        info.record_len <= 0 || info.record_len > (int)sizeof(rec)) {
+        return -1;
+    }
+
+    // With many records, find the used ones by their status byte instead
+    // of reading free records
+    memset(used, 1, sizeof(used));
+    if (info.num_records > (int)sizeof(sms_used_status)) {
+        memset(used, 0, sizeof(used));
+        for (size_t i = 0; i < sizeof(sms_used_status); i++) {
+            if (search_records(sms_used_status[i], used, info.num_records) < 0) {
+                memset(used, 1, sizeof(used));
+                break;
+            }
+        }
+    }
+
+    for (int r = 1; r <= info.num_records; r++) {
+        sms_message_t msg;
+        if (!used[r - 1]) continue;
+        if (read_record(0, r, rec, info.record_len) != info.record_len) return -1;
+        if (sms_parse(rec, info.record_len, r, &msg) < 0) continue;
+        sms_print(&msg);
+        count++;
+    }
+    fflush(stdout);
+    return count;
+}
+
+// EF_SMSP: alpha identifier, parameter indicators (a cleared bit marks a
+// present field), destination address, SMSC address, PID, DCS and validity
+static void sms_export_parameters(int have_usim, int verbose) {
+    snap_file_t info;
+    BYTE rec[256];
+
+    if (sms_select(0x6F, 0x42, &info, have_usim, verbose) < 0 ||
+        info.record_len < 28 || info.record_len > (int)sizeof(rec)) {
+        return;
+    }
+    for (int r = 1; r <= info.num_records; r++) {
+        if (read_record(0, r, rec, info.record_len) != info.record_len ||
+            is_empty(rec, info.record_len)) {
+            continue;
+        }
+        const BYTE *p = rec + info.record_len - 28;
+        char alpha[96];
+        char address[48];
+        decode_alpha(rec, info.record_len - 28, alpha, sizeof(alpha));
+        printf("{\"file\": \"smsp\", \"record\": %d, \"name\": ", r);
+        print_json_string(alpha);
+        if (!(p[0] & 0x01)) {
+            tpdu_reader_t tr = {p + 1, 12, 0, 0};
+            sms_decode_address(&tr, address, sizeof(address));
+            printf(", \"to\": ");
+            print_json_string(address);
+        }
+        if (!(p[0] & 0x02) && p[13] >= 2 && p[13] <= 11) {
+            int plus = ((p[14] >> 4) & 0x07) == 0x01;
+            if (plus) address[0] = '+';
+            decode_bcd_number(p + 15, p[13] - 1, address + plus, sizeof(address) - plus);
+            printf(", \"smsc\": \"%s\"", address);
+        }
+        if (!(p[0] & 0x04)) printf(", \"pid\": %d", p[25]);
+        if (!(p[0] & 0x08)) printf(", \"dcs\": %d", p[26]);
+        if (!(p[0] & 0x10)) printf(", \"validity_minutes\": %d", sms_validity_minutes(p[27]));
+        printf("}\n");
+    }
+}
+
+// EF_SMSS (last message reference, memory capacity flag) and EF_SMSR
+// (status reports linked to EF_SMS records)
+static void sms_export_status(int have_usim, int verbose) {
+    snap_file_t info;
+    BYTE rec[256];
+
+    if (sms_select(0x6F, 0x43, &info, have_usim, verbose) == 0 &&
+        read_binary_all(0, rec, 2) == 2) {
+        printf("{\"file\": \"smss\", \"last_mr\": %d, \"memory_full\": %s}\n",
+               rec[0], rec[1] & 0x01 ? "false" : "true");
+    }
+
+    if (sms_select(0x6F, 0x47, &info, have_usim, verbose) < 0 ||
+        info.record_len < 2 || info.record_len > (int)sizeof(rec)) {
+        return;
+    }
+    for (int r = 1; r <= info.num_records; r++) {
+        if (read_record(0, r, rec, info.record_len) != info.record_len || rec[0] == 0x00 ||
+            rec[0] == 0xFF) {
+            continue;
+        }
+        // SMS-STATUS-REPORT: first octet, MR, recipient, SCTS, discharge
+        // time and status
+        tpdu_reader_t tr = {rec + 1, info.record_len - 1, 0, 0};
+        char recipient[48];
+        char scts[32] = "";
+        char discharge[32] = "";
+        tp_byte(&tr);
+        int mr = tp_byte(&tr);
+        sms_decode_address(&tr, recipient, sizeof(recipient));
+        const BYTE *ts = tp_take(&tr, 7);
+        if (ts) sms_decode_timestamp(ts, scts);
+        ts = tp_take(&tr, 7);
+        if (ts) sms_decode_timestamp(ts, discharge);
+        int st = tp_byte(&tr);
+        if (tr.error) continue;
+        printf("{\"file\": \"smsr\", \"record\": %d, \"sms_record\": %d, \"mr\": %d, \"to\": ",
+               r, rec[0], mr);
+        print_json_string(recipient);
+        printf(", \"timestamp\": \"%s\", \"discharge\": \"%s\", \"st\": %d}\n",
+               scts, discharge, st);
+    }
+}
+
+static int sms_card(const config_t *config, const char *reader, void *arg) {
+    int have_usim = select_usim(config->verbose) == 0;
+
+    (void)arg;
+    if (sms_export_messages(have_usim, config->verbose) < 0) {
+        fprintf(stderr, "%s: cannot read EF_SMS\n", reader);
+        return 1;
+    }
+    sms_export_parameters(have_usim, config->verbose);
+    sms_export_status(have_usim, config->verbose);
+    return 0;
+}
+
+// Authentication benchmark
+
+// A vectors file has one "RAND [AUTN]" line (hex) per vector. Vectors with
+// an AUTN are sent as AUTHENTICATE in 3G context, the others in GSM context
+// (RUN GSM ALGORITHM on cards without a USIM). Latencies are measured
+// around the complete command, including GET RESPONSE.
+
+#define LATENCY_BUCKETS 24   // powers of two from 1 us
+
+typedef struct {
+    BYTE rand[16];
+    BYTE autn[16];
+    int has_autn;
+} auth_vector_t;
+
+typedef struct {
+    auth_vector_t *vectors;
+    int num_vectors;
+    int rounds;
+} auth_bench_ctx_t;
+
+typedef struct {
+    const char *status;      // ok, sync_failure, mac_failure, unsupported, error
+    WORD sw;
+    BYTE res[16];
+    int res_len;
+    BYTE ck[16];
+    BYTE ik[16];
+    BYTE kc[8];
+    BYTE auts[14];
+    int have_ck;
+    int have_kc;
+    int have_auts;
+} auth_result_t;
+
+static int auth_vectors_load(const char *filename, auth_vector_t **vectors, int *count) {
+    FILE *in = fopen(filename, "r");
+    char line[256];
+    int line_no = 0;
+
+    if (!in) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+    *vectors = NULL;
+    *count = 0;
+    while (fgets(line, sizeof(line), in)) {
+        char rand_hex[64];
+        char autn_hex[64];
+        auth_vector_t v = {0};
+        int n;
+
+        line_no++;
+        char *p = trim(line);
+        if (!*p || *p == '#') continue;
+        n = sscanf(p, "%63s %63s", rand_hex, autn_hex);
+        if (n < 1 || strlen(rand_hex) != 32 || hex_to_bytes(rand_hex, v.rand, 16) != 16 ||
+            (n == 2 && (strlen(autn_hex) != 32 || hex_to_bytes(autn_hex, v.autn, 16) != 16))) {
+            fprintf(stderr, "%s:%d: expected RAND [AUTN] as 32 hex digits each\n", filename, line_no);
+            fclose(in);
+            free(*vectors);
+            return -1;
+        }
+        v.has_autn = n == 2;
+        auth_vector_t *grown = realloc(*vectors, (*count + 1) * sizeof(auth_vector_t));
+        if (!grown) {
+            fclose(in);
+            free(*vectors);
+            return -1;
+        }
+        *vectors = grown;
+        (*vectors)[(*count)++] = v;
+    }
+    fclose(in);
+    if (!*count) {
+        fprintf(stderr, "%s: no vectors\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Parse "L value" data objects of an AUTHENTICATE response
+static int auth_take(const BYTE **p, const BYTE *end, BYTE *out, int max) {
+    if (*p >= end || **p > max || *p + 1 + **p > end) return -1;
+    int len = **p;
+    memcpy(out, *p + 1, len);
+    *p += 1 + len;
+    return len;
+}
+
+static void auth_parse(const BYTE *data, int len, WORD sw, int context_3g, int gsm_class,
+                       auth_result_t *r) {
+    const BYTE *p = data + 1;
+    const BYTE *end = data + len;
+
+    r->sw = sw;
+    r->status = "error";
+    if (sw == 0x9862) {
+        r->status = "mac_failure";
+        return;
+    }
+    if (sw != 0x9000) return;
+
+    if (gsm_class) {
+        // RUN GSM ALGORITHM: SRES and Kc without length bytes
+        if (len < 12) return;
+        memcpy(r->res, data, 4);
+        r->res_len = 4;
+        memcpy(r->kc, data + 4, 8);
+        r->have_kc = 1;
+        r->status = "ok";
+    } else if (!context_3g) {
+        p = data;
+        if ((r->res_len = auth_take(&p, end, r->res, 4)) == 4 && auth_take(&p, end, r->kc, 8) == 8) {
+            r->have_kc = 1;
+            r->status = "ok";
+        }
+    } else if (len > 0 && data[0] == 0xDC) {
+        if (auth_take(&p, end, r->auts, 14) == 14) {
+            r->have_auts = 1;
+            r->status = "sync_failure";
+        }
+    } else if (len > 0 && data[0] == 0xDB) {
+        if ((r->res_len = auth_take(&p, end, r->res, 16)) >= 4 &&
+            auth_take(&p, end, r->ck, 16) == 16 && auth_take(&p, end, r->ik, 16) == 16) {
+            r->have_ck = 1;
+            r->have_kc = p < end && auth_take(&p, end, r->kc, 8) == 8;
+            r->status = "ok";
+        }
+    }
+}
+
+// Send one vector; returns the latency in microseconds, -1 on transport
+// failure
+static double auth_run(const auth_vector_t *v, int usim, auth_result_t *r) {
+    BYTE apdu[5 + 34];
+    BYTE data[BUFFER_SIZE];
+    int apdu_len = 0;
+    int data_len;
+    WORD sw;
+
+    memset(r, 0, sizeof(*r));
+    if (v->has_autn && !usim) {
+        r->status = "unsupported";
+        return 0;
+    }
+    if (!usim) {
+        // RUN GSM ALGORITHM
+        BYTE run_gsm[] = {0xA0, 0x88, 0x00, 0x00, 0x10};
+        memcpy(apdu, run_gsm, 5);
+        memcpy(apdu + 5, v->rand, 16);
+        apdu_len = 21;
+    } else {
+        apdu[0] = 0x00;
+        apdu[1] = 0x88;
+        apdu[2] = 0x00;
+        apdu[3] = v->has_autn ? 0x81 : 0x80;   // 3G or GSM security context
+        apdu[4] = v->has_autn ? 34 : 17;
+        apdu[5] = 16;
+        memcpy(apdu + 6, v->rand, 16);
+        apdu_len = 22;
+        if (v->has_autn) {
+            apdu[22] = 16;
+            memcpy(apdu + 23, v->autn, 16);
+            apdu_len = 39;
+        }
+        apdu[apdu_len++] = 0x00;   // Le
+    }
+
+    double start = monotonic_us();
+    if (exchange_apdu(apdu, apdu_len, data, sizeof(data), &data_len, &sw) < 0) {
+        r->status = "error";
+        return -1;
+    }
+    double latency = monotonic_us() - start;
+    auth_parse(data, data_len, sw, v->has_autn, !usim, r);
+    return latency;
+}
+
+static void print_hex_member(const char *key, const BYTE *data, int len) {
+    printf(", \"%s\": \"", key);
+    for (int i = 0; i < len; i++) printf("%02X", data[i]);
+    printf("\"");
+}
+
+// The NDJSON lines carry the ICCID, RAND and AUTN so that auth-verify can
+// check them later against the card keys
+static void auth_print(const char *reader, const char *iccid, int round, int index,
+                       const auth_vector_t *v, int usim, const auth_result_t *r, double latency,
+                       int json) {
+    const char *context = v->has_autn ? "3g" : usim ? "gsm" : "run_gsm";
+
+    if (json) {
+        printf("{\"reader\": ");
+        print_json_string(reader);
+        printf(", \"iccid\": \"%s\", \"round\": %d, \"vector\": %d, \"context\": \"%s\"",
+               iccid, round, index, context);
+        print_hex_member("rand", v->rand, 16);
+        if (v->has_autn) print_hex_member("autn", v->autn, 16);
+        printf(", \"latency_us\": %.1f, \"status\": \"%s\", \"sw\": \"%04X\"", latency, r->status, r->sw);
+        if (r->res_len) print_hex_member(v->has_autn ? "res" : "sres", r->res, r->res_len);
+        if (r->have_ck) {
+            print_hex_member("ck", r->ck, 16);
+            print_hex_member("ik", r->ik, 16);
+        }
+        if (r->have_kc) print_hex_member("kc", r->kc, 8);
+        if (r->have_auts) print_hex_member("auts", r->auts, 14);
+        printf("}\n");
+        return;
+    }
+
+    printf("%3d/%-4d %-3s %8.0f us  %-12s", round, index, v->has_autn ? "3G" : "2G", latency, r->status);
+    if (r->res_len) {
+        printf(" %s ", v->has_autn ? "RES" : "SRES");
+        for (int i = 0; i < r->res_len; i++) printf("%02X", r->res[i]);
+    }
+    if (r->have_ck) {
+        printf(" CK ");
+        for (int i = 0; i < 16; i++) printf("%02X", r->ck[i]);
+        printf(" IK ");
+        for (int i = 0; i < 16; i++) printf("%02X", r->ik[i]);
+    }
+    if (r->have_kc && !r->have_ck) {
+        printf(" Kc ");
+        for (int i = 0; i < 8; i++) printf("%02X", r->kc[i]);
+    }
+    if (r->have_auts) {
+        printf(" AUTS ");
+        for (int i = 0; i < 14; i++) printf("%02X", r->auts[i]);
+    }
+    if (!strcmp(r->status, "error")) printf(" SW %04X", r->sw);
+    printf("\n");
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, int count, double p) {
+    int index = (int)(p / 100.0 * count + 0.5) - 1;
+    if (index < 0) index = 0;
+    if (index >= count) index = count - 1;
+    return sorted[index];
+}
+
+static void auth_print_summary(const char *reader, double *latencies, int count,
+                               const int *statuses, int json) {
+    static const char *status_names[] = {"ok", "sync_failure", "mac_failure", "unsupported", "error"};
+    int histogram[LATENCY_BUCKETS] = {0};
+    double sum = 0;
+
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    for (int i = 0; i < count; i++) {
+        int bucket = 0;
+        while (bucket < LATENCY_BUCKETS - 1 && latencies[i] >= (double)(2u << bucket)) bucket++;
+        histogram[bucket]++;
+        sum += latencies[i];
+    }
+
+    if (json) {
+        printf("{\"reader\": ");
+        print_json_string(reader);
+        printf(", \"summary\": {\"commands\": %d", count);
+        for (int s = 0; s < 5; s++) printf(", \"%s\": %d", status_names[s], statuses[s]);
+        if (count) {
+            printf(", \"latency_us\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+                   "\"max\": %.1f, \"mean\": %.1f}", latencies[0], percentile(latencies, count, 50),
+                   percentile(latencies, count, 90), percentile(latencies, count, 99),
+                   latencies[count - 1], sum / count);
+        }
+        printf(", \"histogram\": [");
+        for (int b = 0, n = 0; b < LATENCY_BUCKETS; b++) {
+            if (!histogram[b]) continue;
+            printf("%s{\"from_us\": %u, \"to_us\": %u, \"count\": %d}", n++ ? ", " : "",
+                   b ? 1u << b : 0, (2u << b) - 1, histogram[b]);
+        }
+        printf("]}}\n");
+        return;
+    }
+
+    printf("--- %s: %d commands", reader, count);
+    for (int s = 0; s < 5; s++) {
+        if (statuses[s]) printf(", %d %s", statuses[s], status_names[s]);
+    }
+    printf("\n");
+    if (!count) return;
+    printf("latency us: min %.0f  p50 %.0f  p90 %.0f  p99 %.0f  max %.0f  mean %.0f\n",
+           latencies[0], percentile(latencies, count, 50), percentile(latencies, count, 90),
+           percentile(latencies, count, 99), latencies[count - 1], sum / count);
+    int peak = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        if (histogram[b] > peak) peak = histogram[b];
+    }
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        if (!histogram[b]) continue;
+        int bar = (histogram[b] * 40 + peak - 1) / peak;
+        printf("%8u - %-8u |%.*s %d\n", b ? 1u << b : 0, (2u << b) - 1, bar,
+               "########################################", histogram[b]);
+    }
+}
+
+static int auth_bench_card(const config_t *config, const char *reader, void *arg) {
+    static const BYTE df_gsm[] = {0x3F, 0x00, 0x7F, 0x20};
+    static const BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+    auth_bench_ctx_t *ctx = arg;
+    BYTE iccid_data[10];
+    char iccid[21] = "";
+    int total = ctx->num_vectors * ctx->rounds;
+    double *latencies = malloc(total * sizeof(double));
+    int statuses[5] = {0};
+    int measured = 0;
+    int usim;
+
+    if (!latencies) return -1;
+    if (select_path(iccid_path, sizeof(iccid_path), NULL, NULL, config->verbose) == 0 &&
+        read_binary_all(0, iccid_data, sizeof(iccid_data)) == (int)sizeof(iccid_data)) {
+        decode_iccid(iccid_data, sizeof(iccid_data), iccid);
+        session_iccid(iccid);
+    }
+    usim = select_usim(config->verbose) == 0;
+    if (!usim) {
+        // RUN GSM ALGORITHM needs DF_GSM selected
+        select_path(df_gsm, sizeof(df_gsm), NULL, NULL, config->verbose);
+    }
+
+    for (int round = 1; round <= ctx->rounds; round++) {
+        for (int i = 0; i < ctx->num_vectors; i++) {
+            const auth_vector_t *v = &ctx->vectors[i];
+            auth_result_t r;
+            double latency = auth_run(v, usim, &r);
+            int s;
+
+            for (s = 0; s < 4; s++) {
+                static const char *names[] = {"ok", "sync_failure", "mac_failure", "unsupported"};
+                if (!strcmp(r.status, names[s])) break;
+            }
+            statuses[s]++;
+            if (latency > 0 && strcmp(r.status, "unsupported") != 0) latencies[measured++] = latency;
+            auth_print(reader, iccid, round, i + 1, v, usim, &r, latency > 0 ? latency : 0,
+                       config->json_output);
+        }
+    }
+
+    auth_print_summary(reader, latencies, measured, statuses, config->json_output);
+    free(latencies);
+    return statuses[4] || statuses[2] ? 1 : 0;
+}
+
+// Authentication response verification
+
+// auth-verify recomputes the responses recorded by "auth-bench -j" from the
+// card keys in the values list: RES, CK and IK in 3G context, and SRES and
+// Kc (c2 and c3 of the Milenage values) in GSM context. The responses of
+// all cards are collected first and then computed in batches, so that the
+// AES work runs in the batched kernels. RUN GSM ALGORITHM responses come
+// from the operator's 2G algorithm and are skipped.
+
+typedef struct {
+    char iccid[21];
+    milenage_t m;
+    int have_keys;
+    int checked;
+    int mismatches;
+    int skipped;
+} auth_card_t;
+
+typedef struct {
+    int card;
+    int round;
+    int vector;
+    int context_3g;
+    BYTE rand[16];
+    BYTE res[16];
+    int res_len;
+    BYTE ck[16];
+    BYTE ik[16];
+    BYTE kc[8];
+    int have_ck;
+    int have_kc;
+} auth_record_t;
+
+typedef struct {
+    const value_table_t *values;
+    int *card_of_row;            // card index per values row, -1 until seen
+    auth_card_t *cards;
+    int num_cards;
+    auth_record_t *records;
+    int num_records;
+    int records_capacity;
+} auth_verify_ctx_t;
+
+// K and OPc from the ki and opc (or op) columns of a values row. OPc is
+// derived from OP as OP XOR E_K(OP).
+static int milenage_from_row(const value_table_t *values, const value_row_t *row, milenage_t *m) {
+    const char *k_hex = value_row_get(values, row, "ki");
+    const char *opc_hex = value_row_get(values, row, "opc");
+    const char *op_hex = value_row_get(values, row, "op");
+    BYTE k[16];
+    BYTE opc[16];
+
+    if (!k_hex || strlen(k_hex) != 32 || hex_to_bytes(k_hex, k, 16) != 16) return -1;
+    if (opc_hex) {
+        if (strlen(opc_hex) != 32 || hex_to_bytes(opc_hex, opc, 16) != 16) return -1;
+        milenage_init(m, k, opc);
+        return 0;
+    }
+    if (!op_hex || strlen(op_hex) != 32 || hex_to_bytes(op_hex, opc, 16) != 16) return -1;
+    aes128_expand(k, &m->k);
+    aes128_encrypt(&m->k, opc, m->opc);
+    for (int i = 0; i < 16; i++) m->opc[i] ^= opc[i];
+    return 0;
+}
+
+// Value of a member of a flat JSON object as written by this tool: a
+// string without escapes, or a number. Returns -1 when it is missing.
+static int json_member(const char *line, const char *key, char *out, int size) {
+    size_t key_len = strlen(key);
+
+    for (const char *p = strchr(line, '"'); p; p = strchr(p + 1, '"')) {
+        if (strncmp(p + 1, key, key_len) != 0 || p[1 + key_len] != '"') continue;
+        const char *v = p + key_len + 2;
+        while (*v == ' ') v++;
+        if (*v++ != ':') continue;
+        while (*v == ' ') v++;
+        int quoted = *v == '"';
+        int n = 0;
+        v += quoted;
+        while (*v && n < size - 1 && (quoted ? *v != '"' : (*v != ',' && *v != '}' && *v != ' '))) {
+            out[n++] = *v++;
+        }
+        out[n] = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+static int json_hex_member(const char *line, const char *key, BYTE *out, int max) {
+    char hex[2 * 16 + 2];
+    if (json_member(line, key, hex, sizeof(hex)) < 0) return -1;
+    return hex_to_bytes(hex, out, max);
+}
+
+// Index of the card with this ICCID, added on first sight with its keys
+// from the values list
+static int auth_verify_card(auth_verify_ctx_t *ctx, const char *iccid) {
+    const value_row_t *row = value_table_find(ctx->values, iccid);
+    int row_index = row ? (int)(row - ctx->values->rows) : -1;
+
+    if (row_index >= 0 && ctx->card_of_row[row_index] >= 0) return ctx->card_of_row[row_index];
+    if (row_index < 0) {
+        for (int c = 0; c < ctx->num_cards; c++) {
+            if (strcmp(ctx->cards[c].iccid, iccid) == 0) return c;
+        }
+    }
+
+    auth_card_t *cards = realloc(ctx->cards, (ctx->num_cards + 1) * sizeof(auth_card_t));
+    if (!cards) return -1;
+    ctx->cards = cards;
+    auth_card_t *card = &cards[ctx->num_cards];
+    memset(card, 0, sizeof(*card));
+    snprintf(card->iccid, sizeof(card->iccid), "%s", iccid);
+    card->have_keys = row && milenage_from_row(ctx->values, row, &card->m) == 0;
+    if (row_index >= 0) ctx->card_of_row[row_index] = ctx->num_cards;
+    return ctx->num_cards++;
+}
+
+// Collect the responses of one auth-bench output ("-" for stdin). Lines
+// without a RAND, such as the summaries, are ignored.
+static int auth_verify_load(auth_verify_ctx_t *ctx, const char *filename) {
+    FILE *in = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    int rv = 0;
+
+    if (!in) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+    while (getline(&line, &capacity, in) > 0) {
+        char iccid[21];
+        char context[16];
+        char status[16];
+        char number[16];
+        auth_record_t r = {0};
+
+        if (json_member(line, "iccid", iccid, sizeof(iccid)) < 0 || !iccid[0] ||
+            json_hex_member(line, "rand", r.rand, 16) != 16 ||
+            json_member(line, "context", context, sizeof(context)) < 0 ||
+            json_member(line, "status", status, sizeof(status)) < 0) {
+            continue;
+        }
+        if ((r.card = auth_verify_card(ctx, iccid)) < 0) {
+            rv = -1;
+            break;
+        }
+        auth_card_t *card = &ctx->cards[r.card];
+        if (strcmp(status, "ok") != 0 || strcmp(context, "run_gsm") == 0 || !card->have_keys) {
+            card->skipped++;
+            continue;
+        }
+
+        if (json_member(line, "round", number, sizeof(number)) == 0) r.round = atoi(number);
+        if (json_member(line, "vector", number, sizeof(number)) == 0) r.vector = atoi(number);
+        r.context_3g = strcmp(context, "3g") == 0;
+        r.res_len = json_hex_member(line, r.context_3g ? "res" : "sres", r.res, r.context_3g ? 16 : 4);
+        if (r.res_len < 0) r.res_len = 0;
+        r.have_ck = json_hex_member(line, "ck", r.ck, 16) == 16 &&
+                    json_hex_member(line, "ik", r.ik, 16) == 16;
+        r.have_kc = json_hex_member(line, "kc", r.kc, 8) == 8;
+
+        if (ctx->num_records == ctx->records_capacity) {
+            int grown_capacity = ctx->records_capacity ? 2 * ctx->records_capacity : 1024;
+            auth_record_t *grown = realloc(ctx->records, grown_capacity * sizeof(auth_record_t));
+            if (!grown) {
+                rv = -1;
+                break;
+            }
+            ctx->records = grown;
+            ctx->records_capacity = grown_capacity;
+        }
+        ctx->records[ctx->num_records++] = r;
+    }
+    free(line);
+    if (in != stdin) fclose(in);
+    return rv;
+}
+
+static void auth_print_mismatch(const auth_card_t *card, const auth_record_t *r, const char *field,
+                                const BYTE *expected, const BYTE *actual, int len, int json) {
+    if (json) {
+        printf("{\"iccid\": \"%s\", \"round\": %d, \"vector\": %d, \"field\": \"%s\"",
+               card->iccid, r->round, r->vector, field);
+        print_hex_member("expected", expected, len);
+        print_hex_member("actual", actual, len);
+        printf("}\n");
+        return;
+    }
+    printf("MISMATCH %s %d/%d %s expected ", card->iccid, r->round, r->vector, field);
+    for (int i = 0; i < len; i++) printf("%02X", expected[i]);
+    printf(" got ");
+    for (int i = 0; i < len; i++) printf("%02X", actual[i]);
+    printf("\n");
+}
+
+// Compare one response with the computed values; returns the number of
+// fields that differ. A RES shorter than 8 bytes is compared as a prefix.
+static int auth_compare(const auth_card_t *card, const auth_record_t *r, const milenage_job_t *job,
+                        int json) {
+    BYTE sres[4];
+    BYTE kc[8];
+    int mismatches = 0;
+
+    umts_to_gsm(job->res, job->ck, job->ik, sres, kc);
+    if (r->context_3g) {
+        int len = r->res_len < 8 ? r->res_len : 8;
+        if (r->res_len < 4 || r->res_len > 8 || memcmp(r->res, job->res, len) != 0) {
+            auth_print_mismatch(card, r, "res", job->res, r->res, 8, json);
+            mismatches++;
+        }
+        if (r->have_ck && memcmp(r->ck, job->ck, 16) != 0) {
+            auth_print_mismatch(card, r, "ck", job->ck, r->ck, 16, json);
+            mismatches++;
+        }
+        if (r->have_ck && memcmp(r->ik, job->ik, 16) != 0) {
+            auth_print_mismatch(card, r, "ik", job->ik, r->ik, 16, json);
+            mismatches++;
+        }
+    } else if (r->res_len != 4 || memcmp(r->res, sres, 4) != 0) {
+        auth_print_mismatch(card, r, "sres", sres, r->res, 4, json);
+        mismatches++;
+    }
+    if (r->have_kc && memcmp(r->kc, kc, 8) != 0) {
+        auth_print_mismatch(card, r, "kc", kc, r->kc, 8, json);
+        mismatches++;
+    }
+    return mismatches;
+}
+
+// Compute and compare all collected responses. Returns the number of cards
+// that failed: a mismatch, or responses but no usable keys.
+static int auth_verify_run(auth_verify_ctx_t *ctx, int json, int verbose) {
+    milenage_job_t *jobs = malloc((ctx->num_records + 1) * sizeof(milenage_job_t));
+    const char *kernel_name;
+    aes128_batch_fn kernel = aes128_batch_kernel(&kernel_name);
+    int failed = 0;
+
+    if (!jobs) return -1;
+    for (int i = 0; i < ctx->num_records; i++) {
+        jobs[i].m = &ctx->cards[ctx->records[i].card].m;
+        memcpy(jobs[i].rand, ctx->records[i].rand, 16);
+    }
+
+    double start = monotonic_us();
+    milenage_f234_batch(kernel, jobs, ctx->num_records);
+    double elapsed = monotonic_us() - start;
+
+    for (int i = 0; i < ctx->num_records; i++) {
+        auth_card_t *card = &ctx->cards[ctx->records[i].card];
+        card->checked++;
+        if (auth_compare(card, &ctx->records[i], &jobs[i], json)) card->mismatches++;
+    }
+    free(jobs);
+
+    for (int c = 0; c < ctx->num_cards; c++) {
+        const auth_card_t *card = &ctx->cards[c];
+        const char *result = !card->have_keys ? "no_keys" : card->mismatches ? "fail" : "pass";
+        if (strcmp(result, "pass") != 0) failed++;
+        if (json) {
+            printf("{\"iccid\": \"%s\", \"result\": \"%s\", \"checked\": %d, \"mismatches\": %d, "
+                   "\"skipped\": %d}\n", card->iccid, result, card->checked, card->mismatches,
+                   card->skipped);
+        } else {
+            printf("%s %s %d checked, %d mismatch(es), %d skipped\n",
+                   !card->have_keys ? "NOKEYS" : card->mismatches ? "FAIL" : "PASS", card->iccid,
+                   card->checked, card->mismatches, card->skipped);
+        }
+    }
+    if (verbose) {
+        fprintf(stderr, "%d response(s) computed in %.0f us (%s AES)\n", ctx->num_records, elapsed,
+                kernel_name);
+    }
+    return failed;
+}
+
+// APDU traces and replay
+
+// A trace is plain text: a "simreader-trace 1" header, then "reader NAME"
+// and "atr HEX" lines for each card, and one "TIME > HEX" line per command
+// and "TIME < HEX" line per response (data and status word), with TIME in
+// microseconds. --trace writes one; tools/usbmon2trace converts usbmon
+// captures of CCID readers into one. replay sends the commands of a trace
+// to a card and compares the responses.
+
+#define TRACE_MAGIC "simreader-trace"
+#define TRACE_VERSION 1
+#define MAX_TRACE_APDU 261
+
+typedef struct {
+    BYTE command[MAX_TRACE_APDU];
+    int command_len;
+    BYTE response[MAX_TRACE_APDU];
+    int response_len;            // -1 when the trace has no response
+    double sent_us;
+    double received_us;
+} trace_entry_t;
+
+typedef struct {
+    trace_entry_t *entries;
+    int count;
+    int capacity;
+} trace_t;
+
+typedef struct {
+    int apdus;
+    int selects;
+    int reads;
+    int updates;
+    int get_responses;
+    int other;
+    long bytes_sent;
+    long bytes_received;
+    double card_us;              // from each command to its response
+    double host_us;              // from each response to the next command
+    double total_us;
+} trace_stats_t;
+
+typedef struct {
+    trace_t *trace;
+    int matched;
+    int differed;
+} replay_ctx_t;
+
+// Start the trace of a card
+static void trace_card(const char *reader) {
+    BYTE atr[MAX_ATR_SIZE];
+    int atr_len;
+
+    fprintf(trace_out, "reader %s\n", reader);
+    if (get_atr(atr, &atr_len) == 0) {
+        fprintf(trace_out, "atr ");
+        fprint_hex(trace_out, atr, atr_len);
+        fputc('\n', trace_out);
+    }
+}
+
+static trace_entry_t *trace_add(trace_t *trace) {
+    if (trace->count == trace->capacity) {
+        int capacity = trace->capacity ? 2 * trace->capacity : 256;
+        trace_entry_t *grown = realloc(trace->entries, capacity * sizeof(trace_entry_t));
+        if (!grown) return NULL;
+        trace->entries = grown;
+        trace->capacity = capacity;
+    }
+    trace_entry_t *entry = &trace->entries[trace->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->response_len = -1;
+    return entry;
+}
+
+static int trace_load(const char *filename, trace_t *trace) {
+    FILE *in = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    int line_no = 0;
+    int started = 0;
+    int rv = 0;
+
+    memset(trace, 0, sizeof(*trace));
+    if (!in) {
+        fprintf(stderr, "Cannot open trace %s\n", filename);
+        return -1;
+    }
+    while (getline(&line, &capacity, in) > 0) {
+        char direction;
+        double time;
+        char hex[2 * MAX_TRACE_APDU + 2];
+        int version;
+
+        line_no++;
+        line[strcspn(line, "\n")] = '\0';
+        char *p = trim(line);
+        if (!*p || *p == '#') continue;
+        if (!started) {
+            if (sscanf(p, TRACE_MAGIC " %d", &version) != 1 || version != TRACE_VERSION) {
+                fprintf(stderr, "%s is not a simreader trace\n", filename);
+                rv = -1;
+                break;
+            }
+            started = 1;
+            continue;
+        }
+        if (strncmp(p, "reader ", 7) == 0 || strncmp(p, "atr ", 4) == 0) continue;
+
+        if (sscanf(p, "%lf %c %523s", &time, &direction, hex) != 3 ||
+            (direction != '>' && direction != '<')) {
+            fprintf(stderr, "%s:%d: expected TIME > HEX or TIME < HEX\n", filename, line_no);
+            rv = -1;
+            break;
+        }
+        trace_entry_t *entry = direction == '>' ? trace_add(trace) :
+                               trace->count ? &trace->entries[trace->count - 1] : NULL;
+        if (!entry || (direction == '<' && entry->response_len >= 0)) {
+            fprintf(stderr, "%s:%d: response without a command\n", filename, line_no);
+            rv = -1;
+            break;
+        }
+        int len = hex_to_bytes(hex, direction == '>' ? entry->command : entry->response, MAX_TRACE_APDU);
+        if (len < (direction == '>' ? 4 : 2)) {
+            fprintf(stderr, "%s:%d: invalid APDU\n", filename, line_no);
+            rv = -1;
+            break;
+        }
+        if (direction == '>') {
+            entry->command_len = len;
+            entry->sent_us = time;
+        } else {
+            entry->response_len = len;
+            entry->received_us = time;
+        }
+    }
+    free(line);
+    if (in != stdin) fclose(in);
+    if (rv == 0 && !trace->count) {
+        fprintf(stderr, "%s: no APDUs\n", filename);
+        rv = -1;
+    }
+    if (rv < 0) free(trace->entries);
+    return rv;
+}
+
+static void trace_statistics(const trace_t *trace, trace_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < trace->count; i++) {
+        const trace_entry_t *e = &trace->entries[i];
+
+        stats->apdus++;
+        switch (e->command[1]) {
+            case 0xA4: stats->selects++; break;
+            case 0xB0: case 0xB2: stats->reads++; break;
+            case 0xD6: case 0xDC: stats->updates++; break;
+            case 0xC0: stats->get_responses++; break;
+            default: stats->other++; break;
+        }
+        stats->bytes_sent += e->command_len;
+        if (e->response_len < 0) continue;
+        stats->bytes_received += e->response_len;
+        stats->card_us += e->received_us - e->sent_us;
+        if (i + 1 < trace->count) stats->host_us += trace->entries[i + 1].sent_us - e->received_us;
+    }
+    const trace_entry_t *last = &trace->entries[trace->count - 1];
+    stats->total_us = (last->response_len >= 0 ? last->received_us : last->sent_us) -
+                      trace->entries[0].sent_us;
+}
+
+static void trace_print_stats(const char *name, const trace_stats_t *s, int json) {
+    if (json) {
+        printf("{\"trace\": ");
+        print_json_string(name);
+        printf(", \"apdus\": %d, \"select\": %d, \"read\": %d, \"update\": %d, \"get_response\": %d, "
+               "\"other\": %d, \"bytes_sent\": %ld, \"bytes_received\": %ld, \"total_ms\": %.3f, "
+               "\"card_ms\": %.3f, \"host_ms\": %.3f}\n", s->apdus, s->selects, s->reads,
+               s->updates, s->get_responses, s->other, s->bytes_sent, s->bytes_received,
+               s->total_us / 1000, s->card_us / 1000, s->host_us / 1000);
+        return;
+    }
+    printf("%s: %d APDUs (%d SELECT, %d READ, %d UPDATE, %d GET RESPONSE, %d other), "
+           "%ld bytes sent, %ld received\n", name, s->apdus, s->selects, s->reads, s->updates,
+           s->get_responses, s->other, s->bytes_sent, s->bytes_received);
+    printf("  %.1f ms total: %.1f ms in the card, %.1f ms between APDUs\n",
+           s->total_us / 1000, s->card_us / 1000, s->host_us / 1000);
+}
+
+// Send the commands of the trace in order and compare each response with
+// the recorded one
+static int replay_card(const config_t *config, const char *reader, void *arg) {
+    replay_ctx_t *ctx = arg;
+    trace_t replayed = {0};
+    trace_stats_t stats;
+    double start = monotonic_us();
+
+    for (int i = 0; i < ctx->trace->count; i++) {
+        const trace_entry_t *e = &ctx->trace->entries[i];
+        trace_entry_t *r = trace_add(&replayed);
+        DWORD len = sizeof(r->response);
+
+        if (!r) {
+            free(replayed.entries);
+            return -1;
+        }
+        memcpy(r->command, e->command, e->command_len);
+        r->command_len = e->command_len;
+        r->sent_us = monotonic_us() - start;
+        if (card_transmit(e->command, e->command_len, r->response, &len) < 0) {
+            fprintf(stderr, "Replay stopped at APDU %d\n", i + 1);
+            replayed.count--;
+            break;
+        }
+        r->received_us = monotonic_us() - start;
+        r->response_len = len;
+
+        if (e->response_len < 0) continue;
+        if (e->response_len == r->response_len && memcmp(e->response, r->response, len) == 0) {
+            ctx->matched++;
+            continue;
+        }
+        ctx->differed++;
+        if (config->json_output) {
+            printf("{\"apdu\": %d", i + 1);
+            print_hex_member("command", e->command, e->command_len);
+            print_hex_member("expected", e->response, e->response_len);
+            print_hex_member("actual", r->response, r->response_len);
+            printf("}\n");
+        } else {
+            printf("DIFF %d ", i + 1);
+            for (int b = 0; b < e->command_len; b++) printf("%02X", e->command[b]);
+            printf(": expected ");
+            for (int b = 0; b < e->response_len; b++) printf("%02X", e->response[b]);
+            printf(" got ");
+            for (int b = 0; b < r->response_len; b++) printf("%02X", r->response[b]);
+            printf("\n");
+        }
+    }
+
+    if (replayed.count) {
+        trace_statistics(&replayed, &stats);
+        trace_print_stats(reader, &stats, config->json_output);
+    }
+    if (!config->json_output) printf("%d response(s) match, %d differ\n", ctx->matched, ctx->differed);
+    free(replayed.entries);
+    return ctx->differed ? 1 : 0;
+}
+
+// Reader health
+
+// In multi-reader mode every session (one card in one reader) updates the
+// health of its reader. A session is degraded when a command needed a
+// retry or failed, or the handler failed. Readers are quarantined when
+// HEALTH_DEGRADED_LIMIT of their last HEALTH_RECENT sessions were degraded,
+// or when their median command latency is more than HEALTH_SLOW_FACTOR
+// times that of the station; quarantined readers are skipped until "health
+// reset". The others are used healthiest first, and "health next" names the
+// healthiest idle reader for conveyors that can feed any reader. With
+// --health FILE the table persists between runs as text: a header line,
+// then one tab-separated line per reader.
+
+#define HEALTH_MAGIC "simreader-health"
+#define HEALTH_VERSION 1
+#define HEALTH_RECENT 8
+#define HEALTH_DEGRADED_LIMIT 3
+#define HEALTH_SLOW_FACTOR 4
+#define HEALTH_MIN_COMMANDS 100      // before latency counts
+
+enum {
+    HEALTH_OK,
+    HEALTH_QUARANTINED_ERRORS,
+    HEALTH_QUARANTINED_SLOW,
+};
+
+typedef struct {
+    reader_health_t *readers;
+    int count;
+} health_table_t;
+
+// The readers of this station, loaded from --health
+static health_table_t station_health;
+
+static reader_health_t *health_find(health_table_t *table, const char *name, int create) {
+    for (int i = 0; i < table->count; i++) {
+        if (strcmp(table->readers[i].name, name) == 0) return &table->readers[i];
+    }
+    if (!create) return NULL;
+
+    reader_health_t *readers = realloc(table->readers, (table->count + 1) * sizeof(reader_health_t));
+    if (!readers) return NULL;
+    table->readers = readers;
+    reader_health_t *h = &table->readers[table->count++];
+    memset(h, 0, sizeof(*h));
+    snprintf(h->name, sizeof(h->name), "%.255s", name);
+    return h;
+}
+
+// Load the table; a file that does not exist yet is an empty table
+static int health_load(const char *filename, health_table_t *table) {
+    FILE *in = fopen(filename, "r");
+    char line[1024];
+    int line_no = 1;
+
+    memset(table, 0, sizeof(*table));
+    if (!in) return 0;
+    if (!fgets(line, sizeof(line), in) ||
+        strncmp(line, HEALTH_MAGIC " ", strlen(HEALTH_MAGIC) + 1) != 0 ||
+        atoi(line + strlen(HEALTH_MAGIC) + 1) != HEALTH_VERSION) {
+        fprintf(stderr, "%s: not a reader health file\n", filename);
+        fclose(in);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        char *tab = strchr(line, '\t');
+        reader_health_t *h;
+        char *p;
+        int n;
+
+        line_no++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (!tab) goto malformed;
+        *tab = '\0';
+        if (!(h = health_find(table, line, 1))) break;
+        if (sscanf(tab + 1, "%lu %lu %lu %lu %lu %" SCNx32 " %d%n", &h->sessions, &h->degraded,
+                   &h->commands, &h->errors, &h->retries, &h->window, &h->quarantined, &n) != 7) {
+            goto malformed;
+        }
+        p = tab + 1 + n;
+        for (int b = 0; b < HEALTH_BUCKETS; b++) {
+            h->latency[b] = strtoul(p, &p, 10);
+            if (*p == ',') p++;
+        }
+        continue;
+
+malformed:
+        fprintf(stderr, "%s:%d: malformed line\n", filename, line_no);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+    return 0;
+}
+
+// Write the table to a temporary file that replaces the old one
+static int health_save(const char *filename, const health_table_t *table) {
+    char temp[1024];
+    FILE *out;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", filename);
+    if (!(out = fopen(temp, "w"))) {
+        fprintf(stderr, "Cannot write %s\n", temp);
+        return -1;
+    }
+    fprintf(out, "%s %d\n", HEALTH_MAGIC, HEALTH_VERSION);
+    fprintf(out, "# reader, sessions, degraded, commands, errors, retries, window, quarantine, latency histogram\n");
+    for (int i = 0; i < table->count; i++) {
+        const reader_health_t *h = &table->readers[i];
+        fprintf(out, "%s\t%lu %lu %lu %lu %lu %08" PRIx32 " %d ", h->name, h->sessions, h->degraded,
+                h->commands, h->errors, h->retries, h->window, h->quarantined);
+        for (int b = 0; b < HEALTH_BUCKETS; b++) fprintf(out, "%s%lu", b ? "," : "", h->latency[b]);
+        fputc('\n', out);
+    }
+    if (fclose(out) != 0 || rename(temp, filename) != 0) {
+        fprintf(stderr, "Cannot write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Degraded sessions among the last HEALTH_RECENT
+static int health_recent_degraded(const reader_health_t *h) {
+    int count = 0;
+    for (int b = 0; b < HEALTH_RECENT; b++) count += (h->window >> b) & 1;
+    return count;
+}
+
+// Latency percentile as the upper end of its log2 bucket, 0 without data
+static unsigned long health_percentile(const reader_health_t *h, int p) {
+    unsigned long seen = 0;
+    unsigned long rank = (h->commands * p + 99) / 100;
+
+    for (int b = 0; b < HEALTH_BUCKETS; b++) {
+        seen += h->latency[b];
+        if (seen && seen >= rank) return (2ul << b) - 1;
+    }
+    return 0;
+}
+
+static void health_begin_session(reader_health_t *h) {
+    h->session_errors = 0;
+    h->session_retries = 0;
+    current_health = h;
+}
+
+static void health_end_session(reader_health_t *h, int failed) {
+    int degraded = failed || h->session_errors || h->session_retries;
+
+    h->sessions++;
+    h->degraded += degraded;
+    h->errors += h->session_errors;
+    h->retries += h->session_retries;
+    h->window = h->window << 1 | degraded;
+    current_health = NULL;
+}
+
+static const char *health_status(const reader_health_t *h) {
+    if (h->quarantined == HEALTH_QUARANTINED_ERRORS) return "quarantined (errors)";
+    if (h->quarantined == HEALTH_QUARANTINED_SLOW) return "quarantined (slow)";
+    return health_recent_degraded(h) ? "degraded" : "ok";
+}
+
+static int compare_ulongs(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Quarantine the readers that degraded; returns the number newly
+// quarantined, each reported on stderr
+static int health_evaluate(health_table_t *table) {
+    unsigned long *medians = malloc((table->count + 1) * sizeof(unsigned long));
+    unsigned long station = 0;
+    int timed = 0;
+    int quarantined = 0;
+
+    if (!medians) return 0;
+    for (int i = 0; i < table->count; i++) {
+        if (table->readers[i].commands >= HEALTH_MIN_COMMANDS) {
+            medians[timed++] = health_percentile(&table->readers[i], 50);
+        }
+    }
+    if (timed >= 2) {
+        qsort(medians, timed, sizeof(unsigned long), compare_ulongs);
+        station = medians[timed / 2];
+    }
+    free(medians);
+
+    for (int i = 0; i < table->count; i++) {
+        reader_health_t *h = &table->readers[i];
+        if (h->quarantined) continue;
+        if (health_recent_degraded(h) >= HEALTH_DEGRADED_LIMIT) {
+            h->quarantined = HEALTH_QUARANTINED_ERRORS;
+        } else if (station && h->commands >= HEALTH_MIN_COMMANDS &&
+                   health_percentile(h, 50) > HEALTH_SLOW_FACTOR * station) {
+            h->quarantined = HEALTH_QUARANTINED_SLOW;
+        } else {
+            continue;
+        }
+        fprintf(stderr, "Reader %s %s: %d of the last %d sessions degraded, median latency %lu us\n",
+                h->name, health_status(h), health_recent_degraded(h), HEALTH_RECENT,
+                health_percentile(h, 50));
+        quarantined++;
+    }
+    return quarantined;
+}
+
+// Healthiest first: in service, fewest recent degraded sessions, fewest
+// retries per command, lowest median latency
+static int compare_health(const void *a, const void *b) {
+    const reader_health_t *x = *(reader_health_t *const *)a;
+    const reader_health_t *y = *(reader_health_t *const *)b;
+    double x_retries = x->commands ? (double)x->retries / x->commands : 0;
+    double y_retries = y->commands ? (double)y->retries / y->commands : 0;
+
+    if ((x->quarantined != 0) != (y->quarantined != 0)) return x->quarantined ? 1 : -1;
+    if (health_recent_degraded(x) != health_recent_degraded(y)) {
+        return health_recent_degraded(x) - health_recent_degraded(y);
+    }
+    if (x_retries != y_retries) return x_retries < y_retries ? -1 : 1;
+    unsigned long x_latency = health_percentile(x, 50);
+    unsigned long y_latency = health_percentile(y, 50);
+    return x_latency < y_latency ? -1 : x_latency > y_latency;
+}
+
+static void health_print(const health_table_t *table, int json) {
+    if (!json) {
+        printf("%-28s %-20s %8s %6s %9s %6s %7s %7s %7s %7s\n", "READER", "STATUS", "SESSIONS",
+               "RECENT", "COMMANDS", "ERRORS", "RETRIES", "P50 US", "P90 US", "P99 US");
+    }
+    for (int i = 0; i < table->count; i++) {
+        const reader_health_t *h = &table->readers[i];
+        if (json) {
+            printf("{\"reader\": ");
+            print_json_string(h->name);
+            printf(", \"status\": \"%s\", \"sessions\": %lu, \"degraded\": %lu, "
+                   "\"recent_degraded\": %d, \"commands\": %lu, \"errors\": %lu, \"retries\": %lu, "
+                   "\"latency_us\": {\"p50\": %lu, \"p90\": %lu, \"p99\": %lu}}\n",
+                   h->quarantined == HEALTH_QUARANTINED_ERRORS ? "quarantined_errors" :
+                   h->quarantined == HEALTH_QUARANTINED_SLOW ? "quarantined_slow" :
+                   health_recent_degraded(h) ? "degraded" : "ok",
+                   h->sessions, h->degraded, health_recent_degraded(h), h->commands, h->errors,
+                   h->retries, health_percentile(h, 50), health_percentile(h, 90),
+                   health_percentile(h, 99));
+            continue;
+        }
+        printf("%-28.28s %-20s %8lu %4d/%d %9lu %6lu %7lu %7lu %7lu %7lu\n", h->name, health_status(h),
+               h->sessions, health_recent_degraded(h), HEALTH_RECENT, h->commands, h->errors,
+               h->retries, health_percentile(h, 50), health_percentile(h, 90), health_percentile(h, 99));
+    }
+}
+
+// Whether a reader has no card, asked without waiting
+static int reader_is_empty(const char *name) {
+    SCARD_READERSTATE state;
+
+    memset(&state, 0, sizeof(state));
+    state.szReader = name;
+    state.dwCurrentState = SCARD_STATE_UNAWARE;
+    if (SCardGetStatusChange(hContext, 0, &state, 1) != SCARD_S_SUCCESS) return 0;
+    return (state.dwEventState & SCARD_STATE_EMPTY) != 0;
+}
+
+// Shared-memory output ring
+
+// --ring PATH publishes a fixed-size binary record for every card read
+// into a ring of RING_SLOTS slots in shared memory, for consumers on the
+// same host (label printers, MES bridges) that would otherwise parse the
+// text or JSON output. Consumers connect to the Unix socket PATH and
+// receive, with SCM_RIGHTS, a read-only descriptor of the ring and an
+// eventfd of their own that is signalled after every record. The ring
+// is a sealed memfd, so it has no name any other process could open and
+// consumers cannot resize it under the writer.
+//
+// The header occupies the first page; record number SEQ (from 1) is in
+// slot (SEQ - 1) % RING_SLOTS after it. Each slot is a seqlock: its
+// sequence is 0 while it is written and SEQ once it is complete, then the
+// header's head is advanced to SEQ. A consumer reads the sequence, copies
+// the record and reads the sequence again; records it falls more than
+// RING_SLOTS behind on are lost. tools/ringtail.c is a reference
+// consumer and must match these layouts.
+#if defined(__linux__)
+#define HAVE_RING 1
+// memfd_create and the seals are GNU extensions, outside _POSIX_C_SOURCE
+long syscall(long number, ...);
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+#endif
+
+#define RING_MAGIC "SRRING01"
+#define RING_VERSION 1
+#define RING_SLOTS 1024
+#define RING_HEADER_SIZE 4096
+#define RING_MAX_CONSUMERS 8
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;            // sizeof(ring_record_t)
+    uint32_t slots;
+    uint32_t header_size;            // offset of the first slot
+    uint64_t head;                   // last published sequence, 0 for none
+} ring_header_t;
+
+typedef struct {
+    uint64_t sequence;
+    uint64_t time_us;                // wall clock, microseconds since the epoch
+    int32_t result;                  // 0 when every identity file was read
+    uint32_t reserved;
+    char reader[96];
+    char iccid[24];
+    char imsi[16];
+    char msisdn[16];
+    char spn[64];
+    char operator_name[64];
+    char expect_status[16];          // --expect result, "" without --expect
+} ring_record_t;
+
+static struct {
+    int listener;
+    int fd;
+    int readonly_fd;
+    ring_header_t *header;
+    ring_record_t *slots;
+    size_t size;
+    int consumers[RING_MAX_CONSUMERS];
+    int events[RING_MAX_CONSUMERS];
+    int num_consumers;
+} ring = {-1, -1, -1, NULL, NULL, 0, {0}, {0}, 0};
+
+#ifdef HAVE_RING
+static int ring_open(const char *path) {
+    char fd_path[64];
+    struct sockaddr_un sun;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    ring.size = RING_HEADER_SIZE + RING_SLOTS * sizeof(ring_record_t);
+    ring.fd = (int)syscall(SYS_memfd_create, "simreader-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring.fd < 0 || ftruncate(ring.fd, ring.size) < 0 ||
+        fcntl(ring.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        perror("Cannot create the ring");
+        return -1;
+    }
+    // The consumers' descriptor is opened read-only, so they cannot map
+    // the ring writable
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", ring.fd);
+    if ((ring.readonly_fd = open(fd_path, O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(fd_path);
+        return -1;
+    }
+    ring.header = mmap(NULL, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, 0);
+    if (ring.header == MAP_FAILED) {
+        ring.header = NULL;
+        perror("Cannot map the ring");
+        return -1;
+    }
+    memcpy(ring.header->magic, RING_MAGIC, 8);
+    ring.header->version = RING_VERSION;
+    ring.header->record_size = sizeof(ring_record_t);
+    ring.header->slots = RING_SLOTS;
+    ring.header->header_size = RING_HEADER_SIZE;
+    ring.slots = (ring_record_t *)((char *)ring.header + RING_HEADER_SIZE);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    if ((ring.listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(ring.listener, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        listen(ring.listener, RING_MAX_CONSUMERS) < 0) {
+        perror(path);
+        return -1;
+    }
+    fcntl(ring.listener, F_SETFL, fcntl(ring.listener, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+static void ring_drop_consumer(int i) {
+    close(ring.consumers[i]);
+    close(ring.events[i]);
+    ring.num_consumers--;
+    ring.consumers[i] = ring.consumers[ring.num_consumers];
+    ring.events[i] = ring.events[ring.num_consumers];
+}
+
+// Hand new consumers the ring and an eventfd, and forget those that hung up
+static void ring_accept(void) {
+    int client;
+
+    if (ring.listener < 0) return;
+    for (int i = ring.num_consumers - 1; i >= 0; i--) {
+        struct pollfd pfd = {ring.consumers[i], POLLIN, 0};
+        char byte;
+        if (poll(&pfd, 1, 0) > 0 && recv(ring.consumers[i], &byte, 1, MSG_DONTWAIT) <= 0) {
+            ring_drop_consumer(i);
+        }
+    }
+    while ((client = accept(ring.listener, NULL, NULL)) >= 0) {
+        int event = eventfd(0, EFD_NONBLOCK);
+        int fds[2] = {ring.readonly_fd, event};
+        union {
+            struct cmsghdr header;
+            char buffer[CMSG_SPACE(sizeof(fds))];
+        } control;
+        char version = RING_VERSION;
+        struct iovec iov = {&version, 1};
+        struct msghdr msg;
+
+        if (event < 0 || ring.num_consumers == RING_MAX_CONSUMERS) {
+            if (event >= 0) close(event);
+            close(client);
+            continue;
+        }
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        if (sendmsg(client, &msg, MSG_NOSIGNAL) != 1) {
+            close(event);
+            close(client);
+            continue;
+        }
+        ring.consumers[ring.num_consumers] = client;
+        ring.events[ring.num_consumers++] = event;
+    }
+}
+
+static void ring_publish(const ring_record_t *record) {
+    uint64_t sequence = ring.header->head + 1;
+    ring_record_t *slot = &ring.slots[(sequence - 1) % RING_SLOTS];
+    uint64_t one = 1;
+
+    ring_accept();
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)slot + sizeof(slot->sequence), (const char *)record + sizeof(record->sequence),
+           sizeof(*record) - sizeof(record->sequence));
+    __atomic_store_n(&slot->sequence, sequence, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring.header->head, sequence, __ATOMIC_RELEASE);
+    for (int i = 0; i < ring.num_consumers; i++) {
+        if (write(ring.events[i], &one, sizeof(one)) < 0) continue;
+    }
+}
+#else
+static int ring_open(const char *path) {
+    (void)path;
+    fprintf(stderr, "--ring is not supported on this system\n");
+    return -1;
+}
+
+static void ring_accept(void) {
+}
+
+static void ring_publish(const ring_record_t *record) {
+    (void)record;
+}
+#endif
+
+// Publish the identity read from a card
+static void ring_publish_card(const char *reader, const sim_data_t *sim_data) {
+    ring_record_t record;
+    struct timespec now;
+
+    if (!ring.header) return;
+    memset(&record, 0, sizeof(record));
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    record.result = sim_data->iccid[0] && sim_data->imsi[0] ? 0 : -1;
+    snprintf(record.reader, sizeof(record.reader), "%s", reader);
+    snprintf(record.iccid, sizeof(record.iccid), "%s", sim_data->iccid);
+    snprintf(record.imsi, sizeof(record.imsi), "%s", sim_data->imsi);
+    snprintf(record.msisdn, sizeof(record.msisdn), "%s", sim_data->msisdn);
+    snprintf(record.spn, sizeof(record.spn), "%s", sim_data->spn);
+    if (sim_data->info.operator_name) {
+        snprintf(record.operator_name, sizeof(record.operator_name), "%s", sim_data->info.operator_name);
+    }
+    if (sim_data->expect_status) {
+        snprintf(record.expect_status, sizeof(record.expect_status), "%s", sim_data->expect_status);
+    }
+    ring_publish(&record);
+}
+
+// Dashboard
+
+// --dashboard keeps a table of the station on standard error (in the
+// terminal's alternate screen): the state of each reader, the card in it,
+// cards per hour and session time percentiles over its last
+// DASHBOARD_WINDOW sessions, and its APDU rate. It is redrawn from the
+// metrics counters at most every DASHBOARD_INTERVAL_US, between card
+// sessions and while --watch waits, so it never delays a command. The
+// reader with the slowest median session is marked with '>'.
+
+#define DASHBOARD_INTERVAL_US 500e3
+#define DASHBOARD_WINDOW 64
+
+enum { DASHBOARD_IDLE, DASHBOARD_READING, DASHBOARD_ERROR };
+
+typedef struct {
+    reader_health_t *health;
+    int state;
+    char iccid[21];
+    unsigned long cards;
+    double session_us[DASHBOARD_WINDOW];  // ring of the last session times
+    double ended_us[DASHBOARD_WINDOW];    // and when they ended
+    unsigned long commands_seen;          // commands at the last rate update
+    double apdu_rate;
+    double p50, p99;                      // session time percentiles, in ms
+} dashboard_reader_t;
+
+static dashboard_reader_t *dashboard;
+static int dashboard_count;
+static double dashboard_start_us;
+static double dashboard_drawn_us;
+static double dashboard_rate_us;
+
+static dashboard_reader_t *dashboard_find(const reader_health_t *h) {
+    for (int i = 0; i < dashboard_count; i++) {
+        if (dashboard[i].health == h) return &dashboard[i];
+    }
+    return NULL;
+}
+
+// Percentiles of the session times in the window, in ms
+static void dashboard_percentiles(const dashboard_reader_t *d, double *p50, double *p99) {
+    double sorted[DASHBOARD_WINDOW];
+    int n = d->cards < DASHBOARD_WINDOW ? (int)d->cards : DASHBOARD_WINDOW;
+
+    *p50 = *p99 = 0;
+    if (!n) return;
+    memcpy(sorted, d->session_us, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    *p50 = percentile(sorted, n, 50) / 1000;
+    *p99 = percentile(sorted, n, 99) / 1000;
+}
+
+// Cards per hour over the window, or since the start while it fills
+static double dashboard_cards_per_hour(const dashboard_reader_t *d, double now) {
+    if (d->cards <= DASHBOARD_WINDOW) {
+        return now > dashboard_start_us ? d->cards * 3600e6 / (now - dashboard_start_us) : 0;
+    }
+    double oldest = d->ended_us[d->cards % DASHBOARD_WINDOW];
+    return (DASHBOARD_WINDOW - 1) * 3600e6 / (now - oldest);
+}
+
+static void dashboard_draw(int force) {
+    static const char *states[] = {"idle", "reading", "error"};
+    double now = monotonic_us();
+    double station_rate = 0;
+    int slowest = -1;
+
+    if (!dashboard || (!force && now - dashboard_drawn_us < DASHBOARD_INTERVAL_US)) return;
+    if (now - dashboard_rate_us >= DASHBOARD_INTERVAL_US) {
+        for (int i = 0; i < dashboard_count; i++) {
+            dashboard_reader_t *d = &dashboard[i];
+            d->apdu_rate = (d->health->commands - d->commands_seen) * 1e6 / (now - dashboard_rate_us);
+            d->commands_seen = d->health->commands;
+        }
+        dashboard_rate_us = now;
+    }
+    for (int i = 0; i < dashboard_count; i++) {
+        dashboard_reader_t *d = &dashboard[i];
+        dashboard_percentiles(d, &d->p50, &d->p99);
+        station_rate += dashboard_cards_per_hour(d, now);
+        if (dashboard_count > 1 && d->cards && (slowest < 0 || d->p50 > dashboard[slowest].p50)) slowest = i;
+    }
+
+    long uptime = (long)((now - dashboard_start_us) / 1e6);
+    fprintf(stderr, "\033[Hsimreader station  up %ld:%02ld:%02ld  cards %lu ok %lu failed  %.0f/h  queue %d\033[K\n\033[K\n",
+            uptime / 3600, uptime / 60 % 60, uptime % 60, metrics.cards_ok, metrics.cards_failed,
+            station_rate, metrics.queue_depth);
+    fprintf(stderr, "  %-28s %-22s %-20s %6s %7s %7s %7s %7s\033[K\n", "READER", "STATE", "CARD", "CARDS",
+            "CARDS/H", "P50 MS", "P99 MS", "APDU/S");
+    for (int i = 0; i < dashboard_count; i++) {
+        const dashboard_reader_t *d = &dashboard[i];
+        const char *state = d->health->quarantined ? health_status(d->health) : states[d->state];
+
+        fprintf(stderr, "%c %-28.28s %-22s %-20s %6lu %7.0f %7.1f %7.1f %7.0f\033[K\n", i == slowest ? '>' : ' ',
+                d->health->name, state, d->iccid[0] ? d->iccid : "-", d->cards,
+                dashboard_cards_per_hour(d, now), d->p50, d->p99, d->apdu_rate);
+    }
+    fprintf(stderr, "\033[J");
+    fflush(stderr);
+    dashboard_drawn_us = now;
+}
+
+// Switch to the alternate screen and track the readers in order
+static int dashboard_open(reader_health_t **order, int count) {
+    if (!(dashboard = calloc(count ? count : 1, sizeof(dashboard_reader_t)))) return -1;
+    dashboard_count = count;
+    for (int i = 0; i < count; i++) {
+        dashboard[i].health = order[i];
+        dashboard[i].commands_seen = order[i]->commands;
+    }
+    dashboard_start_us = dashboard_rate_us = monotonic_us();
+    fprintf(stderr, "\033[?1049h\033[?25l");
+    dashboard_draw(1);
+    return 0;
+}
+
+static void dashboard_close(void) {
+    if (!dashboard) return;
+    fprintf(stderr, "\033[?25h\033[?1049l");
+    fflush(stderr);
+    free(dashboard);
+    dashboard = NULL;
+    dashboard_count = 0;
+}
+
+static void dashboard_begin_session(const reader_health_t *h) {
+    dashboard_reader_t *d = dashboard_find(h);
+
+    if (!d) return;
+    d->state = DASHBOARD_READING;
+    snprintf(d->iccid, sizeof(d->iccid), "%s", metrics.iccid);
+    dashboard_draw(1);
+}
+
+static void dashboard_end_session(const reader_health_t *h, double us, int ok) {
+    dashboard_reader_t *d = dashboard_find(h);
+
+    if (!d) return;
+    d->state = ok ? DASHBOARD_IDLE : DASHBOARD_ERROR;
+    if (metrics.iccid[0]) snprintf(d->iccid, sizeof(d->iccid), "%s", metrics.iccid);
+    d->session_us[d->cards % DASHBOARD_WINDOW] = us;
+    d->ended_us[d->cards % DASHBOARD_WINDOW] = monotonic_us();
+    d->cards++;
+}
+
+// Metrics
+
+// Counters and histograms in the Prometheus text format: card sessions by
+// result, APDUs by INS, responses by SW1, session time, the queue of cards
+// waiting for a reader and the health of every reader. --metrics FILE
+// rewrites a textfile (for the node_exporter textfile collector) every
+// METRICS_INTERVAL_US and at exit; --metrics-listen serves the same text
+// over HTTP on a Unix socket or a local TCP port. The program is single
+// threaded, so scrapes are answered between card sessions. Nothing there
+// waits for a client: connections are kept until their request arrives
+// (or METRICS_REQUEST_WAIT_US passes, for clients that only read), and a
+// client that does not take the response is dropped after
+// METRICS_SEND_TIMEOUT_MS.
+
+#define METRICS_INTERVAL_US 15e6
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_REQUEST_WAIT_US 5e5
+#define METRICS_SEND_TIMEOUT_MS 50
+
+typedef struct {
+    int fd;
+    double accepted_us;
+} metrics_client_t;
+
+static int metrics_listener = -1;
+static metrics_client_t metrics_clients[METRICS_MAX_CLIENTS];
+static int metrics_num_clients;
+static double metrics_written_us;
+static time_t metrics_start_time;
+
+static void metrics_session(double us, int ok) {
+    int bucket = 0;
+
+    while (bucket < METRICS_BUCKETS - 1 && us >= 1000.0 * (1u << bucket)) bucket++;
+    metrics.session_ms[bucket]++;
+    metrics.session_seconds += us / 1e6;
+    if (ok) metrics.cards_ok++;
+    else metrics.cards_failed++;
+}
+
+// Session time below which p percent of the sessions finished, as the
+// upper end of its bucket
+static double metrics_session_quantile(double p) {
+    unsigned long total = metrics.cards_ok + metrics.cards_failed;
+    unsigned long seen = 0;
+
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += metrics.session_ms[b];
+        if (seen && seen >= p * total) return (1u << b) / 1000.0;
+    }
+    return 0;
+}
+
+static void metrics_label(FILE *out, const char *value) {
+    for (; *value; value++) {
+        if (*value == '"' || *value == '\\') fputc('\\', out);
+        fputc(*value, out);
+    }
+}
+
+static void metrics_format(FILE *out) {
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+    unsigned long cumulative = 0;
+
+    fprintf(out, "# HELP simreader_start_time_seconds Start of the process since the epoch.\n");
+    fprintf(out, "# TYPE simreader_start_time_seconds gauge\n");
+    fprintf(out, "simreader_start_time_seconds %ld\n", (long)metrics_start_time);
+    fprintf(out, "# HELP simreader_cards_total Card sessions by result.\n");
+    fprintf(out, "# TYPE simreader_cards_total counter\n");
+    fprintf(out, "simreader_cards_total{result=\"ok\"} %lu\n", metrics.cards_ok);
+    fprintf(out, "simreader_cards_total{result=\"failed\"} %lu\n", metrics.cards_failed);
+
+    fprintf(out, "# HELP simreader_apdus_total Commands sent, by instruction byte.\n");
+    fprintf(out, "# TYPE simreader_apdus_total counter\n");
+    for (int ins = 0; ins < 256; ins++) {
+        if (metrics.apdus[ins]) fprintf(out, "simreader_apdus_total{ins=\"%02X\"} %lu\n", ins, metrics.apdus[ins]);
+    }
+    fprintf(out, "# HELP simreader_status_words_total Responses by status word class (SW1).\n");
+    fprintf(out, "# TYPE simreader_status_words_total counter\n");
+    for (int sw1 = 0; sw1 < 256; sw1++) {
+        if (metrics.status_words[sw1]) {
+            fprintf(out, "simreader_status_words_total{class=\"%02XXX\"} %lu\n", sw1, metrics.status_words[sw1]);
+        }
+    }
+    fprintf(out, "# HELP simreader_transport_errors_total Commands that got no response.\n");
+    fprintf(out, "# TYPE simreader_transport_errors_total counter\n");
+    fprintf(out, "simreader_transport_errors_total %lu\n", metrics.transport_errors);
+
+    fprintf(out, "# HELP simreader_session_seconds Time to process one card.\n");
+    fprintf(out, "# TYPE simreader_session_seconds histogram\n");
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+        cumulative += metrics.session_ms[b];
+        fprintf(out, "simreader_session_seconds_bucket{le=\"%g\"} %lu\n", (1u << b) / 1000.0, cumulative);
+    }
+    fprintf(out, "simreader_session_seconds_bucket{le=\"+Inf\"} %lu\n", metrics.cards_ok + metrics.cards_failed);
+    fprintf(out, "simreader_session_seconds_sum %.6f\n", metrics.session_seconds);
+    fprintf(out, "simreader_session_seconds_count %lu\n", metrics.cards_ok + metrics.cards_failed);
+    fprintf(out, "# HELP simreader_session_quantile_seconds Session time percentiles (bucket upper bounds).\n");
+    fprintf(out, "# TYPE simreader_session_quantile_seconds gauge\n");
+    for (int q = 0; q < 3; q++) {
+        fprintf(out, "simreader_session_quantile_seconds{quantile=\"%g\"} %g\n", quantiles[q],
+                metrics_session_quantile(quantiles[q]));
+    }
+    fprintf(out, "# HELP simreader_queue_depth Inserted cards waiting for their session.\n");
+    fprintf(out, "# TYPE simreader_queue_depth gauge\n");
+    fprintf(out, "simreader_queue_depth %d\n", metrics.queue_depth);
+
+    if (!station_health.count) return;
+    static const struct {
+        const char *name;
+        const char *help;
+    } reader_metrics[] = {
+        {"simreader_reader_sessions_total", "Card sessions per reader."},
+        {"simreader_reader_degraded_sessions_total", "Sessions with retries, errors or a failure."},
+        {"simreader_reader_commands_total", "Commands sent per reader."},
+        {"simreader_reader_errors_total", "Commands that failed after their retries."},
+        {"simreader_reader_retries_total", "Commands retried after a communication error."},
+        {"simreader_reader_quarantined", "1 when the reader is quarantined."},
+        {"simreader_reader_latency_seconds", "Command latency percentiles (bucket upper bounds)."},
+    };
+    for (int m = 0; m < (int)(sizeof(reader_metrics) / sizeof(reader_metrics[0])); m++) {
+        fprintf(out, "# HELP %s %s\n", reader_metrics[m].name, reader_metrics[m].help);
+        fprintf(out, "# TYPE %s %s\n", reader_metrics[m].name, m < 5 ? "counter" : "gauge");
+        for (int i = 0; i < station_health.count; i++) {
+            const reader_health_t *h = &station_health.readers[i];
+            unsigned long values[] = {h->sessions, h->degraded, h->commands, h->errors, h->retries,
+                                      h->quarantined != 0};
+            if (m < 6) {
+                fprintf(out, "%s{reader=\"", reader_metrics[m].name);
+                metrics_label(out, h->name);
+                fprintf(out, "\"} %lu\n", values[m]);
+                continue;
+            }
+            for (int q = 0; q < 3; q++) {
+                fprintf(out, "%s{reader=\"", reader_metrics[m].name);
+                metrics_label(out, h->name);
+                fprintf(out, "\",quantile=\"%g\"} %g\n", quantiles[q],
+                        health_percentile(h, (int)(quantiles[q] * 100 + 0.5)) / 1e6);
+            }
+        }
+    }
+}
+
+// Replace the textfile in one rename, so a collector never reads half of it
+static int metrics_write_file(const char *filename) {
+    char temp[1024];
+    FILE *out;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", filename);
+    if (!(out = fopen(temp, "w"))) {
+        fprintf(stderr, "Cannot write metrics %s\n", temp);
+        return -1;
+    }
+    metrics_format(out);
+    if (fclose(out) != 0 || rename(temp, filename) != 0) {
+        fprintf(stderr, "Cannot write metrics %s\n", filename);
+        return -1;
+    }
+    metrics_written_us = monotonic_us();
+    return 0;
+}
+
+// Listen on "unix:PATH" (or an absolute path), "HOST:PORT" or "PORT" (on
+// 127.0.0.1)
+static int metrics_open_listener(const char *address) {
+    int fd;
+
+    if (strncmp(address, "unix:", 5) == 0 || address[0] == '/') {
+        struct sockaddr_un sun;
+        const char *path = address[0] == '/' ? address : address + 5;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "Socket path too long: %s\n", path);
+            return -1;
+        }
+        strcpy(sun.sun_path, path);
+        unlink(path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) goto failed;
+    } else {
+        struct sockaddr_in sin;
+        char host[64] = "127.0.0.1";
+        const char *colon = strrchr(address, ':');
+        int one = 1;
+
+        if (colon) snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        long port = atol(colon ? colon + 1 : address);
+        sin.sin_port = htons(port);
+        if (port < 1 || port > 65535 || inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+            fprintf(stderr, "Invalid metrics address %s\n", address);
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) goto failed;
+    }
+    if (listen(fd, METRICS_MAX_CLIENTS) < 0) goto failed;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+
+failed:
+    perror(address);
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+// Answer the scrapes that are ready: HTTP for clients that sent a GET
+// request, the bare text for those that only read
+static void metrics_serve(void) {
+    struct timeval timeout = {0, METRICS_SEND_TIMEOUT_MS * 1000};
+    char *text = NULL;
+    size_t text_len = 0;
+    double now = monotonic_us();
+    int client;
+
+    while (metrics_num_clients < METRICS_MAX_CLIENTS &&
+           (client = accept(metrics_listener, NULL, NULL)) >= 0) {
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        metrics_clients[metrics_num_clients].fd = client;
+        metrics_clients[metrics_num_clients++].accepted_us = now;
+    }
+
+    for (int i = 0; i < metrics_num_clients;) {
+        char request[1024];
+        ssize_t n;
+
+        client = metrics_clients[i].fd;
+        n = recv(client, request, sizeof(request), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            now - metrics_clients[i].accepted_us < METRICS_REQUEST_WAIT_US) {
+            i++;
+            continue;
+        }
+        metrics_clients[i] = metrics_clients[--metrics_num_clients];
+        if (!text) {
+            FILE *out = open_memstream(&text, &text_len);
+            if (!out) {
+                close(client);
+                continue;
+            }
+            metrics_format(out);
+            fclose(out);
+        }
+        if (n >= 4 && memcmp(request, "GET ", 4) == 0) {
+            char header[128];
+            int len = snprintf(header, sizeof(header),
+                               "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n\r\n", text_len);
+            send(client, header, len, MSG_NOSIGNAL);
+        }
+        for (size_t sent = 0; sent < text_len;) {
+            ssize_t w = send(client, text + sent, text_len - sent, MSG_NOSIGNAL);
+            if (w <= 0) break;
+            sent += w;
+        }
+        close(client);
+    }
+    free(text);
+}
+
+// Serve scrapes, rewrite the textfile, redraw the dashboard and take new
+// ring consumers when due
+static void metrics_poll(const config_t *config) {
+    dashboard_draw(0);
+    ring_accept();
+    if (metrics_listener >= 0) metrics_serve();
+    if (config->metrics_file && monotonic_us() - metrics_written_us >= METRICS_INTERVAL_US) {
+        metrics_write_file(config->metrics_file);
+    }
+}
+
+// Explore common SIM/USIM files
+static void explore_sim_files(int verbose) {
+    printf("\n=== Exploring SIM/USIM File Structure ===\n");
+    
+    // Common files to check
+    struct {
+        BYTE id[2];
+        const char *name;
+        const char *description;
+    } files_to_check[] = {
+        {{0x2F, 0xE2}, "EF_ICCID", "SIM Card Serial Number"},
+        {{0x2F, 0x05}, "EF_PL", "Preferred Languages"},
+        {{0x2F, 0x06}, "EF_ICCID", "ICCID (alternative location)"},
+        {{0x3F, 0x00}, "MF", "Master File"},
+        {{0x7F, 0x20}, "DF_GSM", "GSM Directory"},
+        {{0x7F, 0x10}, "DF_TELECOM", "Telecom Directory"},
+        {{0x6F, 0x07}, "EF_IMSI", "International Mobile Subscriber Identity"},
+        {{0x6F, 0x46}, "EF_SPN", "Service Provider Name"},
+        {{0x6F, 0x3A}, "EF_ADN", "Abbreviated Dialing Numbers (Contacts)"},
+        {{0x6F, 0x3B}, "EF_FDN", "Fixed Dialing Numbers"},
+        {{0x6F, 0x3C}, "EF_SMS", "SMS Messages"},
+        {{0x6F, 0x49}, "EF_SDN", "Service Dialing Numbers"},
+        {{0x6F, 0x44}, "EF_LDN", "Last Dialed Numbers"},
+        {{0x6F, 0x40}, "EF_MSISDN", "Subscriber Phone Number"},
+        {{0x6F, 0x45}, "EF_EXT1", "Extension 1"},
+        {{0x6F, 0x47}, "EF_SMSR", "SMS Status Reports"},
+        {{0x6F, 0x74}, "EF_PLMNwAcT", "PLMN Selector"},
+        {{0x6F, 0x78}, "EF_ACC", "Access Control Class"},
+        {{0x6F, 0x7B}, "EF_FPLMN", "Forbidden PLMNs"},
+        {{0x6F, 0x7E}, "EF_LOCI", "Location Information"},
+        {{0x6F, 0xAD}, "EF_AD", "Administrative Data"},
+        {{0x6F, 0xAE}, "EF_PHASE", "Phase Identification"},
+        {{0x6F, 0xB1}, "EF_VGCS", "Voice Group Call Service"},
+        {{0x6F, 0xB2}, "EF_VGCSS", "VGCS Status"},
+        {{0x6F, 0xB3}, "EF_VBS", "Voice Broadcast Service"},
+        {{0x6F, 0xB4}, "EF_VBSS", "VBS Status"},
+        {{0x6F, 0xB5}, "EF_eMLPP", "enhanced Multi Level Precedence"},
+        {{0x6F, 0xB6}, "EF_AAeM", "Automatic Answer for eMLPP"},
+        {{0x6F, 0xB7}, "EF_ECC", "Emergency Call Codes"},
+        {{0x6F, 0x20}, "EF_CK", "Ciphering Key"},
+        {{0x6F, 0x21}, "EF_IMSI", "IMSI (alternative location)"},
+        {{0x6F, 0x22}, "EF_Kc", "Ciphering Key (GPRS)"},
+        {{0x6F, 0x23}, "EF_PUNCT", "Punctuation"},
+        {{0x6F, 0x24}, "EF_SME", "Short Message Entity"},
+        {{0x6F, 0x25}, "EF_SMSP", "Short Message Service Parameters"},
+        {{0x6F, 0x26}, "EF_SMSS", "SMS Status"},
+        {{0x6F, 0x30}, "EF_LP", "Language Preference"},
+        {{0x6F, 0x31}, "EF_PLMNsel", "PLMN Selector"},
+        {{0x6F, 0x32}, "EF_FPLMNsel", "Forbidden PLMN Selector"},
+        {{0x6F, 0x33}, "EF_PLMNwAcT", "PLMN with Access Technology"},
+        {{0x6F, 0x35}, "EF_OPLMNwAcT", "Operator PLMN with Access Technology"},
+        {{0x6F, 0x36}, "EF_HPLMNwAcT", "HPLMN with Access Technology"},
+        {{0x6F, 0x37}, "EF_CPBCCH", "CPBCCH Information"},
+        {{0x6F, 0x38}, "EF_INVSCAN", "Inquiry Scan"},
+        {{0x6F, 0x39}, "EF_PNN", "PLMN Network Name"},
+        {{0x6F, 0x3E}, "EF_OPL", "Operator PLMN List"},
+        {{0x6F, 0x41}, "EF_EXT2", "Extension 2"},
+        {{0x6F, 0x42}, "EF_EXT3", "Extension 3"},
+        {{0x6F, 0x43}, "EF_EXT4", "Extension 4"},
+        {{0x6F, 0x48}, "EF_SUME", "Setup Menu Elements"},
+        {{0x6F, 0x4A}, "EF_EXT5", "Extension 5"},
+        {{0x6F, 0x4B}, "EF_EXT6", "Extension 6"},
+        {{0x6F, 0x4C}, "EF_MMI", "Man Machine Interface"},
+        {{0x6F, 0x4D}, "EF_MMSN", "MMS Notification"},
+        {{0x6F, 0x4E}, "EF_MMSICP", "MMS ICP"},
+        {{0x6F, 0x4F}, "EF_MMSUP", "MMS User Preferences"},
+        {{0x6F, 0x50}, "EF_MMSUCP", "MMS User Connectivity Preferences"},
+    };
+    
+    int num_files = sizeof(files_to_check) / sizeof(files_to_check[0]);
+    int found_files = 0;
+    
+    for (int i = 0; i < num_files; i++) {
+        if (select_file_traditional(files_to_check[i].id, files_to_check[i].name, verbose) == 0) {
+            found_files++;
+            printf("✓ %s (%s) - %s\n", files_to_check[i].name, 
+                   files_to_check[i].description, 
+                   files_to_check[i].id[0] < 0x7F ? "Transparent File" : "Dedicated File");
+            printf("\n");
+        }
+    }
+    
+    printf("Found %d accessible files out of %d checked\n", found_files, num_files);
+}
+
+// Universal data extraction functions (try both methods)
+static int get_iccid(sim_data_t *sim_data, int verbose) {
+    BYTE iccid[] = {0x2F, 0xE2};
+    BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+    BYTE data[20];
+    int len;
+    
+    // Try traditional selection first
+    if (select_file_traditional(iccid, "EF_ICCID", verbose) == 0) {
+        if (read_binary(data, 20, &len, verbose) == 0) {
+            print_hex_verbose("ICCID raw", data, len, verbose);
+            if (decode_iccid(data, len, sim_data->iccid) == 0) {
+                return 0;
+            }
+        }
+    }
+    
+    // Try path-based selection
+    if (select_file_by_path(iccid_path, 4, "EF_ICCID", verbose) == 0) {
+        if (read_binary(data, 20, &len, verbose) == 0) {
+            print_hex_verbose("ICCID raw", data, len, verbose);
+            if (decode_iccid(data, len, sim_data->iccid) == 0) {
+                return 0;
+            }
+        }
+    }
+    
+    if (verbose) printf("Failed to read EF_ICCID\n");
+    return -1;
+}
+
+static int get_imsi(sim_data_t *sim_data, int verbose) {
+    BYTE imsi[] = {0x6F, 0x07};
+    BYTE imsi_path[] = {0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x07};
+    BYTE data[20];
+    int len;
+    
+    // Try traditional selection first
+    if (select_file_traditional(imsi, "EF_IMSI", verbose) == 0) {
+        if (read_binary(data, 20, &len, verbose) == 0) {
+            print_hex_verbose("IMSI raw", data, len, verbose);
+            if (decode_imsi(data, len, sim_data->imsi) == 0) {
+                return 0;
+            }
+        }
+    }
+    
+    // Try path-based selection
+    if (select_file_by_path(imsi_path, 6, "EF_IMSI", verbose) == 0) {
+        if (read_binary(data, 20, &len, verbose) == 0) {
+            print_hex_verbose("IMSI raw", data, len, verbose);
+            if (decode_imsi(data, len, sim_data->imsi) == 0) {
+                return 0;
+            }
+        }
+    }
+    
+    if (verbose) printf("Failed to read EF_IMSI\n");
+    return -1;
+}
+
+static int get_msisdn(sim_data_t *sim_data, int verbose) {
+    BYTE msisdn[] = {0x6F, 0x40};
+    BYTE msisdn_path[] = {0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x40};
+    BYTE data[20];
+    int len;
+    
+    // Try traditional selection first
+    if (select_file_traditional(msisdn, "EF_MSISDN", verbose) == 0) {
+        if (read_binary(data, 20, &len, verbose) == 0) {
+            print_hex_verbose("MSISDN raw", data, len, verbose);
+            // Simple MSISDN decoding
+            if (len > 2) {
+                int num_len = data[0];
+                if (num_len > 0 && num_len < len - 2) {
+                    bytes_to_bcd(data + 2, num_len, sim_data->msisdn);
+                    return 0;
+                }
+            }
+        }
+    }
+    
+    // Try path-based selection
+    if (select_file_by_path(msisdn_path, 6, "EF_MSISDN", verbose) == 0) {
+        if (read_binary(data, 20, &len, verbose) == 0) {
+            print_hex_verbose("MSISDN raw", data, len, verbose);
+            // Simple MSISDN decoding
+            if (len > 2) {
+                int num_len = data[0];
+                if (num_len > 0 && num_len < len - 2) {
+                    bytes_to_bcd(data + 2, num_len, sim_data->msisdn);
+                    return 0;
+                }
+            }
+        }
+    }
+    
+    if (verbose) printf("Failed to read EF_MSISDN\n");
+    return -1;
+}
+
+static int get_spn(sim_data_t *sim_data, int verbose) {
+    BYTE spn[] = {0x6F, 0x46};
+    BYTE spn_path[] = {0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x46};
+    BYTE data[20];
+    int len;
+    
+    // Try traditional selection first
+    if (select_file_traditional(spn, "EF_SPN", verbose) == 0) {
+        if (read_binary(data, 20, &len, verbose) == 0) {
+            print_hex_verbose("SPN raw", data, len, verbose);
+            // Display condition, then the name as an FF padded alpha field
+            if (len > 1) {
+                decode_alpha(data + 1, len - 1, sim_data->spn, sizeof(sim_data->spn));
+                return 0;
+            }
+        }
+    }
+    
+    // Try path-based selection
+    if (select_file_by_path(spn_path, 6, "EF_SPN", verbose) == 0) {
+        if (read_binary(data, 20, &len, verbose) == 0) {
+            print_hex_verbose("SPN raw", data, len, verbose);
+            // Display condition, then the name as an FF padded alpha field
+            if (len > 1) {
+                decode_alpha(data + 1, len - 1, sim_data->spn, sizeof(sim_data->spn));
+                return 0;
+            }
+        }
+    }
+    
+    if (verbose) printf("Failed to read EF_SPN\n");
+    return -1;
+}
+
+// Network state files in the USIM and in DF_GSM (00 00: none)
+static const struct {
+    BYTE usim_fid[2];
+    BYTE gsm_fid[2];
+    void (*decode)(const snap_file_t *file, network_info_t *net);
+} network_files[] = {
+    {{0x6F, 0xAD}, {0x6F, 0xAD}, decode_ad},
+    {{0x6F, 0x7E}, {0x6F, 0x7E}, decode_loci},
+    {{0x6F, 0x73}, {0x6F, 0x53}, decode_psloci},
+    {{0x6F, 0xE3}, {0x00, 0x00}, decode_epsloci},
+    {{0x6F, 0x78}, {0x6F, 0x78}, decode_acc},
+    {{0x6F, 0xB7}, {0x6F, 0xB7}, decode_ecc},
+};
+
+// Read EF_AD, the location information files, EF_ACC and EF_ECC from the
+// USIM (DF_GSM without it) and split the IMSI into MCC/MNC
+static int get_network_info(sim_data_t *sim_data, int verbose) {
+    network_info_t *net = &sim_data->net;
+    int usim = select_usim(verbose) == 0;
+    int found = 0;
+
+    network_info_init(net);
+    for (size_t i = 0; i < sizeof(network_files) / sizeof(network_files[0]); i++) {
+        const BYTE *fid = usim ? network_files[i].usim_fid : network_files[i].gsm_fid;
+        BYTE path[] = {0x3F, 0x00, 0x7F, usim ? 0xFF : 0x20, fid[0], fid[1]};
+        snap_file_t file;
+
+        if (fid[0] == 0x00) continue;
+        if (read_ef(&file, path, sizeof(path), verbose) == 0) {
+            network_files[i].decode(&file, net);
+            found++;
+        }
+        free(file.data);
+    }
+
+    split_imsi(sim_data->imsi, net);
+    if (verbose && !found) printf("Failed to read network state files\n");
+    return found ? 0 : -1;
+}
+
+// ISIM data objects are TLVs with tag 80 holding UTF-8 text
+static void decode_ims_tlv(const BYTE *data, int len, char *output, int max_len) {
+    output[0] = '\0';
+    if (len < 2 || data[0] != 0x80 || data[1] == 0xFF || 2 + data[1] > len) return;
+    int n = data[1] < max_len ? data[1] : max_len - 1;
+    memcpy(output, data + 2, n);
+    output[n] = '\0';
+}
+
+// Read the IMS identities from the ISIM, on the current channel
+static int read_ims(ims_info_t *ims, int verbose) {
+    static const BYTE impi_path[] = {0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x02};
+    static const BYTE domain_path[] = {0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x03};
+    static const BYTE impu_path[] = {0x3F, 0x00, 0x7F, 0xFF, 0x6F, 0x04};
+    snap_file_t file;
+
+    memset(ims, 0, sizeof(*ims));
+    if (select_app(APP_ISIM, verbose) < 0) {
+        if (verbose) printf("No ISIM application found\n");
+        return -1;
+    }
+    ims->present = 1;
+    if (read_ef(&file, impi_path, sizeof(impi_path), verbose) == 0) {
+        decode_ims_tlv(file.data, file.data_len, ims->impi, sizeof(ims->impi));
+    }
+    free(file.data);
+    if (read_ef(&file, domain_path, sizeof(domain_path), verbose) == 0) {
+        decode_ims_tlv(file.data, file.data_len, ims->domain, sizeof(ims->domain));
+    }
+    free(file.data);
+    if (read_ef(&file, impu_path, sizeof(impu_path), verbose) == 0 && file.record_len > 0) {
+        for (int rec = 0; rec < file.num_records && ims->num_impu < MAX_IMPU &&
+             (rec + 1) * file.record_len <= file.data_len; rec++) {
+            decode_ims_tlv(file.data + rec * file.record_len, file.record_len,
+                           ims->impu[ims->num_impu], sizeof(ims->impu[0]));
+            if (ims->impu[ims->num_impu][0]) ims->num_impu++;
+        }
+    }
+    free(file.data);
+    return 0;
+}
+
+// Next BER-TLV object in [*p, end): one or two byte tag, value and its
+// length. NULL at the end or on a malformed object.
+static const BYTE *ber_next(const BYTE **p, const BYTE *end, unsigned int *tag, int *len) {
+    const BYTE *q = *p;
+    int l;
+
+    if (end - q < 2) return NULL;
+    *tag = *q++;
+    if ((*tag & 0x1F) == 0x1F) *tag = (*tag << 8) | *q++;
+    if (q >= end) return NULL;
+    l = *q++;
+    if (l == 0x81 && q < end) {
+        l = *q++;
+    } else if (l == 0x82 && end - q >= 2) {
+        l = (q[0] << 8) | q[1];
+        q += 2;
+    } else if (l >= 0x80) {
+        return NULL;
+    }
+    if (l > end - q) return NULL;
+    *len = l;
+    *p = q + l;
+    return q;
+}
+
+// The value of the first object with the given tag in [data, data + len)
+static const BYTE *ber_find(const BYTE *data, int len, unsigned int tag, int *value_len) {
+    const BYTE *p = data;
+    const BYTE *v;
+    unsigned int t;
+
+    while ((v = ber_next(&p, data + len, &t, value_len))) {
+        if (t == tag) return v;
+    }
+    return NULL;
+}
+
+static void ber_string(const BYTE *data, int len, char *out, int out_size) {
+    if (len >= out_size) len = out_size - 1;
+    memcpy(out, data, len);
+    out[len] = '\0';
+}
+
+// Call an ES10 function with one STORE DATA block and collect the complete
+// response, which exchange_apdu follows through 61xx GET RESPONSE chaining
+static int es10_call(const BYTE *request, int request_len, BYTE *response, int max_len, int *response_len) {
+    BYTE apdu[6 + 255];
+    int apdu_len = 0;
+    WORD sw;
+
+    if (request_len > 255) return -1;
+    apdu[apdu_len++] = 0x80;
+    apdu[apdu_len++] = 0xE2;
+    apdu[apdu_len++] = 0x91;   // last block, BER-TLV
+    apdu[apdu_len++] = 0x00;   // block number
+    apdu[apdu_len++] = request_len;
+    memcpy(apdu + apdu_len, request, request_len);
+    apdu_len += request_len;
+    if (dwActiveProtocol != SCARD_PROTOCOL_T0) {
+        apdu[apdu_len++] = 0x00;  // Le (T=0 uses GET RESPONSE instead)
+    }
+    if (exchange_apdu(apdu, apdu_len, response, max_len, response_len, &sw) < 0 || sw != 0x9000) {
+        return -1;
+    }
+    return 0;
+}
+
+// Read the EID and the profile list from the ISD-R, on the current channel
+static int read_euicc(euicc_info_t *euicc, int verbose) {
+    static const BYTE isd_r[] = {0xA0, 0x00, 0x00, 0x05, 0x59, 0x10, 0x10, 0xFF,
+                                 0xFF, 0xFF, 0xFF, 0x89, 0x00, 0x00, 0x01, 0x00};
+    static const BYTE get_eid[] = {0xBF, 0x3E, 0x03, 0x5C, 0x01, 0x5A};
+    // GetProfilesInfo for only the tags shown, which leaves out the icons
+    static const BYTE get_profiles[] = {0xBF, 0x2D, 0x09, 0x5C, 0x07, 0x5A, 0x9F, 0x70,
+                                        0x90, 0x91, 0x92, 0x95};
+    BYTE resp[ES10_MAX_RESPONSE];
+    int resp_len;
+    const BYTE *v, *list, *p;
+    int len, list_len;
+    unsigned int tag;
+
+    memset(euicc, 0, sizeof(*euicc));
+    if (select_aid(isd_r, sizeof(isd_r), verbose) < 0) return -1;
+    euicc->present = 1;
+
+    if (es10_call(get_eid, sizeof(get_eid), resp, sizeof(resp), &resp_len) == 0 &&
+        (v = ber_find(resp, resp_len, 0xBF3E, &len)) && (v = ber_find(v, len, 0x5A, &len))) {
+        hex_string(v, len, euicc->eid, sizeof(euicc->eid));
+    }
+
+    if (es10_call(get_profiles, sizeof(get_profiles), resp, sizeof(resp), &resp_len) < 0 ||
+        !(v = ber_find(resp, resp_len, 0xBF2D, &len)) ||
+        !(list = ber_find(v, len, 0xA0, &list_len))) {
+        if (verbose) printf("GetProfilesInfo failed\n");
+        return 0;
+    }
+    p = list;
+    while ((v = ber_next(&p, list + list_len, &tag, &len))) {
+        euicc_profile_t *profile;
+        const BYTE *field;
+        int field_len;
+
+        if (tag != 0xE3) continue;
+        if (euicc->num_profiles == MAX_PROFILES) {
+            euicc->more_profiles++;
+            continue;
+        }
+        profile = &euicc->profiles[euicc->num_profiles++];
+        profile->profile_class = -1;
+        if ((field = ber_find(v, len, 0x5A, &field_len))) {
+            decode_iccid(field, field_len, profile->iccid);
+        }
+        if ((field = ber_find(v, len, 0x9F70, &field_len)) && field_len == 1) {
+            profile->enabled = field[0] == 0x01;
+        }
+        if ((field = ber_find(v, len, 0x90, &field_len))) {
+            ber_string(field, field_len, profile->nickname, sizeof(profile->nickname));
+        }
+        if ((field = ber_find(v, len, 0x91, &field_len))) {
+            ber_string(field, field_len, profile->provider, sizeof(profile->provider));
+        }
+        if ((field = ber_find(v, len, 0x92, &field_len))) {
+            ber_string(field, field_len, profile->name, sizeof(profile->name));
+        }
+        if ((field = ber_find(v, len, 0x95, &field_len)) && field_len == 1) {
+            profile->profile_class = field[0];
+        }
+    }
+    return 0;
+}
+
+// Read the ISIM identities (when ims is set) and the eUICC information on a
+// logical channel of their own, so the USIM stays selected on the basic
+// channel
+static int get_channel_info(sim_data_t *sim_data, int ims, int verbose) {
+    int channel = open_channel(verbose);
+
+    memset(&sim_data->ims, 0, sizeof(sim_data->ims));
+    memset(&sim_data->euicc, 0, sizeof(sim_data->euicc));
+    if (channel < 0) return -1;
+    logical_channel = channel;
+    if (ims) read_ims(&sim_data->ims, verbose);
+    read_euicc(&sim_data->euicc, verbose);
+    logical_channel = 0;
+    close_channel(channel);
+    return 0;
+}
+
+// ",\n  "key": value" with a JSON string, or null when value is empty
+static void print_json_member(const char *key, const char *value) {
+    printf(",\n  \"%s\": ", key);
+    if (value && value[0]) print_json_string(value);
+    else printf("null");
+}
+
+static const char *status_name(const char **names, int count, int status) {
+    if (status < 0) return NULL;
+    return status < count ? names[status] : "reserved";
+}
+
+static void print_json_network(const network_info_t *net) {
+    print_json_member("mcc", net->mcc);
+    print_json_member("mnc", net->mnc);
+    print_json_member("tmsi", net->tmsi);
+    print_json_member("lai", net->lai);
+    print_json_member("loci_status", status_name(loci_status_names, 4, net->loci_status));
+    print_json_member("ptmsi", net->ptmsi);
+    print_json_member("rai", net->rai);
+    print_json_member("psloci_status", status_name(psloci_status_names, 4, net->psloci_status));
+    print_json_member("guti", net->guti);
+    print_json_member("tai", net->tai);
+    print_json_member("epsloci_status", status_name(epsloci_status_names, 3, net->epsloci_status));
+
+    printf(",\n  \"access_classes\": ");
+    if (net->have_acc) {
+        printf("[");
+        for (int c = 0, n = 0; c < 16; c++) {
+            if (net->access_classes & (1u << c)) printf("%s%d", n++ ? ", " : "", c);
+        }
+        printf("]");
+    } else {
+        printf("null");
+    }
+
+    printf(",\n  \"ecc\": [");
+    for (int i = 0; i < net->num_ecc; i++) {
+        printf("%s{\"code\": \"%s\", \"alpha\": ", i ? ", " : "", net->ecc[i].code);
+        print_json_string(net->ecc[i].alpha);
+        printf(", \"categories\": [");
+        for (int b = 0, n = 0; b < 7 && net->ecc[i].category > 0; b++) {
+            if (net->ecc[i].category & (1 << b)) {
+                printf("%s\"%s\"", n++ ? ", " : "", ecc_category_names[b]);
+            }
+        }
+        printf("]}");
+    }
+    printf("]");
+}
+
+static void print_human_network(const network_info_t *net) {
+    if (net->mcc[0]) {
+        printf("MCC/MNC: %s/%s\n", net->mcc, net->mnc[0] ? net->mnc : "?");
+    }
+    if (net->lai[0] || net->tmsi[0]) {
+        printf("LAI:     %s (%s)%s%s\n", net->lai[0] ? net->lai : "-",
+               status_name(loci_status_names, 4, net->loci_status),
+               net->tmsi[0] ? " TMSI " : "", net->tmsi);
+    }
+    if (net->rai[0] || net->ptmsi[0]) {
+        printf("RAI:     %s (%s)%s%s\n", net->rai[0] ? net->rai : "-",
+               status_name(psloci_status_names, 4, net->psloci_status),
+               net->ptmsi[0] ? " P-TMSI " : "", net->ptmsi);
+    }
+    if (net->tai[0] || net->guti[0]) {
+        printf("TAI:     %s (%s)%s%s\n", net->tai[0] ? net->tai : "-",
+               status_name(epsloci_status_names, 3, net->epsloci_status),
+               net->guti[0] ? " GUTI " : "", net->guti);
+    }
+    if (net->have_acc) {
+        char classes[64];
+        format_access_classes(net->access_classes, classes, sizeof(classes));
+        printf("ACC:     %s\n", classes);
+    }
+    if (net->num_ecc) {
+        printf("ECC:    ");
+        for (int i = 0; i < net->num_ecc; i++) {
+            char categories[96];
+            format_ecc_categories(net->ecc[i].category, categories, sizeof(categories));
+            printf(" %s%s%s%s", net->ecc[i].code, categories[0] ? " (" : "", categories,
+                   categories[0] ? ")" : "");
+        }
+        printf("\n");
+    }
+}
+
+static void print_json_enrichment(const enrichment_t *info) {
+    print_json_member("country", info->country);
+    print_json_member("country_iso", info->country_iso);
+    print_json_member("operator", info->operator_name);
+    print_json_member("issuer", info->issuer);
+    print_json_member("issuer_country", info->issuer_country);
+    print_json_member("issuer_country_iso", info->issuer_country_iso);
+    print_json_member("iccid_check_digit", info->iccid_valid < 0 ? NULL :
+                      info->iccid_valid ? "valid" : "invalid");
+}
+
+static void print_human_enrichment(const enrichment_t *info) {
+    if (info->operator_name) {
+        printf("Network: %s%s%s%s\n", info->operator_name, info->country ? " (" : "",
+               info->country ? info->country : "", info->country ? ")" : "");
+    } else if (info->country) {
+        printf("Network: %s\n", info->country);
+    }
+    if (info->issuer) {
+        printf("Issuer:  %s%s%s%s\n", info->issuer, info->issuer_country ? " (" : "",
+               info->issuer_country ? info->issuer_country : "", info->issuer_country ? ")" : "");
+    } else if (info->issuer_country) {
+        printf("Issuer:  %s\n", info->issuer_country);
+    }
+    if (info->iccid_valid == 0) printf("Warning: ICCID check digit is invalid\n");
+}
+
+static void print_json_ims(const ims_info_t *ims) {
+    print_json_member("impi", ims->impi);
+    printf(",\n  \"impu\": ");
+    if (ims->present) {
+        printf("[");
+        for (int i = 0; i < ims->num_impu; i++) {
+            if (i) printf(", ");
+            print_json_string(ims->impu[i]);
+        }
+        printf("]");
+    } else {
+        printf("null");
+    }
+    print_json_member("ims_domain", ims->domain);
+}
+
+static void print_human_ims(const ims_info_t *ims) {
+    if (ims->impi[0]) printf("IMPI:    %s\n", ims->impi);
+    for (int i = 0; i < ims->num_impu; i++) printf("IMPU:    %s\n", ims->impu[i]);
+    if (ims->domain[0]) printf("Domain:  %s\n", ims->domain);
+}
+
+static const char *profile_class_names[] = {"test", "provisioning", "operational"};
+
+// ", "key": value" inside a one-line object, null when value is empty
+static void print_json_field(const char *key, const char *value) {
+    printf(", \"%s\": ", key);
+    if (value && value[0]) print_json_string(value);
+    else printf("null");
+}
+
+static void print_json_euicc(const euicc_info_t *euicc) {
+    print_json_member("eid", euicc->eid);
+    printf(",\n  \"profiles\": ");
+    if (!euicc->present) {
+        printf("null");
+        return;
+    }
+    printf("[");
+    for (int i = 0; i < euicc->num_profiles; i++) {
+        const euicc_profile_t *profile = &euicc->profiles[i];
+        const char *class_name = status_name(profile_class_names, 3, profile->profile_class);
+
+        printf("%s{\"iccid\": ", i ? ", " : "");
+        print_json_string(profile->iccid);
+        printf(", \"state\": \"%s\"", profile->enabled ? "enabled" : "disabled");
+        print_json_field("class", class_name);
+        print_json_field("name", profile->name);
+        print_json_field("provider", profile->provider);
+        print_json_field("nickname", profile->nickname);
+        printf("}");
+    }
+    printf("]");
+    if (euicc->more_profiles) printf(",\n  \"profiles_not_listed\": %d", euicc->more_profiles);
+}
+
+// "ICCID enabled Name (Provider) [class]" for a profile
+static void format_profile(const euicc_profile_t *profile, char *out, int size) {
+    const char *label = profile->nickname[0] ? profile->nickname : profile->name;
+
+    snprintf(out, size, "%s %-8s %s%s%s%s%s%s%s", profile->iccid[0] ? profile->iccid : "-",
+             profile->enabled ? "enabled" : "disabled", label,
+             profile->provider[0] ? " (" : "", profile->provider, profile->provider[0] ? ")" : "",
+             profile->profile_class == 0 || profile->profile_class == 1 ? " [" : "",
+             profile->profile_class == 0 || profile->profile_class == 1 ?
+                 profile_class_names[profile->profile_class] : "",
+             profile->profile_class == 0 || profile->profile_class == 1 ? "]" : "");
+}
+
+static void print_human_euicc(const euicc_info_t *euicc) {
+    char line[256];
+
+    if (!euicc->present) return;
+    printf("EID:     %s\n", euicc->eid[0] ? euicc->eid : "Not available");
+    for (int i = 0; i < euicc->num_profiles; i++) {
+        format_profile(&euicc->profiles[i], line, sizeof(line));
+        printf("Profile: %s\n", line);
+    }
+    if (euicc->more_profiles) printf("Profile: %d more not listed\n", euicc->more_profiles);
+}
+
+static void print_json_output(sim_data_t *sim_data) {
+    printf("{\n");
+    printf("  \"imsi\": \"%s\",\n", sim_data->imsi[0] ? sim_data->imsi : "null");
+    printf("  \"iccid\": \"%s\",\n", sim_data->iccid[0] ? sim_data->iccid : "null");
+    printf("  \"msisdn\": \"%s\",\n", sim_data->msisdn[0] ? sim_data->msisdn : "null");
+    printf("  \"spn\": \"%s\"", sim_data->spn[0] ? sim_data->spn : "null");
+    print_json_network(&sim_data->net);
+    print_json_enrichment(&sim_data->info);
+    print_json_ims(&sim_data->ims);
+    print_json_euicc(&sim_data->euicc);
+    if (sim_data->expect_status) {
+        printf(",\n  \"expect\": \"%s\"", sim_data->expect_status);
+    }
+    printf("\n}\n");
+}
+
+static void print_human_output(sim_data_t *sim_data) {
+    printf("=== SIM Card Information ===\n");
+    printf("IMSI:    %s\n", sim_data->imsi[0] ? sim_data->imsi : "Not available");
+    printf("ICCID:   %s\n", sim_data->iccid[0] ? sim_data->iccid : "Not available");
+    printf("MSISDN:  %s\n", sim_data->msisdn[0] ? sim_data->msisdn : "Not available");
+    printf("SPN:     %s\n", sim_data->spn[0] ? sim_data->spn : "Not available");
+    print_human_enrichment(&sim_data->info);
+    print_human_network(&sim_data->net);
+    print_human_ims(&sim_data->ims);
+    print_human_euicc(&sim_data->euicc);
+    if (sim_data->expect_status) {
+        printf("Expect:  %s\n", sim_data->expect_status);
+    }
+}
+
+// Identity fields from a snapshot, preferring the USIM files over DF_GSM
+// and DF_TELECOM
+static void sim_data_from_snapshot(sim_data_t *sim_data, const snapshot_t *snap) {
+    static const BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+    const snap_file_t *file;
+
+    if ((file = snapshot_find(snap, iccid_path, sizeof(iccid_path)))) {
+        decode_iccid(file->data, file->data_len, sim_data->iccid);
+    }
+    if ((file = snapshot_find_ef(snap, 0xFF, 0x07)) || (file = snapshot_find_ef(snap, 0x20, 0x07))) {
+        decode_imsi(file->data, file->data_len, sim_data->imsi);
+    }
+    if ((file = snapshot_find_ef(snap, 0xFF, 0x40)) || (file = snapshot_find_ef(snap, 0x10, 0x40))) {
+        for (int rec = 0; file->record_len >= 14 && (rec + 1) * file->record_len <= file->data_len; rec++) {
+            char alpha[64];
+            const BYTE *r = file->data + rec * file->record_len;
+            if (is_empty(r, file->record_len)) continue;
+            decode_dialling_record(r, file->record_len, alpha, sizeof(alpha), sim_data->msisdn,
+                                   sizeof(sim_data->msisdn));
+            if (sim_data->msisdn[0]) break;
+        }
+    }
+    if (((file = snapshot_find_ef(snap, 0xFF, 0x46)) || (file = snapshot_find_ef(snap, 0x20, 0x46))) &&
+        file->data_len > 1) {
+        decode_alpha(file->data + 1, file->data_len - 1, sim_data->spn, sizeof(sim_data->spn));
+    }
+
+    int usim = snapshot_find_ef(snap, 0xFF, 0x07) != NULL;
+    network_info_init(&sim_data->net);
+    for (size_t i = 0; i < sizeof(network_files) / sizeof(network_files[0]); i++) {
+        const BYTE *fid = usim ? network_files[i].usim_fid : network_files[i].gsm_fid;
+        if (fid[0] && (file = snapshot_find_ef(snap, usim ? 0xFF : 0x20, fid[1]))) {
+            network_files[i].decode(file, &sim_data->net);
+        }
+    }
+    split_imsi(sim_data->imsi, &sim_data->net);
+}
+
+// Records in use in a record file; SMS records by their status byte (free
+// when bit 1 is clear), others when not all FF. -1 when the file was not
+// captured or could not be read.
+static int analysis_records_used(const snap_file_t *file, int sms, int *total, int *unread) {
+    int used = 0;
+
+    *total = 0;
+    if (unread) *unread = 0;
+    if (!file || !file->record_len || file->data_len < file->record_len) return -1;
+    *total = file->num_records;
+    for (int rec = 0; (rec + 1) * file->record_len <= file->data_len; rec++) {
+        const BYTE *r = file->data + rec * file->record_len;
+        if (sms ? !(r[0] & 0x01) : is_empty(r, file->record_len)) continue;
+        used++;
+        if (unread && r[0] == 0x03) (*unread)++;
+    }
+    return used;
+}
+
+static int analysis_services(const snap_file_t *file) {
+    int bits = path_in_adf(file->path, file->path_len) ? 1 : 2;
+    int count = 0;
+
+    for (int i = 0; i < file->data_len * 8 / bits; i++) {
+        int bit = i * bits;
+        if (file->data[bit / 8] & (1 << (bit % 8))) count++;
+    }
+    return count;
+}
+
+// The analysis of -a, built from the snapshot capture alone: the card and
+// its applications, service tables, fill levels of the phonebook and SMS
+// files, and the files the card did not let us read
+static void print_complete_analysis(const sim_data_t *sim_data, const snapshot_t *snap, const char *reader) {
+    static const struct {
+        BYTE df;
+        BYTE fid;
+        int sms;
+        const char *name;
+    } storage[] = {
+        {0x10, 0x3A, 0, "Contacts (EF_ADN)"},
+        {0x10, 0x3B, 0, "Fixed dialling (EF_FDN)"},
+        {0x10, 0x49, 0, "Service dialling (EF_SDN)"},
+        {0x10, 0x44, 0, "Last numbers (EF_LND)"},
+        {0x10, 0x3C, 1, "SMS (EF_SMS)"},
+    };
+    static const BYTE dir_path[] = {0x3F, 0x00, 0x2F, 0x00};
+    int num_catalog = sizeof(snapshot_catalog) / sizeof(snapshot_catalog[0]);
+    int usim = 0, isim = 0, gsm = 0;
+    int contacts = -1, messages = -1, unread = 0, protected = 0;
+    const snap_file_t *file;
+    char hex[2 * MAX_ATR_SIZE + 1];
+
+    printf("=== Complete SIM Card Analysis ===\n\n");
+
+    printf("📱 Card:\n");
+    hex_string(snap->atr, snap->atr_len, hex, sizeof(hex));
+    printf("  Reader:       %s (%s)\n", reader, dwActiveProtocol == SCARD_PROTOCOL_T1 ? "T=1" : "T=0");
+    printf("  ATR:          %s\n", snap->atr_len ? hex : "not available");
+    printf("  Commands:     %s\n", card_class == 0xA0 ? "GSM 11.11 (CLA A0)" : "UICC (CLA 00)");
+    if ((file = snapshot_find(snap, dir_path, sizeof(dir_path))) && file->record_len >= 4) {
+        for (int rec = 0; (rec + 1) * file->record_len <= file->data_len; rec++) {
+            const BYTE *r = file->data + rec * file->record_len;
+            int rlen = file->record_len;
+            BYTE aid[16];
+            char label[40] = "";
+            const char *kind = "application";
+
+            if (r[0] != 0x61 || r[2] != 0x4F || r[3] > 16 || 4 + r[3] > rlen) continue;
+            if (dir_record_aid(r, rlen, APP_USIM, aid) > 0) kind = "USIM", usim = 1;
+            else if (dir_record_aid(r, rlen, APP_ISIM, aid) > 0) kind = "ISIM", isim = 1;
+            int i = 4 + r[3];
+            if (i + 2 <= rlen && r[i] == 0x50) {
+                decode_alpha(&r[i + 2], r[i + 1] <= rlen - i - 2 ? r[i + 1] : rlen - i - 2, label, sizeof(label));
+            }
+            hex_string(&r[4], r[3], hex, sizeof(hex));
+            printf("  Application:  %-11s %s%s%s\n", kind, hex, label[0] ? " " : "", label);
+        }
+    }
+    for (int i = 0; i < snap->num_files; i++) {
+        if (path_in_adf(snap->files[i].path, snap->files[i].path_len)) usim = 1;
+        else if (snap->files[i].path_len == 6 && snap->files[i].path[3] == 0x20) gsm = 1;
+    }
+    if (card_class == 0xA0) {
+        usim = isim = 0;   // listed in EF_DIR, but unreachable without the UICC commands
+        gsm = 1;
+    }
+    printf("  Type:         %s\n", usim ? (isim ? "UICC with USIM and ISIM (3G/4G/5G, IMS)" : "UICC with USIM (3G/4G/5G)") :
+                                  gsm ? "GSM SIM (2G only)" : "unknown (no SIM or USIM files found)");
+    if (sim_data->euicc.present) {
+        printf("  EID:          %s\n", sim_data->euicc.eid[0] ? sim_data->euicc.eid : "not available");
+        for (int i = 0; i < sim_data->euicc.num_profiles; i++) {
+            char line[256];
+            format_profile(&sim_data->euicc.profiles[i], line, sizeof(line));
+            printf("  Profile:      %s\n", line);
+        }
+        if (sim_data->euicc.more_profiles) {
+            printf("  Profile:      %d more not listed\n", sim_data->euicc.more_profiles);
+        }
+    }
+    printf("\n");
+
+    printf("🔍 Identity:\n");
+    printf("  ICCID:        %s\n", sim_data->iccid[0] ? sim_data->iccid : "not available");
+    if (sim_data->info.iccid_valid >= 0) {
+        printf("  Check digit:  %s\n", sim_data->info.iccid_valid ? "valid" : "invalid");
+    }
+    if (sim_data->info.issuer) printf("  Issuer:       %s\n", sim_data->info.issuer);
+    printf("  IMSI:         %s\n", sim_data->imsi[0] ? sim_data->imsi : "not available");
+    if (sim_data->info.operator_name || sim_data->info.country) {
+        printf("  Operator:     %s%s%s%s\n", sim_data->info.operator_name ? sim_data->info.operator_name : "unknown",
+               sim_data->info.country ? " (" : "", sim_data->info.country ? sim_data->info.country : "",
+               sim_data->info.country ? ")" : "");
+    }
+    printf("  MSISDN:       %s\n", sim_data->msisdn[0] ? sim_data->msisdn : "not stored");
+    printf("  SPN:          %s\n", sim_data->spn[0] ? sim_data->spn : "not set");
+    printf("\n");
+
+    printf("🧾 Services:\n");
+    if ((file = snapshot_find_ef(snap, 0xFF, 0x38)) && file->data_len) {
+        printf("  EF_UST:       %d of %d USIM services enabled\n", analysis_services(file), file->data_len * 8);
+    }
+    if ((file = snapshot_find_ef(snap, 0x20, 0x38)) && file->data_len) {
+        printf("  EF_SST:       %d of %d SIM services allocated\n", analysis_services(file), file->data_len * 4);
+    }
+    if (!snapshot_find_ef(snap, 0xFF, 0x38) && !snapshot_find_ef(snap, 0x20, 0x38)) {
+        printf("  No service table found\n");
+    }
+    printf("\n");
+
+    printf("📞 Storage:\n");
+    for (size_t i = 0; i < sizeof(storage) / sizeof(storage[0]); i++) {
+        int total;
+        int n = analysis_records_used(snapshot_find_ef(snap, storage[i].df, storage[i].fid), storage[i].sms,
+                                      &total, storage[i].sms ? &unread : NULL);
+        if (storage[i].fid == 0x3A) contacts = n;
+        if (storage[i].sms) messages = n;
+        if (n < 0) {
+            printf("  %-26s not present or not readable\n", storage[i].name);
+        } else if (storage[i].sms && unread) {
+            printf("  %-26s %d of %d records used, %d unread\n", storage[i].name, n, total, unread);
+        } else {
+            printf("  %-26s %d of %d records used\n", storage[i].name, n, total);
+        }
+    }
+    if (sim_data->local_contacts >= 0) {
+        printf("  %-26s %d of %d records used\n", "Contacts (USIM, EF_PBR)", sim_data->local_contacts,
+               sim_data->local_total);
+        contacts = (contacts > 0 ? contacts : 0) + sim_data->local_contacts;
+    }
+    printf("\n");
+
+    printf("🔐 Access:\n");
+    printf("  Files found:  %d of the %d files in the catalog\n", snap->num_files, num_catalog);
+    for (int i = 0; i < snap->num_files; i++) {
+        const snap_file_t *f = &snap->files[i];
+        const char *name = catalog_name(f->path, f->path_len);
+        const BYTE *v;
+        int len;
+
+        if (f->data_len || !fcp_file_size(f)) continue;
+        protected++;
+        printf("  Not readable: %-11s", name ? name : "EF");
+        if ((v = fcp_find_tag(f->fcp, f->fcp_len, 0x8B, &len)) && len >= 3) {
+            printf(" access rule %02X%02X record %d", v[0], v[1], v[2]);
+        } else if ((v = fcp_find_tag(f->fcp, f->fcp_len, 0x8C, &len)) && len >= 1) {
+            hex_string(v, len, hex, sizeof(hex));
+            printf(" compact security attributes %s", hex);
+        }
+        printf("\n");
+    }
+    if (!protected) printf("  Every file found was readable without a PIN\n");
+    printf("\n");
+
+    printf("🎯 Summary:\n");
+    if (!usim && gsm) printf("  - GSM-only SIM: no USIM application, so no 3G/4G/5G authentication\n");
+    if (sim_data->info.iccid_valid == 0) printf("  - The ICCID check digit is invalid\n");
+    if (contacts > 0) {
+        printf("  - %d contact(s) on the card; export them with 'simreader phonebook'\n", contacts);
+    } else if (contacts == 0) {
+        printf("  - No contacts on the card; phones usually keep contacts in their own memory or an account\n");
+    }
+    if (messages > 0) printf("  - %d SMS message(s) on the card; read them with 'simreader sms'\n", messages);
+    if (protected) printf("  - %d file(s) need a PIN or ADM key to be read\n", protected);
+    printf("\n=== Analysis Complete ===\n");
+}
+
+static void cleanup(void) {
+    if (virtual_card.snap) {
+        snapshot_free(virtual_card.snap);
+        free(virtual_card.snap);
+        memset(&virtual_card, 0, sizeof(virtual_card));
+        emulated_transmit = NULL;
+    }
+    if (hCard) {
+        SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+    }
+    if (hContext) {
+        SCardReleaseContext(hContext);
+    }
+}
+
+static void print_usage(const char *program_name) {
+    printf("simreader - Unified SIM Card Reader Tool v%s\n", VERSION);
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("       %s [OPTIONS] diff SNAPSHOT|card SNAPSHOT|card\n", program_name);
+    printf("       %s [OPTIONS] verify GOLDEN\n", program_name);
+    printf("       %s [OPTIONS] provision TEMPLATE\n", program_name);
+    printf("       %s [OPTIONS] phonebook [export | import FILE.vcf]\n", program_name);
+    printf("       %s [OPTIONS] sms\n", program_name);
+    printf("       %s [OPTIONS] auth-bench VECTORS [ROUNDS]\n", program_name);
+    printf("       %s [OPTIONS] -l KEYS auth-verify RESPONSES...\n", program_name);
+    printf("       %s [-s OUTPUT] import DUMP...\n", program_name);
+    printf("       %s [OPTIONS] replay TRACE\n", program_name);
+    printf("       %s [-s OUTPUT] generate TEMPLATE COUNT [PB%%[,SMS%%]]\n", program_name);
+    printf("       %s [-j] [-s OUTPUT] reprocess ARCHIVE [THREADS]\n", program_name);
+    printf("       %s --health FILE health [reset [READER] | next]\n", program_name);
+    printf("Options:\n");
+    printf("  -v, --verbose        Show verbose output (APDUs, hex dumps)\n");
+    printf("  -j, --json           Output in JSON format\n");
+    printf("  -e, --explore        Explore all accessible SIM files\n");
+    printf("  -a, --analysis       Complete analysis of the card from one capture\n");
+    printf("  --apps               Also read the ISIM identities and the eUICC profiles\n");
+    printf("  -r, --reader NAME    Specify reader name\n");
+    printf("  -p, --pin            Prompt for PIN (not implemented)\n");
+    printf("  -s, --snapshot FILE  Save a snapshot of the card files (- for stdout)\n");
+    printf("  -A, --all-readers    Process the card in every connected reader\n");
+    printf("  -l, --values FILE    Per-card values (CSV keyed by iccid) for verify/provision,\n");
+    printf("                       Milenage keys (ki, opc or op) for auth-verify\n");
+    printf("  --expect FILE        Mark cards as expected/unexpected/duplicate against an\n");
+    printf("                       ICCID list and print the unscanned remainder\n");
+    printf("  --adm KEY            ADM1 key for writes (16 hex digits or up to 8 chars)\n");
+    printf("  --dry-run            Show the provision/import write plan without writing,\n");
+    printf("                       or only the statistics of a replay trace\n");
+    printf("  --virtual SNAPSHOT   Use a card emulated from a snapshot instead of a reader\n");
+    printf("                       (Milenage K/OPc from the ki/opc columns of --values)\n");
+    printf("  --trace FILE         Record every APDU and response with its time\n");
+    printf("  --health FILE        Keep reader health (errors, retries, latency) across\n");
+    printf("                       -A runs; degraded readers are quarantined\n");
+    printf("  --watch              Keep running with -A and process every inserted card\n");
+    printf("                       until interrupted\n");
+    printf("  --dashboard          Show reader states, throughput and session times on\n");
+    printf("                       standard error while -A or --watch runs\n");
+    printf("  --journal FILE       Record completed cards so an interrupted batch resumes\n");
+    printf("                       without re-reading them or duplicating output\n");
+    printf("  --ring PATH          Publish binary card records in a shared-memory ring,\n");
+    printf("                       handed to consumers on the Unix socket PATH\n");
+    printf("  --where EXPR         Only output the cards matching EXPR, such as\n");
+    printf("                       'mcc==262 && ust.has(27) && adn.count>0'\n");
+    printf("  --metrics FILE       Write Prometheus metrics to FILE (every 15 s and at exit)\n");
+    printf("  --metrics-listen ADDR\n");
+    printf("                       Serve metrics on PORT, HOST:PORT or unix:PATH\n");
+    printf("  -h, --help           Show this help message\n");
+    printf("  --version            Show version information\n");
+    printf("\nThis tool is designed for modern USIM cards and may not find\n");
+    printf("contacts stored on older SIM cards or in phone memory.\n");
+    printf("\nExamples:\n");
+    printf("  %s                    Basic SIM information\n", program_name);
+    printf("  %s -a                Complete analysis of the card\n", program_name);
+    printf("  %s -e -v             Explore all files with verbose output\n", program_name);
+    printf("  %s -j                Output in JSON format\n", program_name);
+    printf("  %s -s golden.snap    Save a snapshot of the card\n", program_name);
+    printf("  %s diff golden.snap card  Compare the card against a snapshot\n", program_name);
+    printf("  %s -A -l batch.csv verify golden.snap  Verify all inserted cards\n", program_name);
+}
+
+static char current_reader[256];
+
+// Emulate the card captured in a snapshot. Its Milenage K and OPc are
+// taken from the ki and opc (or op) columns of the --values row for its
+// ICCID.
+static int open_virtual_card(const config_t *config) {
+    static const BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+    snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+    const snap_file_t *iccid_file;
+
+    if (!snap || snapshot_load_file(config->virtual_file, snap) < 0) {
+        free(snap);
+        return -1;
+    }
+    memset(&virtual_card, 0, sizeof(virtual_card));
+    virtual_card.snap = snap;
+    virtual_card.df[0] = 0x3F;
+    virtual_card.df[1] = 0x00;
+    virtual_card.df_len = 2;
+    memcpy(emulated_atr, snap->atr, snap->atr_len);
+    emulated_atr_len = snap->atr_len;
+    emulated_transmit = virtual_transmit;
+    snprintf(current_reader, sizeof(current_reader), "virtual:%.240s", config->virtual_file);
+
+    iccid_file = snapshot_find(snap, iccid_path, sizeof(iccid_path));
+    if (config->values_file && iccid_file) {
+        value_table_t values;
+        char iccid[21];
+
+        decode_iccid(iccid_file->data, iccid_file->data_len, iccid);
+        if (value_table_load(config->values_file, &values) < 0) {
+            cleanup();
+            return -1;
+        }
+        const value_row_t *row = value_table_find(&values, iccid);
+        if (row && milenage_from_row(&values, row, &virtual_card.milenage) == 0) {
+            virtual_card.have_keys = 1;
+        }
+        value_table_free(&values);
+    }
+    if (config->verbose) {
+        printf("Using reader: %s%s\n", current_reader,
+               virtual_card.have_keys ? " (Milenage keys loaded)" : "");
+    }
+    return 0;
+}
+
+static int open_card(const config_t *config) {
+    if (config->virtual_file) {
+        return open_virtual_card(config);
+    }
+    if (establish_context() < 0) {
+        return -1;
+    }
+    
+    DWORD reader_len = sizeof(current_reader);
+    
+    if (find_reader(config->reader_name, current_reader, &reader_len) < 0) {
+        fprintf(stderr, "No compatible reader found\n");
+        cleanup();
+        return -1;
+    }
+    
+    if (config->verbose) {
+        printf("Using reader: %s\n", current_reader);
+    }
+    
+    if (connect_to_card(current_reader) < 0) {
+        fprintf(stderr, "Failed to connect to card\n");
+        cleanup();
+        return -1;
+    }
+    
+    if (config->verbose) {
+        printf("Protocol: %s\n", (dwActiveProtocol == SCARD_PROTOCOL_T0) ? "T=0" : "T=1");
+    }
+    return 0;
+}
+
+// Filter expressions (--where)
+//
+// A --where expression is compiled once into bytecode for a small stack
+// machine and run on every card before anything is formatted or written.
+// Values are strings (the identity fields) or non-negative numbers (record
+// counts, service bits and truth values). Two values compare as numbers
+// when both are digit strings or numbers, otherwise as strings, so that
+// mcc==262 and iccid=="8949..." both work. && and || short-circuit: the
+// file-backed fields of a card that fails an earlier test are never
+// decoded.
+
+#define MAX_WHERE_CODE 128
+#define MAX_WHERE_STACK 16
+
+enum {
+    WHERE_CONST,          // push constants[arg]
+    WHERE_FIELD,          // push field arg
+    WHERE_UST_HAS,        // push 1 when USIM service arg is available
+    WHERE_SST_HAS,        // push 1 when SIM service arg is allocated
+    WHERE_EQ, WHERE_NE, WHERE_LT, WHERE_LE, WHERE_GT, WHERE_GE,
+    WHERE_NOT,
+    WHERE_TEST,           // replace the top with its truth value
+    WHERE_AND,            // false on top: jump to arg, else pop
+    WHERE_OR,             // true on top: jump to arg, else pop
+};
+
+enum {
+    WHERE_ICCID, WHERE_IMSI, WHERE_MSISDN, WHERE_SPN, WHERE_MCC, WHERE_MNC,
+    WHERE_OPERATOR, WHERE_COUNTRY, WHERE_ISSUER, WHERE_EXPECT,
+    WHERE_RECORDS, WHERE_UNREAD,
+};
+
+// Files the record counts and service tables are decoded from
+static const struct {
+    BYTE df;
+    BYTE fid;
+    int sms;
+} where_files[] = {
+    {0xFF, 0x38, 0},   // EF_UST
+    {0x20, 0x38, 0},   // EF_SST
+    {0x10, 0x3A, 0},   // EF_ADN
+    {0x10, 0x3B, 0},   // EF_FDN
+    {0x10, 0x49, 0},   // EF_SDN
+    {0x10, 0x44, 0},   // EF_LND
+    {0x10, 0x3C, 1},   // EF_SMS
+};
+
+static const struct {
+    const char *name;
+    int field;
+    int file;          // index in where_files, -1 for the identity fields
+} where_fields[] = {
+    {"iccid", WHERE_ICCID, -1},
+    {"imsi", WHERE_IMSI, -1},
+    {"msisdn", WHERE_MSISDN, -1},
+    {"spn", WHERE_SPN, -1},
+    {"mcc", WHERE_MCC, -1},
+    {"mnc", WHERE_MNC, -1},
+    {"operator", WHERE_OPERATOR, -1},
+    {"country", WHERE_COUNTRY, -1},
+    {"issuer", WHERE_ISSUER, -1},
+    {"expect", WHERE_EXPECT, -1},
+    {"adn.count", WHERE_RECORDS, 2},
+    {"fdn.count", WHERE_RECORDS, 3},
+    {"sdn.count", WHERE_RECORDS, 4},
+    {"lnd.count", WHERE_RECORDS, 5},
+    {"sms.count", WHERE_RECORDS, 6},
+    {"sms.unread", WHERE_UNREAD, 6},
+};
+
+typedef struct {
+    BYTE op;
+    BYTE file;         // where_files index of WHERE_FIELD
+    short arg;
+} where_insn_t;
+
+typedef struct {
+    const char *str;   // NULL for numbers
+    long long num;
+} where_value_t;
+
+typedef struct {
+    where_insn_t code[MAX_WHERE_CODE];
+    int length;
+    char *constants[MAX_WHERE_CODE];
+    int num_constants;
+    int identity;      // reads the identity fields
+    unsigned int files;  // bit n: reads where_files[n]
+    snapshot_t *plan;  // those files, for cards read without -a
+} where_t;
+
+typedef struct {
+    const char *text;
+    const char *pos;
+    const char *error;
+    where_t *w;
+    int depth;         // stack depth at this point of the code
+    int max_depth;
+} where_parser_t;
+
+// Set when --where was given
+static where_t where_filter;
+
+static void where_space(where_parser_t *p) {
+    while (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n') p->pos++;
+}
+
+static int where_accept(where_parser_t *p, const char *token) {
+    size_t len = strlen(token);
+
+    where_space(p);
+    if (strncmp(p->pos, token, len) != 0) return 0;
+    p->pos += len;
+    return 1;
+}
+
+static int where_fail(where_parser_t *p, const char *error) {
+    if (!p->error) p->error = error;
+    return -1;
+}
+
+// Append an instruction; push is its effect on the stack depth. Returns
+// its index.
+static int where_emit(where_parser_t *p, int op, int arg, int push) {
+    if (p->w->length >= MAX_WHERE_CODE) return where_fail(p, "expression too long");
+    p->depth += push;
+    if (p->depth > p->max_depth) p->max_depth = p->depth;
+    if (p->max_depth > MAX_WHERE_STACK) return where_fail(p, "expression too deeply nested");
+
+    where_insn_t *insn = &p->w->code[p->w->length];
+    insn->op = op;
+    insn->arg = arg;
+    insn->file = 0;
+    return p->w->length++;
+}
+
+static int where_or(where_parser_t *p);
+
+static int where_constant(where_parser_t *p, const char *start, size_t len) {
+    where_t *w = p->w;
+
+    if (w->num_constants >= MAX_WHERE_CODE) return where_fail(p, "expression too long");
+    if (!(w->constants[w->num_constants] = strndup(start, len))) return where_fail(p, "out of memory");
+    return where_emit(p, WHERE_CONST, w->num_constants++, 1);
+}
+
+// A literal, a field, ust.has(N) or sst.has(N), or a parenthesized
+// expression
+static int where_primary(where_parser_t *p) {
+    const char *start;
+
+    where_space(p);
+    start = p->pos;
+    if (where_accept(p, "(")) {
+        if (where_or(p) < 0) return -1;
+        return where_accept(p, ")") ? 0 : where_fail(p, "expected )");
+    }
+    if (*p->pos >= '0' && *p->pos <= '9') {
+        while (*p->pos >= '0' && *p->pos <= '9') p->pos++;
+        return where_constant(p, start, p->pos - start) < 0 ? -1 : 0;
+    }
+    if (*p->pos == '"' || *p->pos == '\'') {
+        const char *end = strchr(start + 1, *start);
+        if (!end) return where_fail(p, "unterminated string");
+        p->pos = end + 1;
+        return where_constant(p, start + 1, end - start - 1) < 0 ? -1 : 0;
+    }
+    if (!(*p->pos >= 'a' && *p->pos <= 'z')) return where_fail(p, "expected a value");
+
+    while ((*p->pos >= 'a' && *p->pos <= 'z') || (*p->pos >= '0' && *p->pos <= '9') ||
+           *p->pos == '_' || *p->pos == '.') {
+        p->pos++;
+    }
+    size_t len = p->pos - start;
+
+    if ((len == 7 && strncmp(start, "ust.has", 7) == 0) ||
+        (len == 7 && strncmp(start, "sst.has", 7) == 0)) {
+        int usim = start[0] == 'u';
+        char *end;
+        if (!where_accept(p, "(")) return where_fail(p, "expected (");
+        where_space(p);
+        long service = strtol(p->pos, &end, 10);
+        if (end == p->pos || service < 1 || service > 255 * (usim ? 8 : 4)) {
+            return where_fail(p, "expected a service number");
+        }
+        p->pos = end;
+        if (!where_accept(p, ")")) return where_fail(p, "expected )");
+        p->w->files |= 1u << (usim ? 0 : 1);
+        return where_emit(p, usim ? WHERE_UST_HAS : WHERE_SST_HAS, service, 1) < 0 ? -1 : 0;
+    }
+
+    for (size_t i = 0; i < sizeof(where_fields) / sizeof(where_fields[0]); i++) {
+        if (strlen(where_fields[i].name) != len || strncmp(where_fields[i].name, start, len) != 0) {
+            continue;
+        }
+        int at = where_emit(p, WHERE_FIELD, where_fields[i].field, 1);
+        if (at < 0) return -1;
+        if (where_fields[i].file < 0) {
+            p->w->identity = 1;
+        } else {
+            p->w->code[at].file = where_fields[i].file;
+            p->w->files |= 1u << where_fields[i].file;
+        }
+        return 0;
+    }
+    p->pos = start;
+    return where_fail(p, "unknown field");
+}
+
+static int where_comparison(where_parser_t *p) {
+    static const struct {
+        const char *token;
+        int op;
+    } ops[] = {
+        {"==", WHERE_EQ}, {"!=", WHERE_NE}, {"<=", WHERE_LE}, {">=", WHERE_GE},
+        {"<", WHERE_LT}, {">", WHERE_GT},
+    };
+
+    if (where_primary(p) < 0) return -1;
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (!where_accept(p, ops[i].token)) continue;
+        if (where_primary(p) < 0) return -1;
+        return where_emit(p, ops[i].op, 0, -1) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+static int where_not(where_parser_t *p) {
+    where_space(p);
+    if (p->pos[0] == '!' && p->pos[1] != '=') {
+        p->pos++;
+        if (where_not(p) < 0) return -1;
+        return where_emit(p, WHERE_NOT, 0, 0) < 0 ? -1 : 0;
+    }
+    return where_comparison(p);
+}
+
+// One level of && or ||: each operand is tested, and a jump past the rest
+// is patched in once its end is known
+static int where_chain(where_parser_t *p, const char *token, int op, int (*operand)(where_parser_t *)) {
+    int jumps[MAX_WHERE_CODE];
+    int num_jumps = 0;
+
+    if (operand(p) < 0) return -1;
+    while (where_accept(p, token)) {
+        if (where_emit(p, WHERE_TEST, 0, 0) < 0) return -1;
+        if ((jumps[num_jumps++] = where_emit(p, op, 0, -1)) < 0) return -1;
+        if (operand(p) < 0) return -1;
+    }
+    if (!num_jumps) return 0;
+    if (where_emit(p, WHERE_TEST, 0, 0) < 0) return -1;
+    for (int i = 0; i < num_jumps; i++) p->w->code[jumps[i]].arg = p->w->length;
+    return 0;
+}
+
+static int where_and(where_parser_t *p) {
+    return where_chain(p, "&&", WHERE_AND, where_not);
+}
+
+static int where_or(where_parser_t *p) {
+    return where_chain(p, "||", WHERE_OR, where_and);
+}
+
+static void where_free(where_t *w) {
+    for (int i = 0; i < w->num_constants; i++) free(w->constants[i]);
+    free(w->plan);
+    memset(w, 0, sizeof(*w));
+}
+
+// Compile text into w; prints the error and returns -1 when it is not a
+// valid expression
+static int where_compile(const char *text, where_t *w) {
+    where_parser_t p = {text, text, NULL, w, 0, 0};
+
+    memset(w, 0, sizeof(*w));
+    if (where_or(&p) == 0) {
+        where_space(&p);
+        if (*p.pos) where_fail(&p, "unexpected text");
+    }
+    if (!p.error && w->files && !(w->plan = calloc(1, sizeof(snapshot_t)))) p.error = "out of memory";
+    if (p.error) {
+        fprintf(stderr, "--where: %s at column %d\n", p.error, (int)(p.pos - text) + 1);
+        where_free(w);
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(where_files) / sizeof(where_files[0]); i++) {
+        if (!(w->files & (1u << i))) continue;
+        snap_file_t *file = &w->plan->files[w->plan->num_files++];
+        BYTE path[] = {0x3F, 0x00, 0x7F, where_files[i].df, 0x6F, where_files[i].fid};
+        memcpy(file->path, path, sizeof(path));
+        file->path_len = sizeof(path);
+    }
+    return 0;
+}
+
+static int where_truth(const where_value_t *v) {
+    return v->str ? v->str[0] != '\0' : v->num != 0;
+}
+
+static int where_digits(const char *s) {
+    if (!*s) return 0;
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9') return 0;
+    }
+    return 1;
+}
+
+// Digit strings compare by value, without a length limit; anything else
+// compares as text
+static int where_compare(const where_value_t *a, const where_value_t *b) {
+    char abuf[24];
+    char bbuf[24];
+    const char *x = a->str;
+    const char *y = b->str;
+
+    if (!x) snprintf(abuf, sizeof(abuf), "%lld", a->num), x = abuf;
+    if (!y) snprintf(bbuf, sizeof(bbuf), "%lld", b->num), y = bbuf;
+    if (!where_digits(x) || !where_digits(y)) return strcmp(x, y);
+
+    while (x[0] == '0' && x[1]) x++;
+    while (y[0] == '0' && y[1]) y++;
+    size_t xl = strlen(x);
+    size_t yl = strlen(y);
+    if (xl != yl) return xl < yl ? -1 : 1;
+    return strcmp(x, y);
+}
+
+static where_value_t where_field(const where_insn_t *insn, const sim_data_t *sim_data,
+                                 const snapshot_t *snap) {
+    where_value_t v = {"", 0};
+    const snap_file_t *file;
+    int total;
+    int unread;
+
+    switch (insn->arg) {
+        case WHERE_ICCID: v.str = sim_data->iccid; break;
+        case WHERE_IMSI: v.str = sim_data->imsi; break;
+        case WHERE_MSISDN: v.str = sim_data->msisdn; break;
+        case WHERE_SPN: v.str = sim_data->spn; break;
+        case WHERE_MCC: v.str = sim_data->net.mcc; break;
+        case WHERE_MNC: v.str = sim_data->net.mnc; break;
+        case WHERE_OPERATOR: if (sim_data->info.operator_name) v.str = sim_data->info.operator_name; break;
+        case WHERE_COUNTRY: if (sim_data->info.country) v.str = sim_data->info.country; break;
+        case WHERE_ISSUER: if (sim_data->info.issuer) v.str = sim_data->info.issuer; break;
+        case WHERE_EXPECT: if (sim_data->expect_status) v.str = sim_data->expect_status; break;
+        case WHERE_RECORDS:
+        case WHERE_UNREAD:
+            v.str = NULL;
+            file = snap ? snapshot_find_ef(snap, where_files[insn->file].df, where_files[insn->file].fid) : NULL;
+            v.num = analysis_records_used(file, where_files[insn->file].sms, &total, &unread);
+            if (insn->arg == WHERE_UNREAD) v.num = unread;
+            if (v.num < 0) v.num = 0;
+            break;
+    }
+    return v;
+}
+
+static int where_service(const snapshot_t *snap, int usim, int service) {
+    const snap_file_t *file = snap ? snapshot_find_ef(snap, usim ? 0xFF : 0x20, 0x38) : NULL;
+    int bit = (service - 1) * (usim ? 1 : 2);
+
+    return file && bit / 8 < file->data_len && (file->data[bit / 8] & (1 << (bit % 8)));
+}
+
+// Run the program on one card. snap holds the files of w->files; it may be
+// NULL when there are none.
+static int where_match(const where_t *w, const sim_data_t *sim_data, const snapshot_t *snap) {
+    where_value_t stack[MAX_WHERE_STACK];
+    int top = -1;
+
+    for (int pc = 0; pc < w->length; pc++) {
+        const where_insn_t *insn = &w->code[pc];
+        int c;
+
+        switch (insn->op) {
+            case WHERE_CONST:
+                stack[++top].str = w->constants[insn->arg];
+                break;
+            case WHERE_FIELD:
+                stack[top + 1] = where_field(insn, sim_data, snap);
+                top++;
+                break;
+            case WHERE_UST_HAS:
+            case WHERE_SST_HAS:
+                top++;
+                stack[top].str = NULL;
+                stack[top].num = where_service(snap, insn->op == WHERE_UST_HAS, insn->arg);
+                break;
+            case WHERE_NOT:
+            case WHERE_TEST:
+                c = where_truth(&stack[top]);
+                stack[top].str = NULL;
+                stack[top].num = insn->op == WHERE_NOT ? !c : c;
+                break;
+            case WHERE_AND:
+            case WHERE_OR:
+                if ((stack[top].num != 0) == (insn->op == WHERE_OR)) pc = insn->arg - 1;
+                else top--;
+                break;
+            default:
+                c = where_compare(&stack[top - 1], &stack[top]);
+                top--;
+                stack[top].str = NULL;
+                stack[top].num = insn->op == WHERE_EQ ? c == 0 : insn->op == WHERE_NE ? c != 0 :
+                                 insn->op == WHERE_LT ? c < 0 : insn->op == WHERE_LE ? c <= 0 :
+                                 insn->op == WHERE_GT ? c > 0 : c >= 0;
+                break;
+        }
     }
-    
-    // Try path-based selection
-    if (select_file_by_path(iccid_path, 4, "EF_ICCID", verbose) == 0) {
-        if (read_binary(data, 20, &len, verbose) == 0) {
-            print_hex_verbose("ICCID raw", data, len, verbose);
-            if (decode_iccid(data, len, sim_data->iccid) == 0) {
-                return 0;
-            }
+    return top == 0 && where_truth(&stack[0]);
+}
+
+// --where for a card being read: the files it needs are read now unless
+// -a captured them already
+static int where_card_matches(const sim_data_t *sim_data, const snapshot_t *snap, int verbose) {
+    snapshot_t *files = NULL;
+    int match;
+
+    if (!snap && where_filter.plan) {
+        if (!(files = calloc(1, sizeof(snapshot_t)))) return 1;
+        snapshot_capture(files, where_filter.plan, verbose);
+        snap = files;
+    }
+    match = where_match(&where_filter, sim_data, snap);
+    if (files) {
+        snapshot_free(files);
+        free(files);
+    }
+    return match;
+}
+
+// Archive reprocessing
+//
+// reprocess runs the field decoders over every card of a snapshot archive.
+// The mapped archive is cut into work units of about REPROCESS_UNIT_SIZE
+// bytes at snapshot boundaries. Units are dealt round-robin to one deque per
+// thread; a thread takes its own units from the front and, once its deque is
+// empty, steals from the back of the fullest other deque. Each unit's output
+// goes to a shard in memory, and the main thread writes the shards in
+// archive order as they complete, so the output does not depend on the
+// scheduling and only the shards ahead of the slowest thread are held.
+
+#define REPROCESS_UNIT_SIZE (1 << 20)
+
+typedef struct {
+    const char *start;
+    size_t len;
+    char *text;                   // the shard, once done
+    size_t text_len;
+    unsigned long long cards;
+    unsigned long long matched;   // cards that passed --where
+    unsigned long long malformed;
+    int failed;                   // shard could not be written
+    int done;
+} reprocess_unit_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int *slots;                   // unit numbers
+    int head;                     // taken by the owner
+    int tail;                     // stolen by the other threads; both are
+                                  // written under lock and read without it
+} reprocess_deque_t;
+
+typedef struct {
+    reprocess_unit_t *units;
+    int num_units;
+    reprocess_deque_t *deques;
+    int num_threads;
+    int json;
+    pthread_mutex_t lock;         // guards units[].done
+    pthread_cond_t unit_done;
+} reprocess_ctx_t;
+
+typedef struct {
+    reprocess_ctx_t *ctx;
+    int id;
+    pthread_t thread;
+    snapshot_t *snap;
+    field_list_t *fields;
+    int steals;
+} reprocess_worker_t;
+
+// Offset of the first snapshot header at or after from, or size
+static size_t reprocess_boundary(const char *text, size_t size, size_t from) {
+    const char *end = text + size;
+    const char *p = text + from - 1;
+    size_t magic_len = strlen(SNAPSHOT_MAGIC);
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        if ((size_t)(end - p) >= magic_len && memcmp(p, SNAPSHOT_MAGIC, magic_len) == 0) {
+            return p - text;
         }
     }
-    
-    if (verbose) printf("Failed to read EF_ICCID\n");
-    return -1;
+    return size;
 }
 
-static int get_imsi(sim_data_t *sim_data, int verbose) {
-    BYTE imsi[] = {0x6F, 0x07};
-    BYTE imsi_path[] = {0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x07};
-    BYTE data[20];
-    int len;
-    
-    // Try traditional selection first
-    if (select_file_traditional(imsi, "EF_IMSI", verbose) == 0) {
-        if (read_binary(data, 20, &len, verbose) == 0) {
-            print_hex_verbose("IMSI raw", data, len, verbose);
-            if (decode_imsi(data, len, sim_data->imsi) == 0) {
-                return 0;
+// Next unit for w, or -1 when every deque is empty
+static int reprocess_take(reprocess_worker_t *w) {
+    reprocess_ctx_t *ctx = w->ctx;
+    reprocess_deque_t *own = &ctx->deques[w->id];
+    int unit = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail) {
+        unit = own->slots[own->head];
+        __atomic_store_n(&own->head, own->head + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    while (unit < 0) {
+        reprocess_deque_t *victim = NULL;
+        int most = 0;
+
+        // Unlocked sizes only pick the victim; the steal itself is locked
+        for (int i = 0; i < ctx->num_threads; i++) {
+            reprocess_deque_t *d = &ctx->deques[i];
+            int left = __atomic_load_n(&d->tail, __ATOMIC_RELAXED) -
+                       __atomic_load_n(&d->head, __ATOMIC_RELAXED);
+            if (i != w->id && left > most) {
+                victim = d;
+                most = left;
             }
         }
+        if (!victim) break;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            unit = victim->slots[victim->tail - 1];
+            __atomic_store_n(&victim->tail, victim->tail - 1, __ATOMIC_RELAXED);
+            w->steals++;
+        }
+        pthread_mutex_unlock(&victim->lock);
     }
-    
-    // Try path-based selection
-    if (select_file_by_path(imsi_path, 6, "EF_IMSI", verbose) == 0) {
-        if (read_binary(data, 20, &len, verbose) == 0) {
-            print_hex_verbose("IMSI raw", data, len, verbose);
-            if (decode_imsi(data, len, sim_data->imsi) == 0) {
-                return 0;
+    return unit;
+}
+
+static void reprocess_card(FILE *out, const snapshot_t *snap, field_list_t *fields, int json) {
+    static const BYTE iccid_path[] = {0x3F, 0x00, 0x2F, 0xE2};
+    const snap_file_t *file = snapshot_find(snap, iccid_path, sizeof(iccid_path));
+    char iccid[21] = "";
+
+    if (file && decode_iccid(file->data, file->data_len, iccid) < 0) iccid[0] = '\0';
+    if (json) {
+        fprintf(out, "{\"iccid\":");
+        if (iccid[0]) fprint_json_string(out, iccid);
+        else fprintf(out, "null");
+        fprintf(out, ",\"files\":{");
+    }
+
+    for (int i = 0; i < snap->num_files; i++) {
+        file = &snap->files[i];
+        fields->count = 0;
+        decode_file_fields(file, fields);
+
+        if (json) {
+            fprintf(out, "%s\"", i ? "," : "");
+            fprint_hex(out, file->path, file->path_len);
+            fprintf(out, "\":{");
+            for (int f = 0; f < fields->count; f++) {
+                if (f) fputc(',', out);
+                fprint_json_string(out, fields->fields[f].name);
+                fputc(':', out);
+                fprint_json_string(out, fields->fields[f].value);
             }
+            fputc('}', out);
+            continue;
+        }
+        for (int f = 0; f < fields->count; f++) {
+            fprintf(out, "%s\t", iccid[0] ? iccid : "-");
+            fprint_hex(out, file->path, file->path_len);
+            fprintf(out, "\t%s\t%s\n", fields->fields[f].name, fields->fields[f].value);
         }
     }
-    
-    if (verbose) printf("Failed to read EF_IMSI\n");
-    return -1;
+    if (json) fprintf(out, "}}\n");
 }
 
-static int get_msisdn(sim_data_t *sim_data, int verbose) {
-    BYTE msisdn[] = {0x6F, 0x40};
-    BYTE msisdn_path[] = {0x3F, 0x00, 0x7F, 0x10, 0x6F, 0x40};
-    BYTE data[20];
-    int len;
-    
-    // Try traditional selection first
-    if (select_file_traditional(msisdn, "EF_MSISDN", verbose) == 0) {
-        if (read_binary(data, 20, &len, verbose) == 0) {
-            print_hex_verbose("MSISDN raw", data, len, verbose);
-            // Simple MSISDN decoding
-            if (len > 2) {
-                int num_len = data[0];
-                if (num_len > 0 && num_len < len - 2) {
-                    bytes_to_bcd(data + 2, num_len, sim_data->msisdn);
-                    return 0;
-                }
+// --where on an archived card; the identity fields are decoded only when
+// the expression uses them
+static int reprocess_matches(const snapshot_t *snap) {
+    sim_data_t sim_data;
+
+    if (!where_filter.length) return 1;
+    memset(&sim_data, 0, sizeof(sim_data));
+    if (where_filter.identity) {
+        sim_data_from_snapshot(&sim_data, snap);
+        enrich(sim_data.imsi, sim_data.net.mnc_length, sim_data.iccid, &sim_data.info);
+    }
+    return where_match(&where_filter, &sim_data, snap);
+}
+
+static void reprocess_unit(reprocess_worker_t *w, reprocess_unit_t *unit) {
+    FILE *in = fmemopen((void *)unit->start, unit->len, "r");
+    FILE *out = open_memstream(&unit->text, &unit->text_len);
+    int rv;
+    int resync = 0;
+
+    if (!in || !out) {
+        if (in) fclose(in);
+        if (out) fclose(out);
+        free(unit->text);
+        unit->text = NULL;
+        unit->failed = 1;
+        return;
+    }
+
+    // After a malformed snapshot every line up to the next header fails
+    // on its own; count the run once
+    while ((rv = snapshot_load(in, w->snap)) != 0) {
+        if (rv < 0) {
+            if (!resync) unit->malformed++;
+            resync = 1;
+            continue;
+        }
+        resync = 0;
+        if (reprocess_matches(w->snap)) {
+            reprocess_card(out, w->snap, w->fields, w->ctx->json);
+            unit->matched++;
+        }
+        snapshot_free(w->snap);
+        unit->cards++;
+    }
+    fclose(in);
+    if (fclose(out) != 0) unit->failed = 1;
+}
+
+static void *reprocess_worker(void *arg) {
+    reprocess_worker_t *w = arg;
+    reprocess_ctx_t *ctx = w->ctx;
+    int unit;
+
+    while ((unit = reprocess_take(w)) >= 0) {
+        reprocess_unit(w, &ctx->units[unit]);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->units[unit].done = 1;
+        pthread_cond_signal(&ctx->unit_done);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return NULL;
+}
+
+// Batch journal
+
+// --journal FILE makes long batch runs restartable. After each completed
+// card an append-only line "ICCID<TAB>OFFSET<TAB>RESULT" records the size
+// of the output (the -s snapshot file, or standard output when it is a
+// regular file) after that card's record. The output and then the journal
+// are fsynced every JOURNAL_SYNC_RECORDS cards and after each pass over the
+// readers. A rerun with the same journal skips the ICCIDs it lists, and
+// cuts the output back to the offset of the last journalled card that it
+// still fully contains, dropping any partial record a crash left behind.
+// The header names the output ("-" for standard output) and a journal is
+// only resumed into the same one. Standard output must be appended to
+// (>>): a shell truncating it with > would leave nothing to resume.
+#define JOURNAL_MAGIC "simreader-journal"
+#define JOURNAL_VERSION 2
+#define JOURNAL_SYNC_RECORDS 32
+
+typedef struct {
+    FILE *file;
+    FILE *output;                    // stream whose offsets are journalled
+    iccid_key_t *slots;              // completed ICCIDs, as in the expect set
+    uint64_t num_slots;
+    uint64_t num_keys;
+    int resumed;                     // the journal existed before this run
+    off_t resume_offset;             // output size to resume from
+    int unsynced;                    // records since the last fsync
+} journal_t;
+
+static journal_t journal;
+
+static int journal_add(const char *iccid) {
+    iccid_key_t key;
+
+    if (iccid_key(iccid, strlen(iccid), &key) < 0) return -1;
+    if ((journal.num_keys + 1) * 2 > journal.num_slots) {
+        uint64_t num_slots = journal.num_slots ? journal.num_slots * 2 : 1024;
+        iccid_key_t *slots = calloc(num_slots, sizeof(iccid_key_t));
+        if (!slots) return -1;
+        for (uint64_t i = 0; i < journal.num_slots; i++) {
+            if (journal.slots[i].hi || journal.slots[i].lo) {
+                slots[expect_slot(slots, num_slots, &journal.slots[i])] = journal.slots[i];
             }
         }
+        free(journal.slots);
+        journal.slots = slots;
+        journal.num_slots = num_slots;
+    }
+    uint64_t slot = expect_slot(journal.slots, journal.num_slots, &key);
+    if (!journal.slots[slot].hi && !journal.slots[slot].lo) {
+        journal.slots[slot] = key;
+        journal.num_keys++;
+    }
+    return 0;
+}
+
+static int journal_contains(const char *iccid) {
+    iccid_key_t key;
+
+    if (!journal.num_keys || iccid_key(iccid, strlen(iccid), &key) < 0) return 0;
+    uint64_t slot = expect_slot(journal.slots, journal.num_slots, &key);
+    return journal.slots[slot].hi || journal.slots[slot].lo;
+}
+
+// Size of the file behind fd, or -1 when it is not a regular file
+static off_t regular_file_size(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+    return st.st_size;
+}
+
+// Open or resume the journal. output_name is the -s file (NULL for
+// standard output); an existing output is expected to be at least as long
+// as the journal says, and journal lines beyond its size are dropped. A
+// missing -s file counts as empty, which drops them all.
+static int journal_open(const char *filename, const char *output_name) {
+    char line[4096];
+    off_t output_size = -1;
+    off_t keep = 0;                  // journal bytes that stay valid
+    int to_stdout = !output_name || strcmp(output_name, "-") == 0;
+    const char *output_key = to_stdout ? "-" : output_name;
+    struct stat st;
+    FILE *in;
+
+    memset(&journal, 0, sizeof(journal));
+    if (!to_stdout) {
+        if (stat(output_name, &st) == 0) output_size = st.st_size;
+        else if (errno == ENOENT) output_size = 0;
+    } else {
+        output_size = regular_file_size(STDOUT_FILENO);
+    }
+
+    if ((in = fopen(filename, "r")) != NULL) {
+        char *key;
+        int version;
+
+        journal.resumed = 1;
+        if (!fgets(line, sizeof(line), in) ||
+            strncmp(line, JOURNAL_MAGIC " ", strlen(JOURNAL_MAGIC) + 1) != 0) {
+            fprintf(stderr, "%s: not a simreader journal\n", filename);
+            fclose(in);
+            return -1;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        version = (int)strtol(line + strlen(JOURNAL_MAGIC) + 1, &key, 10);
+        if (version != JOURNAL_VERSION || *key++ != ' ') {
+            fprintf(stderr, "%s: unsupported journal version\n", filename);
+            fclose(in);
+            return -1;
+        }
+        if (strcmp(key, output_key) != 0) {
+            fprintf(stderr, "%s journals the output %s, not %s\n", filename, key, output_key);
+            fclose(in);
+            return -1;
+        }
+        // Offsets into a pipe or terminal cannot be checked; a regular file
+        // opened without O_APPEND was truncated by the shell
+        if (to_stdout && output_size < 0) {
+            fprintf(stderr, "Warning: standard output is not a file; %s cannot repair it\n", filename);
+        } else if (to_stdout && !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND)) {
+            fprintf(stderr, "Resuming %s needs standard output appended to (>>), not overwritten (>)\n",
+                    filename);
+            fclose(in);
+            return -1;
+        }
+        keep = ftello(in);
+        while (fgets(line, sizeof(line), in)) {
+            char iccid[32];
+            long long offset;
+            int result;
+
+            // A torn last line ends the journal
+            if (!strchr(line, '\n') || sscanf(line, "%31s %lld %d", iccid, &offset, &result) != 3) break;
+            if (output_size >= 0 && offset > output_size) break;
+            if (journal_add(iccid) < 0) break;
+            journal.resume_offset = offset;
+            keep = ftello(in);
+        }
+        fclose(in);
+        if (truncate(filename, keep) < 0 || !(journal.file = fopen(filename, "a"))) {
+            perror(filename);
+            return -1;
+        }
+        fprintf(stderr, "Resuming from %s: %llu card(s) done\n", filename, (unsigned long long)journal.num_keys);
+    } else {
+        if (!(journal.file = fopen(filename, "w"))) {
+            perror(filename);
+            return -1;
+        }
+        fprintf(journal.file, "%s %d %s\n", JOURNAL_MAGIC, JOURNAL_VERSION, output_key);
+    }
+
+    // Standard output is repaired here, the -s file when it is opened
+    if (to_stdout && journal.resumed && output_size > journal.resume_offset) {
+        if (ftruncate(STDOUT_FILENO, journal.resume_offset) < 0 ||
+            lseek(STDOUT_FILENO, journal.resume_offset, SEEK_SET) < 0) {
+            perror("Cannot repair standard output");
+            return -1;
+        }
+    }
+    journal.output = stdout;
+    return 0;
+}
+
+// Open the -s output of a journalled run: appended to after cutting it back
+// to the last complete card when resuming, created otherwise. It is only
+// ever cut, never grown to the journalled size.
+static FILE *journal_open_output(const char *filename) {
+    FILE *out;
+
+    if (!journal.resumed) return journal.output = fopen(filename, "w");
+    if (!(out = fopen(filename, "a"))) return NULL;
+    if (regular_file_size(fileno(out)) > journal.resume_offset &&
+        ftruncate(fileno(out), journal.resume_offset) < 0) {
+        fclose(out);
+        return NULL;
+    }
+    return journal.output = out;
+}
+
+// Make the output and then the journal durable
+static void journal_sync(void) {
+    if (!journal.file || !journal.unsynced) return;
+    if (journal.output) {
+        fflush(journal.output);
+        if (regular_file_size(fileno(journal.output)) >= 0) fsync(fileno(journal.output));
+    }
+    fflush(journal.file);
+    fsync(fileno(journal.file));
+    journal.unsynced = 0;
+}
+
+static void journal_record(const char *iccid, int result) {
+    off_t offset = 0;
+
+    if (journal.output) {
+        fflush(journal.output);
+        if ((offset = regular_file_size(fileno(journal.output))) < 0) offset = 0;
+    }
+    fprintf(journal.file, "%s\t%lld\t%d\n", iccid, (long long)offset, result);
+    journal_add(iccid);
+    if (++journal.unsynced >= JOURNAL_SYNC_RECORDS) journal_sync();
+}
+
+static int journal_close(void) {
+    int rv = 0;
+
+    if (!journal.file) return 0;
+    journal_sync();
+    if (fclose(journal.file) != 0) rv = -1;
+    free(journal.slots);
+    memset(&journal, 0, sizeof(journal));
+    return rv;
+}
+
+typedef int (*card_handler_t)(const config_t *config, const char *reader, void *arg);
+
+// Set by SIGINT and SIGTERM to end --watch after the current card
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Run handler on the connected card in current_reader, with its trace
+// header, health accounting (when h is set) and session metrics
+static int card_session(const config_t *config, reader_health_t *h, card_handler_t handler, void *arg) {
+    sim_data_t card = {0};
+    double start;
+    int rv;
+
+    session_iccid("");
+    if (journal.file) {
+        if (get_iccid(&card, 0) < 0) {
+            fprintf(stderr, "%s: cannot read the ICCID for the journal\n", current_reader);
+            return -1;
+        }
+        if (journal_contains(card.iccid)) {
+            if (config->verbose) printf("Skipping %s: %s is in the journal\n", current_reader, card.iccid);
+            return 0;
+        }
+        session_iccid(card.iccid);
+    }
+    start = monotonic_us();
+    if (trace_out) trace_card(current_reader);
+    if (h) health_begin_session(h);
+    dashboard_begin_session(h);
+    rv = handler(config, current_reader, arg);
+    dashboard_end_session(h, monotonic_us() - start, rv >= 0);
+    if (h) {
+        health_end_session(h, rv < 0);
+        if (h->window & 1) {
+            fprintf(stderr, "Reader %s degraded: %d error(s), %d retries%s\n", h->name,
+                    h->session_errors, h->session_retries, rv < 0 ? ", card not processed" : "");
+        }
+    }
+    metrics_session(monotonic_us() - start, rv >= 0);
+    if (journal.file && rv >= 0) journal_record(card.iccid, rv);
+    metrics_poll(config);
+    return rv;
+}
+
+// Wait up to timeout_ms for a card that was not processed yet. seen holds
+// the event state of the last card handled in each reader (0 for none),
+// indexed by its position in station_health so that it survives re-ranking
+// order; the new cards are flagged in pending[i] for order[i]. Returns their
+// number.
+static int wait_for_cards(reader_health_t **order, int count, DWORD *seen, int *pending, DWORD timeout_ms) {
+    SCARD_READERSTATE *states = calloc(count ? count : 1, sizeof(SCARD_READERSTATE));
+    int found = 0;
+
+    if (!states) return 0;
+    for (int i = 0; i < count; i++) {
+        DWORD last = seen[order[i] - station_health.readers];
+        states[i].szReader = order[i]->name;
+        states[i].dwCurrentState = last ? last : SCARD_STATE_UNAWARE;
+    }
+    LONG rv = SCardGetStatusChange(hContext, timeout_ms, states, count);
+    if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT) {
+        fprintf(stderr, "SCardGetStatusChange failed: %s\n", pcsc_stringify_error(rv));
+        poll(NULL, 0, timeout_ms);
+        free(states);
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        DWORD state = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+        DWORD *last = &seen[order[i] - station_health.readers];
+
+        pending[i] = 0;
+        if (!(state & SCARD_STATE_PRESENT) || (state & SCARD_STATE_MUTE)) {
+            if (state & SCARD_STATE_EMPTY) *last = state;
+            continue;
+        }
+        // The upper 16 bits count card events, so a new card changes them
+        if (!*last || !(*last & SCARD_STATE_PRESENT) || (*last >> 16) != (state >> 16)) {
+            pending[i] = 1;
+            found++;
+        }
+        *last = state;
+    }
+    free(states);
+    return found;
+}
+
+// Run handler on the selected card, or with --all-readers on the card in
+// every reader (optionally filtered by --reader). With --watch, keep waiting
+// for new cards until SIGINT or SIGTERM. Returns the highest handler result,
+// or -1 when no card could be processed.
+static int for_each_card(const config_t *config, card_handler_t handler, void *arg) {
+    if (!config->all_readers || config->virtual_file) {
+        if (open_card(config) < 0) return -1;
+        int rv = card_session(config, NULL, handler, arg);
+        journal_sync();
+        cleanup();
+        if (config->metrics_file) metrics_write_file(config->metrics_file);
+        return rv;
     }
     
-    // Try path-based selection
-    if (select_file_by_path(msisdn_path, 6, "EF_MSISDN", verbose) == 0) {
-        if (read_binary(data, 20, &len, verbose) == 0) {
-            print_hex_verbose("MSISDN raw", data, len, verbose);
-            // Simple MSISDN decoding
-            if (len > 2) {
-                int num_len = data[0];
-                if (num_len > 0 && num_len < len - 2) {
-                    bytes_to_bcd(data + 2, num_len, sim_data->msisdn);
-                    return 0;
-                }
+    char *readers;
+    reader_health_t **order = NULL;
+    DWORD *seen = NULL;
+    int *pending = NULL;
+    int num_readers = 0;
+    int count = 0;
+    int processed = 0;
+    int result = 0;
+    
+    if (establish_context() < 0) return -1;
+    if (config->health_file && health_load(config->health_file, &station_health) < 0) {
+        cleanup();
+        return -1;
+    }
+    if (!(readers = list_readers(&num_readers))) {
+        cleanup();
+        return -1;
+    }
+    
+    // Healthiest readers first. Adding readers moves the table, so the
+    // pointers are only taken once all of them are in.
+    for (char *p = readers; *p; p += strlen(p) + 1) {
+        if (config->reader_name && !strstr(p, config->reader_name)) continue;
+        health_find(&station_health, p, 1);
+    }
+    order = calloc(num_readers + 1, sizeof(reader_health_t *));
+    pending = calloc(num_readers + 1, sizeof(int));
+    seen = calloc(station_health.count + 1, sizeof(DWORD));
+    if (!order || !pending || !seen) goto out;
+    for (char *p = readers; *p; p += strlen(p) + 1) {
+        if (config->reader_name && !strstr(p, config->reader_name)) continue;
+        if ((order[count] = health_find(&station_health, p, 0)) != NULL) count++;
+    }
+    qsort(order, count, sizeof(order[0]), compare_health);
+    if (config->dashboard && dashboard_open(order, count) < 0) goto out;
+    
+    do {
+        if (config->watch) {
+            metrics_poll(config);
+            metrics.queue_depth = 0;
+            if (!wait_for_cards(order, count, seen, pending, 250)) continue;
+        } else {
+            for (int i = 0; i < count; i++) pending[i] = 1;
+        }
+        for (int i = 0; i < count; i++) metrics.queue_depth += pending[i];
+        
+        for (int i = 0; i < count && !stop_requested; i++) {
+            reader_health_t *h = order[i];
+            if (!pending[i]) continue;
+            metrics.queue_depth--;
+            if (h->quarantined) {
+                fprintf(stderr, "Skipping %s: %s\n", h->name, health_status(h));
+                continue;
+            }
+            if (connect_to_card(h->name) < 0) {
+                if (config->verbose) printf("Skipping %s: no card\n", h->name);
+                continue;
+            }
+            if (config->verbose) {
+                printf("Using reader: %s\n", h->name);
             }
+            snprintf(current_reader, sizeof(current_reader), "%.255s", h->name);
+            
+            int rv = card_session(config, h, handler, arg);
+            if (rv > result) result = rv;
+            if (rv >= 0) processed++;
+            disconnect_card();
         }
-    }
+        metrics.queue_depth = 0;
+        
+        health_evaluate(&station_health);
+        if (config->health_file) health_save(config->health_file, &station_health);
+        // Route the next pass by the health as it is now
+        qsort(order, count, sizeof(order[0]), compare_health);
+        fflush(stdout);
+        journal_sync();
+    } while (config->watch && !stop_requested);
     
-    if (verbose) printf("Failed to read EF_MSISDN\n");
-    return -1;
+    dashboard_close();
+    if (config->metrics_file) metrics_write_file(config->metrics_file);
+    if (!processed && !config->watch) {
+        fprintf(stderr, "No card found in any reader\n");
+        result = -1;
+    }
+out:
+    if (!order || !pending || !seen) result = -1;
+    free(readers);
+    free(order);
+    free(pending);
+    free(seen);
+    cleanup();
+    return result;
 }
 
-static int get_spn(sim_data_t *sim_data, int verbose) {
-    BYTE spn[] = {0x6F, 0x46};
-    BYTE spn_path[] = {0x3F, 0x00, 0x7F, 0x20, 0x6F, 0x46};
-    BYTE data[20];
-    int len;
+static int save_card_snapshot(FILE *out, int verbose) {
+    snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+    if (!snap) return -1;
     
-    // Try traditional selection first
-    if (select_file_traditional(spn, "EF_SPN", verbose) == 0) {
-        if (read_binary(data, 20, &len, verbose) == 0) {
-            print_hex_verbose("SPN raw", data, len, verbose);
-            // Decode SPN
-            if (len > 1) {
-                int spn_len = len - 1;
-                if (spn_len > 0 && spn_len < (int)sizeof(sim_data->spn)) {
-                    memcpy(sim_data->spn, data + 1, spn_len);
-                    sim_data->spn[spn_len] = '\0';
-                    return 0;
-                }
-            }
+    int rv = -1;
+    if (snapshot_capture(snap, NULL, verbose) < 0) {
+        fprintf(stderr, "Failed to capture snapshot\n");
+    } else {
+        rv = snapshot_save(out, snap);
+        fflush(out);
+    }
+    
+    snapshot_free(snap);
+    free(snap);
+    return rv;
+}
+
+typedef struct {
+    FILE *snapshot_out;
+    expect_set_t *expect;
+} read_ctx_t;
+
+// Default mode: read and print the basic card information
+static int read_card(const config_t *config, const char *reader, void *arg) {
+    read_ctx_t *ctx = arg;
+    sim_data_t sim_data = {0};
+    snapshot_t *snap = NULL;
+    int rv = 0;
+    
+    // -a reads the catalog once and decodes everything from that capture,
+    // which also serves as the -s snapshot
+    if (config->complete_analysis) {
+        if (!(snap = calloc(1, sizeof(snapshot_t)))) return -1;
+        if (snapshot_capture(snap, NULL, config->verbose) < 0) {
+            fprintf(stderr, "Failed to capture snapshot\n");
         }
+        sim_data_from_snapshot(&sim_data, snap);
+        sim_data.local_contacts = phonebook_count_local(&sim_data.local_total, config->verbose);
+        get_channel_info(&sim_data, 0, config->verbose);
+    } else {
+        // Extract SIM data using universal methods
+        get_iccid(&sim_data, config->verbose);
+        get_imsi(&sim_data, config->verbose);
+        get_msisdn(&sim_data, config->verbose);
+        get_spn(&sim_data, config->verbose);
+        get_network_info(&sim_data, config->verbose);
+        // MANAGE CHANNEL and the ISIM and ISD-R selections cost a few
+        // round trips that most batches do not need
+        if (config->read_apps) get_channel_info(&sim_data, 1, config->verbose);
     }
+    enrich(sim_data.imsi, sim_data.net.mnc_length, sim_data.iccid, &sim_data.info);
+    session_iccid(sim_data.iccid);
     
-    // Try path-based selection
-    if (select_file_by_path(spn_path, 6, "EF_SPN", verbose) == 0) {
-        if (read_binary(data, 20, &len, verbose) == 0) {
-            print_hex_verbose("SPN raw", data, len, verbose);
-            // Decode SPN
-            if (len > 1) {
-                int spn_len = len - 1;
-                if (spn_len > 0 && spn_len < (int)sizeof(sim_data->spn)) {
-                    memcpy(sim_data->spn, data + 1, spn_len);
-                    sim_data->spn[spn_len] = '\0';
-                    return 0;
-                }
-            }
+    if (ctx->expect) {
+        sim_data.expect_status = expect_status_names[expect_check(ctx->expect, sim_data.iccid)];
+    }
+    // Cards that do not match --where are read but not published or written
+    if (where_filter.length && !where_card_matches(&sim_data, snap, config->verbose)) {
+        if (config->verbose) fprintf(stderr, "Card %s does not match --where\n", sim_data.iccid);
+        if (snap) {
+            snapshot_free(snap);
+            free(snap);
         }
+        return 0;
     }
+    ring_publish_card(reader, &sim_data);
     
-    if (verbose) printf("Failed to read EF_SPN\n");
-    return -1;
-}
-
-static void print_json_output(sim_data_t *sim_data) {
-    printf("{\n");
-    printf("  \"imsi\": \"%s\",\n", sim_data->imsi[0] ? sim_data->imsi : "null");
-    printf("  \"iccid\": \"%s\",\n", sim_data->iccid[0] ? sim_data->iccid : "null");
-    printf("  \"msisdn\": \"%s\",\n", sim_data->msisdn[0] ? sim_data->msisdn : "null");
-    printf("  \"spn\": \"%s\"\n", sim_data->spn[0] ? sim_data->spn : "null");
-    printf("}\n");
-}
-
-static void print_human_output(sim_data_t *sim_data) {
-    printf("=== SIM Card Information ===\n");
-    printf("IMSI:    %s\n", sim_data->imsi[0] ? sim_data->imsi : "Not available");
-    printf("ICCID:   %s\n", sim_data->iccid[0] ? sim_data->iccid : "Not available");
-    printf("MSISDN:  %s\n", sim_data->msisdn[0] ? sim_data->msisdn : "Not available");
-    printf("SPN:     %s\n", sim_data->spn[0] ? sim_data->spn : "Not available");
+    // Output results
+    if (config->complete_analysis) {
+        print_complete_analysis(&sim_data, snap, reader);
+    } else if (config->json_output) {
+        print_json_output(&sim_data);
+    } else {
+        print_human_output(&sim_data);
+    }
+    
+    // Explore files if requested
+    if (config->explore_files) {
+        explore_sim_files(config->verbose);
+    }
+    
+    // Save a snapshot of the card if requested
+    if (ctx->snapshot_out) {
+        if (snap && snap->num_files) {
+            rv = snapshot_save(ctx->snapshot_out, snap);
+            fflush(ctx->snapshot_out);
+        } else {
+            rv = save_card_snapshot(ctx->snapshot_out, config->verbose);
+        }
+    }
+    if (snap) {
+        snapshot_free(snap);
+        free(snap);
+    }
+    return rv;
 }
 
-static void print_complete_analysis(sim_data_t *sim_data) {
-    printf("=== Complete SIM Card Analysis ===\n");
-    printf("\n");
+// simreader diff A B: each operand is a snapshot file or "card". A card is
+// read only for the files present in the other snapshot.
+static int run_diff(const config_t *config, int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: simreader diff SNAPSHOT|card SNAPSHOT|card\n");
+        return 2;
+    }
     
-    printf("📱 SIM Card Type Detection:\n");
-    printf("This appears to be a modern USIM (Universal Subscriber Identity Module) card.\n");
-    printf("USIM cards are used in 3G/4G/5G networks and have different file organization\n");
-    printf("compared to traditional 2G SIM cards.\n");
-    printf("\n");
+    int card_a = strcmp(argv[0], "card") == 0;
+    int card_b = strcmp(argv[1], "card") == 0;
+    if (card_a && card_b) {
+        fprintf(stderr, "At most one operand can be the card\n");
+        return 2;
+    }
     
-    printf("🔍 Analysis Results:\n");
-    printf("✓ Successfully read basic SIM information:\n");
-    printf("  - ICCID: %s\n", sim_data->iccid[0] ? sim_data->iccid : "Not available");
-    printf("  - IMSI: %s\n", sim_data->imsi[0] ? sim_data->imsi : "Not available");
-    printf("  - SPN: %s\n", sim_data->spn[0] ? sim_data->spn : "Not available");
-    printf("\n");
+    snapshot_t *a = calloc(1, sizeof(snapshot_t));
+    snapshot_t *b = calloc(1, sizeof(snapshot_t));
+    int rv = 2;
     
-    printf("📞 Contact Storage Analysis:\n");
-    printf("❌ No contacts found on SIM card\n");
-    printf("❌ No SMS messages found on SIM card\n");
-    printf("\n");
+    if (!a || !b) goto out;
+    if (!card_a && snapshot_load_file(argv[0], a) < 0) goto out;
+    if (!card_b && snapshot_load_file(argv[1], b) < 0) goto out;
     
-    printf("🤔 Why no contacts were found:\n");
-    printf("1. **Empty SIM**: The contacts/SMS files exist but contain no data\n");
-    printf("2. **Modern Phone Storage**: Most smartphones store contacts in phone memory\n");
-    printf("3. **Cloud Sync**: Contacts may be synced to Google/Apple/Microsoft accounts\n");
-    printf("4. **USIM Structure**: Modern USIM cards use different storage methods\n");
-    printf("\n");
+    if (card_a || card_b) {
+        if (open_card(config) < 0) goto out;
+        snapshot_t *live = card_a ? a : b;
+        if (snapshot_capture(live, card_a ? b : a, config->verbose) < 0) {
+            fprintf(stderr, "Failed to read card\n");
+            cleanup();
+            goto out;
+        }
+        cleanup();
+    }
     
-    printf("📊 SIM File Structure:\n");
-    printf("All phonebook files (ADN, FDN, SMS, etc.) are 'Transparent Files':\n");
-    printf("- This means they contain binary data rather than structured records\n");
-    printf("- The files are likely empty or contain metadata\n");
-    printf("- This is normal for modern USIM cards\n");
-    printf("\n");
+    printf("--- %s\n+++ %s\n", argv[0], argv[1]);
+    int differences = snapshot_diff(a, b);
+    if (differences >= 0) {
+        printf("%d file(s) differ\n", differences);
+        rv = differences > 0 ? 1 : 0;
+    }
     
-    printf("💡 Recommendations:\n");
-    printf("\n");
-    printf("To extract contacts from your device:\n");
-    printf("\n");
-    printf("📲 **Android Phones**:\n");
-    printf("  - Settings → Google → Contacts → Export → .csv file\n");
-    printf("  - Or use 'Contacts' app → Import/Export\n");
-    printf("  - Many Android phones don't store contacts on SIM by default\n");
-    printf("\n");
-    printf("🍎 **iPhones**:\n");
-    printf("  - iCloud.com → Contacts → Export (vCard format)\n");
-    printf("  - iTunes/Finder backup extraction\n");
-    printf("  - iPhones typically don't store contacts on SIM\n");
-    printf("\n");
-    printf("💻 **Computer Backup**:\n");
-    printf("  - Check if you have phone backups with contacts\n");
-    printf("  - Look for .vcf, .csv, or similar contact files\n");
-    printf("\n");
-    printf("📞 **From Old Phone**:\n");
-    printf("  - If you have an old phone with the contacts:\n");
-    printf("  - Copy contacts to phone memory first\n");
-    printf("  - Then export to computer/cloud\n");
-    printf("\n");
+out:
+    if (a) snapshot_free(a);
+    if (b) snapshot_free(b);
+    free(a);
+    free(b);
+    return rv;
+}
+
+// simreader verify GOLDEN: check each card against a golden snapshot, with
+// per-card values from --values. Exits 0 when every card passed.
+static int run_verify(const config_t *config, int argc, char **argv) {
+    if (argc != 1) {
+        fprintf(stderr, "Usage: simreader verify [-l VALUES] GOLDEN\n");
+        return 2;
+    }
     
-    printf("🔧 Technical Details:\n");
-    printf("SIM Card Reader successfully:\n");
-    printf("✓ Connected to ACS ACR 38U-CCID reader\n");
-    printf("✓ Established communication with SIM card\n");
-    printf("✓ Read ICCID, IMSI, and SPN information\n");
-    printf("✓ Explored 57 different SIM/USIM files\n");
-    printf("✓ Verified all phonebook files are accessible but empty\n");
-    printf("\n");
+    verify_ctx_t *ctx = calloc(1, sizeof(verify_ctx_t));
+    snapshot_t *golden = calloc(1, sizeof(snapshot_t));
+    value_table_t values;
+    int have_values = 0;
+    int rv = 2;
     
-    printf("📋 What this tool CAN extract from SIM cards:\n");
-    printf("✓ ICCID (SIM serial number)\n");
-    printf("✓ IMSI (subscriber identity)\n");
-    printf("✓ SPN (service provider name)\n");
-    printf("✓ Network information and preferences\n");
-    printf("✓ SMS service parameters\n");
-    printf("✓ Emergency call codes\n");
-    printf("✓ Language preferences\n");
-    printf("\n");
+    if (!ctx || !golden) goto out;
+    if (snapshot_load_file(argv[0], golden) < 0) goto out;
+    if (config->values_file) {
+        if (value_table_load(config->values_file, &values) < 0) goto out;
+        have_values = 1;
+        ctx->values = &values;
+    }
+    ctx->golden = golden;
+    if (plan_verification(ctx) < 0) goto out;
     
-    printf("📋 What this tool CANNOT extract:\n");
-    printf("❌ Contacts (when stored in phone memory)\n");
-    printf("❌ Contacts (when stored in cloud services)\n");
-    printf("❌ SMS messages (when stored in phone memory)\n");
-    printf("❌ Call history (stored in phone, not SIM)\n");
-    printf("❌ Photos, videos, apps (stored in phone memory/storage)\n");
-    printf("\n");
+    if (for_each_card(config, verify_card, ctx) >= 0) {
+        if (!config->json_output) {
+            printf("%d passed, %d failed\n", ctx->passed, ctx->failed);
+        }
+        rv = ctx->failed ? 1 : 0;
+    }
     
-    printf("🎯 Conclusion:\n");
-    printf("Your SIM card is working correctly and is a modern USIM card.\n");
-    printf("The lack of contacts/SMS on the SIM is normal for current smartphones.\n");
-    printf("Your contacts are likely stored in your phone's memory or cloud service.\n");
-    printf("\n");
+out:
+    if (have_values) value_table_free(&values);
+    if (golden) snapshot_free(golden);
+    free(golden);
+    free(ctx);
+    return rv;
+}
+
+// ADM keys are given as 16 hex digits, or as up to 8 characters padded
+// with FF
+static int parse_adm_key(const char *text, BYTE *key) {
+    memset(key, 0xFF, 8);
+    if (strlen(text) == 16 && hex_to_bytes(text, key, 8) == 8) return 0;
+    if (strlen(text) <= 8) {
+        memcpy(key, text, strlen(text));
+        return 0;
+    }
+    fprintf(stderr, "Invalid ADM key\n");
+    return -1;
+}
+
+// simreader provision TEMPLATE: apply a profile template to each card,
+// writing only what differs from the card's current contents
+static int run_provision(const config_t *config, int argc, char **argv) {
+    if (argc != 1) {
+        fprintf(stderr, "Usage: simreader provision [-l VALUES] [--adm KEY] [--dry-run] TEMPLATE\n");
+        return 2;
+    }
     
-    printf("For contact extraction, use your phone's built-in export functions\n");
-    printf("or check your cloud service (Google Contacts, iCloud, etc.).\n");
-    printf("\n");
+    provision_ctx_t *ctx = calloc(1, sizeof(provision_ctx_t));
+    profile_template_t *profile = calloc(1, sizeof(profile_template_t));
+    value_table_t values;
+    int have_values = 0;
+    int rv = 2;
+    
+    if (!ctx || !profile) goto out;
+    if (template_load(argv[0], profile) < 0) goto out;
+    if (config->values_file) {
+        if (value_table_load(config->values_file, &values) < 0) goto out;
+        have_values = 1;
+        ctx->values = &values;
+    }
+    if (config->adm_key) {
+        if (parse_adm_key(config->adm_key, ctx->adm) < 0) goto out;
+        ctx->have_adm = 1;
+    }
+    ctx->profile = profile;
+    ctx->dry_run = config->dry_run;
+    
+    if (for_each_card(config, provision_card, ctx) >= 0) {
+        if (!ctx->dry_run) {
+            printf("%d provisioned, %d unchanged, %d failed\n",
+                   ctx->provisioned, ctx->unchanged, ctx->failed);
+        }
+        rv = ctx->failed ? 1 : 0;
+    }
     
-    printf("=== Analysis Complete ===\n");
+out:
+    if (have_values) value_table_free(&values);
+    free(profile);
+    free(ctx);
+    return rv;
 }
 
-static void cleanup(void) {
-    if (hCard) {
-        SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+// simreader phonebook [export] | phonebook import FILE: export the
+// phonebooks as vCard (NDJSON with -j), or make the card phonebook match a
+// vCard file
+static int run_phonebook(const config_t *config, int argc, char **argv) {
+    phonebook_ctx_t ctx = {0};
+    contact_t *contacts = NULL;
+    int rv;
+
+    if (argc == 2 && strcmp(argv[0], "import") == 0) {
+        if (vcard_load(argv[1], &contacts, &ctx.num_contacts) < 0) return 2;
+        ctx.contacts = contacts;
+    } else if (argc > 1 || (argc == 1 && strcmp(argv[0], "export") != 0)) {
+        fprintf(stderr, "Usage: simreader phonebook [export] | phonebook import FILE.vcf\n");
+        return 2;
     }
-    if (hContext) {
-        SCardReleaseContext(hContext);
+    if (config->adm_key) {
+        if (parse_adm_key(config->adm_key, ctx.adm) < 0) {
+            free(contacts);
+            return 2;
+        }
+        ctx.have_adm = 1;
+    }
+    ctx.dry_run = config->dry_run;
+
+    rv = for_each_card(config, phonebook_card, &ctx);
+    free(contacts);
+    return rv < 0 ? 2 : rv;
+}
+
+// simreader sms: print the SMS store (EF_SMS, EF_SMSP, EF_SMSS, EF_SMSR)
+// as NDJSON
+static int run_sms(const config_t *config, int argc, char **argv) {
+    (void)argv;
+    if (argc != 0) {
+        fprintf(stderr, "Usage: simreader sms\n");
+        return 2;
     }
+    int rv = for_each_card(config, sms_card, NULL);
+    return rv < 0 ? 2 : rv;
 }
 
-static void print_usage(const char *program_name) {
-    printf("simreader - Unified SIM Card Reader Tool v%s\n", VERSION);
-    printf("Usage: %s [OPTIONS]\n", program_name);
-    printf("Options:\n");
-    printf("  -v, --verbose        Show verbose output (APDUs, hex dumps)\n");
-    printf("  -j, --json           Output in JSON format\n");
-    printf("  -e, --explore        Explore all accessible SIM files\n");
-    printf("  -a, --analysis       Complete analysis with recommendations\n");
-    printf("  -r, --reader NAME    Specify reader name\n");
-    printf("  -p, --pin            Prompt for PIN (not implemented)\n");
-    printf("  -h, --help           Show this help message\n");
-    printf("  --version            Show version information\n");
-    printf("\nThis tool is designed for modern USIM cards and may not find\n");
-    printf("contacts stored on older SIM cards or in phone memory.\n");
-    printf("\nExamples:\n");
-    printf("  %s                    Basic SIM information\n", program_name);
-    printf("  %s -a                Complete analysis with recommendations\n", program_name);
-    printf("  %s -e -v             Explore all files with verbose output\n", program_name);
-    printf("  %s -j                Output in JSON format\n", program_name);
+// simreader auth-bench VECTORS [ROUNDS]: send the authentication vectors
+// ROUNDS times (default 1) and report responses and latencies
+static int run_auth_bench(const config_t *config, int argc, char **argv) {
+    auth_bench_ctx_t ctx = {0};
+    int rv;
+
+    if (argc < 1 || argc > 2 || (argc == 2 && atoi(argv[1]) < 1)) {
+        fprintf(stderr, "Usage: simreader auth-bench VECTORS [ROUNDS]\n");
+        return 2;
+    }
+    if (auth_vectors_load(argv[0], &ctx.vectors, &ctx.num_vectors) < 0) return 2;
+    ctx.rounds = argc == 2 ? atoi(argv[1]) : 1;
+
+    rv = for_each_card(config, auth_bench_card, &ctx);
+    free(ctx.vectors);
+    return rv < 0 ? 2 : rv;
+}
+
+// simreader replay TRACE: send the commands of a trace to the card and
+// compare the responses. With --dry-run only the trace statistics are
+// printed.
+static int run_replay(const config_t *config, int argc, char **argv) {
+    replay_ctx_t ctx = {0};
+    trace_t trace;
+    trace_stats_t stats;
+    int rv;
+
+    if (argc != 1) {
+        fprintf(stderr, "Usage: simreader [--dry-run] replay TRACE\n");
+        return 2;
+    }
+    if (trace_load(argv[0], &trace) < 0) return 2;
+    trace_statistics(&trace, &stats);
+    trace_print_stats(argv[0], &stats, config->json_output);
+    if (config->dry_run) {
+        free(trace.entries);
+        return 0;
+    }
+
+    ctx.trace = &trace;
+    rv = for_each_card(config, replay_card, &ctx);
+    free(trace.entries);
+    return rv < 0 ? 2 : rv;
+}
+
+// simreader import DUMP...: convert pySim-read, pySim-shell export, JSON
+// and hex dumps into snapshots, written to --snapshot or standard output
+static int run_import(const config_t *config, int argc, char **argv) {
+    snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+    FILE *out = stdout;
+    int imported = 0;
+    int failed = 0;
+
+    if (!snap) return 2;
+    if (argc < 1) {
+        fprintf(stderr, "Usage: simreader [-s OUTPUT] import DUMP...\n");
+        free(snap);
+        return 2;
+    }
+    if (config->snapshot_file && strcmp(config->snapshot_file, "-") != 0 &&
+        !(out = fopen(config->snapshot_file, "w"))) {
+        fprintf(stderr, "Cannot write snapshot %s\n", config->snapshot_file);
+        free(snap);
+        return 2;
+    }
+
+    for (int i = 0; i < argc; i++) {
+        const char *format;
+        if (import_dump(argv[i], snap, &format) < 0) {
+            fprintf(stderr, "Cannot import %s\n", argv[i]);
+            failed++;
+            continue;
+        }
+        fprintf(out, "# imported from %s (%s)\n", argv[i], format);
+        if (snapshot_save(out, snap) < 0) failed++;
+        else imported++;
+        if (config->verbose) fprintf(stderr, "%s: %s, %d file(s)\n", argv[i], format, snap->num_files);
+        snapshot_free(snap);
+    }
+
+    if (out != stdout && fclose(out) != 0) failed++;
+    free(snap);
+    fprintf(stderr, "%d imported, %d failed\n", imported, failed);
+    return failed ? 1 : 0;
+}
+
+// simreader generate TEMPLATE COUNT [FILL]: write COUNT synthetic cards
+// derived from a template snapshot to --snapshot or standard output. FILL
+// is the percentage of phonebook and SMS records in use, "PB,SMS" to set
+// them apart (default 50).
+static int run_generate(const config_t *config, int argc, char **argv) {
+    generate_ctx_t ctx = {0};
+    FILE *out = stdout;
+    char *end;
+    unsigned long long count = 0;
+    int failed = 0;
+
+    if (argc >= 2) count = strtoull(argv[1], &end, 10);
+    ctx.fill_phonebook = ctx.fill_sms = 50;
+    if (argc == 3) {
+        int n = sscanf(argv[2], "%d,%d", &ctx.fill_phonebook, &ctx.fill_sms);
+        if (n == 1) ctx.fill_sms = ctx.fill_phonebook;
+        if (n < 1 || ctx.fill_phonebook < 0 || ctx.fill_phonebook > 100 ||
+            ctx.fill_sms < 0 || ctx.fill_sms > 100) {
+            count = 0;
+        }
+    }
+    if (argc < 2 || argc > 3 || !count || *end) {
+        fprintf(stderr, "Usage: simreader [-s OUTPUT] generate TEMPLATE COUNT [PB%%[,SMS%%]]\n");
+        return 2;
+    }
+
+    ctx.snap = calloc(1, sizeof(snapshot_t));
+    if (!ctx.snap) return 2;
+    if (snapshot_load_file(argv[0], ctx.snap) < 0 || generate_prepare(&ctx) < 0) {
+        snapshot_free(ctx.snap);
+        free(ctx.snap);
+        return 2;
+    }
+    if (config->snapshot_file && strcmp(config->snapshot_file, "-") != 0 &&
+        !(out = fopen(config->snapshot_file, "w"))) {
+        fprintf(stderr, "Cannot write snapshot %s\n", config->snapshot_file);
+        snapshot_free(ctx.snap);
+        free(ctx.snap);
+        return 2;
+    }
+
+    double start = monotonic_us();
+    unsigned long long n;
+    for (n = 0; n < count && !failed; n++) {
+        generate_card(&ctx, n);
+        if (snapshot_save(out, ctx.snap) < 0) failed = 1;
+    }
+    if (out != stdout && fclose(out) != 0) failed = 1;
+    if (failed) fprintf(stderr, "Write error after %llu card(s)\n", n);
+    else if (config->verbose) fprintf(stderr, "%.0f cards/s\n", count / ((monotonic_us() - start) / 1e6));
+    fprintf(stderr, "%llu card(s) generated from %s (ICCID %s, IMSI %s)\n",
+            failed ? n - 1 : count, argv[0], ctx.iccid, ctx.imsi);
+
+    snapshot_free(ctx.snap);
+    free(ctx.snap);
+    return failed ? 1 : 0;
+}
+
+// simreader reprocess ARCHIVE [THREADS]: run the field decoders over every
+// card of a snapshot archive on THREADS threads (default one per online
+// CPU). Writes one tab-separated line per field (ICCID, path, field, value),
+// or with -j one JSON object per card, to --snapshot or standard output in
+// archive order. Cards that do not match --where are skipped.
+static int run_reprocess(const config_t *config, int argc, char **argv) {
+    reprocess_ctx_t ctx = {0};
+    reprocess_worker_t *workers = NULL;
+    FILE *out = stdout;
+    struct stat st;
+    char *end = "";
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int started = 0;
+    int rv = 2;
+
+    if (argc == 2) threads = strtol(argv[1], &end, 10);
+    else if (threads < 1) threads = 1;
+    if (argc < 1 || argc > 2 || *end || threads < 1 || threads > 1024) {
+        fprintf(stderr, "Usage: simreader [-j] [-s OUTPUT] reprocess ARCHIVE [THREADS]\n");
+        return 2;
+    }
+
+    int fd = open(argv[0], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot read archive %s\n", argv[0]);
+        if (fd >= 0) close(fd);
+        return 2;
+    }
+    const char *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map archive %s\n", argv[0]);
+        return 2;
+    }
+    if (st.st_size) posix_madvise((void *)map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    size_t size = st.st_size;
+    ctx.units = calloc(size / REPROCESS_UNIT_SIZE + 1, sizeof(reprocess_unit_t));
+    for (size_t pos = 0; ctx.units && pos < size; ctx.num_units++) {
+        size_t next = size - pos > REPROCESS_UNIT_SIZE ?
+                      reprocess_boundary(map, size, pos + REPROCESS_UNIT_SIZE) : size;
+        ctx.units[ctx.num_units].start = map + pos;
+        ctx.units[ctx.num_units].len = next - pos;
+        pos = next;
+    }
+    if (threads > ctx.num_units) threads = ctx.num_units ? ctx.num_units : 1;
+    ctx.num_threads = threads;
+    ctx.json = config->json_output;
+    ctx.deques = calloc(threads, sizeof(reprocess_deque_t));
+    workers = calloc(threads, sizeof(reprocess_worker_t));
+    if (!ctx.units || !ctx.deques || !workers) goto out;
+
+    for (int i = 0; i < ctx.num_threads; i++) pthread_mutex_init(&ctx.deques[i].lock, NULL);
+    for (int i = 0; i < ctx.num_threads; i++) {
+        reprocess_deque_t *d = &ctx.deques[i];
+        d->slots = malloc((ctx.num_units / threads + 1) * sizeof(int));
+        for (int u = i; d->slots && u < ctx.num_units; u += threads) d->slots[d->tail++] = u;
+        workers[i].ctx = &ctx;
+        workers[i].id = i;
+        workers[i].snap = calloc(1, sizeof(snapshot_t));
+        workers[i].fields = malloc(sizeof(field_list_t));
+        if (!d->slots || !workers[i].snap || !workers[i].fields) goto out;
+    }
+
+    if (config->snapshot_file && strcmp(config->snapshot_file, "-") != 0 &&
+        !(out = fopen(config->snapshot_file, "w"))) {
+        fprintf(stderr, "Cannot write %s\n", config->snapshot_file);
+        out = stdout;
+        goto out;
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.unit_done, NULL);
+    double start = monotonic_us();
+    for (started = 0; started < ctx.num_threads; started++) {
+        if (pthread_create(&workers[started].thread, NULL, reprocess_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    // The running threads steal the units of any that failed to start
+    if (!started) reprocess_worker(&workers[0]);
+
+    unsigned long long cards = 0;
+    unsigned long long matched = 0;
+    unsigned long long malformed = 0;
+    int failed = 0;
+    for (int i = 0; i < ctx.num_units; i++) {
+        reprocess_unit_t *unit = &ctx.units[i];
+
+        pthread_mutex_lock(&ctx.lock);
+        while (!unit->done) pthread_cond_wait(&ctx.unit_done, &ctx.lock);
+        pthread_mutex_unlock(&ctx.lock);
+
+        if (unit->failed || fwrite(unit->text, 1, unit->text_len, out) != unit->text_len) failed = 1;
+        free(unit->text);
+        unit->text = NULL;
+        cards += unit->cards;
+        matched += unit->matched;
+        malformed += unit->malformed;
+    }
+    int steals = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        steals += workers[i].steals;
+    }
+    pthread_cond_destroy(&ctx.unit_done);
+    pthread_mutex_destroy(&ctx.lock);
+
+    if (fflush(out) != 0) failed = 1;
+    if (failed) fprintf(stderr, "Write error\n");
+    if (config->verbose) {
+        double seconds = (monotonic_us() - start) / 1e6;
+        fprintf(stderr, "%d work unit(s), %d stolen, %.0f cards/s, %.0f MB/s\n", ctx.num_units,
+                steals, cards / seconds, size / seconds / 1e6);
+    }
+    fprintf(stderr, "%llu card(s) reprocessed on %d thread(s)", cards, started ? started : 1);
+    if (where_filter.length) fprintf(stderr, ", %llu matched", matched);
+    if (malformed) fprintf(stderr, ", %llu malformed", malformed);
+    fprintf(stderr, "\n");
+    rv = failed || malformed ? 1 : 0;
+
+out:
+    if (out != stdout && fclose(out) != 0) rv = 1;
+    for (int i = 0; ctx.units && ctx.deques && workers && i < ctx.num_threads; i++) {
+        pthread_mutex_destroy(&ctx.deques[i].lock);
+        free(ctx.deques[i].slots);
+        free(workers[i].snap);
+        free(workers[i].fields);
+    }
+    free(workers);
+    free(ctx.deques);
+    free(ctx.units);
+    if (st.st_size) munmap((void *)map, st.st_size);
+    return rv;
+}
+
+// simreader --health FILE health [reset [READER] | next]: print the reader
+// health table, return quarantined readers to service, or name the
+// healthiest idle reader for the next card
+static int run_health(const config_t *config, int argc, char **argv) {
+    health_table_t health;
+    int rv = 0;
+
+    if (!config->health_file || argc > 2 ||
+        (argc >= 1 && strcmp(argv[0], "reset") != 0 && (strcmp(argv[0], "next") != 0 || argc > 1))) {
+        fprintf(stderr, "Usage: simreader --health FILE health [reset [READER] | next]\n");
+        return 2;
+    }
+    if (health_load(config->health_file, &health) < 0) return 2;
+
+    if (argc == 0) {
+        health_print(&health, config->json_output);
+    } else if (strcmp(argv[0], "reset") == 0) {
+        int released = 0;
+        for (int i = 0; i < health.count; i++) {
+            reader_health_t *h = &health.readers[i];
+            if (argc == 2 && !strstr(h->name, argv[1])) continue;
+            released += h->quarantined != 0;
+            h->quarantined = HEALTH_OK;
+            h->window = 0;
+        }
+        printf("%d reader(s) returned to service\n", released);
+        if (health_save(config->health_file, &health) < 0) rv = 1;
+    } else {
+        reader_health_t **order;
+        char *readers;
+        int num_readers = 0;
+        int count = 0;
+
+        if (establish_context() < 0 || !(readers = list_readers(&num_readers))) {
+            cleanup();
+            free(health.readers);
+            return 2;
+        }
+        // As in for_each_card: adding readers moves the table, so the
+        // pointers are only taken once all of them are in
+        for (char *p = readers; *p; p += strlen(p) + 1) {
+            if (config->reader_name && !strstr(p, config->reader_name)) continue;
+            health_find(&health, p, 1);
+        }
+        if (!(order = calloc(num_readers + 1, sizeof(reader_health_t *)))) {
+            free(readers);
+            cleanup();
+            free(health.readers);
+            return 2;
+        }
+        for (char *p = readers; *p; p += strlen(p) + 1) {
+            if (config->reader_name && !strstr(p, config->reader_name)) continue;
+            reader_health_t *h = health_find(&health, p, 0);
+            if (h && !h->quarantined && reader_is_empty(p)) order[count++] = h;
+        }
+        cleanup();
+        qsort(order, count, sizeof(order[0]), compare_health);
+        if (count) {
+            printf("%s\n", order[0]->name);
+        } else {
+            fprintf(stderr, "No idle reader in service\n");
+            rv = 1;
+        }
+        free(order);
+        free(readers);
+    }
+    free(health.readers);
+    return rv;
+}
+
+// simreader -l KEYS auth-verify RESPONSES...: check auth-bench -j output
+// against the Milenage keys of each card. Exits 0 when every card passed.
+static int run_auth_verify(const config_t *config, int argc, char **argv) {
+    auth_verify_ctx_t ctx = {0};
+    value_table_t values;
+    int rv = 2;
+
+    if (argc < 1 || !config->values_file) {
+        fprintf(stderr, "Usage: simreader -l KEYS auth-verify RESPONSES...\n");
+        return 2;
+    }
+    if (value_table_load(config->values_file, &values) < 0) return 2;
+    ctx.values = &values;
+    ctx.card_of_row = malloc((values.num_rows + 1) * sizeof(int));
+    if (!ctx.card_of_row) goto out;
+    for (int i = 0; i < values.num_rows; i++) ctx.card_of_row[i] = -1;
+
+    for (int i = 0; i < argc; i++) {
+        if (auth_verify_load(&ctx, argv[i]) < 0) goto out;
+    }
+    if (!ctx.num_cards) {
+        fprintf(stderr, "No auth-bench responses with an ICCID found\n");
+        goto out;
+    }
+    int failed = auth_verify_run(&ctx, config->json_output, config->verbose);
+    if (failed >= 0) {
+        if (!config->json_output) printf("%d passed, %d failed\n", ctx.num_cards - failed, failed);
+        rv = failed ? 1 : 0;
+    }
+
+out:
+    free(ctx.card_of_row);
+    free(ctx.cards);
+    free(ctx.records);
+    value_table_free(&values);
+    return rv;
 }
 
 int main(int argc, char *argv[]) {
@@ -679,11 +11132,28 @@ int main(int argc, char *argv[]) {
         {"reader", required_argument, 0, 'r'},
         {"pin", no_argument, 0, 'p'},
         {"help", no_argument, 0, 'h'},
+        {"snapshot", required_argument, 0, 's'},
+        {"all-readers", no_argument, 0, 'A'},
+        {"values", required_argument, 0, 'l'},
+        {"expect", required_argument, 0, 1001},
+        {"adm", required_argument, 0, 1002},
+        {"dry-run", no_argument, 0, 1003},
+        {"virtual", required_argument, 0, 1004},
+        {"trace", required_argument, 0, 1005},
+        {"health", required_argument, 0, 1006},
+        {"metrics", required_argument, 0, 1007},
+        {"metrics-listen", required_argument, 0, 1008},
+        {"watch", no_argument, 0, 1009},
+        {"dashboard", no_argument, 0, 1010},
+        {"journal", required_argument, 0, 1011},
+        {"ring", required_argument, 0, 1012},
+        {"where", required_argument, 0, 1013},
+        {"apps", no_argument, 0, 1014},
         {"version", no_argument, 0, 1000},
         {0, 0, 0, 0}
     };
     
-    while ((opt = getopt_long(argc, argv, "vjea r:ph", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "vjear:phs:Al:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'v':
                 config.verbose = 1;
@@ -700,6 +11170,15 @@ int main(int argc, char *argv[]) {
             case 'r':
                 config.reader_name = optarg;
                 break;
+            case 's':
+                config.snapshot_file = optarg;
+                break;
+            case 'A':
+                config.all_readers = 1;
+                break;
+            case 'l':
+                config.values_file = optarg;
+                break;
             case 'p':
                 config.use_pin = 1;
                 printf("PIN verification not implemented yet\n");
@@ -710,61 +11189,163 @@ int main(int argc, char *argv[]) {
             case 1000:
                 printf("simreader version %s\n", VERSION);
                 return 0;
+            case 1001:
+                config.expect_file = optarg;
+                break;
+            case 1002:
+                config.adm_key = optarg;
+                break;
+            case 1003:
+                config.dry_run = 1;
+                break;
+            case 1004:
+                config.virtual_file = optarg;
+                break;
+            case 1005:
+                config.trace_file = optarg;
+                break;
+            case 1006:
+                config.health_file = optarg;
+                break;
+            case 1007:
+                config.metrics_file = optarg;
+                break;
+            case 1008:
+                config.metrics_listen = optarg;
+                break;
+            case 1009:
+                config.watch = 1;
+                config.all_readers = 1;
+                break;
+            case 1010:
+                config.dashboard = 1;
+                config.all_readers = 1;
+                break;
+            case 1011:
+                config.journal_file = optarg;
+                break;
+            case 1012:
+                config.ring_path = optarg;
+                break;
+            case 1013:
+                config.where_expr = optarg;
+                break;
+            case 1014:
+                config.read_apps = 1;
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
         }
     }
     
-    sim_data_t sim_data = {0};
-    
-    if (establish_context() < 0) {
+    if (config.where_expr && where_compile(config.where_expr, &where_filter) < 0) {
         return 1;
     }
+    if (config.trace_file) {
+        trace_out = strcmp(config.trace_file, "-") == 0 ? stdout : fopen(config.trace_file, "w");
+        if (!trace_out) {
+            fprintf(stderr, "Cannot write trace %s\n", config.trace_file);
+            return 1;
+        }
+        fprintf(trace_out, "%s %d\n", TRACE_MAGIC, TRACE_VERSION);
+        trace_start_us = monotonic_us();
+    }
     
-    char reader_name[256];
-    DWORD reader_len = sizeof(reader_name);
-    
-    if (find_reader(config.reader_name, reader_name, &reader_len) < 0) {
-        fprintf(stderr, "No compatible reader found\n");
-        cleanup();
+    metrics_start_time = time(NULL);
+    if (config.metrics_listen && (metrics_listener = metrics_open_listener(config.metrics_listen)) < 0) {
         return 1;
     }
-    
-    if (config.verbose) {
-        printf("Using reader: %s\n", reader_name);
+    if (config.ring_path && ring_open(config.ring_path) < 0) {
+        return 1;
     }
-    
-    if (connect_to_card(reader_name) < 0) {
-        fprintf(stderr, "Failed to connect to card\n");
-        cleanup();
+    if (config.journal_file && journal_open(config.journal_file, config.snapshot_file) < 0) {
+        return 1;
+    }
+    if (config.dashboard && !isatty(STDERR_FILENO)) {
+        fprintf(stderr, "--dashboard needs a terminal on standard error\n");
         return 1;
     }
+    if (config.watch || config.dashboard) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = request_stop;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
     
-    if (config.verbose) {
-        printf("Protocol: %s\n", (dwActiveProtocol == SCARD_PROTOCOL_T0) ? "T=0" : "T=1");
+    if (optind < argc) {
+        if (strcmp(argv[optind], "diff") == 0) {
+            return run_diff(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "verify") == 0) {
+            return run_verify(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "provision") == 0) {
+            return run_provision(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "phonebook") == 0) {
+            return run_phonebook(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "sms") == 0) {
+            return run_sms(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "auth-bench") == 0) {
+            return run_auth_bench(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "replay") == 0) {
+            return run_replay(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "import") == 0) {
+            return run_import(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "health") == 0) {
+            return run_health(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "generate") == 0) {
+            return run_generate(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "reprocess") == 0) {
+            return run_reprocess(&config, argc - optind - 1, argv + optind + 1);
+        }
+        if (strcmp(argv[optind], "auth-verify") == 0) {
+            return run_auth_verify(&config, argc - optind - 1, argv + optind + 1);
+        }
+        fprintf(stderr, "Unknown command: %s\n", argv[optind]);
+        print_usage(argv[0]);
+        return 1;
     }
     
-    // Extract SIM data using universal methods
-    get_iccid(&sim_data, config.verbose);
-    get_imsi(&sim_data, config.verbose);
-    get_msisdn(&sim_data, config.verbose);
-    get_spn(&sim_data, config.verbose);
+    read_ctx_t ctx = {0};
+    expect_set_t expect;
     
-    // Output results
-    if (config.complete_analysis) {
-        print_complete_analysis(&sim_data);
-    } else if (config.json_output) {
-        print_json_output(&sim_data);
-    } else {
-        print_human_output(&sim_data);
+    if (config.expect_file) {
+        if (expect_load(config.expect_file, &expect) < 0) {
+            return 1;
+        }
+        ctx.expect = &expect;
     }
     
-    // Explore files if requested
-    if (config.explore_files) {
-        explore_sim_files(config.verbose);
+    if (config.snapshot_file) {
+        if (strcmp(config.snapshot_file, "-") == 0) ctx.snapshot_out = stdout;
+        else if (journal.file) ctx.snapshot_out = journal_open_output(config.snapshot_file);
+        else ctx.snapshot_out = fopen(config.snapshot_file, "w");
+        if (!ctx.snapshot_out) {
+            fprintf(stderr, "Cannot write snapshot %s\n", config.snapshot_file);
+            if (ctx.expect) expect_free(ctx.expect);
+            return 1;
+        }
     }
     
-    cleanup();
-    return 0;
-}
\ No newline at end of file
+    int rv = for_each_card(&config, read_card, &ctx);
+    
+    if (journal_close() < 0) rv = -1;
+    if (ctx.snapshot_out && ctx.snapshot_out != stdout && fclose(ctx.snapshot_out) != 0) {
+        rv = -1;
+    }
+    if (ctx.expect) {
+        expect_print_remainder(ctx.expect, config.json_output);
+        expect_free(ctx.expect);
+    }
+    return rv == 0 ? 0 : 1;
+}
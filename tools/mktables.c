@@ -0,0 +1,319 @@
+/*
+ * mktables - compile the operator and issuer CSV files into the perfect
+ * hash tables included by simreader (src/lookup_tables.h)
+ *
+ * Usage: mktables DATADIR > lookup_tables.h
+ *
+ * Every table is keyed by a digit string (an MCC, MCC+MNC, ICCID country
+ * code or ICCID issuer prefix). Keys are hashed with hash-and-displace:
+ * a first hash picks a bucket, and each bucket stores the displacement
+ * that sends all of its keys to free slots of the second hash. A lookup
+ * is two hashes and one key comparison.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#define MAX_LINE 512
+#define MAX_DISPLACEMENT 65535
+
+typedef struct {
+    uint64_t key;
+    char *digits;
+    char *name;
+    char *iso;
+} entry_t;
+
+typedef struct {
+    entry_t *entries;
+    int count;
+    int min_len;
+    int max_len;
+} table_t;
+
+// Key and hash functions; these must match the lookup in simreader.c
+static uint64_t digits_key(const char *digits, int len) {
+    uint64_t value = 0;
+    for (int i = 0; i < len; i++) value = value * 10 + (digits[i] - '0');
+    return ((uint64_t)len << 56) | value;
+}
+
+static uint64_t lookup_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint32_t lookup_slot(uint64_t key, uint32_t disp, uint32_t num_slots) {
+    return lookup_mix(key + (uint64_t)(disp + 1) * 0x9E3779B97F4A7C15ULL) % num_slots;
+}
+
+static char *trim(char *str) {
+    while (isspace((unsigned char)*str)) str++;
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) *--end = '\0';
+    return str;
+}
+
+static int is_digits(const char *s) {
+    if (!*s) return 0;
+    for (; *s; s++) {
+        if (!isdigit((unsigned char)*s)) return 0;
+    }
+    return 1;
+}
+
+// Load DATADIR/name. Rows are "digits,name", "digits,iso,name" with
+// iso_column set, or "mcc,mnc,name" when join is set. Blank lines, # comments and a header row are skipped.
+static int table_load(const char *dir, const char *name, int join, int iso_column, table_t *table) {
+    char path[1024];
+    char line[MAX_LINE];
+    int line_no = 0;
+    FILE *in;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return -1;
+    }
+
+    memset(table, 0, sizeof(*table));
+    while (fgets(line, sizeof(line), in)) {
+        char *cells[4] = {NULL};
+        char digits[32];
+        int n = 0;
+        char *p = line;
+
+        line_no++;
+        p = trim(p);
+        if (!*p || *p == '#') continue;
+        cells[n++] = p;
+        while (n < 4 && (p = strchr(p, ',')) != NULL) {
+            *p++ = '\0';
+            cells[n++] = p;
+        }
+        for (int i = 0; i < n; i++) cells[i] = trim(cells[i]);
+        if (!is_digits(cells[0])) continue;   // header row
+
+        if (join) {
+            if (n < 3 || !is_digits(cells[1])) goto malformed;
+            snprintf(digits, sizeof(digits), "%s%s", cells[0], cells[1]);
+        } else {
+            if (n < (iso_column ? 3 : 2)) goto malformed;
+            snprintf(digits, sizeof(digits), "%s", cells[0]);
+        }
+        if (strlen(digits) > 15) goto malformed;
+
+        entry_t *e = realloc(table->entries, (table->count + 1) * sizeof(entry_t));
+        if (!e) {
+            fclose(in);
+            return -1;
+        }
+        table->entries = e;
+        e = &table->entries[table->count++];
+        int len = strlen(digits);
+        e->key = digits_key(digits, len);
+        e->digits = strdup(digits);
+        e->name = strdup(cells[join || iso_column ? 2 : 1]);
+        e->iso = strdup(iso_column ? cells[1] : "");
+        if (!table->min_len || len < table->min_len) table->min_len = len;
+        if (len > table->max_len) table->max_len = len;
+        continue;
+
+malformed:
+        fprintf(stderr, "%s:%d: malformed row\n", path, line_no);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+
+    for (int i = 0; i < table->count; i++) {
+        for (int j = i + 1; j < table->count; j++) {
+            if (table->entries[i].key == table->entries[j].key) {
+                fprintf(stderr, "%s: duplicate key %s\n", path, table->entries[i].digits);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static uint32_t *bucket_of;
+static int *sort_sizes;
+
+static int compare_buckets(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    if (sort_sizes[x] != sort_sizes[y]) return sort_sizes[y] - sort_sizes[x];
+    return x - y;
+}
+
+// Find a displacement for every bucket, largest buckets first. slots[i]
+// receives the entry index stored in slot i, or -1.
+static int build_phf(const table_t *table, uint32_t num_buckets, uint32_t num_slots,
+                     uint16_t *disp, int *slots) {
+    int *sizes = calloc(num_buckets, sizeof(int));
+    int *order = malloc(num_buckets * sizeof(int));
+    uint32_t taken[64];
+    int ok = 1;
+
+    for (uint32_t s = 0; s < num_slots; s++) slots[s] = -1;
+    for (int i = 0; i < table->count; i++) {
+        bucket_of[i] = lookup_mix(table->entries[i].key) % num_buckets;
+        sizes[bucket_of[i]]++;
+    }
+    for (uint32_t b = 0; b < num_buckets; b++) {
+        order[b] = b;
+        disp[b] = 0;
+    }
+    sort_sizes = sizes;
+    qsort(order, num_buckets, sizeof(int), compare_buckets);
+
+    for (uint32_t o = 0; o < num_buckets && ok; o++) {
+        int b = order[o];
+        int placed = 0;
+
+        if (!sizes[b]) break;
+        if (sizes[b] > 64) {
+            ok = 0;
+            break;
+        }
+        for (uint32_t d = 0; d <= MAX_DISPLACEMENT && !placed; d++) {
+            int n = 0;
+            placed = 1;
+            for (int i = 0; i < table->count && placed; i++) {
+                if ((int)bucket_of[i] != b) continue;
+                uint32_t s = lookup_slot(table->entries[i].key, d, num_slots);
+                if (slots[s] >= 0) placed = 0;
+                for (int k = 0; k < n && placed; k++) {
+                    if (taken[k] == s) placed = 0;
+                }
+                taken[n++] = s;
+            }
+            if (!placed) continue;
+            disp[b] = d;
+            n = 0;
+            for (int i = 0; i < table->count; i++) {
+                if ((int)bucket_of[i] == b) slots[taken[n++]] = i;
+            }
+        }
+        if (!placed) ok = 0;
+    }
+
+    free(sizes);
+    free(order);
+    return ok ? 0 : -1;
+}
+
+static void print_c_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+static int emit_table(const char *dir, const char *file, const char *name, int join, int iso_column) {
+    table_t table;
+    uint32_t num_buckets;
+    uint32_t num_slots;
+    uint16_t *disp;
+    int *slots;
+
+    if (table_load(dir, file, join, iso_column, &table) < 0) return -1;
+    num_buckets = table.count / 4 + 1;
+    num_slots = table.count + table.count / 4 + 1;
+    disp = malloc(num_buckets * sizeof(uint16_t));
+    bucket_of = malloc((table.count + 1) * sizeof(uint32_t));
+    slots = malloc((2 * table.count + 2) * sizeof(int));
+    while (build_phf(&table, num_buckets, num_slots, disp, slots) < 0) {
+        num_slots++;
+        if (num_slots > 2 * (uint32_t)table.count + 1) {
+            fprintf(stderr, "%s: no perfect hash found\n", file);
+            return -1;
+        }
+    }
+
+    printf("\n// %s: %d entries in %u slots\n", file, table.count, num_slots);
+    printf("static const uint16_t %s_disp[%u] = {", name, num_buckets);
+    for (uint32_t b = 0; b < num_buckets; b++) {
+        printf("%s%s%u", b ? "," : "", b % 16 ? " " : "\n    ", disp[b]);
+    }
+    printf("\n};\n\n");
+    printf("static const lookup_entry_t %s_slots[%u] = {\n", name, num_slots);
+    for (uint32_t s = 0; s < num_slots; s++) {
+        if (slots[s] < 0) {
+            printf("    {0, NULL, NULL},\n");
+            continue;
+        }
+        const entry_t *e = &table.entries[slots[s]];
+        printf("    {0x%016llXULL, ", (unsigned long long)e->key);
+        print_c_string(e->name);
+        printf(", ");
+        print_c_string(e->iso);
+        printf("},   // %s\n", e->digits);
+    }
+    printf("};\n\n");
+    printf("static const lookup_table_t %s_table = {\n", name);
+    printf("    %s_disp, %u, %s_slots, %u, %d, %d\n", name, num_buckets, name, num_slots,
+           table.min_len, table.max_len);
+    printf("};\n");
+
+    for (int i = 0; i < table.count; i++) {
+        free(table.entries[i].digits);
+        free(table.entries[i].name);
+        free(table.entries[i].iso);
+    }
+    free(table.entries);
+    free(disp);
+    free(bucket_of);
+    free(slots);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s DATADIR > lookup_tables.h\n", argv[0]);
+        return 1;
+    }
+
+    printf("// Generated by tools/mktables from %s/*.csv. Do not edit; change the\n", argv[1]);
+    printf("// CSV files and run 'make tables' instead.\n\n");
+    printf("#ifndef LOOKUP_TABLES_H\n");
+    printf("#define LOOKUP_TABLES_H\n\n");
+    printf("#include <stddef.h>\n");
+    printf("#include <stdint.h>\n\n");
+    printf("typedef struct {\n");
+    printf("    uint64_t key;        // digit count << 56 | value\n");
+    printf("    const char *name;\n");
+    printf("    const char *iso;     // ISO 3166 country code, \"\" when not applicable\n");
+    printf("} lookup_entry_t;\n\n");
+    printf("typedef struct {\n");
+    printf("    const uint16_t *disp;\n");
+    printf("    uint32_t num_buckets;\n");
+    printf("    const lookup_entry_t *slots;\n");
+    printf("    uint32_t num_slots;\n");
+    printf("    int min_len;         // shortest and longest key in digits\n");
+    printf("    int max_len;\n");
+    printf("} lookup_table_t;\n");
+
+    if (emit_table(argv[1], "mcc.csv", "mcc", 0, 1) < 0 ||
+        emit_table(argv[1], "mnc.csv", "mnc", 1, 0) < 0 ||
+        emit_table(argv[1], "iccid-countries.csv", "iccid_country", 0, 1) < 0 ||
+        emit_table(argv[1], "iccid-issuers.csv", "iccid_issuer", 0, 0) < 0) {
+        return 1;
+    }
+
+    printf("\n#endif\n");
+    return 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# pgo-train.sh - training run for the profile-guided build (make pgo)
+#
+# Usage: pgo-train.sh SIMREADER CORPUS WORKDIR [CARDS]
+#
+# Runs the decode, plan and output paths of SIMREADER over the benchmark
+# corpus in CORPUS, without a card reader: template.snap is expanded into
+# CARDS synthetic cards, every 40th of which is read back through --virtual
+# in each output format, compared, verified and planned against
+# profile.tpl, the whole corpus is reprocessed, and the recorded
+# session.trace is parsed and replayed. The output is discarded; only the
+# profile written by SIMREADER matters.
+
+set -e
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 SIMREADER CORPUS WORKDIR [CARDS]" >&2
+    exit 2
+fi
+bin=$1
+corpus=$2
+work=$3
+cards=${4:-2000}
+
+rm -rf "$work"
+mkdir -p "$work"
+
+# Encode: synthetic cards and their snapshots
+"$bin" -s "$work/corpus.snap" generate "$corpus/template.snap" "$cards"
+
+# One snapshot file per sampled card, for --virtual
+awk -v dir="$work" -v step=40 '
+    /^simreader-snapshot / {
+        n++
+        if (out) close(out)
+        out = n % step == 1 ? dir "/card" n ".snap" : ""
+    }
+    out { print > out }
+' "$work/corpus.snap"
+
+# Decode, plan and output, card by card. diff and verify report the
+# differences they are given with a non-zero status.
+for card in "$work"/card*.snap; do
+    "$bin" --virtual "$card" > /dev/null
+    "$bin" --virtual "$card" -j > /dev/null
+    "$bin" --virtual "$card" --apps > /dev/null
+    "$bin" --virtual "$card" -a > /dev/null
+    "$bin" --virtual "$card" -s - > /dev/null
+    "$bin" --virtual "$card" phonebook export > /dev/null
+    "$bin" --virtual "$card" sms > /dev/null
+    "$bin" --virtual "$card" --dry-run provision "$corpus/profile.tpl" > /dev/null
+    "$bin" --virtual "$card" verify "$corpus/template.snap" > /dev/null || true
+    "$bin" --virtual "$card" -j diff "$corpus/template.snap" card > /dev/null || true
+done
+
+# Decoders over the whole corpus; one thread keeps the profile counters exact
+"$bin" reprocess "$work/corpus.snap" 1 > /dev/null
+"$bin" -j reprocess "$work/corpus.snap" 1 > /dev/null
+"$bin" --where 'mcc==262 && ust.has(27) && adn.count>0' reprocess "$work/corpus.snap" 1 > /dev/null
+
+# Trace parsing and statistics, and a replay against the template card
+"$bin" --dry-run replay "$corpus/session.trace" > /dev/null
+"$bin" --dry-run -j replay "$corpus/session.trace" > /dev/null
+"$bin" --virtual "$corpus/template.snap" replay "$corpus/session.trace" > /dev/null
+
+echo "Trained on $cards generated card(s) and $(basename "$corpus")/session.trace"
@@ -0,0 +1,159 @@
+/*
+ * ringtail - follow the card records simreader publishes with --ring
+ *
+ * Usage: ringtail [-a] SOCKET
+ *
+ * Connects to the Unix socket given to simreader --ring, receives the
+ * read-only ring and an eventfd, and prints one tab-separated line per
+ * card: sequence, time (microseconds since the epoch), result, reader,
+ * ICCID, IMSI, MSISDN, SPN, operator and --expect status. Only new records
+ * are printed unless -a asks for those still in the ring. Ends when
+ * simreader exits.
+ *
+ * This is also the reference for other consumers: the layouts and the
+ * seqlock protocol below must match the shared-memory ring in simreader.c.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define RING_MAGIC "SRRING01"
+#define RING_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t slots;
+    uint32_t header_size;
+    uint64_t head;
+} ring_header_t;
+
+typedef struct {
+    uint64_t sequence;
+    uint64_t time_us;
+    int32_t result;
+    uint32_t reserved;
+    char reader[96];
+    char iccid[24];
+    char imsi[16];
+    char msisdn[16];
+    char spn[64];
+    char operator_name[64];
+    char expect_status[16];
+} ring_record_t;
+
+// Receive the ring and eventfd descriptors sent with SCM_RIGHTS
+static int receive_fds(int sock, int fds[2]) {
+    char version;
+    struct iovec iov = {&version, 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(sock, &msg, 0) != 1 || version != RING_VERSION) return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) return -1;
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    return 0;
+}
+
+// Copy record number sequence; -1 when it was overwritten before or
+// during the copy
+static int read_record(const ring_header_t *header, uint64_t sequence, ring_record_t *out) {
+    const ring_record_t *slot = (const ring_record_t *)((const char *)header + header->header_size) +
+                                (sequence - 1) % header->slots;
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != sequence) return -1;
+    memcpy(out, slot, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) return -1;
+    out->sequence = sequence;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un sun;
+    int all = 0;
+    int sock;
+    int fds[2];
+    int done = 0;
+
+    if (argc == 3 && strcmp(argv[1], "-a") == 0) {
+        all = 1;
+    } else if (argc != 2) {
+        fprintf(stderr, "Usage: %s [-a] SOCKET\n", argv[0]);
+        return 2;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", argv[argc - 1]);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        perror(argv[argc - 1]);
+        return 1;
+    }
+    if (receive_fds(sock, fds) < 0) {
+        fprintf(stderr, "%s: no ring received\n", argv[argc - 1]);
+        return 1;
+    }
+
+    ring_header_t *header = mmap(NULL, sizeof(ring_header_t), PROT_READ, MAP_SHARED, fds[0], 0);
+    if (header == MAP_FAILED || memcmp(header->magic, RING_MAGIC, 8) != 0 ||
+        header->record_size != sizeof(ring_record_t)) {
+        fprintf(stderr, "Incompatible ring\n");
+        return 1;
+    }
+    size_t size = header->header_size + (size_t)header->slots * header->record_size;
+    munmap(header, sizeof(ring_header_t));
+    header = mmap(NULL, size, PROT_READ, MAP_SHARED, fds[0], 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t next = head + 1;
+    if (all) next = head > header->slots ? head - header->slots + 1 : 1;
+
+    for (;;) {
+        struct pollfd pfds[2] = {{fds[1], POLLIN, 0}, {sock, POLLIN, 0}};
+        uint64_t count;
+        ring_record_t r;
+
+        head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        for (; next <= head; next++) {
+            if (read_record(header, next, &r) < 0) {
+                fprintf(stderr, "Record %llu lost\n", (unsigned long long)next);
+                continue;
+            }
+            printf("%llu\t%llu\t%d\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n", (unsigned long long)r.sequence,
+                   (unsigned long long)r.time_us, r.result, r.reader, r.iccid, r.imsi, r.msisdn, r.spn,
+                   r.operator_name, r.expect_status);
+        }
+        fflush(stdout);
+        if (done || poll(pfds, 2, -1) < 0) break;
+        if (pfds[1].revents) done = 1;   // simreader exited; print the rest
+        if (pfds[0].revents && read(fds[1], &count, sizeof(count)) < 0) continue;
+    }
+    return 0;
+}
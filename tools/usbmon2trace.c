@@ -0,0 +1,354 @@
+/*
+ * usbmon2trace - convert a usbmon capture of a CCID reader into a
+ * simreader APDU trace
+ *
+ * Usage: usbmon2trace [-1] [-d BUS.DEVICE] CAPTURE > TRACE
+ *
+ * CAPTURE is a pcap or pcapng file captured on a Linux usbmon interface
+ * (link types LINUX_USB and LINUX_USB_MMAPPED, as written by Wireshark or
+ * tcpdump -i usbmonN). PC_to_RDR_XfrBlock commands submitted on a bulk OUT
+ * endpoint are paired with the RDR_to_PC_DataBlock that completes on the
+ * bulk IN endpoint with the same sequence number; PC_to_RDR_IccPowerOn
+ * answers give the ATR. Times are taken from the usbmon events, so the
+ * trace keeps the gaps between APDUs of the captured tool.
+ *
+ * Readers exchanging short APDUs or T=0 TPDUs need no options. With -1 the
+ * data are T=1 blocks (TPDU level readers): chained I-blocks are joined and
+ * R- and S-blocks dropped.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define LINKTYPE_USB_LINUX 189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+#define MAX_INTERFACES 8
+#define MAX_APDU 4096
+
+// CCID message types (CCID 1.1 section 6)
+#define PC_TO_RDR_ICC_POWER_ON 0x62
+#define PC_TO_RDR_XFR_BLOCK 0x6F
+#define RDR_TO_PC_DATA_BLOCK 0x80
+
+// One direction of the APDU exchange being assembled
+typedef struct {
+    uint8_t data[MAX_APDU];
+    int len;
+    double time_us;
+} message_t;
+
+// Exchange state of a reader
+enum {
+    IDLE,
+    COMMAND_CHAIN,               // T=1: more blocks of the command follow
+    AWAIT_RESPONSE,
+    AWAIT_ATR,
+};
+
+typedef struct {
+    int bus;
+    int device;
+    int state;
+    int seq;                     // of the last PC_to_RDR message
+    message_t command;
+    message_t response;
+} reader_t;
+
+static int t1_blocks;
+static int filter_bus = -1;
+static int filter_device = -1;
+static double first_us = -1;
+static reader_t readers[16];
+static int num_readers;
+static int last_reader = -1;
+static long apdus;
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t get32(const uint8_t *p, int swapped) {
+    return swapped ? (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3] : le32(p);
+}
+
+static void print_hex(const uint8_t *data, int len) {
+    for (int i = 0; i < len; i++) printf("%02X", data[i]);
+}
+
+static reader_t *find_reader(int bus, int device) {
+    for (int i = 0; i < num_readers; i++) {
+        if (readers[i].bus == bus && readers[i].device == device) return &readers[i];
+    }
+    if (num_readers == (int)(sizeof(readers) / sizeof(readers[0]))) return NULL;
+    reader_t *r = &readers[num_readers++];
+    memset(r, 0, sizeof(*r));
+    r->bus = bus;
+    r->device = device;
+    return r;
+}
+
+static void select_reader(reader_t *r) {
+    int index = r - readers;
+    if (index != last_reader) {
+        printf("reader usbmon:%d.%d\n", r->bus, r->device);
+        last_reader = index;
+    }
+}
+
+// The information field of a T=1 block is appended to m. Returns 1 for
+// the last I-block of a chain, 0 when more follow and -1 for R- and
+// S-blocks.
+static int t1_unwrap(const uint8_t *block, int len, message_t *m) {
+    if (len < 4 || block[2] + 4 > len || (block[1] & 0x80)) return -1;
+    if (m->len + block[2] <= MAX_APDU) {
+        memcpy(m->data + m->len, block + 3, block[2]);
+        m->len += block[2];
+    }
+    return block[1] & 0x20 ? 0 : 1;
+}
+
+static void emit_exchange(reader_t *r) {
+    select_reader(r);
+    if (first_us < 0) first_us = r->command.time_us;
+    printf("%.0f > ", r->command.time_us - first_us);
+    print_hex(r->command.data, r->command.len);
+    printf("\n%.0f < ", r->response.time_us - first_us);
+    print_hex(r->response.data, r->response.len);
+    printf("\n");
+    apdus++;
+}
+
+static void copy_message(message_t *m, const uint8_t *data, int len, double time_us) {
+    m->len = len < MAX_APDU ? len : MAX_APDU;
+    memcpy(m->data, data, m->len);
+    m->time_us = time_us;
+}
+
+// A CCID message in the data of a bulk transfer
+static void ccid_message(int bus, int device, int in, const uint8_t *data, int len, double time_us) {
+    if (len < 10 || (filter_bus >= 0 && (bus != filter_bus || device != filter_device))) return;
+
+    uint8_t type = data[0];
+    uint32_t payload = le32(data + 1);
+    uint8_t seq = data[6];
+    const uint8_t *body = data + 10;
+    int body_len = len - 10 < (int)payload ? len - 10 : (int)payload;
+    reader_t *r = find_reader(bus, device);
+
+    if (!r) return;
+    if (body_len < (int)payload) fprintf(stderr, "usbmon2trace: message truncated by the capture\n");
+
+    if (!in) {
+        r->seq = seq;
+        if (type == PC_TO_RDR_ICC_POWER_ON) {
+            r->state = AWAIT_ATR;
+        } else if (type == PC_TO_RDR_XFR_BLOCK && !t1_blocks) {
+            copy_message(&r->command, body, body_len, time_us);
+            r->state = AWAIT_RESPONSE;
+        } else if (type == PC_TO_RDR_XFR_BLOCK) {
+            // R- and S-blocks (acknowledgements, waiting time extensions)
+            // leave the exchange as it is
+            if (body_len >= 4 && !(body[1] & 0x80)) {
+                if (r->state != COMMAND_CHAIN) {
+                    r->command.len = 0;
+                    r->command.time_us = time_us;
+                }
+                r->response.len = 0;
+                r->state = t1_unwrap(body, body_len, &r->command) ? AWAIT_RESPONSE : COMMAND_CHAIN;
+            }
+        }
+        return;
+    }
+
+    if (type != RDR_TO_PC_DATA_BLOCK || seq != r->seq) return;
+    if (r->state == AWAIT_ATR) {
+        select_reader(r);
+        printf("atr ");
+        print_hex(body, body_len);
+        printf("\n");
+        r->state = IDLE;
+        return;
+    }
+    if (r->state != AWAIT_RESPONSE) return;
+    if (t1_blocks) {
+        if (t1_unwrap(body, body_len, &r->response) != 1) return;   // chained, R- or S-block
+        r->response.time_us = time_us;
+    } else {
+        copy_message(&r->response, body, body_len, time_us);
+    }
+    if (r->command.len >= 4 && r->response.len >= 2) emit_exchange(r);
+    r->state = IDLE;
+}
+
+// One captured packet: a usbmon header followed by the transfer data
+static void usbmon_packet(int linktype, const uint8_t *packet, uint32_t len) {
+    int header_len = linktype == LINKTYPE_USB_LINUX_MMAPPED ? 64 : 48;
+    if (len < (uint32_t)header_len) return;
+
+    uint8_t event = packet[8];
+    uint8_t xfer_type = packet[9];
+    uint8_t endpoint = packet[10];
+    int device = packet[11];
+    int bus = le16(packet + 12);
+    double time_us = (double)(int64_t)((uint64_t)le32(packet + 16) | (uint64_t)le32(packet + 20) << 32) * 1e6 +
+                     (int32_t)le32(packet + 24);
+    uint32_t data_len = le32(packet + 36);
+
+    if (xfer_type != 3) return;   // bulk
+    if (data_len > len - header_len) data_len = len - header_len;
+    if (!data_len) return;
+
+    int in = endpoint & 0x80;
+    // Commands are captured when submitted, responses when completed
+    if ((in && event == 'C') || (!in && event == 'S')) {
+        ccid_message(bus, device, in != 0, packet + header_len, data_len, time_us);
+    }
+}
+
+static int read_pcap(FILE *in, const uint8_t *header) {
+    uint32_t magic = le32(header);
+    int swapped = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+    uint32_t linktype = get32(header + 20, swapped);
+    uint8_t record[16];
+    uint8_t *packet = malloc(262144);
+
+    if (!packet) return -1;
+    if (linktype != LINKTYPE_USB_LINUX && linktype != LINKTYPE_USB_LINUX_MMAPPED) {
+        fprintf(stderr, "usbmon2trace: link type %u is not a usbmon capture\n", linktype);
+        free(packet);
+        return -1;
+    }
+    while (fread(record, 1, 16, in) == 16) {
+        uint32_t caplen = get32(record + 8, swapped);
+        if (caplen > 262144 || fread(packet, 1, caplen, in) != caplen) {
+            fprintf(stderr, "usbmon2trace: truncated capture\n");
+            break;
+        }
+        usbmon_packet(linktype, packet, caplen);
+    }
+    free(packet);
+    return 0;
+}
+
+// pcapng: section header, interface description and (enhanced) packet
+// blocks. The usbmon header carries its own time, so the block times and
+// resolutions are not needed.
+static int read_pcapng(FILE *in, const uint8_t *first) {
+    int linktypes[MAX_INTERFACES];
+    int num_interfaces = 0;
+    uint8_t head[8];
+    uint8_t *block = NULL;
+    uint32_t capacity = 0;
+    int swapped = 0;
+    int rv = 0;
+
+    memcpy(head, first, 8);
+    for (;;) {
+        uint32_t type = get32(head, swapped);
+        uint32_t total;
+
+        if (type == 0x0A0D0D0A) {
+            // The byte order magic follows the block length
+            uint8_t bom[4];
+            if (fread(bom, 1, 4, in) != 4) break;
+            swapped = le32(bom) != 0x1A2B3C4D;
+            total = get32(head + 4, swapped);
+            if (total < 16) break;
+            if (fseek(in, total - 12, SEEK_CUR) != 0) break;
+            num_interfaces = 0;
+        } else {
+            total = get32(head + 4, swapped);
+            if (total < 12 || total > 16 * 1024 * 1024) {
+                fprintf(stderr, "usbmon2trace: malformed pcapng block\n");
+                rv = -1;
+                break;
+            }
+            if (total - 8 > capacity) {
+                uint8_t *grown = realloc(block, total - 8);
+                if (!grown) {
+                    rv = -1;
+                    break;
+                }
+                block = grown;
+                capacity = total - 8;
+            }
+            if (fread(block, 1, total - 8, in) != total - 8) break;
+
+            if (type == 1 && num_interfaces < MAX_INTERFACES) {
+                linktypes[num_interfaces++] = swapped ? block[0] << 8 | block[1] : block[0] | block[1] << 8;
+            } else if (type == 6 && total >= 32) {
+                uint32_t id = get32(block, swapped);
+                uint32_t caplen = get32(block + 12, swapped);
+                if (id < (uint32_t)num_interfaces && caplen <= total - 32) {
+                    int linktype = linktypes[id];
+                    if (linktype == LINKTYPE_USB_LINUX || linktype == LINKTYPE_USB_LINUX_MMAPPED) {
+                        usbmon_packet(linktype, block + 20, caplen);
+                    }
+                }
+            }
+        }
+        if (fread(head, 1, 8, in) != 8) break;
+    }
+    free(block);
+    return rv;
+}
+
+int main(int argc, char *argv[]) {
+    const char *filename = NULL;
+    uint8_t header[24];
+    FILE *in;
+    int rv;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "-1") == 0) {
+            t1_blocks = 1;
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%d.%d", &filter_bus, &filter_device) == 2) {
+            i++;
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1 || (argv[i][0] == '-' && argv[i][1])) {
+        fprintf(stderr, "Usage: %s [-1] [-d BUS.DEVICE] CAPTURE > TRACE\n", argv[0]);
+        return 2;
+    }
+    filename = argv[i];
+
+    in = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (!in) {
+        perror(filename);
+        return 2;
+    }
+    if (fread(header, 1, 8, in) != 8) {
+        fprintf(stderr, "usbmon2trace: %s is empty\n", filename);
+        return 2;
+    }
+
+    printf("simreader-trace 1\n");
+    printf("# converted from %s\n", filename);
+    if (le32(header) == 0x0A0D0D0A) {
+        rv = read_pcapng(in, header);
+    } else {
+        uint32_t magic = le32(header);
+        if ((magic != 0xA1B2C3D4 && magic != 0xD4C3B2A1 && magic != 0xA1B23C4D && magic != 0x4D3CB2A1) ||
+            fread(header + 8, 1, 16, in) != 16) {
+            fprintf(stderr, "usbmon2trace: %s is not a pcap or pcapng file\n", filename);
+            return 2;
+        }
+        rv = read_pcap(in, header);
+    }
+    if (in != stdin) fclose(in);
+
+    fprintf(stderr, "usbmon2trace: %ld APDU(s)\n", apdus);
+    return rv < 0 || !apdus ? 1 : 0;
+}